@@ -31,6 +31,7 @@
 #include <stdint.h>
 #include <machine/vmparam.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <microkernel.h>
 #include <sys/queue.h>
 #include <mrg.h>
@@ -148,48 +149,151 @@ AcpiOsPhysicalTableOverride(ACPI_TABLE_HEADER * ExistingTable,
 
 
 
-void *AcpiOsMapMemory(ACPI_PHYSICAL_ADDRESS pa, ACPI_SIZE len)
+/*
+ * MMIO mapping cache.
+ *
+ * ACPICA maps and unmaps the same tables and regions over and over.
+ * Mappings are kept, reference counted, in a list of physical page
+ * ranges. A request covered by a mapping reuses it. Unused mappings
+ * stay mapped, least recently used first in the idle list, until
+ * more than ACPI_MAP_MAXIDLE of them exist. A new mapping absorbs
+ * the idle mappings it overlaps or is adjacent to, so that mappings
+ * of neighbouring pages coalesce into one.
+ */
+
+#define ACPI_MAP_MAXIDLE 16
+
+struct acpi_map {
+	paddr_t pa;		/* Page aligned. */
+	unsigned pages;
+	vaddr_t va;
+	unsigned ref;
+	LIST_ENTRY(acpi_map) list;
+	TAILQ_ENTRY(acpi_map) idle;
+};
+static LIST_HEAD(, acpi_map) acpi_maps = LIST_HEAD_INITIALIZER(acpi_maps);
+static TAILQ_HEAD(acpi_map_tq, acpi_map) acpi_idlemaps =
+TAILQ_HEAD_INITIALIZER(acpi_idlemaps);
+static unsigned acpi_nidlemaps;
+
+static struct acpi_map *acpi_map_find(paddr_t start, paddr_t end)
+{
+	struct acpi_map *m;
+
+	LIST_FOREACH(m, &acpi_maps, list)
+		if (m->pa <= start
+		    && end <= m->pa + ((paddr_t)m->pages << PAGE_SHIFT))
+			return m;
+	return NULL;
+}
+
+static struct acpi_map *acpi_map_findva(vaddr_t va)
+{
+	struct acpi_map *m;
+
+	LIST_FOREACH(m, &acpi_maps, list)
+		if (m->va <= va && va < m->va + (m->pages << PAGE_SHIFT))
+			return m;
+	return NULL;
+}
+
+static void acpi_map_destroy(struct acpi_map *m)
+{
+	unsigned i;
+
+	for (i = 0; i < m->pages; i++)
+		sys_iounmap(acpi_pltfd, m->va + (i << PAGE_SHIFT));
+	vmap_free(m->va, m->pages << PAGE_SHIFT);
+	LIST_REMOVE(m, list);
+	if (m->ref == 0) {
+		TAILQ_REMOVE(&acpi_idlemaps, m, idle);
+		acpi_nidlemaps--;
+	}
+	free(m);
+}
+
+static struct acpi_map *acpi_map_create(paddr_t start, paddr_t end)
 {
 	int ret;
-	vaddr_t va;
-	unsigned i, pages;
+	struct acpi_map *m, *n;
+
+	/* Absorb idle mappings touching the range. */
+	for (m = TAILQ_FIRST(&acpi_idlemaps); m != NULL; m = n) {
+		paddr_t mend = m->pa + ((paddr_t)m->pages << PAGE_SHIFT);
+
+		n = TAILQ_NEXT(m, idle);
+		if (mend < start || end < m->pa)
+			continue;
+		if (m->pa < start)
+			start = m->pa;
+		if (mend > end)
+			end = mend;
+		acpi_map_destroy(m);
+	}
+
+	m = malloc(sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	m->pa = start;
+	m->pages = (end - start) >> PAGE_SHIFT;
+	m->va = vmap_alloc(m->pages << PAGE_SHIFT, VFNT_MMIO);
+	if (m->va == 0) {
+		free(m);
+		return NULL;
+	}
+	ret = sys_iomaprange(acpi_pltfd, m->va, m->pa, m->pages);
+	if (ret < 0) {
+		vmap_free(m->va, m->pages << PAGE_SHIFT);
+		free(m);
+		return NULL;
+	}
+	m->ref = 0;
+	LIST_INSERT_HEAD(&acpi_maps, m, list);
+	return m;
+}
 
-	pages = (len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+void *AcpiOsMapMemory(ACPI_PHYSICAL_ADDRESS pa, ACPI_SIZE len)
+{
+	paddr_t start, end;
+	struct acpi_map *m;
 
 	dbgprintf("requesting to map %lx(%d)\n", pa, len);
 	acpi_init();
-	va = vmap_alloc(len, VFNT_MMIO);
-	if (va == 0)
-		return NULL;
-	for (i = 0; i < pages; i++) {
-		ret = sys_iomap(acpi_pltfd,
-				va + (i << PAGE_SHIFT),
-				trunc_page(pa) + (i << PAGE_SHIFT));
-		if (ret < 0) {
-			int j;
-			for (j = 0; j < i; j++)
-				sys_iounmap(acpi_pltfd,
-					    va + (j << PAGE_SHIFT));
-			return NULL;
-		}
+	start = trunc_page(pa);
+	end = round_page(pa + len);
+
+	m = acpi_map_find(start, end);
+	if (m != NULL && m->ref == 0) {
+		TAILQ_REMOVE(&acpi_idlemaps, m, idle);
+		acpi_nidlemaps--;
 	}
-	dbgprintf("%lx = %s(%lx, %ld) called\n", va, __FUNCTION__, pa,
-		  len);
-	return (void *) (uintptr_t) (va + (pa & PAGE_MASK));
+	if (m == NULL)
+		m = acpi_map_create(start, end);
+	if (m == NULL)
+		return NULL;
+	m->ref++;
+	dbgprintf("%lx = %s(%lx, %ld) called\n",
+		  m->va + (pa - m->pa), __FUNCTION__, pa, len);
+	return (void *) (uintptr_t) (m->va + (pa - m->pa));
 }
 
 void AcpiOsUnmapMemory(void *ptr, ACPI_SIZE len)
 {
-	vaddr_t va;
-	unsigned i, pages;
+	struct acpi_map *m;
 
 	dbgprintf("unmapping %p(%d)\n", ptr, len);
 	acpi_init();
-	va = (vaddr_t) (uintptr_t) ptr;
-	pages = (len + PAGE_SIZE - 1) >> PAGE_SHIFT;
-	for (i = 0; i < pages; i++)
-		sys_iounmap(acpi_pltfd, trunc_page(va) + (i << PAGE_SHIFT));
-	vmap_free(trunc_page(va), len);
+	m = acpi_map_findva((vaddr_t) (uintptr_t) ptr);
+	if (m == NULL || m->ref == 0) {
+		printf("ACPI: unmapping unknown address %p\n", ptr);
+		return;
+	}
+	if (--m->ref)
+		return;
+
+	TAILQ_INSERT_HEAD(&acpi_idlemaps, m, idle);
+	if (++acpi_nidlemaps > ACPI_MAP_MAXIDLE)
+		acpi_map_destroy(TAILQ_LAST(&acpi_idlemaps, acpi_map_tq));
 }
 
 
@@ -208,16 +312,45 @@ void AcpiOsFree(void *ptr)
 	free(ptr);
 }
 
+/*
+ * Object caches.
+ *
+ * Each cache keeps up to MaxDepth released objects of its size in a
+ * free list, linked through the objects themselves.
+ */
+struct acpi_cache {
+	const char *name;
+	size_t size;
+	unsigned maxdepth;
+	unsigned depth;
+	void *free;
+	unsigned long hits;
+	unsigned long misses;
+};
+
 #ifndef ACPI_USE_ALTERNATE_PROTOTYPE_AcpiOsCreateCache
 ACPI_STATUS
 AcpiOsCreateCache(const char *CacheName,
 		  UINT16 ObjectSize,
 		  UINT16 MaxDepth, ACPI_CACHE_T ** ReturnCache)
 {
+	struct acpi_cache *c;
 
 	dbgprintf("(%s called: %s[%d]\n", __FUNCTION__, CacheName,
 		  ObjectSize);
-	*ReturnCache = (ACPI_CACHE_T *) (uintptr_t) ObjectSize;
+	if (ReturnCache == NULL || ObjectSize < sizeof(void *))
+		return AE_BAD_PARAMETER;
+	c = malloc(sizeof(*c));
+	if (c == NULL)
+		return AE_NO_MEMORY;
+	c->name = CacheName;
+	c->size = ObjectSize;
+	c->maxdepth = MaxDepth;
+	c->depth = 0;
+	c->free = NULL;
+	c->hits = 0;
+	c->misses = 0;
+	*ReturnCache = (ACPI_CACHE_T *) c;
 	return AE_OK;
 }
 #endif
@@ -225,8 +358,20 @@ AcpiOsCreateCache(const char *CacheName,
 #ifndef ACPI_USE_ALTERNATE_PROTOTYPE_AcpiOsPurgeCache
 ACPI_STATUS AcpiOsPurgeCache(ACPI_CACHE_T * Cache)
 {
+	void *obj;
+	struct acpi_cache *c = (struct acpi_cache *) Cache;
 
 	dbgprintf("(%s called.)\n", __FUNCTION__);
+	if (c == NULL)
+		return AE_BAD_PARAMETER;
+	printf("ACPI: cache %s: %lu hits, %lu misses, %u free\n",
+	       c->name, c->hits, c->misses, c->depth);
+	while (c->free != NULL) {
+		obj = c->free;
+		c->free = *(void **) obj;
+		free(obj);
+	}
+	c->depth = 0;
 	return AE_OK;
 }
 #endif
@@ -234,9 +379,13 @@ ACPI_STATUS AcpiOsPurgeCache(ACPI_CACHE_T * Cache)
 #ifndef ACPI_USE_ALTERNATE_PROTOTYPE_AcpiOsDeleteCache
 ACPI_STATUS AcpiOsDeleteCache(ACPI_CACHE_T * Cache)
 {
+	ACPI_STATUS ret;
 
 	dbgprintf("(%s called.)\n", __FUNCTION__);
-	return AE_OK;
+	ret = AcpiOsPurgeCache(Cache);
+	if (ret == AE_OK)
+		free(Cache);
+	return ret;
 }
 #endif
 
@@ -245,10 +394,22 @@ ACPI_STATUS AcpiOsDeleteCache(ACPI_CACHE_T * Cache)
 void *AcpiOsAcquireObject(ACPI_CACHE_T * Cache)
 {
 	void *ptr;
-	size_t size = (size_t) (uintptr_t) Cache;
+	struct acpi_cache *c = (struct acpi_cache *) Cache;
 
-	ptr = malloc(size);
-	memset(ptr, 0, size);
+	if (c == NULL)
+		return NULL;
+	if (c->free != NULL) {
+		ptr = c->free;
+		c->free = *(void **) ptr;
+		c->depth--;
+		c->hits++;
+	} else {
+		ptr = malloc(c->size);
+		if (ptr == NULL)
+			return NULL;
+		c->misses++;
+	}
+	memset(ptr, 0, c->size);
 	return ptr;
 }
 #endif
@@ -256,8 +417,17 @@ void *AcpiOsAcquireObject(ACPI_CACHE_T * Cache)
 #ifndef ACPI_USE_ALTERNATE_PROTOTYPE_AcpiOsReleaseObject
 ACPI_STATUS AcpiOsReleaseObject(ACPI_CACHE_T * Cache, void *Object)
 {
+	struct acpi_cache *c = (struct acpi_cache *) Cache;
 
-	free(Object);
+	if (c == NULL || Object == NULL)
+		return AE_BAD_PARAMETER;
+	if (c->depth >= c->maxdepth) {
+		free(Object);
+		return AE_OK;
+	}
+	*(void **) Object = c->free;
+	c->free = Object;
+	c->depth++;
 	return AE_OK;
 }
 #endif
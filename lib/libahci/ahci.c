@@ -20,6 +20,7 @@
 enum blk_op {
 	BLK_OP_READ,
 	BLK_OP_WRITE,
+	BLK_OP_FLUSH,
 };
 
 struct blk_ahci_hw_hba;
@@ -34,15 +35,33 @@ struct blk_ahci_qop {
 	int evt;
 	int *retp;
 
+	/* Vectored I/O: segments and completion callback. */
+	const struct blkiov *iov;
+	unsigned iovcnt;
+	void (*done)(void *, int);
+	void *donearg;
+
 	TAILQ_ENTRY(blk_ahci_qop) ioqe;
 };
 
 struct blk_ahci_port {
+	uint64_t name;
+	int ncq;
+	unsigned nslots;	/* Usable command slots. */
+	unsigned qdepth;	/* Max commands in flight. */
+	unsigned inflight;
+	int flushing;		/* A non-queued FLUSH is in flight. */
+	int recovering;		/* Error recovery in progress. */
+	int dead;		/* Port could not be reset. */
+
 	uint32_t lastci;
-	void *cmd_addr[32];
-	size_t cmd_sz[32];
-	int *cmd_retp[32];
-	int cmd_evt[32];
+	struct blkiov cmd_seg[32];	/* Single buffer commands. */
+	const struct blkiov *cmd_iov[32];
+	unsigned cmd_iovcnt[32];
+	uint32_t cmd_expmask[32];	/* Segments exported for the command. */
+	struct blk_ahci_qop cmd_qop[32];	/* Requeued on NCQ errors. */
+
+	TAILQ_HEAD(, blk_ahci_qop) ioq;
 };
 
 struct blk_ahci {
@@ -57,13 +76,29 @@ struct blk_ahci {
 	iova_t mem_iova;
 
 	uint32_t ports_impl;
-	TAILQ_HEAD(, blk_ahci_qop) ioq;
 	struct blk_ahci_port ports[32];
 
 	volatile struct blk_ahci_hw_hba *hw_hba;
 	volatile struct blk_ahci_hw_port *hw_ports;
+
+	LIST_HEAD(, blk_ahci_dmareg) dmaregs;
+
+	SLIST_ENTRY(blk_ahci) list;
 };
 
+/*
+ * Buffer registered for DMA. Pages are exported once at registration,
+ * and I/O within the buffer uses the IOVAs recorded here.
+ */
+struct blk_ahci_dmareg {
+	vaddr_t va;
+	size_t sz;
+	LIST_ENTRY(blk_ahci_dmareg) list;
+	iova_t iova[];	/* IOVA of each page. */
+};
+
+static SLIST_HEAD(, blk_ahci) ahcis = SLIST_HEAD_INITIALIZER(ahcis);
+
 struct blk_ahci_opq {
 	struct blk_ahci *ahci;
 	int port;
@@ -74,24 +109,21 @@ struct blk_ahci_opq {
 #define blk_ahci_clb_iova(_a, _i) ((uint64_t)((_a)->mem_iova + ((_i) << 10)))
 #define blk_ahci_fb(_a, _i) ((_a)->mem + (32 << 10) + ((_i) << 8))
 #define blk_ahci_fb_iova(_a, _i) ((uint64_t)((_a)->mem_iova + (32 << 10) + ((_i) << 8)))
-#define blk_ahci_ctba(_a, _i, _j) ((_a)->mem + (40 << 10) + ((_i) << 13) + ((_j) << 8))
-#define blk_ahci_ctba_iova(_a, _i, _j) ((uint64_t)(_a)->mem_iova + (40 << 10) + ((_i) << 13) + ((_j) << 8))
-#define blk_ahci_memsize() ((40 << 10) + (33 << 13))
+#define blk_ahci_ctba(_a, _i, _j) ((_a)->mem + (40 << 10) + ((_i) << 15) + ((_j) << 10))
+#define blk_ahci_ctba_iova(_a, _i, _j) ((uint64_t)(_a)->mem_iova + (40 << 10) + ((_i) << 15) + ((_j) << 10))
+#define blk_ahci_log(_a, _i) ((_a)->mem + (40 << 10) + (32 << 15) + ((_i) << 9))
+#define blk_ahci_log_iova(_a, _i) ((uint64_t)(_a)->mem_iova + (40 << 10) + (32 << 15) + ((_i) << 9))
+#define blk_ahci_memsize() ((40 << 10) + (32 << 15) + (32 << 9))
 
 
 #define blk_ahci_ch(_a, _i, _j) ((volatile struct blk_ahci_hw_cmdhdr *)(blk_ahci_clb((_a), (_i))) + (_j))
 #define blk_ahci_cfis(_a, _i, _j) ((volatile void *)blk_ahci_ctba((_a), (_i), (_j)))
 #define blk_ahci_prdtl(_a, _i, _j) ((volatile struct blk_ahci_hw_prdt *)(blk_ahci_ctba((_a), (_i), (_j)) + 0x80))
 
-#define AHCI_PORT_PRDT_SIZE 8
-/* For simplicity (and probable lack of consecutive pages) we
- * use a page per PRDT entry.
- *
- * If va is not aligned, we would could fit no more than (n-1)
- * full pages in the PRDT, where n is the size of the PDT.
- * Reflect that by only allowing (n - 1) maximum pages.
- */
-#define AHCI_PORT_DMA_MAXSIZE ((AHCI_PORT_PRDT_SIZE - 1) * PAGE_SIZE)
+/* A 1K command table: the command FIS followed by the PRDT. */
+#define AHCI_PORT_PRDT_SIZE ((1024 - 0x80) / sizeof(struct blk_ahci_hw_prdt))
+/* Physically contiguous pages are merged up to the PRDT entry limit. */
+#define AHCI_PRDT_MAXBYTES (PRDT_DBC_MASK + 1)
 
 
 #define AHCI_LOG(_a, ...) do { dbgprintf("AHCI %s: ", unsquoze_inline((_a)->devid).str); dbgprintf(__VA_ARGS__); dbgprintf("\n"); } while(0)
@@ -99,35 +131,276 @@ struct blk_ahci_opq {
 #define AHCI_PORT_INFO(_a_, _i, ...) do { printf("AHCI %s port %d: ", unsquoze_inline((_a)->devid).str, i); printf(__VA_ARGS__); printf("\n"); } while(0)
 #define AHCI_PORT_ERR(_a, _i, ...) do { dbgprintf("AHCI %s port %d ERROR: ", unsquoze_inline((_a)->devid).str, i); dbgprintf(__VA_ARGS__); dbgprintf("\n"); } while(0)
 
-static void ahci_port_unset_prdt(struct blk_ahci *ahci, int i, int j, void *addr, size_t sz);
+static void ahci_port_unset_prdt(struct blk_ahci *ahci, int i, int j);
+static int ahci_port_error(struct blk_ahci *ahci, unsigned i);
+static void ahci_port_drain(struct blk_ahci *ahci, int i);
+
+static void ahci_port_cmd_done(struct blk_ahci *ahci, int i, int j, int ret)
+{
+	struct blk_ahci_port *p = ahci->ports + i;
+
+	AHCI_PORT_LOG(ahci, i, "CMD %d DONE (%d)", j, ret);
+	ahci_port_unset_prdt(ahci, i, j);
+	p->lastci &= ~(1U << j);
+	p->inflight--;
+	if (p->cmd_qop[j].op == BLK_OP_FLUSH)
+		p->flushing = 0;
+	if (p->cmd_qop[j].done != NULL) {
+		p->cmd_qop[j].done(p->cmd_qop[j].donearg, ret);
+		return;
+	}
+	*p->cmd_qop[j].retp = ret;
+	evtset(p->cmd_qop[j].evt);
+}
+
+/* Put an aborted command back at the head of the port queue. */
+static void ahci_port_cmd_requeue(struct blk_ahci *ahci, int i, int j)
+{
+	struct blk_ahci_qop *qop;
+	struct blk_ahci_port *p = ahci->ports + i;
+
+	qop = malloc(sizeof(*qop));
+	if (qop == NULL) {
+		ahci_port_cmd_done(ahci, i, j, -EIO);
+		return;
+	}
+	*qop = p->cmd_qop[j];
+
+	AHCI_PORT_LOG(ahci, i, "CMD %d REQUEUED", j);
+	ahci_port_unset_prdt(ahci, i, j);
+	p->lastci &= ~(1U << j);
+	p->inflight--;
+	if (qop->op == BLK_OP_FLUSH)
+		p->flushing = 0;
+	TAILQ_INSERT_HEAD(&p->ioq, qop, ioqe);
+}
+
+static void ahci_qop_fail(struct blk_ahci_qop *qop, int ret)
+{
+	if (qop->done != NULL) {
+		qop->done(qop->donearg, ret);
+		return;
+	}
+	*qop->retp = ret;
+	evtset(qop->evt);
+}
+
+/* Timeouts for port state changes, in milliseconds. */
+#define AHCI_TMO_STOP	500
+#define AHCI_TMO_CLO	500
+#define AHCI_TMO_LINK	1000
+#define AHCI_TMO_BUSY	5000
+#define AHCI_TMO_CMD	5000
+
+/*
+ * Poll until '*reg & mask' equals 'val'. Without a timer the number
+ * of polls is bounded instead.
+ */
+static int ahci_wait(volatile uint32_t *reg, uint32_t mask, uint32_t val, unsigned ms)
+{
+	unsigned n;
+	uint64_t now, start = timer_nsecs();
+
+	for (n = 0; (*reg & mask) != val; n++) {
+		now = timer_nsecs();
+		if (now ? now - start >= (uint64_t)ms * 1000000 : n >= ms * 1000)
+			return -ETIMEDOUT;
+		lwt_pause();
+	}
+	return 0;
+}
+
+/*
+ * Stop the command engine and clear a busy device. Fails if the
+ * engine doesn't stop or the device stays busy.
+ */
+static int ahci_port_stop(struct blk_ahci *ahci, int i)
+{
+	volatile struct blk_ahci_hw_port *hwp = ahci->hw_ports + i;
+
+	hwp->cmd &= ~PX_CMD_ST;
+	if (ahci_wait(&hwp->cmd, PX_CMD_CR, 0, AHCI_TMO_STOP))
+		return -ETIMEDOUT;
+
+	hwp->serr = -1;
+	hwp->is = -1;
+
+	if (!(hwp->tfd & 0x88))
+		return 0;
+	if (!(ahci->hw_hba->cap & CAP_SCLO))
+		return -EBUSY;
+	hwp->cmd |= PX_CMD_CLO;
+	return ahci_wait(&hwp->cmd, PX_CMD_CLO, 0, AHCI_TMO_CLO);
+}
+
+/*
+ * Reset the link and the device with a COMRESET. Everything the
+ * device had queued is lost. The engine must be stopped.
+ */
+static int ahci_port_comreset(struct blk_ahci *ahci, int i)
+{
+	int ret;
+	volatile struct blk_ahci_hw_port *hwp = ahci->hw_ports + i;
+
+	AHCI_PORT_ERR(ahci, i, "COMRESET");
+	hwp->cmd &= ~PX_CMD_ST;
+	ret = ahci_wait(&hwp->cmd, PX_CMD_CR, 0, AHCI_TMO_STOP);
+	if (ret)
+		return ret;
+
+	hwp->sctl = bitfld_set(hwp->sctl, PX_SSTS_DET, 1);
+	lwt_nsleep(1000000);
+	hwp->sctl = bitfld_set(hwp->sctl, PX_SSTS_DET, 0);
+
+	ret = ahci_wait(&hwp->ssts, PX_SSTS_DET_MASK, PX_SSTS_DET_P, AHCI_TMO_LINK);
+	if (ret)
+		return ret;
+	ret = ahci_wait(&hwp->tfd, 0x88, 0, AHCI_TMO_BUSY);
+	hwp->serr = -1;
+	hwp->is = -1;
+	return ret;
+}
+
+/*
+ * Read the NCQ Command Error log (log page 10h) with a polled,
+ * non-queued READ LOG EXT. Reading the log also takes the device out
+ * of the NCQ error state. Returns the tag of the failed command, or
+ * -1 if the error was not caused by a queued command.
+ */
+static int ahci_port_ncq_errlog(struct blk_ahci *ahci, int i)
+{
+	int ret;
+	const int j = 0;
+	uint8_t *log = blk_ahci_log(ahci, i);
+	volatile struct blk_ahci_hw_port *hwp = ahci->hw_ports + i;
+	volatile struct blk_ahci_hw_cmdhdr *ch;
+	volatile struct blk_ahci_hw_prdt *prdt;
+	volatile struct fis_reg_h2d *cfis;
+
+	ch = blk_ahci_ch(ahci, i, j);
+	memset((void *)ch, 0, sizeof(*ch));
+	ch->ctba = (uint32_t) blk_ahci_ctba_iova(ahci, i, j);
+	ch->ctbau = (uint32_t) (blk_ahci_ctba_iova(ahci, i, j) >> 32);
+
+	cfis = (volatile struct fis_reg_h2d *) blk_ahci_cfis(ahci, i, j);
+	memset((void *)cfis, 0, sizeof(*cfis));
+	cfis->fis = FIS_TYPE_REG_H2D;
+	cfis->flags = FIS_FLAGS_C;
+	cfis->cmd = 0x2f;
+	cfis->lba0 = 0x10;
+	cfis->dev = (1 << 6);
+	cfis->count1 = 1;
+	ch->opts = bitfld_set(ch->opts, CMDHDR_CFL, 5);
+
+	prdt = blk_ahci_prdtl(ahci, i, j);
+	prdt->dba = (uint32_t)blk_ahci_log_iova(ahci, i);
+	prdt->dbau = blk_ahci_log_iova(ahci, i) >> 32;
+	prdt->dbc = (512 - 1) | PRDT_DBC_I;
+	ch->opts = bitfld_set(ch->opts, CMDHDR_PRDTL, 1);
+
+	memset(log, 0, 512);
+	__compiler_membar();
+	hwp->ci = (1U << j);
+
+	ret = ahci_wait(&hwp->ci, 1U << j, 0, AHCI_TMO_CMD);
+	if (ret == 0 && ahci_port_error(ahci, i))
+		ret = -EIO;
+	if (ret) {
+		AHCI_PORT_ERR(ahci, i, "READ LOG EXT failed (%d)", ret);
+		return ret;
+	}
+
+	/* Byte 0: NQ in bit 7, the failed tag in bits 4:0. */
+	if (log[0] & 0x80)
+		return -1;
+	return log[0] & 0x1f;
+}
+
+/*
+ * Recover from a fatal port error.
+ *
+ * Stopping the engine aborts every command in flight. With NCQ the
+ * device error log tells which queued command failed: only that one
+ * completes with -EIO, the others are requeued. If the engine does
+ * not stop, the device stays busy or the log can't be read, the port
+ * is reset with a COMRESET and everything in flight fails.
+ */
+static void ahci_port_recover(struct blk_ahci *ahci, int i)
+{
+	int j, tag = -1, reset;
+	uint32_t busy, queued;
+	volatile struct blk_ahci_hw_port *hwp = ahci->hw_ports + i;
+	struct blk_ahci_port *p = ahci->ports + i;
+
+	p->recovering = 1;
+
+	/* Queued commands the device completed before the error. */
+	queued = p->ncq && !p->flushing ? p->lastci : 0;
+	busy = queued & ~hwp->sact;
+	while (busy) {
+		j = ffs32(busy) - 1;
+		busy &= ~(1U << j);
+		ahci_port_cmd_done(ahci, i, j, 0);
+	}
+	queued &= p->lastci;
+
+	reset = !!ahci_port_stop(ahci, i);
+	if (!reset) {
+		hwp->cmd |= PX_CMD_ST;
+		if (queued) {
+			tag = ahci_port_ncq_errlog(ahci, i);
+			reset = tag < -1;
+		}
+	}
+
+	if (reset) {
+		if (ahci_port_comreset(ahci, i)) {
+			AHCI_PORT_ERR(ahci, i, "Port reset failed. Disabling port");
+			p->dead = 1;
+		} else {
+			hwp->cmd |= PX_CMD_ST;
+		}
+	}
+
+	busy = p->lastci;
+	while (busy) {
+		j = ffs32(busy) - 1;
+		busy &= ~(1U << j);
+		if (reset || j == tag || !(queued & (1U << j)))
+			ahci_port_cmd_done(ahci, i, j, -EIO);
+		else
+			ahci_port_cmd_requeue(ahci, i, j);
+	}
+
+	p->recovering = 0;
+}
 
 static void ahci_port_intr(struct blk_ahci *ahci, int i)
 {
 	int j;
 	volatile struct blk_ahci_hw_port *hwp= ahci->hw_ports + i;
 	struct blk_ahci_port *p = ahci->ports + i;
-	uint32_t ci;
 	uint32_t done;
 
+	if (ahci_port_error(ahci, i))
+		ahci_port_recover(ahci, i);
+
 	hwp->is = -1;
 	__compiler_membar();
 
-	ci = hwp->ci;
-	done = p->lastci & ~ci;
+	/*
+	 * Non-queued commands are done when their CI bit clears. Queued
+	 * commands clear CI once the command FIS is accepted, and are
+	 * only done when the device clears their SACT bit.
+	 */
+	done = p->lastci & ~(hwp->ci | hwp->sact);
 	while (done) {
-		for (j = 0; j < 32; j++) {
-			if (done & (1 << j)) {
-				AHCI_PORT_LOG(ahci, i, "CMD %d DONE", j);
-				ahci_port_unset_prdt(ahci, i, j, p->cmd_addr[j], p->cmd_sz[j]);
-				evtset(p->cmd_evt[j]);
-				*p->cmd_retp[j] = 0;
-			}
-		}
-		p->lastci = ci;
-		ci = hwp->ci;
-		done = p->lastci & ~ci;
-		
+		j = ffs32(done) - 1;
+		done &= ~(1U << j);
+		ahci_port_cmd_done(ahci, i, j, 0);
 	}
+
+	ahci_port_drain(ahci, i);
 }
 
 static int ahci_port_error(struct blk_ahci *ahci, unsigned i)
@@ -150,8 +423,14 @@ static int ahci_port_get_slot(struct blk_ahci *ahci, unsigned i)
 {
 	int j;
 	uint32_t free;
+	struct blk_ahci_port *p = ahci->ports + i;
+
+	if (p->inflight >= p->qdepth)
+		return -EBUSY;
 
-	free = ~ahci->ports[i].lastci & ~ahci->hw_ports[i].sact;
+	free = ~p->lastci & ~ahci->hw_ports[i].sact;
+	if (p->nslots < 32)
+		free &= (1U << p->nslots) - 1;
 	j = ffs32((long)free);
 	if (j == 0)
 		return -EBUSY;
@@ -159,57 +438,190 @@ static int ahci_port_get_slot(struct blk_ahci *ahci, unsigned i)
 	return j - 1;
 }
 
-static int ahci_port_set_prdt(struct blk_ahci *ahci, int i, int j, volatile struct blk_ahci_hw_cmdhdr *ch, void *addr, size_t sz)
+/* Unexport the first 'n' pages of a buffer starting at 'addr'. */
+static void ahci_unexport(struct blk_ahci *ahci, void *addr, unsigned n)
+{
+	unsigned k;
+	vaddr_t va = (vaddr_t)addr;
+
+	for (k = 0; k < n; k++) {
+		(void)dunexport(ahci->d, (void *)va);
+		va = trunc_page(va) + PAGE_SIZE;
+	}
+}
+
+static struct blk_ahci_dmareg *ahci_dmareg_find(struct blk_ahci *ahci, void *addr, size_t sz)
+{
+	struct blk_ahci_dmareg *reg;
+	vaddr_t va = (vaddr_t)addr;
+
+	LIST_FOREACH(reg, &ahci->dmaregs, list)
+		if (va >= reg->va && va + sz <= reg->va + reg->sz)
+			return reg;
+
+	return NULL;
+}
+
+static int ahci_dmareg_add(struct blk_ahci *ahci, void *addr, size_t sz)
 {
 	int ret;
 	iova_t iova;
 	size_t chunk;
-	volatile struct blk_ahci_hw_prdt *prdt;
-	unsigned k, n = (round_page((vaddr_t)addr + sz) - trunc_page((vaddr_t)addr)) >> PAGE_SHIFT;
+	struct blk_ahci_dmareg *reg;
+	vaddr_t va = (vaddr_t)addr;
+	unsigned k, n = (round_page(va + sz) - trunc_page(va)) >> PAGE_SHIFT;
+
+	if (sz == 0)
+		return -EINVAL;
 
-	if (sz >= AHCI_PORT_DMA_MAXSIZE)
+	reg = malloc(sizeof(*reg) + n * sizeof(iova_t));
+	if (reg == NULL)
 		return -ENOMEM;
 
 	for (k = 0; k < n; k++) {
-		chunk = PAGE_SIZE - ((vaddr_t)addr & PAGE_MASK);
+		chunk = PAGE_SIZE - (va & PAGE_MASK);
 		chunk = sz > chunk ? chunk : sz;
-		ret = dexport(ahci->d, addr, chunk, &iova);
+		ret = dexport(ahci->d, (void *)va, chunk, &iova);
 		if (ret) {
-			unsigned l;
-			for (l = 0; l < k; l++)
-				dunexport(ahci->d, addr + (l << PAGE_SHIFT));
+			ahci_unexport(ahci, addr, k);
+			free(reg);
 			return ret;
 		}
-
-		prdt = blk_ahci_prdtl(ahci, i, j) + k;
-		prdt->dba = (uint32_t)iova;
-		prdt->dbau = iova >> 32;
-		prdt->dbc = (chunk - 1);
-		addr += chunk;
+		reg->iova[k] = iova - (va & PAGE_MASK);
+		va += chunk;
+		sz -= chunk;
 	}
-	prdt->dbc |= PRDT_DBC_I;
 
-	ch->opts |= bitfld_set(ch->opts, CMDHDR_PRDTL, n);
+	reg->va = (vaddr_t)addr;
+	reg->sz = va - (vaddr_t)addr;
+	LIST_INSERT_HEAD(&ahci->dmaregs, reg, list);
+	return 0;
+}
+
+static int ahci_dmareg_del(struct blk_ahci *ahci, void *addr)
+{
+	struct blk_ahci_dmareg *reg;
+
+	LIST_FOREACH(reg, &ahci->dmaregs, list)
+		if (reg->va == (vaddr_t)addr)
+			break;
+
+	if (reg == NULL)
+		return -ENOENT;
+
+	LIST_REMOVE(reg, list);
+	ahci_unexport(ahci, addr, (round_page(reg->va + reg->sz) - trunc_page(reg->va)) >> PAGE_SHIFT);
+	free(reg);
 	return 0;
 }
 
-static void ahci_port_unset_prdt(struct blk_ahci *ahci, int i, int j, void *addr, size_t sz)
+/* Unexport the segments in 'mask', exported a page at a time. */
+static void ahci_unexport_iov(struct blk_ahci *ahci, const struct blkiov *iov, unsigned iovcnt, uint32_t mask)
+{
+	unsigned s;
+	vaddr_t va;
+
+	for (s = 0; s < iovcnt; s++) {
+		if (!(mask & (1U << s)))
+			continue;
+		va = (vaddr_t)iov[s].addr;
+		ahci_unexport(ahci, iov[s].addr,
+			      (round_page(va + iov[s].len) - trunc_page(va)) >> PAGE_SHIFT);
+	}
+}
+
+/*
+ * Fill the PRDT of command slot 'j' with the segments of 'iov'.
+ * Segments within a registered region use its IOVAs, others are
+ * exported a page at a time and unexported on completion. Physically
+ * contiguous pages share an entry, also across segments.
+ */
+static int ahci_port_set_prdt(struct blk_ahci *ahci, int i, int j, volatile struct blk_ahci_hw_cmdhdr *ch, const struct blkiov *iov, unsigned iovcnt)
 {
 	int ret;
-	iova_t iova;
-	size_t chunk;
-	volatile struct blk_ahci_hw_prdt *prdt;
-	unsigned k, n = (round_page((vaddr_t)addr + sz) - trunc_page((vaddr_t)addr)) >> PAGE_SHIFT;
+	iova_t iova, next = 0;
+	size_t sz, chunk, len = 0;
+	unsigned s, k = 0, npgs = 0;
+	uint32_t expmask = 0;
+	vaddr_t va;
+	struct blk_ahci_dmareg *reg;
+	volatile struct blk_ahci_hw_prdt *prdt = NULL;
+
+	if (iovcnt == 0 || iovcnt > 32)
+		return -EINVAL;
+
+	for (s = 0; s < iovcnt; s++) {
+		va = (vaddr_t)iov[s].addr;
+		sz = iov[s].len;
+		npgs = 0;
+		if (sz == 0) {
+			ret = -EINVAL;
+			goto err;
+		}
 
-	for (k = 0; k < n; k++) {
-		chunk = PAGE_SIZE - ((vaddr_t)addr & PAGE_MASK);
-		chunk = sz > chunk ? chunk : sz;
-		(void)dunexport(ahci->d, addr);
+		reg = ahci_dmareg_find(ahci, iov[s].addr, sz);
+		if (reg == NULL)
+			expmask |= 1U << s;
+
+		while (sz) {
+			chunk = PAGE_SIZE - (va & PAGE_MASK);
+			chunk = sz > chunk ? chunk : sz;
+
+			if (reg != NULL) {
+				iova = reg->iova[(trunc_page(va) - trunc_page(reg->va)) >> PAGE_SHIFT]
+					+ (va & PAGE_MASK);
+			} else {
+				ret = dexport(ahci->d, (void *)va, chunk, &iova);
+				if (ret)
+					goto err;
+				npgs++;
+			}
+
+			if (prdt != NULL && iova == next && len + chunk <= AHCI_PRDT_MAXBYTES) {
+				len += chunk;
+			} else {
+				if (k == AHCI_PORT_PRDT_SIZE) {
+					ret = -ENOMEM;
+					goto err;
+				}
+				prdt = blk_ahci_prdtl(ahci, i, j) + k++;
+				prdt->dba = (uint32_t)iova;
+				prdt->dbau = iova >> 32;
+				len = chunk;
+			}
+			prdt->dbc = len - 1;
+
+			next = iova + chunk;
+			va += chunk;
+			sz -= chunk;
+		}
 	}
+	prdt->dbc |= PRDT_DBC_I;
+
+	ahci->ports[i].cmd_iov[j] = iov;
+	ahci->ports[i].cmd_iovcnt[j] = iovcnt;
+	ahci->ports[i].cmd_expmask[j] = expmask;
+	ch->opts = bitfld_set(ch->opts, CMDHDR_PRDTL, k);
+	return 0;
+
+err:
+	/* The failing segment is partially exported. */
+	if (expmask & (1U << s))
+		ahci_unexport(ahci, iov[s].addr, npgs);
+	ahci_unexport_iov(ahci, iov, s, expmask);
+	return ret;
+}
+
+static void ahci_port_unset_prdt(struct blk_ahci *ahci, int i, int j)
+{
+	struct blk_ahci_port *p = ahci->ports + i;
+
+	ahci_unexport_iov(ahci, p->cmd_iov[j], p->cmd_iovcnt[j], p->cmd_expmask[j]);
 }
 
 static int ahci_port_set_fis(struct blk_ahci *ahci, int i, int j, volatile struct blk_ahci_hw_cmdhdr *ch, enum blk_op op,  uint64_t blkid, size_t nblks)
 {
+	int ncq = ahci->ports[i].ncq;
 	volatile struct fis_reg_h2d *cfis;
 
 	cfis = (volatile struct fis_reg_h2d *) blk_ahci_cfis(ahci, i, j);
@@ -218,14 +630,22 @@ static int ahci_port_set_fis(struct blk_ahci *ahci, int i, int j, volatile struc
 	cfis->flags = FIS_FLAGS_C;
 	cfis->dev = (1 << 6);
 
+	/* READ/WRITE FPDMA QUEUED or READ/WRITE DMA EXT. */
 	switch(op) {
 	case BLK_OP_READ:
-		cfis->cmd = 0x25;
+		cfis->cmd = ncq ? 0x60 : 0x25;
 		break;
 	case BLK_OP_WRITE:
-		cfis->cmd = 0x35;
+		cfis->cmd = ncq ? 0x61 : 0x35;
 		ch->opts |= CMDHDR_W;
 		break;
+	case BLK_OP_FLUSH:
+		/* FLUSH CACHE EXT: non-queued, no data. */
+		cfis->cmd = 0xea;
+		ncq = 0;
+		blkid = 0;
+		nblks = 0;
+		break;
 	default:
 		return -ENODEV;
 	};
@@ -242,9 +662,17 @@ static int ahci_port_set_fis(struct blk_ahci *ahci, int i, int j, volatile struc
 	blkid >>= 8;
 	cfis->lba5 = blkid & 0xff;
 
-	cfis->count1 = nblks & 0xff;
-	nblks >>= 8;
-	cfis->count2 = nblks & 0xff;
+	if (ncq) {
+		/* Sector count is in FEATURE, the tag in COUNT. */
+		cfis->feature1 = nblks & 0xff;
+		nblks >>= 8;
+		cfis->feature2 = nblks & 0xff;
+		cfis->count1 = j << 3;
+	} else {
+		cfis->count1 = nblks & 0xff;
+		nblks >>= 8;
+		cfis->count2 = nblks & 0xff;
+	}
 
 	ch->opts |= bitfld_set(ch->opts, CMDHDR_CFL, 5);
 
@@ -255,19 +683,33 @@ static int ahci_port_issue_qop(struct blk_ahci *ahci, int i, int j, struct blk_a
 {
 	int ret;
 	volatile struct blk_ahci_hw_cmdhdr *ch;
+	struct blk_ahci_port *p = ahci->ports + i;
 
 	ch = blk_ahci_ch(ahci, i, j);
 	memset((void *)ch, 0, sizeof(*ch));
 	ch->ctba = (uint32_t) blk_ahci_ctba_iova(ahci, i, j);
 	ch->ctbau = (uint32_t) (blk_ahci_ctba_iova(ahci, i, j) >> 32);
 
-	ret = ahci_port_set_prdt(ahci, i, j, ch, qop->data, qop->sz);
+	if (qop->op == BLK_OP_FLUSH) {
+		p->cmd_iov[j] = NULL;
+		p->cmd_iovcnt[j] = 0;
+		p->cmd_expmask[j] = 0;
+		ret = 0;
+	} else if (qop->iov == NULL) {
+		p->cmd_seg[j].addr = qop->data;
+		p->cmd_seg[j].len = qop->sz;
+		ret = ahci_port_set_prdt(ahci, i, j, ch, p->cmd_seg + j, 1);
+	} else {
+		ret = ahci_port_set_prdt(ahci, i, j, ch, qop->iov, qop->iovcnt);
+	}
 	if (ret)
 		return ret;
 
 	ret = ahci_port_set_fis(ahci, i, j, ch, qop->op, qop->blkid, qop->nblks);
-	if (ret)
+	if (ret) {
+		ahci_port_unset_prdt(ahci, i, j);
 		return ret;
+	}
 
 #if 0
 	int v;
@@ -285,44 +727,103 @@ static int ahci_port_issue_qop(struct blk_ahci *ahci, int i, int j, struct blk_a
 	}
 #endif
 
-	ahci->ports[i].lastci |= (1 << j);
-	ahci->ports[i].cmd_retp[j] = qop->retp;
-	ahci->ports[i].cmd_evt[j] = qop->evt;
-	ahci->ports[i].cmd_addr[j] = qop->data;
-	ahci->ports[i].cmd_sz[j] = qop->sz;
-	ahci->hw_ports[i].ci |= (1 << j);
+	ahci->ports[i].lastci |= (1U << j);
+	ahci->ports[i].inflight++;
+	ahci->ports[i].cmd_qop[j] = *qop;
+	if (qop->op == BLK_OP_FLUSH)
+		ahci->ports[i].flushing = 1;
+	/* SACT and CI are write-one-to-set. SACT must be set first. */
+	if (ahci->ports[i].ncq && qop->op != BLK_OP_FLUSH)
+		ahci->hw_ports[i].sact = (1U << j);
+	__compiler_membar();
+	ahci->hw_ports[i].ci = (1U << j);
 	return 0;
 }
 
-static int ahci_port_queue_op(struct blk_ahci *ahci, int i, enum blk_op op, void *data, size_t sz, uint64_t blkid, size_t nblks, int evt, int *ret)
+/*
+ * Slot for qop. A FLUSH can't be mixed with queued commands: it
+ * waits for those in flight, and nothing is issued until it's done.
+ */
+static int ahci_port_get_qslot(struct blk_ahci *ahci, int i, struct blk_ahci_qop *qop)
 {
-	struct blk_ahci_qop qop, *ptr;
+	struct blk_ahci_port *p = ahci->ports + i;
 
-	qop.op = op;
-	qop.data = data;
-	qop.sz = sz;
-	qop.blkid = blkid;
-	qop.nblks = nblks;
-	qop.evt = evt;
-	qop.retp = ret;
+	if (p->flushing || p->recovering)
+		return -EBUSY;
+	if (qop->op == BLK_OP_FLUSH && p->inflight)
+		return -EBUSY;
+	return ahci_port_get_slot(ahci, i);
+}
+
+/* Issue queued operations while the port has free slots. */
+static void ahci_port_drain(struct blk_ahci *ahci, int i)
+{
+	int j, ret;
+	struct blk_ahci_qop *qop;
+	struct blk_ahci_port *p = ahci->ports + i;
+
+	while ((qop = TAILQ_FIRST(&p->ioq)) != NULL) {
+		if (p->dead) {
+			j = -1;
+			ret = -EIO;
+		} else {
+			j = ahci_port_get_qslot(ahci, i, qop);
+			if (j < 0)
+				break;
+		}
+
+		TAILQ_REMOVE(&p->ioq, qop, ioqe);
+		if (j >= 0)
+			ret = ahci_port_issue_qop(ahci, i, j, qop);
+		if (ret)
+			ahci_qop_fail(qop, ret);
+		free(qop);
+	}
+}
+
+static int ahci_port_queue_qop(struct blk_ahci *ahci, int i, struct blk_ahci_qop *qop)
+{
+	struct blk_ahci_qop *ptr;
+	struct blk_ahci_port *p = ahci->ports + i;
 
-	if (TAILQ_EMPTY(&ahci->ioq)) {
+	if (p->dead)
+		return -EIO;
+
+	if (TAILQ_EMPTY(&p->ioq)) {
 		int j;
 
-		j = ahci_port_get_slot(ahci, i);
+		j = ahci_port_get_qslot(ahci, i, qop);
 		if (j >= 0)
-			return ahci_port_issue_qop(ahci, i, j, &qop);
+			return ahci_port_issue_qop(ahci, i, j, qop);
 	}
 
 	ptr = (struct blk_ahci_qop *)malloc(sizeof(*ptr));
 	if (ptr == NULL)
 		return -ENOMEM;
 
-	*ptr = qop;
-	TAILQ_INSERT_TAIL(&ahci->ioq, ptr, ioqe);
+	*ptr = *qop;
+	TAILQ_INSERT_TAIL(&p->ioq, ptr, ioqe);
 	return 0;
 }
 
+static int ahci_port_queue_op(struct blk_ahci *ahci, int i, enum blk_op op, void *data, size_t sz, uint64_t blkid, size_t nblks, int evt, int *ret)
+{
+	struct blk_ahci_qop qop;
+
+	qop.op = op;
+	qop.data = data;
+	qop.sz = sz;
+	qop.blkid = blkid;
+	qop.nblks = nblks;
+	qop.evt = evt;
+	qop.retp = ret;
+	qop.iov = NULL;
+	qop.iovcnt = 0;
+	qop.done = NULL;
+	qop.donearg = NULL;
+	return ahci_port_queue_qop(ahci, i, &qop);
+}
+
 static int ahci_port_blkrd(void *opq, void *data, size_t sz, uint64_t blkid, size_t nblks, int evt, int *res)
 {
 	struct blk_ahci_opq *aopq = (struct blk_ahci_opq *)opq;
@@ -337,9 +838,53 @@ static int ahci_port_blkwr(void *opq, uint64_t blkid, size_t nblks, void *data,
 	return ahci_port_queue_op(aopq->ahci, aopq->port, BLK_OP_WRITE, data, sz, blkid, nblks, evt, res);
 }
 
+static int ahci_port_blkflush(void *opq, int evt, int *res)
+{
+	struct blk_ahci_opq *aopq = (struct blk_ahci_opq *)opq;
+
+	return ahci_port_queue_op(aopq->ahci, aopq->port, BLK_OP_FLUSH, NULL, 0, 0, 0, evt, res);
+}
+
+static int ahci_port_blkiov(void *opq, int wr, uint64_t blkid, size_t nblks, const struct blkiov *iov, unsigned iovcnt, void (*done)(void *, int), void *arg)
+{
+	struct blk_ahci_qop qop;
+	struct blk_ahci_opq *aopq = (struct blk_ahci_opq *)opq;
+
+	qop.op = wr ? BLK_OP_WRITE : BLK_OP_READ;
+	qop.data = NULL;
+	qop.sz = 0;
+	qop.blkid = blkid;
+	qop.nblks = nblks;
+	qop.evt = -1;
+	qop.retp = NULL;
+	qop.iov = iov;
+	qop.iovcnt = iovcnt;
+	qop.done = done;
+	qop.donearg = arg;
+	return ahci_port_queue_qop(aopq->ahci, aopq->port, &qop);
+}
+
+static int ahci_port_blkreg(void *opq, void *va, size_t sz)
+{
+	struct blk_ahci_opq *aopq = (struct blk_ahci_opq *)opq;
+
+	return ahci_dmareg_add(aopq->ahci, va, sz);
+}
+
+static int ahci_port_blkunreg(void *opq, void *va)
+{
+	struct blk_ahci_opq *aopq = (struct blk_ahci_opq *)opq;
+
+	return ahci_dmareg_del(aopq->ahci, va);
+}
+
 static const struct blkops ahci_blkops =  {
 	.blkrd = ahci_port_blkrd,
 	.blkwr = ahci_port_blkwr,
+	.blkreg = ahci_port_blkreg,
+	.blkunreg = ahci_port_blkunreg,
+	.blkflush = ahci_port_blkflush,
+	.blkiov = ahci_port_blkiov,
 };
 
 static void ahci_port_ata_get_blkinfo(struct blk_ahci *ahci, unsigned i, uint16_t *ident, struct blkinfo *bi)
@@ -383,6 +928,16 @@ static void ahci_port_ata_get_blkinfo(struct blk_ahci *ahci, unsigned i, uint16_
 	
 	AHCI_PORT_LOG(ahci, i, "ATA Device: %"PRId64" sectors", sectno);
 
+	if ((ahci->hw_hba->cap & CAP_SNCQ)
+	    && (ident[ATA_IDENT_SATACAP] & ATA_IDENT_SATACAP_NCQ)) {
+		unsigned depth = 1 + bitfld_get(ident[ATA_IDENT_QDEPTH], ATA_IDENT_QDEPTH);
+
+		ahci->ports[i].ncq = 1;
+		if (depth < ahci->ports[i].nslots)
+			ahci->ports[i].nslots = depth;
+		AHCI_PORT_LOG(ahci, i, "ATA Device: NCQ depth %d", depth);
+	}
+
 	bi->blksz = sectsz;
 	bi->blkno = sectno;
 }
@@ -391,11 +946,14 @@ static int ahci_port_get_blkinfo(struct blk_ahci *ahci, unsigned i, struct blkin
 {
 	int j, ret;
 	char ident[512];
+	struct blkiov identiov;
 	unsigned long n = (round_page((vaddr_t)ident + 512) - trunc_page((vaddr_t)ident)) >> PAGE_SHIFT;
 	volatile struct blk_ahci_hw_cmdhdr *ch;
 	volatile struct fis_reg_h2d *cfis;
 
 	j = ahci_port_get_slot(ahci, i);
+	if (j < 0)
+		return j;
 
 	ch = blk_ahci_ch(ahci, i, j);
 	memset((void *)ch, 0, sizeof(*ch));
@@ -411,7 +969,9 @@ static int ahci_port_get_blkinfo(struct blk_ahci *ahci, unsigned i, struct blkin
 	cfis->feature1 = 1;
 	ch->opts = bitfld_set(ch->opts, CMDHDR_CFL, 5);
 
-	ret = ahci_port_set_prdt(ahci, i, j, ch, ident, 512);
+	identiov.addr = ident;
+	identiov.len = 512;
+	ret = ahci_port_set_prdt(ahci, i, j, ch, &identiov, 1);
 	if (ret)
 		return ret;
 
@@ -419,7 +979,7 @@ static int ahci_port_get_blkinfo(struct blk_ahci *ahci, unsigned i, struct blkin
 	evtwait(ahci->evt);
 	evtclear(ahci->evt);
 
-	ahci_port_unset_prdt(ahci, i, j, ident, 512);
+	ahci_port_unset_prdt(ahci, i, j);
 
 	if (ahci_port_error(ahci, i)) {
 		ahci->hw_ports[i].is = -1;
@@ -443,7 +1003,16 @@ static void ahci_port_init(struct blk_ahci *ahci, unsigned i)
 	volatile struct blk_ahci_hw_cmdhdr *ch;
 	volatile struct blk_ahci_hw_port *p = ahci->hw_ports + i;
 
+	ahci->ports[i].name = 0;
+	ahci->ports[i].ncq = 0;
+	ahci->ports[i].nslots = 1 + bitfld_get(ahci->hw_hba->cap, CAP_NCS);
+	ahci->ports[i].qdepth = 1;
+	ahci->ports[i].inflight = 0;
+	ahci->ports[i].flushing = 0;
+	ahci->ports[i].recovering = 0;
+	ahci->ports[i].dead = 0;
 	ahci->ports[i].lastci = 0;
+	TAILQ_INIT(&ahci->ports[i].ioq);
 
 	p->cmd &= ~PX_CMD_ST;
 	while (p->cmd & PX_CMD_CR) lwt_pause();
@@ -494,6 +1063,8 @@ static void ahci_port_init(struct blk_ahci *ahci, unsigned i)
 	aopq->ahci = ahci;
 	aopq->port = i;
 	name = squoze_sprintf(0, "%s%d", unsquoze_inline(ahci->basename).str, i);
+	ahci->ports[i].name = name;
+	ahci->ports[i].qdepth = ahci->ports[i].nslots;
 	blk_add(name, ahci->devid, &blkinfo, &ahci_blkops, (void *)aopq);
 	return;
 
@@ -689,7 +1260,8 @@ int blkdrv_ahci_probe(uint64_t nameid, uint64_t basename)
 	ahci->hw_ports = ports;
 	ahci->mem = (void *)ahcimem_va;
 	ahci->mem_iova = ahcimem_iova;
-	TAILQ_INIT(&ahci->ioq);
+	memset(ahci->ports, 0, sizeof(ahci->ports));
+	LIST_INIT(&ahci->dmaregs);
 
 	ahci_print_info(ahci);
 	ahci_init(ahci);
@@ -702,6 +1274,8 @@ int blkdrv_ahci_probe(uint64_t nameid, uint64_t basename)
 		}
 	}
 
+	SLIST_INSERT_HEAD(&ahcis, ahci, list);
+
 	/* Start async device via intr. */
 	evtast(ahci->evt, __ahci_intr, (void *)ahci);
 	ret = 0;
@@ -716,3 +1290,27 @@ err:
 	return ret;
 }
 
+
+int blkdrv_ahci_qdepth(uint64_t diskname, unsigned qdepth)
+{
+	int i;
+	struct blk_ahci *ahci;
+	struct blk_ahci_port *p;
+
+	SLIST_FOREACH(ahci, &ahcis, list) {
+		for (i = 0; i < 32; i++) {
+			p = ahci->ports + i;
+			if (p->name != diskname)
+				continue;
+
+			if (qdepth == 0)
+				return p->qdepth;
+
+			p->qdepth = qdepth > p->nslots ? p->nslots : qdepth;
+			ahci_port_drain(ahci, i);
+			return p->qdepth;
+		}
+	}
+
+	return -ENOENT;
+}
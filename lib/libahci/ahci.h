@@ -6,4 +6,12 @@
 
 int blkdrv_ahci_probe(uint64_t nameid, uint64_t dkbaseid);
 
+/*
+ * Set the maximum number of commands in flight on disk 'diskname',
+ * bounded by the slots supported by the HBA and the device.
+ * A 'qdepth' of zero only queries the current value.
+ * Returns the queue depth in use or a negative error.
+ */
+int blkdrv_ahci_qdepth(uint64_t diskname, unsigned qdepth);
+
 #endif
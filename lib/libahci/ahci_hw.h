@@ -10,6 +10,11 @@ struct blk_ahci_ata_ident {
 #define ATA_IDENT_FIRMWARE   23
 #define ATA_IDENT_MODEL      27
 #define ATA_IDENT_SECTNO     60
+#define ATA_IDENT_QDEPTH     75
+#define ATA_IDENT_QDEPTH_MASK  0x001F
+#define ATA_IDENT_QDEPTH_SHIFT 0
+#define ATA_IDENT_SATACAP    76
+#define ATA_IDENT_SATACAP_NCQ  _B(8)
 #define ATA_IDENT_SECTNO48   100
 #define ATA_IDENT_SECTSZ     106
 #define ATA_IDENT_SECTSZ_MBZ _B(15)
@@ -172,7 +177,7 @@ struct blk_ahci_hw_prdt {
 	uint32_t res;
 
 #define PRDT_DBC_I     _B(31)
-#define PRDT_DBC_MASK  0x0001FFFF
+#define PRDT_DBC_MASK  0x003FFFFF
 #define PRDT_DBC_SHIFT 0
 	uint32_t dbc;
 } __packed;
@@ -4,6 +4,38 @@
 #include <mrg.h>
 #include <mrg/blk.h>
 
+extern int __blkcache_read(struct blkcache *c, void *addr, size_t sz,
+			   uint64_t blkid, size_t nblks, int evt, int *retp);
+extern int __blkcache_write(struct blkcache *c, uint64_t blkid, size_t nblks,
+			    void *addr, size_t sz, int evt, int *retp);
+extern void __blkcache_free(struct blkcache *c);
+extern int __blkq_submit(struct blkq *q, int wr, void *addr, size_t sz,
+			 uint64_t blkid, size_t nblks, int evt, int *retp);
+extern void __blkq_free(struct blkq *q);
+extern void __blkq_drain(struct blkq *q);
+
+/* Pass a request to the driver, through the queue if any. */
+int
+__blk_submit(struct blkdisk *blk, int wr, void *addr, size_t sz, uint64_t blkid, size_t blkno, int evt, int *retp)
+{
+	if (blk->queue != NULL)
+		return __blkq_submit(blk->queue, wr, addr, sz, blkid, blkno, evt, retp);
+	if (wr)
+		return blk->ops->blkwr(blk->opq, blkid, blkno, addr, sz, evt, retp);
+	return blk->ops->blkrd(blk->opq, addr, sz, blkid, blkno, evt, retp);
+}
+
+static void
+blk_free(struct blkdisk *blk)
+{
+	/* The cache uses the queue. */
+	if (blk->cache != NULL)
+		__blkcache_free(blk->cache);
+	if (blk->queue != NULL)
+		__blkq_free(blk->queue);
+	free(blk);
+}
+
 static int blk_compare_nodes(void *ctx, const void *n1, const void *n2)
 {
 	const struct blkdisk *blk1 = (const struct blkdisk *)n1;
@@ -57,6 +89,8 @@ blk_add(uint64_t disk, uint64_t blkdev, struct blkinfo *info, const struct blkop
 	blkdisk->opq = opsopq;
 	blkdisk->ref = 0;
 	blkdisk->invalid = 0;
+	blkdisk->cache = NULL;
+	blkdisk->queue = NULL;
 	rb_tree_insert_node(&blk_rbtree, (void *)blkdisk);
 
 	printf("BLK: added device %s\n", unsquoze_inline(disk).str);
@@ -77,8 +111,9 @@ blk_del(uint64_t disk)
 	rb_tree_remove_node(&blk_rbtree, (void *) blkdisk);
 
 
-	if (blkdisk->ref == 0)
-		free(blkdisk);
+	if (blkdisk->ref == 0) {
+		blk_free(blkdisk);
+	}
 }
 
 uint64_t
@@ -135,7 +170,9 @@ blk_read(struct blkdisk *blk, void *addr, size_t sz, uint64_t blkid, size_t blkn
 {
 	if (blk->invalid)
 		return -ENODEV;
-	return blk->ops->blkrd(blk->opq, addr, sz, blkid, blkno, evt, retp);
+	if (blk->cache != NULL)
+		return __blkcache_read(blk->cache, addr, sz, blkid, blkno, evt, retp);
+	return __blk_submit(blk, 0, addr, sz, blkid, blkno, evt, retp);
 }
 
 int
@@ -143,15 +180,66 @@ blk_write(struct blkdisk *blk, uint64_t blkid, size_t blkno, void *addr, size_t
 {
 	if (blk->invalid)
 		return -ENODEV;
-	return blk->ops->blkwr(blk->opq, blkid, blkno, addr, sz, evt, retp);
+	if (blk->cache != NULL)
+		return __blkcache_write(blk->cache, blkid, blkno, addr, sz, evt, retp);
+	return __blk_submit(blk, 1, addr, sz, blkid, blkno, evt, retp);
+}
+
+int
+blk_register(struct blkdisk *blk, void *addr, size_t sz)
+{
+	if (blk->invalid)
+		return -ENODEV;
+	if (blk->ops->blkreg == NULL)
+		return -ENOSYS;
+	return blk->ops->blkreg(blk->opq, addr, sz);
+}
+
+int
+blk_unregister(struct blkdisk *blk, void *addr)
+{
+	if (blk->invalid)
+		return -ENODEV;
+	if (blk->ops->blkunreg == NULL)
+		return -ENOSYS;
+	return blk->ops->blkunreg(blk->opq, addr);
+}
+
+int
+blk_flush(struct blkdisk *blk)
+{
+	int ret, evt, res;
+
+	if (blk->invalid)
+		return -ENODEV;
+
+	ret = blk_sync(blk);
+	if (ret)
+		return ret;
+	if (blk->queue != NULL)
+		__blkq_drain(blk->queue);
+	if (blk->ops->blkflush == NULL)
+		return 0;
+
+	evt = evtalloc();
+	ret = blk->ops->blkflush(blk->opq, evt, &res);
+	if (ret == 0) {
+		evtwait(evt);
+		evtclear(evt);
+		ret = res;
+	}
+	evtfree(evt);
+	return ret;
 }
 
 void
 blk_close(struct blkdisk *blk)
 {
 	blk->ref--;
+	if (!blk->invalid && !blk->ref)
+		blk_sync(blk);
 	if (blk->invalid && !blk->ref) {
 		/* We're the last reference. Cleanup. */
-		free(blk);
+		blk_free(blk);
 	}
 }
@@ -0,0 +1,678 @@
+/*
+ * Copyright (c) 2015, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <microkernel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mrg.h>
+#include <mrg/blk.h>
+
+/*
+ * Block cache.
+ *
+ * A disk with a cache enabled by blk_cache() has its blocks cached
+ * in buffers of BLKC_BUFSZ bytes, hashed by buffer number and
+ * replaced with the CLOCK algorithm.
+ *
+ * Requests that hit the cache are completed before blk_read() or
+ * blk_write() return. The others are queued to a small pool of
+ * worker LWTs, which read the missing buffers in as few I/Os as
+ * possible. When reads are sequential, the missing buffers past the
+ * request are read too, in a window that doubles at each sequential
+ * request.
+ *
+ * Writes only dirty the buffers. A flusher LWT per disk writes them
+ * back, in block order, when more than half of the allowed dirty
+ * buffers are dirty; writers wait while the limit is exceeded, and
+ * fail with the write back error if it can't be brought down.
+ * blk_sync() and the last blk_close() write back everything.
+ */
+
+extern int __blk_submit(struct blkdisk *dk, int wr, void *addr, size_t sz,
+			uint64_t blkid, size_t nblks, int evt, int *retp);
+
+#define BLKC_BUFSZ 4096
+#define BLKC_NHASH 256
+#define BLKC_RAMAX 32		/* Buffers. */
+#define BLKC_RUNMAX 32		/* Buffers per I/O. */
+#define BLKC_NWORKERS 4
+#define BLKC_STACKSIZE (16 * 1024)
+
+#define BUF_HASHED 1
+#define BUF_VALID  2
+#define BUF_DIRTY  4
+#define BUF_BUSY   8		/* Under I/O. */
+#define BUF_REF    16		/* Accessed since last CLOCK pass. */
+
+struct blkbuf {
+	uint64_t bno;
+	int flags;
+	uint8_t *data;
+	LIST_ENTRY(blkbuf) hash;
+};
+
+struct blkcreq {
+	int wr;
+	uint8_t *addr;
+	uint64_t blkid;
+	size_t nblks;
+	int evt;
+	int *retp;
+	TAILQ_ENTRY(blkcreq) list;
+};
+
+struct blkcache {
+	struct blkdisk *dk;
+	unsigned bpb;		/* Blocks per buffer. */
+	unsigned nbufs;
+	unsigned runmax;
+	struct blkbuf *bufs;
+	uint8_t *mem;
+	LIST_HEAD(, blkbuf) hash[BLKC_NHASH];
+	unsigned hand;
+
+	unsigned ndirty;
+	unsigned maxdirty;
+	int flushreq;
+	int flushidle;
+	unsigned nflushes;	/* Write back passes done. */
+	int flusherr;		/* Result of the last one. */
+	lwt_t *flusher;
+
+	TAILQ_HEAD(, blkcreq) reqq;
+	lwt_t *workers[BLKC_NWORKERS];
+	int widle[BLKC_NWORKERS];
+
+	uint64_t nextblk;	/* Sequential read detection. */
+	unsigned ra;
+
+	struct blkcache_stats stats;
+};
+
+#define bc_bufhash(_c, _bno) ((_c)->hash + ((_bno) % BLKC_NHASH))
+
+static struct blkbuf *_bc_lookup(struct blkcache *c, uint64_t bno)
+{
+	struct blkbuf *b;
+
+	LIST_FOREACH(b, bc_bufhash(c, bno), hash)
+		if (b->bno == bno)
+			return b;
+	return NULL;
+}
+
+static void _bc_unhash(struct blkbuf *b)
+{
+	if (b->flags & BUF_HASHED)
+		LIST_REMOVE(b, hash);
+	b->flags = 0;
+}
+
+/* Get a free buffer for bno, busy. NULL if none can be replaced. */
+static struct blkbuf *_bc_alloc(struct blkcache *c, uint64_t bno)
+{
+	unsigned n;
+	struct blkbuf *b;
+
+	for (n = 0; n < 2 * c->nbufs; n++) {
+		b = c->bufs + c->hand;
+		c->hand = (c->hand + 1) % c->nbufs;
+		if (b->flags & (BUF_BUSY | BUF_DIRTY))
+			continue;
+		if (b->flags & BUF_REF) {
+			b->flags &= ~BUF_REF;
+			continue;
+		}
+		_bc_unhash(b);
+		b->bno = bno;
+		b->flags = BUF_HASHED | BUF_BUSY;
+		LIST_INSERT_HEAD(bc_bufhash(c, bno), b, hash);
+		return b;
+	}
+	return NULL;
+}
+
+/*
+ * Only wake the flusher when idle: while writing it sleeps in
+ * evtwait(), which does not expect other wake ups.
+ */
+static void _bc_flushreq(struct blkcache *c)
+{
+	c->flushreq = 1;
+	if (c->flushidle && lwt_getcurrent() != c->flusher) {
+		c->flushidle = 0;
+		lwt_wake(c->flusher);
+	}
+}
+
+/*
+ * As _bc_alloc(), but wait for buffers to be written back. Returns
+ * NULL if someone else cached bno in the meantime.
+ */
+static struct blkbuf *_bc_allocwait(struct blkcache *c, uint64_t bno)
+{
+	struct blkbuf *b;
+
+	while ((b = _bc_alloc(c, bno)) == NULL) {
+		_bc_flushreq(c);
+		lwt_yield();
+		if (_bc_lookup(c, bno) != NULL)
+			return NULL;
+	}
+	return b;
+}
+
+static int _bc_io(struct blkcache *c, int wr, uint64_t bno, unsigned n,
+		  void *buf)
+{
+	int evt, ret, res;
+	struct blkdisk *dk = c->dk;
+	uint64_t blkid = bno * c->bpb;
+	size_t nblks = n * c->bpb;
+
+	if (dk->invalid)
+		return -ENODEV;
+	/* The last buffer might extend past the end of the disk. */
+	if (blkid + nblks > dk->info.blkno)
+		nblks = dk->info.blkno - blkid;
+
+	evt = evtalloc();
+	if (evt < 0)
+		return -EAGAIN;
+	ret = __blk_submit(dk, wr, buf, nblks * dk->info.blksz, blkid, nblks,
+			   evt, &res);
+	if (ret == 0) {
+		evtwait(evt);
+		evtclear(evt);
+		ret = res;
+	}
+	evtfree(evt);
+	return ret;
+}
+
+/*
+ * Read the missing buffers from 'bno' up to 'end', stopping at the
+ * first cached one, with a single I/O. Buffers past 'reqend' are
+ * read ahead.
+ */
+static int _bc_fill(struct blkcache *c, uint64_t bno, uint64_t end,
+		    uint64_t reqend)
+{
+	int ret;
+	unsigned i, n;
+	uint64_t last;
+	uint8_t *stage;
+	struct blkbuf *b, *bufv[BLKC_RUNMAX];
+
+	last = (c->dk->info.blkno - 1) / c->bpb;
+	if (end > last + 1)
+		end = last + 1;
+	for (n = 0; n < c->runmax && bno + n < end; n++) {
+		if (_bc_lookup(c, bno + n) != NULL)
+			break;
+		b = _bc_allocwait(c, bno + n);
+		if (b == NULL)
+			break;
+		bufv[n] = b;
+	}
+	if (n == 0)
+		return 0;
+
+	stage = malloc(n * BLKC_BUFSZ);
+	if (stage == NULL)
+		ret = -ENOMEM;
+	else
+		ret = _bc_io(c, 0, bno, n, stage);
+
+	for (i = 0; i < n; i++) {
+		b = bufv[i];
+		if (ret) {
+			/* Forget it, it will be read again. */
+			_bc_unhash(b);
+			continue;
+		}
+		memcpy(b->data, stage + i * BLKC_BUFSZ, BLKC_BUFSZ);
+		b->flags = (b->flags & ~BUF_BUSY) | BUF_VALID;
+		if (bno + i >= reqend)
+			c->stats.readahead++;
+	}
+	free(stage);
+	return ret;
+}
+
+/*
+ * Get buffer bno, valid. If 'nofill', the caller will overwrite it
+ * entirely and a missing buffer is not read.
+ */
+static struct blkbuf *_bc_get(struct blkcache *c, uint64_t bno, uint64_t end,
+			      uint64_t reqend, int nofill, int *ret)
+{
+	int missed = 0;
+	struct blkbuf *b;
+
+	for (;;) {
+		b = _bc_lookup(c, bno);
+		if (b != NULL && (b->flags & BUF_BUSY)) {
+			lwt_yield();
+			continue;
+		}
+		if (b != NULL) {
+			if (!missed)
+				c->stats.hits++;
+			return b;
+		}
+		if (!missed)
+			c->stats.misses++;
+		missed = 1;
+		if (nofill) {
+			b = _bc_allocwait(c, bno);
+			if (b != NULL)
+				b->flags = (b->flags & ~BUF_BUSY) | BUF_VALID;
+			continue;
+		}
+		*ret = _bc_fill(c, bno, end, reqend);
+		if (*ret)
+			return NULL;
+	}
+}
+
+/* Copy between the request and the buffer. */
+static void _bc_copy(struct blkcache *c, struct blkbuf *b,
+		     struct blkcreq *req)
+{
+	size_t blksz = c->dk->info.blksz;
+	uint64_t first = b->bno * c->bpb;
+	uint64_t s, e;
+
+	s = MAX(req->blkid, first);
+	e = MIN(req->blkid + req->nblks, first + c->bpb);
+	if (req->wr)
+		memcpy(b->data + (s - first) * blksz,
+		       req->addr + (s - req->blkid) * blksz, (e - s) * blksz);
+	else
+		memcpy(req->addr + (s - req->blkid) * blksz,
+		       b->data + (s - first) * blksz, (e - s) * blksz);
+	b->flags |= BUF_REF;
+}
+
+static void _bc_dirty(struct blkcache *c, struct blkbuf *b)
+{
+	if (b->flags & BUF_DIRTY)
+		return;
+	b->flags |= BUF_DIRTY;
+	c->ndirty++;
+	if (c->ndirty > c->maxdirty / 2)
+		_bc_flushreq(c);
+}
+
+/*
+ * Wait for the dirty buffers to drop below the limit. Fails with the
+ * write back error if a pass started after us could not clean them.
+ */
+static int _bc_dirtywait(struct blkcache *c)
+{
+	unsigned start = c->nflushes;
+
+	while (c->ndirty >= c->maxdirty) {
+		/* The pass running when we started might predate us. */
+		if (c->nflushes - start > 1 && c->flusherr)
+			return c->flusherr;
+		_bc_flushreq(c);
+		lwt_yield();
+	}
+	return 0;
+}
+
+static void _bc_doreq(struct blkcache *c, struct blkcreq *req)
+{
+	int ret = 0, nofill;
+	uint64_t bno, end, raend;
+	struct blkbuf *b;
+
+	bno = req->blkid / c->bpb;
+	end = (req->blkid + req->nblks + c->bpb - 1) / c->bpb;
+	raend = end + (req->wr ? 0 : c->ra);
+	for (; bno < end; bno++) {
+		if (req->wr && (ret = _bc_dirtywait(c)))
+			break;
+		nofill = req->wr && req->blkid <= bno * c->bpb
+			&& req->blkid + req->nblks >= (bno + 1) * c->bpb;
+		b = _bc_get(c, bno, raend, end, nofill, &ret);
+		if (b == NULL)
+			break;
+		_bc_copy(c, b, req);
+		if (req->wr)
+			_bc_dirty(c, b);
+	}
+
+	*req->retp = ret;
+	evtset(req->evt);
+}
+
+static void _bc_worker(void *arg)
+{
+	unsigned id;
+	lwt_t *self = lwt_getcurrent();
+	struct blkcreq *req;
+	struct blkcache *c = (struct blkcache *)arg;
+
+	for (id = 0; c->workers[id] != self; id++);
+	for (;;) {
+		while ((req = TAILQ_FIRST(&c->reqq)) == NULL) {
+			c->widle[id] = 1;
+			lwt_sleep();
+		}
+		TAILQ_REMOVE(&c->reqq, req, list);
+		_bc_doreq(c, req);
+		free(req);
+	}
+}
+
+static int _bc_fast(struct blkcache *c, uint8_t *addr, uint64_t blkid,
+		    size_t nblks, int wr)
+{
+	struct blkbuf *b;
+	struct blkcreq req;
+	uint64_t bno, end;
+	unsigned nclean = 0;
+
+	bno = blkid / c->bpb;
+	end = (blkid + nblks + c->bpb - 1) / c->bpb;
+	for (; bno < end; bno++) {
+		b = _bc_lookup(c, bno);
+		if (b == NULL || (b->flags & BUF_BUSY))
+			return 0;
+		if (!(b->flags & BUF_DIRTY))
+			nclean++;
+	}
+	if (wr && c->ndirty + nclean > c->maxdirty)
+		return 0;
+
+	req.wr = wr;
+	req.addr = addr;
+	req.blkid = blkid;
+	req.nblks = nblks;
+	for (bno = blkid / c->bpb; bno < end; bno++) {
+		b = _bc_lookup(c, bno);
+		c->stats.hits++;
+		_bc_copy(c, b, &req);
+		if (wr)
+			_bc_dirty(c, b);
+	}
+	return 1;
+}
+
+static int _bc_req(struct blkcache *c, int wr, void *addr, size_t sz,
+		   uint64_t blkid, size_t nblks, int evt, int *retp)
+{
+	unsigned i;
+	struct blkcreq *req;
+
+	if (nblks == 0 || sz < nblks * c->dk->info.blksz)
+		return -EINVAL;
+	if (blkid >= c->dk->info.blkno || nblks > c->dk->info.blkno - blkid)
+		return -EINVAL;
+
+	if (!wr) {
+		if (blkid == c->nextblk)
+			c->ra = c->ra ? MIN(c->ra * 2, BLKC_RAMAX) : 4;
+		else
+			c->ra = 0;
+		c->nextblk = blkid + nblks;
+	}
+
+	if (_bc_fast(c, addr, blkid, nblks, wr)) {
+		*retp = 0;
+		evtset(evt);
+		return 0;
+	}
+
+	req = malloc(sizeof(*req));
+	if (req == NULL)
+		return -ENOMEM;
+	req->wr = wr;
+	req->addr = addr;
+	req->blkid = blkid;
+	req->nblks = nblks;
+	req->evt = evt;
+	req->retp = retp;
+	TAILQ_INSERT_TAIL(&c->reqq, req, list);
+
+	/* Busy workers will get to it otherwise. */
+	for (i = 0; i < BLKC_NWORKERS; i++)
+		if (c->widle[i]) {
+			c->widle[i] = 0;
+			lwt_wake(c->workers[i]);
+			break;
+		}
+	return 0;
+}
+
+int __blkcache_read(struct blkcache *c, void *addr, size_t sz,
+		    uint64_t blkid, size_t nblks, int evt, int *retp)
+{
+	return _bc_req(c, 0, addr, sz, blkid, nblks, evt, retp);
+}
+
+int __blkcache_write(struct blkcache *c, uint64_t blkid, size_t nblks,
+		     void *addr, size_t sz, int evt, int *retp)
+{
+	return _bc_req(c, 1, addr, sz, blkid, nblks, evt, retp);
+}
+
+static int _bc_bnocmp(const void *a, const void *b)
+{
+	uint64_t x = (*(struct blkbuf **)a)->bno;
+	uint64_t y = (*(struct blkbuf **)b)->bno;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Write back all dirty buffers, in runs of consecutive buffers. */
+static int _bc_flush(struct blkcache *c)
+{
+	int ret = 0, r;
+	unsigned i, j, n, nd = 0;
+	uint8_t *stage;
+	struct blkbuf **dv;
+
+	dv = malloc(c->nbufs * sizeof(*dv));
+	stage = malloc(c->runmax * BLKC_BUFSZ);
+	if (dv == NULL || stage == NULL) {
+		free(dv);
+		free(stage);
+		c->flusherr = -ENOMEM;
+		c->nflushes++;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < c->nbufs; i++)
+		if ((c->bufs[i].flags & (BUF_DIRTY | BUF_BUSY)) == BUF_DIRTY) {
+			c->bufs[i].flags |= BUF_BUSY;
+			dv[nd++] = c->bufs + i;
+		}
+	qsort(dv, nd, sizeof(*dv), _bc_bnocmp);
+
+	for (i = 0; i < nd; i += n) {
+		for (n = 1; i + n < nd && n < c->runmax; n++)
+			if (dv[i + n]->bno != dv[i]->bno + n)
+				break;
+		for (j = 0; j < n; j++)
+			memcpy(stage + j * BLKC_BUFSZ, dv[i + j]->data, BLKC_BUFSZ);
+		r = _bc_io(c, 1, dv[i]->bno, n, stage);
+		if (r) {
+			printf("BLKCACHE: %s: write of buffer %llu failed: %d\n",
+			       unsquoze_inline(c->dk->nameid).str, dv[i]->bno, r);
+			ret = r;
+		}
+		for (j = 0; j < n; j++) {
+			dv[i + j]->flags &= ~BUF_BUSY;
+			if (r)
+				continue;
+			dv[i + j]->flags &= ~BUF_DIRTY;
+			c->ndirty--;
+			c->stats.writebacks++;
+		}
+	}
+
+	free(dv);
+	free(stage);
+	c->flusherr = ret;
+	c->nflushes++;
+	return ret;
+}
+
+static void _bc_flusher(void *arg)
+{
+	struct blkcache *c = (struct blkcache *)arg;
+
+	for (;;) {
+		while (!c->flushreq) {
+			c->flushidle = 1;
+			lwt_sleep();
+		}
+		c->flushreq = 0;
+		_bc_flush(c);
+	}
+}
+
+/*
+ * Enable a cache of 'sz' bytes on the disk, allowing up to
+ * 'maxdirty' bytes to be waiting for write back.
+ */
+int blk_cache(struct blkdisk *dk, size_t sz, size_t maxdirty)
+{
+	unsigned i;
+	struct blkcache *c;
+
+	if (dk->invalid)
+		return -ENODEV;
+	if (dk->cache != NULL)
+		return -EBUSY;
+	if (dk->info.blksz == 0 || dk->info.blksz > BLKC_BUFSZ
+	    || BLKC_BUFSZ % dk->info.blksz)
+		return -EINVAL;
+	if (sz < 16 * BLKC_BUFSZ || maxdirty < BLKC_BUFSZ)
+		return -EINVAL;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return -ENOMEM;
+	c->dk = dk;
+	c->bpb = BLKC_BUFSZ / dk->info.blksz;
+	c->nbufs = sz / BLKC_BUFSZ;
+	c->runmax = MIN(BLKC_RUNMAX, c->nbufs / 4);
+	c->maxdirty = MIN(maxdirty / BLKC_BUFSZ, c->nbufs / 2);
+	c->bufs = calloc(c->nbufs, sizeof(*c->bufs));
+	c->mem = malloc(c->nbufs * BLKC_BUFSZ);
+	c->flusher = lwt_create(_bc_flusher, c, BLKC_STACKSIZE);
+	for (i = 0; i < BLKC_NWORKERS; i++)
+		c->workers[i] = lwt_create(_bc_worker, c, BLKC_STACKSIZE);
+	if (c->bufs == NULL || c->mem == NULL || c->flusher == NULL)
+		goto nomem;
+	for (i = 0; i < BLKC_NWORKERS; i++)
+		if (c->workers[i] == NULL)
+			goto nomem;
+
+	for (i = 0; i < BLKC_NHASH; i++)
+		LIST_INIT(c->hash + i);
+	for (i = 0; i < c->nbufs; i++)
+		c->bufs[i].data = c->mem + i * BLKC_BUFSZ;
+	TAILQ_INIT(&c->reqq);
+
+	/* Start them: they go idle immediately. */
+	lwt_wake(c->flusher);
+	for (i = 0; i < BLKC_NWORKERS; i++)
+		lwt_wake(c->workers[i]);
+
+	dk->cache = c;
+	return 0;
+
+      nomem:
+	for (i = 0; i < BLKC_NWORKERS; i++)
+		free(c->workers[i]);
+	free(c->flusher);
+	free(c->bufs);
+	free(c->mem);
+	free(c);
+	return -ENOMEM;
+}
+
+int blk_cache_stats(struct blkdisk *dk, struct blkcache_stats *st)
+{
+	if (dk->cache == NULL)
+		return -ENOENT;
+	*st = dk->cache->stats;
+	return 0;
+}
+
+/* Write back all dirty blocks of the disk. */
+int blk_sync(struct blkdisk *dk)
+{
+	int ret;
+	unsigned i;
+	struct blkcache *c = dk->cache;
+
+	if (c == NULL)
+		return 0;
+
+	ret = _bc_flush(c);
+	/* Wait for buffers being written by the flusher. */
+	for (i = 0; i < c->nbufs; i++)
+		while (c->bufs[i].flags & BUF_BUSY)
+			lwt_yield();
+	return ret;
+}
+
+/*
+ * Called on the last close of a removed disk. Waits for the
+ * cache LWTs to be idle, then frees it. Dirty data is lost.
+ */
+void __blkcache_free(struct blkcache *c)
+{
+	int i, busy;
+
+	do {
+		busy = !c->flushidle || !TAILQ_EMPTY(&c->reqq);
+		for (i = 0; i < BLKC_NWORKERS; i++)
+			busy |= !c->widle[i];
+		if (busy)
+			lwt_yield();
+	} while (busy);
+
+	for (i = 0; i < BLKC_NWORKERS; i++)
+		free(c->workers[i]);
+	free(c->flusher);
+	free(c->bufs);
+	free(c->mem);
+	free(c);
+}
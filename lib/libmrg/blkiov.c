@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2015, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <microkernel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mrg.h>
+#include <mrg/blk.h>
+
+/*
+ * Vectored and batched block I/O.
+ *
+ * blk_iov() passes vectored requests to drivers that implement
+ * blkiov, through the disk's queue if it has one. Disks with a cache,
+ * and drivers that only take contiguous buffers on disks without a
+ * queue, are served by a few helper LWTs shared by all disks, through
+ * a bounce buffer.
+ *
+ * Completion rings sit on top of blk_iov(). A ring slot is reserved
+ * for each request submitted, so completions never overflow.
+ */
+
+extern int __blkq_submitv(struct blkq *q, int wr, uint64_t blkid,
+			  size_t nblks, const struct blkiov *iov,
+			  unsigned iovcnt, void (*done)(void *, int),
+			  void *arg);
+
+#define BLKV_NHELPERS 4
+#define BLKV_STACKSIZE (16 * 1024)
+
+struct blkvwork {
+	struct blkdisk *dk;
+	int wr;
+	uint64_t blkid;
+	size_t nblks;
+	const struct blkiov *iov;
+	unsigned iovcnt;
+	void (*done)(void *, int);
+	void *arg;
+	TAILQ_ENTRY(blkvwork) list;
+};
+
+static TAILQ_HEAD(, blkvwork) blkv_workq = TAILQ_HEAD_INITIALIZER(blkv_workq);
+static lwt_t *blkv_helpers[BLKV_NHELPERS];
+static int blkv_hidle[BLKV_NHELPERS];
+static int blkv_hevt[BLKV_NHELPERS];
+static unsigned blkv_nhelpers;
+
+static int _blkv_emulate(int evt, struct blkvwork *w)
+{
+	int ret, res;
+	unsigned i;
+	size_t sz = w->nblks * w->dk->info.blksz;
+	uint8_t *buf, *p;
+
+	if (w->iovcnt == 1) {
+		buf = w->iov[0].addr;
+	} else {
+		buf = malloc(sz);
+		if (buf == NULL)
+			return -ENOMEM;
+	}
+	if (w->iovcnt > 1 && w->wr)
+		for (i = 0, p = buf; i < w->iovcnt; p += w->iov[i++].len)
+			memcpy(p, w->iov[i].addr, w->iov[i].len);
+
+	if (w->wr)
+		ret = blk_write(w->dk, w->blkid, w->nblks, buf, sz, evt, &res);
+	else
+		ret = blk_read(w->dk, buf, sz, w->blkid, w->nblks, evt, &res);
+	if (ret == 0) {
+		evtwait(evt);
+		evtclear(evt);
+		ret = res;
+	}
+
+	if (w->iovcnt > 1) {
+		if (!w->wr && ret == 0)
+			for (i = 0, p = buf; i < w->iovcnt; p += w->iov[i++].len)
+				memcpy(w->iov[i].addr, p, w->iov[i].len);
+		free(buf);
+	}
+	return ret;
+}
+
+static void _blkv_helper(void *arg)
+{
+	unsigned id = (uintptr_t)arg;
+	struct blkvwork *w;
+
+	for (;;) {
+		while ((w = TAILQ_FIRST(&blkv_workq)) == NULL) {
+			blkv_hidle[id] = 1;
+			lwt_sleep();
+		}
+		TAILQ_REMOVE(&blkv_workq, w, list);
+		w->done(w->arg, _blkv_emulate(blkv_hevt[id], w));
+		blk_close(w->dk);
+		free(w);
+	}
+}
+
+static int _blkv_queue(struct blkdisk *dk, int wr, uint64_t blkid,
+		       size_t nblks, const struct blkiov *iov, unsigned iovcnt,
+		       void (*done)(void *, int), void *arg)
+{
+	unsigned i;
+	struct blkvwork *w;
+
+	/* Start the helpers on first use. */
+	for (; blkv_nhelpers < BLKV_NHELPERS; blkv_nhelpers++) {
+		i = blkv_nhelpers;
+		blkv_helpers[i] = lwt_create(_blkv_helper, (void *)(uintptr_t)i,
+					     BLKV_STACKSIZE);
+		if (blkv_helpers[i] == NULL)
+			break;
+		blkv_hevt[i] = evtalloc();
+		lwt_wake(blkv_helpers[i]);
+	}
+	if (blkv_nhelpers == 0)
+		return -ENOMEM;
+
+	w = malloc(sizeof(*w));
+	if (w == NULL)
+		return -ENOMEM;
+	w->dk = dk;
+	w->wr = wr;
+	w->blkid = blkid;
+	w->nblks = nblks;
+	w->iov = iov;
+	w->iovcnt = iovcnt;
+	w->done = done;
+	w->arg = arg;
+	/* Keep the disk until done. */
+	dk->ref++;
+	TAILQ_INSERT_TAIL(&blkv_workq, w, list);
+
+	for (i = 0; i < blkv_nhelpers; i++)
+		if (blkv_hidle[i]) {
+			blkv_hidle[i] = 0;
+			lwt_wake(blkv_helpers[i]);
+			break;
+		}
+	return 0;
+}
+
+int blk_iov(struct blkdisk *dk, int wr, uint64_t blkid, size_t nblks,
+	    const struct blkiov *iov, unsigned iovcnt,
+	    void (*done)(void *arg, int ret), void *arg)
+{
+	unsigned i;
+	size_t sz = 0;
+	size_t blksz = dk->info.blksz;
+
+	if (dk->invalid)
+		return -ENODEV;
+	if (iovcnt == 0 || iovcnt > BLK_IOVMAX || nblks == 0)
+		return -EINVAL;
+	if (blkid >= dk->info.blkno || nblks > dk->info.blkno - blkid)
+		return -EINVAL;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].len == 0 || iov[i].len % blksz)
+			return -EINVAL;
+		sz += iov[i].len;
+	}
+	if (sz != nblks * blksz)
+		return -EINVAL;
+
+	/* The cache must see every access to stay coherent. */
+	if (dk->cache != NULL)
+		return _blkv_queue(dk, wr, blkid, nblks, iov, iovcnt,
+				   done, arg);
+	if (dk->queue != NULL)
+		return __blkq_submitv(dk->queue, wr, blkid, nblks, iov, iovcnt,
+				      done, arg);
+	if (dk->ops->blkiov != NULL)
+		return dk->ops->blkiov(dk->opq, wr, blkid, nblks, iov, iovcnt,
+				       done, arg);
+	return _blkv_queue(dk, wr, blkid, nblks, iov, iovcnt, done, arg);
+}
+
+struct blkrctx {
+	struct blkring *ring;
+	void *cookie;
+	struct blkiov iov[BLK_IOVMAX];
+	struct blkrctx *next;
+};
+
+struct blkring {
+	unsigned nentries;
+	unsigned head;		/* Next to reap. */
+	unsigned tail;		/* Next to post. */
+	unsigned inflight;
+	int evt;
+	int waiting;
+	unsigned wantmin;
+	struct blkrctx *ctxs;
+	struct blkrctx *freectx;
+	struct blkcpl cpl[];
+};
+
+static void _blkring_post(struct blkring *ring, void *cookie, int ret)
+{
+	struct blkcpl *cpl = ring->cpl + ring->tail % ring->nentries;
+
+	cpl->cookie = cookie;
+	cpl->ret = ret;
+	ring->tail++;
+	if (ring->waiting && ring->tail - ring->head >= ring->wantmin) {
+		ring->waiting = 0;
+		evtset(ring->evt);
+	}
+}
+
+static void _blkring_done(void *arg, int ret)
+{
+	struct blkrctx *ctx = (struct blkrctx *)arg;
+	struct blkring *ring = ctx->ring;
+
+	ring->inflight--;
+	_blkring_post(ring, ctx->cookie, ret);
+	ctx->next = ring->freectx;
+	ring->freectx = ctx;
+}
+
+struct blkring *blk_ring_create(unsigned nentries)
+{
+	unsigned i;
+	struct blkring *ring;
+
+	if (nentries == 0)
+		return NULL;
+
+	ring = malloc(sizeof(*ring) + nentries * sizeof(struct blkcpl));
+	if (ring == NULL)
+		return NULL;
+	ring->ctxs = malloc(nentries * sizeof(struct blkrctx));
+	if (ring->ctxs == NULL) {
+		free(ring);
+		return NULL;
+	}
+	ring->nentries = nentries;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->inflight = 0;
+	ring->waiting = 0;
+	ring->wantmin = 0;
+	ring->freectx = NULL;
+	for (i = 0; i < nentries; i++) {
+		ring->ctxs[i].ring = ring;
+		ring->ctxs[i].next = ring->freectx;
+		ring->freectx = ring->ctxs + i;
+	}
+	ring->evt = evtalloc();
+	return ring;
+}
+
+/* Waits for requests in flight. Unreaped completions are lost. */
+void blk_ring_destroy(struct blkring *ring)
+{
+	while (ring->inflight)
+		lwt_yield();
+	evtfree(ring->evt);
+	free(ring->ctxs);
+	free(ring);
+}
+
+int blk_submit(struct blkdisk *dk, const struct blkreq *reqs, unsigned nreqs,
+	       struct blkring *ring)
+{
+	int ret;
+	unsigned n;
+	struct blkrctx *ctx;
+	const struct blkreq *req;
+
+	if (dk->invalid)
+		return -ENODEV;
+
+	for (n = 0; n < nreqs; n++) {
+		req = reqs + n;
+		if (ring->inflight + (ring->tail - ring->head) >= ring->nentries)
+			break;
+		if (req->iovcnt > BLK_IOVMAX) {
+			_blkring_post(ring, req->cookie, -EINVAL);
+			continue;
+		}
+
+		ctx = ring->freectx;
+		ring->freectx = ctx->next;
+		ctx->cookie = req->cookie;
+		memcpy(ctx->iov, req->iov, req->iovcnt * sizeof(struct blkiov));
+
+		/* Completions can come before blk_iov() returns. */
+		ring->inflight++;
+		ret = blk_iov(dk, req->op == BLKREQ_WRITE, req->blkid,
+			      req->nblks, ctx->iov, req->iovcnt,
+			      _blkring_done, ctx);
+		if (ret)
+			_blkring_done(ctx, ret);
+	}
+	return n;
+}
+
+unsigned blk_reap(struct blkring *ring, struct blkcpl *cpls, unsigned max,
+		  unsigned min)
+{
+	unsigned n;
+
+	if (min > max)
+		min = max;
+	/* Don't wait for what will never come. */
+	if (min > ring->tail - ring->head + ring->inflight)
+		min = ring->tail - ring->head + ring->inflight;
+
+	while (ring->tail - ring->head < min) {
+		evtclear(ring->evt);
+		ring->wantmin = min;
+		ring->waiting = 1;
+		evtwait(ring->evt);
+	}
+
+	for (n = 0; n < max && ring->head != ring->tail; n++, ring->head++)
+		cpls[n] = ring->cpl[ring->head % ring->nentries];
+	return n;
+}
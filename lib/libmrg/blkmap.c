@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2015, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <machine/vmparam.h>
+#include <microkernel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mrg.h>
+#include <mrg/blk.h>
+
+/*
+ * Block device mappings.
+ *
+ * A mapping is a VFNT_BLKMAP vmap area. Pages are absent until
+ * accessed. On a not-present fault the faulting thread is made to
+ * call _blkmap_pagein(), which reads the page and the following
+ * absent pages into a staging area and moves them in place, read
+ * only. The first write to a page of a RW mapping marks it dirty
+ * and makes it writable.
+ */
+
+void framecall(struct intframe *f, void (*fn)(vaddr_t), vaddr_t arg);
+
+#define BLKPG_ABSENT 0
+#define BLKPG_BUSY   1
+#define BLKPG_CLEAN  2
+#define BLKPG_DIRTY  3
+#define BLKPG_ERROR  4
+
+struct blkmap {
+	struct blkdisk *dk;
+	uint64_t blkid;
+	vaddr_t va;
+	size_t sz;
+	vm_prot_t prot;
+	unsigned readahead;
+	unsigned npages;
+
+	LIST_ENTRY(blkmap) list;
+	uint8_t pgst[];
+};
+
+static LIST_HEAD(, blkmap) blkmaps = LIST_HEAD_INITIALIZER(blkmaps);
+
+static struct blkmap *_blkmap_find(vaddr_t va)
+{
+	struct blkmap *map;
+
+	LIST_FOREACH(map, &blkmaps, list)
+		if (va >= map->va && va < map->va + map->sz)
+			return map;
+	return NULL;
+}
+
+/* Blocks of the disk backing the 'n' pages starting at page 'pg'. */
+static size_t _blkmap_nblks(struct blkmap *map, unsigned pg, unsigned n,
+			    uint64_t *blkid)
+{
+	size_t blksz = map->dk->info.blksz;
+	uint64_t start, end, disk_end;
+
+	start = map->blkid + ((uint64_t)pg << PAGE_SHIFT) / blksz;
+	end = start + ((uint64_t)n << PAGE_SHIFT) / blksz;
+	disk_end = map->dk->info.blkno;
+	if (end > disk_end)
+		end = disk_end;
+	*blkid = start;
+	return end > start ? end - start : 0;
+}
+
+static int _blkmap_io(struct blkmap *map, int wr, unsigned pg, unsigned n,
+		      vaddr_t buf)
+{
+	int evt, ret, res;
+	size_t nblks;
+	uint64_t blkid;
+
+	nblks = _blkmap_nblks(map, pg, n, &blkid);
+	if (nblks == 0)
+		return 0;
+
+	evt = evtalloc();
+	if (wr)
+		ret = blk_write(map->dk, blkid, nblks, (void *)buf,
+				nblks * map->dk->info.blksz, evt, &res);
+	else
+		ret = blk_read(map->dk, (void *)buf,
+			       nblks * map->dk->info.blksz, blkid, nblks,
+			       evt, &res);
+	if (ret == 0) {
+		evtwait(evt);
+		evtclear(evt);
+		ret = res;
+	}
+	evtfree(evt);
+	return ret;
+}
+
+static void _blkmap_pagein(vaddr_t va)
+{
+	int ret;
+	unsigned pg, n, i;
+	vaddr_t stage, dst;
+	struct blkmap *map;
+
+	map = _blkmap_find(va);
+	if (map == NULL)
+		return;
+	pg = (va - map->va) >> PAGE_SHIFT;
+
+	/* Someone else is reading it. Retry when they are done. */
+	while (map->pgst[pg] == BLKPG_BUSY)
+		lwt_yield();
+	if (map->pgst[pg] != BLKPG_ABSENT)
+		return;
+
+	for (n = 1; n <= map->readahead && pg + n < map->npages; n++)
+		if (map->pgst[pg + n] != BLKPG_ABSENT)
+			break;
+	for (i = 0; i < n; i++)
+		map->pgst[pg + i] = BLKPG_BUSY;
+
+	/* Read in a private area: the pages are not accessible in
+	 * the mapping until they are complete. */
+	stage = vmap_alloc(n << PAGE_SHIFT, VFNT_RWDATA);
+	if (stage == 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = vmmap_range(stage, n << PAGE_SHIFT, VM_PROT_RW);
+	if (ret == 0)
+		ret = _blkmap_io(map, 0, pg, n, stage);
+	if (ret == 0) {
+		dst = map->va + ((vaddr_t)pg << PAGE_SHIFT);
+		for (i = 0; i < n; i++)
+			sys_move(dst + (i << PAGE_SHIFT), stage + (i << PAGE_SHIFT));
+		vmchprot_range(dst, n << PAGE_SHIFT, VM_PROT_RO);
+	}
+	vmap_free(stage, n << PAGE_SHIFT);
+
+      out:
+	if (ret)
+		printf("BLKMAP: read of %lx failed: %d\n", va, ret);
+	for (i = 0; i < n; i++)
+		map->pgst[pg + i] = ret ? BLKPG_ERROR : BLKPG_CLEAN;
+}
+
+vm_prot_t __blkmap_prot(vaddr_t va)
+{
+	struct blkmap *map = _blkmap_find(va);
+
+	return map == NULL ? VM_PROT_NIL : map->prot;
+}
+
+/*
+ * Called from the page fault handler. Returns 1 if the fault has
+ * been handled, -1 if the page could not be read, 0 otherwise.
+ */
+int __blkmap_fault(vaddr_t va, u_long err, struct intframe *f)
+{
+	unsigned pg;
+	struct blkmap *map;
+
+	map = _blkmap_find(va);
+	if (map == NULL)
+		return 0;
+	pg = (va - map->va) >> PAGE_SHIFT;
+
+	switch (err & PG_ERR_REASON_MASK) {
+	case PG_ERR_REASON_NOTP:
+		if (map->pgst[pg] == BLKPG_ERROR)
+			return -1;
+		framecall(f, _blkmap_pagein, va);
+		return 1;
+	case PG_ERR_REASON_PROT:
+		if (!(err & PG_ERR_INFO_WRITE) || map->prot != VM_PROT_RW)
+			return 0;
+		if (map->pgst[pg] != BLKPG_CLEAN && map->pgst[pg] != BLKPG_DIRTY)
+			return 0;
+		/* COW pages after fork: the generic handler copies them. */
+		map->pgst[pg] = BLKPG_DIRTY;
+		if (err & PG_ERR_INFO_COW)
+			return 0;
+		vmchprot(va, VM_PROT_RW);
+		return 1;
+	}
+	return 0;
+}
+
+void *blk_mmap(struct blkdisk *dk, uint64_t blkid, size_t sz, int prot,
+	       unsigned readahead)
+{
+	unsigned npages;
+	struct blkmap *map;
+
+	if (dk->invalid || dk->info.blksz == 0
+	    || PAGE_SIZE % dk->info.blksz != 0)
+		return NULL;
+	if (prot != VM_PROT_RO && prot != VM_PROT_RW)
+		return NULL;
+	if (sz == 0 || blkid >= dk->info.blkno)
+		return NULL;
+
+	npages = round_page(sz) >> PAGE_SHIFT;
+	map = malloc(sizeof(*map) + npages);
+	if (map == NULL)
+		return NULL;
+	map->va = vmap_alloc(sz, VFNT_BLKMAP);
+	if (map->va == 0) {
+		free(map);
+		return NULL;
+	}
+	map->dk = dk;
+	map->blkid = blkid;
+	map->sz = round_page(sz);
+	map->prot = prot;
+	map->readahead = readahead;
+	map->npages = npages;
+	memset(map->pgst, BLKPG_ABSENT, npages);
+	dk->ref++;
+
+	LIST_INSERT_HEAD(&blkmaps, map, list);
+	return (void *)map->va;
+}
+
+/* Write back dirty pages between addr and addr + sz. */
+int blk_msync(void *addr, size_t sz)
+{
+	int ret = 0, r;
+	unsigned pg, end, n, i;
+	vaddr_t va = (vaddr_t)addr;
+	struct blkmap *map;
+
+	map = _blkmap_find(va);
+	if (map == NULL)
+		return -EINVAL;
+	if (va + sz > map->va + map->sz || va + sz < va)
+		sz = map->va + map->sz - va;
+
+	pg = (va - map->va) >> PAGE_SHIFT;
+	end = (round_page(va + sz) - map->va) >> PAGE_SHIFT;
+	while (pg < end) {
+		if (map->pgst[pg] != BLKPG_DIRTY) {
+			pg++;
+			continue;
+		}
+		for (n = 1; pg + n < end; n++)
+			if (map->pgst[pg + n] != BLKPG_DIRTY)
+				break;
+
+		/* Writes from now on dirty the pages again. */
+		for (i = 0; i < n; i++)
+			map->pgst[pg + i] = BLKPG_CLEAN;
+		va = map->va + ((vaddr_t)pg << PAGE_SHIFT);
+		vmchprot_range(va, n << PAGE_SHIFT, VM_PROT_RO);
+
+		r = _blkmap_io(map, 1, pg, n, va);
+		if (r) {
+			printf("BLKMAP: write of %lx failed: %d\n", va, r);
+			for (i = 0; i < n; i++)
+				map->pgst[pg + i] = BLKPG_DIRTY;
+			ret = r;
+		}
+		pg += n;
+	}
+	return ret;
+}
+
+int blk_munmap(void *addr)
+{
+	int ret;
+	unsigned pg;
+	struct blkmap *map;
+
+	map = _blkmap_find((vaddr_t)addr);
+	if (map == NULL || map->va != (vaddr_t)addr)
+		return -EINVAL;
+
+	ret = blk_msync(addr, map->sz);
+	for (pg = 0; pg < map->npages; pg++)
+		while (map->pgst[pg] == BLKPG_BUSY)
+			lwt_yield();
+
+	LIST_REMOVE(map, list);
+	vmunmap_range(map->va, map->sz);
+	vmap_free(map->va, map->sz);
+	blk_close(map->dk);
+	free(map);
+	return ret;
+}
@@ -0,0 +1,541 @@
+/*
+ * Copyright (c) 2015, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <microkernel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mrg.h>
+#include <mrg/blk.h>
+
+/*
+ * Block request queue.
+ *
+ * A disk with a queue enabled by blk_queue() doesn't pass requests
+ * to the driver as they come. They are queued, and a request for
+ * blocks contiguous to a queued one of the same direction is merged
+ * with it, at its back or front. Vectored requests from blk_iov()
+ * are queued and merged the same way. Drivers that implement blkiov
+ * get the merged segments as a vector; for the others, merged
+ * requests whose buffers are not contiguous in memory go through a
+ * staging buffer.
+ *
+ * Queued requests are issued by BLKQ_DEPTH dispatcher LWTs, so
+ * requests queue up, and merge, while the driver is busy. A plugged
+ * queue issues nothing until unplugged: callers plug around bursts
+ * of small requests to have them merged.
+ *
+ * The elevator chooses the next request to issue. FIFO issues them
+ * in order of arrival. DEADLINE issues them in ascending block
+ * order, wrapping around at the end, unless a request has waited
+ * for more than its expiry (counted in issued requests, reads
+ * expiring sooner than writes).
+ */
+
+#define BLKQ_DEPTH 4
+#define BLKQ_MAXBYTES (64 * 1024)
+#define BLKQ_STACKSIZE (16 * 1024)
+
+#define BLKQ_READEXPIRE 16
+#define BLKQ_WRITEEXPIRE 64
+
+/* A request as submitted. */
+struct blkqbio {
+	uint64_t blkid;
+	size_t nblks;
+	const struct blkiov *iov;
+	unsigned iovcnt;
+	struct blkiov seg;	/* The buffer of non vectored requests. */
+	int evt;
+	int *retp;
+	void (*done)(void *, int);	/* Vectored requests only. */
+	void *arg;
+	TAILQ_ENTRY(blkqbio) list;
+};
+
+/* An I/O to the driver: one or more contiguous requests. */
+struct blkqio {
+	int wr;
+	uint64_t blkid;
+	size_t nblks;
+	unsigned nsegs;
+	uint64_t expire;
+	TAILQ_HEAD(, blkqbio) bios;
+	TAILQ_ENTRY(blkqio) list;
+};
+
+struct blkq;
+
+struct blkq_elevator {
+	const char *name;
+	void (*add)(struct blkq *q, struct blkqio *io);
+	struct blkqio *(*next)(struct blkq *q);
+};
+
+struct blkq {
+	struct blkdisk *dk;
+	const struct blkq_elevator *elv;
+	size_t maxblks;
+	unsigned plugged;
+
+	TAILQ_HEAD(, blkqio) ioq;	/* In order of arrival. */
+	uint64_t ndispatched;
+	uint64_t headpos;
+
+	lwt_t *disp[BLKQ_DEPTH];
+	int devt[BLKQ_DEPTH];
+	int didle[BLKQ_DEPTH];
+
+	struct blkq_stats stats;
+};
+
+static void _fifo_add(struct blkq *q, struct blkqio *io)
+{
+	TAILQ_INSERT_TAIL(&q->ioq, io, list);
+}
+
+static struct blkqio *_fifo_next(struct blkq *q)
+{
+	return TAILQ_FIRST(&q->ioq);
+}
+
+static void _deadline_add(struct blkq *q, struct blkqio *io)
+{
+	io->expire = q->ndispatched
+		+ (io->wr ? BLKQ_WRITEEXPIRE : BLKQ_READEXPIRE);
+	TAILQ_INSERT_TAIL(&q->ioq, io, list);
+}
+
+static struct blkqio *_deadline_next(struct blkq *q)
+{
+	struct blkqio *io, *ahead = NULL, *lowest = NULL;
+
+	io = TAILQ_FIRST(&q->ioq);
+	if (io == NULL || io->expire <= q->ndispatched)
+		return io;
+
+	TAILQ_FOREACH(io, &q->ioq, list) {
+		if (io->expire <= q->ndispatched)
+			return io;
+		if (io->blkid >= q->headpos
+		    && (ahead == NULL || io->blkid < ahead->blkid))
+			ahead = io;
+		if (lowest == NULL || io->blkid < lowest->blkid)
+			lowest = io;
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+static const struct blkq_elevator blkq_elevators[] = {
+	[BLKQ_FIFO] = { "fifo", _fifo_add, _fifo_next },
+	[BLKQ_DEADLINE] = { "deadline", _deadline_add, _deadline_next },
+};
+
+#define BLKQ_NELEVATORS (sizeof(blkq_elevators) / sizeof(blkq_elevators[0]))
+
+/* Merge bio in a queued I/O. Returns 0 if no I/O could take it. */
+static int _blkq_merge(struct blkq *q, int wr, struct blkqbio *bio)
+{
+	struct blkqio *io;
+
+	TAILQ_FOREACH(io, &q->ioq, list) {
+		if (io->wr != wr || io->nblks + bio->nblks > q->maxblks)
+			continue;
+		/* The driver's vector must hold all segments. */
+		if (q->dk->ops->blkiov != NULL
+		    && io->nsegs + bio->iovcnt > BLK_IOVMAX)
+			continue;
+		if (io->blkid + io->nblks == bio->blkid) {
+			TAILQ_INSERT_TAIL(&io->bios, bio, list);
+			io->nblks += bio->nblks;
+			io->nsegs += bio->iovcnt;
+			q->stats.backmerges++;
+			return 1;
+		}
+		if (bio->blkid + bio->nblks == io->blkid) {
+			TAILQ_INSERT_HEAD(&io->bios, bio, list);
+			io->blkid = bio->blkid;
+			io->nblks += bio->nblks;
+			io->nsegs += bio->iovcnt;
+			q->stats.frontmerges++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void _blkq_kick(struct blkq *q)
+{
+	unsigned i;
+
+	if (q->plugged || TAILQ_EMPTY(&q->ioq))
+		return;
+	for (i = 0; i < BLKQ_DEPTH; i++)
+		if (q->didle[i]) {
+			q->didle[i] = 0;
+			lwt_wake(q->disp[i]);
+			return;
+		}
+	/* All busy: the next to finish will issue it. */
+}
+
+struct blkqwait {
+	int evt;
+	int ret;
+};
+
+static void _blkq_iodone(void *arg, int ret)
+{
+	struct blkqwait *w = (struct blkqwait *)arg;
+
+	w->ret = ret;
+	evtset(w->evt);
+}
+
+/*
+ * Issue io as a single vector, coalescing segments contiguous in
+ * memory, and wait for its completion.
+ */
+static int _blkq_issuev(struct blkq *q, int evt, struct blkqio *io)
+{
+	int ret;
+	unsigned i, n = 0;
+	struct blkiov iov[BLK_IOVMAX];
+	struct blkqbio *bio;
+	struct blkqwait w;
+	struct blkdisk *dk = q->dk;
+
+	TAILQ_FOREACH(bio, &io->bios, list)
+		for (i = 0; i < bio->iovcnt; i++) {
+			if (n > 0 && (uint8_t *)iov[n - 1].addr + iov[n - 1].len
+			    == bio->iov[i].addr)
+				iov[n - 1].len += bio->iov[i].len;
+			else
+				iov[n++] = bio->iov[i];
+		}
+
+	w.evt = evt;
+	ret = dk->ops->blkiov(dk->opq, io->wr, io->blkid, io->nblks, iov, n,
+			      _blkq_iodone, &w);
+	if (ret == 0) {
+		evtwait(evt);
+		evtclear(evt);
+		ret = w.ret;
+	}
+	return ret;
+}
+
+/* Copy between the segments of io and the staging buffer. */
+static void _blkq_stage(struct blkqio *io, uint8_t *stage, int in)
+{
+	unsigned i;
+	struct blkqbio *bio;
+
+	TAILQ_FOREACH(bio, &io->bios, list)
+		for (i = 0; i < bio->iovcnt; i++) {
+			if (in)
+				memcpy(stage, bio->iov[i].addr,
+				       bio->iov[i].len);
+			else
+				memcpy(bio->iov[i].addr, stage,
+				       bio->iov[i].len);
+			stage += bio->iov[i].len;
+		}
+}
+
+/*
+ * Issue io as a single buffer and wait for its completion. Requests
+ * are completed in place if their buffers are contiguous, through a
+ * staging buffer otherwise.
+ */
+static int _blkq_issuebuf(struct blkq *q, int evt, struct blkqio *io)
+{
+	int ret, res, contig = 1;
+	unsigned i;
+	size_t sz = io->nblks * q->dk->info.blksz;
+	uint8_t *buf, *stage = NULL, *p;
+	struct blkqbio *bio;
+	struct blkdisk *dk = q->dk;
+
+	buf = TAILQ_FIRST(&io->bios)->iov[0].addr;
+	p = buf;
+	TAILQ_FOREACH(bio, &io->bios, list)
+		for (i = 0; i < bio->iovcnt; i++) {
+			contig &= bio->iov[i].addr == p;
+			p = (uint8_t *)bio->iov[i].addr + bio->iov[i].len;
+		}
+	if (!contig) {
+		stage = malloc(sz);
+		if (stage == NULL)
+			return -ENOMEM;
+		buf = stage;
+		if (io->wr)
+			_blkq_stage(io, stage, 1);
+	}
+
+	if (io->wr)
+		ret = dk->ops->blkwr(dk->opq, io->blkid, io->nblks, buf, sz,
+				     evt, &res);
+	else
+		ret = dk->ops->blkrd(dk->opq, buf, sz, io->blkid, io->nblks,
+				     evt, &res);
+	if (ret == 0) {
+		evtwait(evt);
+		evtclear(evt);
+		ret = res;
+	}
+
+	if (stage != NULL && !io->wr && ret == 0)
+		_blkq_stage(io, stage, 0);
+	free(stage);
+	return ret;
+}
+
+/* Issue io, wait for its completion and complete its requests. */
+static void _blkq_issue(struct blkq *q, int evt, struct blkqio *io)
+{
+	int ret;
+	struct blkqbio *bio;
+	struct blkdisk *dk = q->dk;
+
+	if (dk->invalid)
+		ret = -ENODEV;
+	else if (dk->ops->blkiov != NULL)
+		ret = _blkq_issuev(q, evt, io);
+	else
+		ret = _blkq_issuebuf(q, evt, io);
+
+	while ((bio = TAILQ_FIRST(&io->bios)) != NULL) {
+		TAILQ_REMOVE(&io->bios, bio, list);
+		if (bio->done != NULL) {
+			bio->done(bio->arg, ret);
+		} else {
+			*bio->retp = ret;
+			evtset(bio->evt);
+		}
+		free(bio);
+	}
+	free(io);
+}
+
+static void _blkq_dispatcher(void *arg)
+{
+	unsigned id;
+	lwt_t *self = lwt_getcurrent();
+	struct blkqio *io;
+	struct blkq *q = (struct blkq *)arg;
+
+	for (id = 0; q->disp[id] != self; id++);
+	for (;;) {
+		while (q->plugged || (io = q->elv->next(q)) == NULL) {
+			q->didle[id] = 1;
+			lwt_sleep();
+		}
+		TAILQ_REMOVE(&q->ioq, io, list);
+		q->ndispatched++;
+		q->headpos = io->blkid + io->nblks;
+		q->stats.ios++;
+		_blkq_issue(q, q->devt[id], io);
+	}
+}
+
+static int _blkq_add(struct blkq *q, int wr, struct blkqbio *bio)
+{
+	struct blkqio *io;
+
+	q->stats.reqs++;
+	if (!_blkq_merge(q, wr, bio)) {
+		io = malloc(sizeof(*io));
+		if (io == NULL) {
+			free(bio);
+			return -ENOMEM;
+		}
+		io->wr = wr;
+		io->blkid = bio->blkid;
+		io->nblks = bio->nblks;
+		io->nsegs = bio->iovcnt;
+		io->expire = 0;
+		TAILQ_INIT(&io->bios);
+		TAILQ_INSERT_TAIL(&io->bios, bio, list);
+		q->elv->add(q, io);
+	}
+	_blkq_kick(q);
+	return 0;
+}
+
+int __blkq_submit(struct blkq *q, int wr, void *addr, size_t sz,
+		  uint64_t blkid, size_t nblks, int evt, int *retp)
+{
+	struct blkqbio *bio;
+
+	if (nblks == 0 || sz < nblks * q->dk->info.blksz)
+		return -EINVAL;
+
+	bio = malloc(sizeof(*bio));
+	if (bio == NULL)
+		return -ENOMEM;
+	bio->blkid = blkid;
+	bio->nblks = nblks;
+	bio->seg.addr = addr;
+	bio->seg.len = nblks * q->dk->info.blksz;
+	bio->iov = &bio->seg;
+	bio->iovcnt = 1;
+	bio->evt = evt;
+	bio->retp = retp;
+	bio->done = NULL;
+	bio->arg = NULL;
+	return _blkq_add(q, wr, bio);
+}
+
+/* Queue a request checked by blk_iov(). */
+int __blkq_submitv(struct blkq *q, int wr, uint64_t blkid, size_t nblks,
+		   const struct blkiov *iov, unsigned iovcnt,
+		   void (*done)(void *, int), void *arg)
+{
+	struct blkqbio *bio;
+
+	bio = malloc(sizeof(*bio));
+	if (bio == NULL)
+		return -ENOMEM;
+	bio->blkid = blkid;
+	bio->nblks = nblks;
+	bio->iov = iov;
+	bio->iovcnt = iovcnt;
+	bio->evt = -1;
+	bio->retp = NULL;
+	bio->done = done;
+	bio->arg = arg;
+	return _blkq_add(q, wr, bio);
+}
+
+int blk_queue(struct blkdisk *dk, int elevator)
+{
+	int i;
+	struct blkq *q;
+
+	if (dk->invalid)
+		return -ENODEV;
+	if (dk->queue != NULL)
+		return -EBUSY;
+	if (elevator < 0 || elevator >= (int)BLKQ_NELEVATORS
+	    || dk->info.blksz == 0)
+		return -EINVAL;
+
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return -ENOMEM;
+	q->dk = dk;
+	q->elv = blkq_elevators + elevator;
+	q->maxblks = MAX(BLKQ_MAXBYTES / dk->info.blksz, 1);
+	TAILQ_INIT(&q->ioq);
+	for (i = 0; i < BLKQ_DEPTH; i++) {
+		q->disp[i] = lwt_create(_blkq_dispatcher, q, BLKQ_STACKSIZE);
+		if (q->disp[i] == NULL)
+			goto nomem;
+		q->devt[i] = evtalloc();
+	}
+	for (i = 0; i < BLKQ_DEPTH; i++)
+		lwt_wake(q->disp[i]);
+
+	printf("BLK: %s: %s request queue\n",
+	       unsquoze_inline(dk->nameid).str, q->elv->name);
+	dk->queue = q;
+	return 0;
+
+      nomem:
+	while (i--) {
+		evtfree(q->devt[i]);
+		free(q->disp[i]);
+	}
+	free(q);
+	return -ENOMEM;
+}
+
+int blk_queue_stats(struct blkdisk *dk, struct blkq_stats *st)
+{
+	if (dk->queue == NULL)
+		return -ENOENT;
+	*st = dk->queue->stats;
+	return 0;
+}
+
+void blk_plug(struct blkdisk *dk)
+{
+	if (dk->queue != NULL)
+		dk->queue->plugged++;
+}
+
+void blk_unplug(struct blkdisk *dk)
+{
+	unsigned i;
+	struct blkq *q = dk->queue;
+
+	if (q == NULL || q->plugged == 0 || --q->plugged)
+		return;
+	for (i = 0; i < BLKQ_DEPTH; i++)
+		_blkq_kick(q);
+}
+
+/* Wait for all queued requests to complete, plugged or not. */
+void __blkq_drain(struct blkq *q)
+{
+	int i, busy;
+	unsigned plugged = q->plugged;
+
+	q->plugged = 0;
+	for (i = 0; i < BLKQ_DEPTH; i++)
+		_blkq_kick(q);
+	do {
+		busy = !TAILQ_EMPTY(&q->ioq);
+		for (i = 0; i < BLKQ_DEPTH; i++)
+			busy |= !q->didle[i];
+		if (busy)
+			lwt_yield();
+	} while (busy);
+	q->plugged += plugged;
+}
+
+/*
+ * Called on the last close of a removed disk. Queued requests fail
+ * with -ENODEV.
+ */
+void __blkq_free(struct blkq *q)
+{
+	int i;
+
+	q->plugged = 0;
+	__blkq_drain(q);
+	for (i = 0; i < BLKQ_DEPTH; i++) {
+		evtfree(q->devt[i]);
+		free(q->disp[i]);
+	}
+	free(q);
+}
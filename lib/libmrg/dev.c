@@ -6,6 +6,10 @@
 #include <stdio.h>
 #include <sys/errno.h>
 
+/* Request interrupt + 1 of the devices created, by descriptor. */
+#define DEV_MAXDIDS 16
+static unsigned dev_reqints[DEV_MAXDIDS];
+
 static void __req_handler(int reqint, void *arg)
 {
 	int reqevt = (int)(uintptr_t)arg;
@@ -27,9 +31,28 @@ devcreat(struct sys_creat_cfg *cfg, devmode_t mode, int evt)
 		return ret;
 	}
 
+	if (ret < DEV_MAXDIDS)
+		dev_reqints[ret] = reqint + 1;
 	return ret;
 }
 
+/* Remove a device created by devcreat(). Its clients lose it. */
+int
+devremove(unsigned did)
+{
+	int ret;
+
+	ret = sys_remove(did);
+	if (ret < 0)
+		return ret;
+
+	if (did < DEV_MAXDIDS && dev_reqints[did]) {
+		intfree(dev_reqints[did] - 1);
+		dev_reqints[did] = 0;
+	}
+	return 0;
+}
+
 int
 devpoll(unsigned did, struct sys_poll_ior *ior)
 {
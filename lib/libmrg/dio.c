@@ -263,23 +263,28 @@ int dgetinfo(DEVICE * d, struct dinfo *i)
 
 void *diomap(DEVICE * d, uint64_t base, size_t len)
 {
+	int ret;
 	vaddr_t va;
-	unsigned i, pages, ret;
+	unsigned pages;
 
-	pages = round_page(len) >> PAGE_SHIFT;
-	va = vmap_alloc(len, VFNT_MMIO);
+	pages = (round_page(base + len) - trunc_page(base)) >> PAGE_SHIFT;
+	va = vmap_alloc(pages << PAGE_SHIFT, VFNT_MMIO);
 	if (va == 0)
 		return NULL;
 
-	for (i = 0; i < pages; i++) {
-		ret = sys_iomap(d->dd,
-				va + (i << PAGE_SHIFT),
-				trunc_page(base) + (i << PAGE_SHIFT));
-	}
+	/* Registers within a single page: map only the small pages
+	   covering them, not the neighbouring device memory. */
+	ret = -1;
+	if (pages == 1)
+		ret = sys_iomapsmall(d->dd,
+				     va + (trunc_spage(base) - trunc_page(base)),
+				     trunc_spage(base),
+				     (round_spage(base + len) - trunc_spage(base))
+				     >> SPAGE_SHIFT);
+	if (ret < 0)
+		ret = sys_iomaprange(d->dd, va, trunc_page(base), pages);
 	if (ret < 0) {
-		int j;
-		for (j = 0; j < i; j++)
-			sys_iounmap(d->dd, va + (j << PAGE_SHIFT));
+		vmap_free(va, pages << PAGE_SHIFT);
 		return NULL;
 	}
 
@@ -6,7 +6,7 @@
 void *dma32_alloc(size_t len)
 {
 	int ret;
-	vaddr_t i, j, va;
+	vaddr_t va;
 
 	va = vmap_alloc(len, VFNT_MEM32);
 	if (va == 0) {
@@ -14,27 +14,22 @@ void *dma32_alloc(size_t len)
 		return NULL;
 	}
 
-	for (i = 0; i < len; i += PAGE_SIZE) {
-		ret = vmmap32(va + i, VM_PROT_RW);
-		if (ret) {
-			for (j = 0; j < i; j++)
-				vmunmap(va + j);
-			vmap_free(va, len);
-			/* errno: set RET */
-			return NULL;
-		}
+	ret = vmmap32_range(va, len, VM_PROT_RW);
+	if (ret) {
+		vmunmap_range(va, len);
+		vmap_free(va, len);
+		/* errno: set RET */
+		return NULL;
 	}
 	return (void *)va;
 }
 
 void dma32_free(void *vaddr, size_t len)
 {
-	int ret;
-	vaddr_t i, j, va;
+	vaddr_t va;
 
 	va = (vaddr_t)(uintptr_t)vaddr;
-	for (j = 0; j < i; j++)
-		vmunmap(va + j);
+	vmunmap_range(va, len);
 	vmap_free(va, len);
 	/* errno: set RET */
 }
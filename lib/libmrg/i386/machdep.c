@@ -31,6 +31,29 @@ void framelongjmp(volatile struct intframe *f, jmp_buf *jb)
 	f->eax = 1;
 }
 
+void __framecall(void);
+
+/*
+ * Make the interrupted thread call fn(arg) before resuming at the
+ * faulting instruction. Caller-saved registers and flags are saved
+ * on the thread's stack and restored by __framecall.
+ */
+void framecall(volatile struct intframe *f, void (*fn)(vaddr_t), vaddr_t arg)
+{
+	uint32_t *sp = (uint32_t *)f->esp;
+
+	*--sp = f->eip;
+	*--sp = f->eflags;
+	*--sp = f->eax;
+	*--sp = f->ecx;
+	*--sp = f->edx;
+	*--sp = (uint32_t)arg;
+	*--sp = (uint32_t)fn;
+
+	f->esp = (uint32_t)sp;
+	f->eip = (uint32_t)__framecall;
+}
+
 void
 lwt_makebuf(lwt_t *lwt, void (*start)(void *), void * arg,
 	    void *stack_base, size_t stack_size)
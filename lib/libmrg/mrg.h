@@ -49,6 +49,7 @@
 #define VFNT_WREXEC  5
 #define VFNT_MMIO    6
 #define VFNT_MEM32   7
+#define VFNT_BLKMAP  8
 
 vaddr_t vmap_alloc(size_t size, uint8_t type);
 void vmap_free(vaddr_t va, size_t size);
@@ -57,6 +58,9 @@ void vmap_info(vaddr_t va, vaddr_t * start, size_t * size, uint8_t * type);
 int brk(void *);
 void *sbrk(int);
 
+/* Map up to 'npages' following pages on faults in vmap areas. */
+void vmfaultaround(unsigned npages);
+
 void *dma32_alloc(size_t len);
 void dma32_free(void *vaddr, size_t len);
 
@@ -91,6 +95,16 @@ void evtfree(int evt);
 void __evtset(int evt);
 
 
+/*
+ * Time.
+ */
+
+uint64_t timer_nsecs(void);
+uint64_t timer_boottime(void);
+int lwt_sleepuntil(uint64_t nsecs);
+void lwt_nsleep(uint64_t nsecs);
+
+
 /*
  * Device handling.
  */
@@ -135,6 +149,7 @@ void dclose(DEVICE * d);
  */
 
 int devcreat(struct sys_creat_cfg *cfg, devmode_t mode, int evt);
+int devremove(unsigned did);
 int devpoll(unsigned did, struct sys_poll_ior *ior);
 int devwriospace(unsigned did, unsigned id, uint32_t port, uint64_t val);
 int devraiseirq(unsigned did, unsigned id, unsigned irq);
@@ -8,9 +8,24 @@ struct blkinfo {
 	uint64_t blkno;
 };
 
+/* A segment of a vectored request. */
+struct blkiov {
+	void *addr;
+	size_t len;
+};
+
+#define BLK_IOVMAX 32
+
 struct blkops {
 	int      (*blkrd)(void *opq, void *data, size_t sz, uint64_t blkid, size_t nblks, int evt, int *res);
 	int      (*blkwr)(void *opq, uint64_t blkid, size_t nblks, void *data, size_t sz, int evt, int *res);
+	/* Optional: prepare a buffer for repeated I/O. */
+	int      (*blkreg)(void *opq, void *va, size_t sz);
+	int      (*blkunreg)(void *opq, void *va);
+	/* Optional: write back the device's volatile cache. */
+	int      (*blkflush)(void *opq, int evt, int *res);
+	/* Optional: vectored I/O, completed by calling done(). */
+	int      (*blkiov)(void *opq, int wr, uint64_t blkid, size_t nblks, const struct blkiov *iov, unsigned iovcnt, void (*done)(void *arg, int ret), void *arg);
 };
 
 struct blkdisk {
@@ -22,6 +37,8 @@ struct blkdisk {
 
 	const struct blkops *ops;
 	void *opq;
+	struct blkcache *cache;
+	struct blkq *queue;
 
 	rb_node_t rb_node;
 };
@@ -37,5 +54,116 @@ int blk_read(struct blkdisk *dk, void *addr, size_t sz, uint64_t blkid, size_t b
 int blk_write(struct blkdisk *dk, uint64_t blkid, size_t blkno, void *addr, size_t sz, int evt, int *retp);
 void blk_close(struct blkdisk *dk);
 
+/*
+ * Make all completed writes durable: write back the cache, wait for
+ * queued requests and flush the device's own cache. Sleeps.
+ */
+int blk_flush(struct blkdisk *dk);
+
+/*
+ * Cache the disk in 'sz' bytes of memory. Up to 'maxdirty' bytes
+ * of writes are held in the cache, and written back in the
+ * background or by blk_sync(). Cache hits complete before
+ * blk_read() and blk_write() return.
+ */
+struct blkcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t readahead;
+	uint64_t writebacks;
+};
+
+int blk_cache(struct blkdisk *dk, size_t sz, size_t maxdirty);
+int blk_cache_stats(struct blkdisk *dk, struct blkcache_stats *st);
+int blk_sync(struct blkdisk *dk);
+
+/*
+ * Queue requests to the disk, merging contiguous ones, and issue
+ * them in the order chosen by the elevator. While plugged, with
+ * blk_plug(), requests are only queued. Plugs nest.
+ */
+#define BLKQ_FIFO	0
+#define BLKQ_DEADLINE	1
+
+struct blkq_stats {
+	uint64_t reqs;
+	uint64_t ios;
+	uint64_t backmerges;
+	uint64_t frontmerges;
+};
+
+int blk_queue(struct blkdisk *dk, int elevator);
+int blk_queue_stats(struct blkdisk *dk, struct blkq_stats *st);
+void blk_plug(struct blkdisk *dk);
+void blk_unplug(struct blkdisk *dk);
+
+/*
+ * Vectored I/O. Each segment must be a multiple of the block size,
+ * and 'iov' must stay valid until done(arg, ret) is called, from an
+ * LWT. Disks with a cache, and drivers without vectored I/O on disks
+ * without a queue, go through a bounce buffer.
+ */
+int blk_iov(struct blkdisk *dk, int wr, uint64_t blkid, size_t nblks, const struct blkiov *iov, unsigned iovcnt, void (*done)(void *arg, int ret), void *arg);
+
+/*
+ * Batched submission. blk_submit() issues requests, copying their
+ * vectors, and returns how many it took: no more than there is room
+ * for in the completion ring. Completions are collected in the ring
+ * and reaped with blk_reap(), which waits for at least 'min' of
+ * them. The ring has a single event, set only when a reaper waits.
+ * A ring must have a single reaper.
+ */
+#define BLKREQ_READ	0
+#define BLKREQ_WRITE	1
+
+struct blkreq {
+	int op;
+	uint64_t blkid;
+	size_t nblks;
+	const struct blkiov *iov;
+	unsigned iovcnt;
+	void *cookie;
+};
+
+struct blkcpl {
+	void *cookie;
+	int ret;
+};
+
+struct blkring *blk_ring_create(unsigned nentries);
+void blk_ring_destroy(struct blkring *ring);
+int blk_submit(struct blkdisk *dk, const struct blkreq *reqs, unsigned nreqs, struct blkring *ring);
+unsigned blk_reap(struct blkring *ring, struct blkcpl *cpls, unsigned max, unsigned min);
+
+/*
+ * Register a buffer used for I/O on the disk. Transfers within a
+ * registered buffer avoid per-I/O DMA setup. Returns -ENOSYS if the
+ * driver has no use for registration.
+ */
+int blk_register(struct blkdisk *dk, void *addr, size_t sz);
+int blk_unregister(struct blkdisk *dk, void *addr);
+
+/*
+ * Map 'sz' bytes of the disk, starting at block 'blkid', in the
+ * address space. Pages are read on first access, together with up
+ * to 'readahead' following pages. In VM_PROT_RW mappings, written
+ * pages are written back by blk_msync() and blk_munmap().
+ *
+ * Faulting threads sleep while the page is read: mapped areas must
+ * not be accessed with preemption disabled.
+ */
+void *blk_mmap(struct blkdisk *dk, uint64_t blkid, size_t sz, int prot, unsigned readahead);
+int blk_msync(void *addr, size_t sz);
+int blk_munmap(void *addr);
+
+/*
+ * Use 'nblks' blocks of the disk from 'blkid' as swap area for
+ * anonymous vmap areas. blk_swapout() evicts pages not accessed in
+ * the last 'minage' calls; when the kernel is out of memory, faults
+ * evict pages regardless of age.
+ */
+int blk_swapon(struct blkdisk *dk, uint64_t blkid, uint64_t nblks);
+unsigned blk_swapout(unsigned npages, unsigned minage);
+
 
 #endif
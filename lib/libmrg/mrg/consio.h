@@ -1,6 +1,8 @@
 #ifndef __mrg_consio_h
 #define __mrg_consio_h
 
+#include <inttypes.h>
+
 #define CONSIO_DEVSTS 0
 #define CONSIO_DEVSTS_KBDVAL (1 << 0)
 
@@ -18,6 +20,42 @@
 #define CONSIO_OUTOP_CURSON 3
 #define CONSIO_OUTOP_CRSOFF 4
 
+#define CONSIO_CELLBUF 36
+
+#define CONSIO_FLUSH   37
+
+/*
+ * Cell buffer entries use the same encoding as OUTDATA.
+ */
+#define CONSIO_CELL(_c, _xattr, _colattr)				\
+	(((uint32_t)((_colattr) & 0xff) << 16)				\
+	 | ((uint32_t)((_xattr) & 0xff) << 8) | ((_c) & 0xff))
+
+/*
+ * FLUSH rectangle, inclusive on both corners.
+ */
+#define CONSIO_FLUSH_RECT(_x0, _y0, _x1, _y1)				\
+	(((uint64_t)((_y1) & 0xffff) << 48)				\
+	 | ((uint64_t)((_x1) & 0xffff) << 32)				\
+	 | ((uint64_t)((_y0) & 0xffff) << 16) | ((_x0) & 0xffff))
+#define CONSIO_FLUSH_X0(_v) ((unsigned)((_v) & 0xffff))
+#define CONSIO_FLUSH_Y0(_v) ((unsigned)(((_v) >> 16) & 0xffff))
+#define CONSIO_FLUSH_X1(_v) ((unsigned)(((_v) >> 32) & 0xffff))
+#define CONSIO_FLUSH_Y1(_v) ((unsigned)(((_v) >> 48) & 0xffff))
+
+#define CONSIO_KBRING  38
+
+/*
+ * Keyboard ring, exported by the client. The console produces, the
+ * client consumes. Indexes are free running.
+ */
+#define CONSIO_KBRING_SIZE 64
+struct consio_kbring {
+	volatile uint32_t prod;
+	volatile uint32_t cons;
+	uint16_t keys[CONSIO_KBRING_SIZE];
+};
+
 #define CONSIO_IRQ_KBDATA 0
 #define CONSIO_IRQ_REDRAW 1
 
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2015, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/bitops.h>
+#include <machine/vmparam.h>
+#include <machine/mrgparam.h>
+#include <microkernel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mrg.h>
+#include <mrg/blk.h>
+
+/*
+ * Swap.
+ *
+ * Cold pages of anonymous vmap areas (VFNT_RODATA and VFNT_RWDATA)
+ * are written to a swap area on disk and freed with vmswap(). The
+ * kernel reflects faults on them to us, and the faulting thread is
+ * made to read them back.
+ *
+ * The heap, stack and code are never swapped out: they hold the
+ * state needed to swap in.
+ *
+ * Swap slots are private to the process. The kernel can't copy
+ * swapped out entries, so fork() fails with -EBUSY while any page
+ * is swapped out.
+ */
+
+void framecall(struct intframe *f, void (*fn)(vaddr_t), vaddr_t arg);
+
+#define SWAP_NPAGES (VM_MAXMMAP_ADDRESS >> PAGE_SHIFT)
+#define SWAP_MINPAGE (VM_MINMMAP_ADDRESS >> PAGE_SHIFT)
+
+/* Pages reclaimed when out of memory. */
+#define SWAP_RECLAIM 4
+
+#define SWST_NONE    0
+#define SWST_OUT     1		/* Being written. */
+#define SWST_SWAPPED 2
+#define SWST_IN      3		/* Being read. */
+
+struct swpage {
+	uint32_t slot;
+	uint8_t st;
+};
+
+static struct {
+	struct blkdisk *dk;
+	uint64_t blkid;
+	size_t blkperpg;
+	unsigned nslots;
+	unsigned nfree;
+	uint32_t *slotmap;
+
+	struct swpage *pages;
+	uint8_t *ages;
+} swap;
+
+static int _swap_slotalloc(uint32_t *slot)
+{
+	unsigned i;
+
+	if (swap.nfree == 0)
+		return -ENOSPC;
+
+	for (i = 0; i < swap.nslots; i += 32) {
+		if (swap.slotmap[i / 32] == 0xffffffff)
+			continue;
+		*slot = i + ffs32(~swap.slotmap[i / 32]) - 1;
+		swap.slotmap[*slot / 32] |= 1U << (*slot % 32);
+		swap.nfree--;
+		return 0;
+	}
+	return -ENOSPC;
+}
+
+static void _swap_slotfree(uint32_t slot)
+{
+	swap.slotmap[slot / 32] &= ~(1U << (slot % 32));
+	swap.nfree++;
+}
+
+/* Protection of swappable pages, VM_PROT_NIL for the others. */
+static vm_prot_t _swap_prot(vaddr_t va)
+{
+	uint8_t type;
+
+	vmap_info(va, NULL, NULL, &type);
+	switch (type) {
+	case VFNT_RODATA:
+		return VM_PROT_RO;
+	case VFNT_RWDATA:
+		return VM_PROT_RW;
+	default:
+		return VM_PROT_NIL;
+	}
+}
+
+static int _swap_io(int wr, uint32_t slot, vaddr_t va)
+{
+	int evt, ret, res;
+	uint64_t blkid = swap.blkid + (uint64_t)slot * swap.blkperpg;
+
+	evt = evtalloc();
+	if (wr)
+		ret = blk_write(swap.dk, blkid, swap.blkperpg, (void *)va,
+				PAGE_SIZE, evt, &res);
+	else
+		ret = blk_read(swap.dk, (void *)va, PAGE_SIZE, blkid,
+			       swap.blkperpg, evt, &res);
+	if (ret == 0) {
+		evtwait(evt);
+		evtclear(evt);
+		ret = res;
+	}
+	evtfree(evt);
+	return ret;
+}
+
+static int _swap_pageout(vaddr_t va, vm_prot_t prot)
+{
+	int ret;
+	uint32_t slot;
+	struct swpage *sp = swap.pages + (va >> PAGE_SHIFT);
+
+	if (_swap_slotalloc(&slot))
+		return -ENOSPC;
+
+	/* Writes during I/O wait for the page to be out. */
+	sp->st = SWST_OUT;
+	if (prot != VM_PROT_RO)
+		vmchprot(va, VM_PROT_RO);
+
+	ret = _swap_io(1, slot, va);
+	if (ret == 0)
+		ret = vmswap(va);
+	if (ret) {
+		/* Shared, exported or I/O error. Keep it. */
+		if (prot != VM_PROT_RO)
+			vmchprot(va, prot);
+		_swap_slotfree(slot);
+		sp->st = SWST_NONE;
+		return ret;
+	}
+
+	sp->slot = slot;
+	sp->st = SWST_SWAPPED;
+	return 0;
+}
+
+static void _swap_pagein(vaddr_t va)
+{
+	int ret;
+	vaddr_t stage;
+	vm_prot_t prot;
+	struct swpage *sp;
+
+	va = trunc_page(va);
+	sp = swap.pages + (va >> PAGE_SHIFT);
+	while (sp->st == SWST_IN || sp->st == SWST_OUT)
+		lwt_yield();
+	if (sp->st != SWST_SWAPPED)
+		return;
+
+	sp->st = SWST_IN;
+	prot = _swap_prot(va);
+
+	stage = vmap_alloc(PAGE_SIZE, VFNT_RWDATA);
+	if (stage == 0)
+		goto fail;
+	ret = vmmap(stage, VM_PROT_RW);
+	if (ret == -ENOMEM && blk_swapout(SWAP_RECLAIM, 0))
+		ret = vmmap(stage, VM_PROT_RW);
+	if (ret == 0)
+		ret = _swap_io(0, sp->slot, stage);
+	if (ret) {
+		vmap_free(stage, PAGE_SIZE);
+		goto fail;
+	}
+	sys_move(va, stage);
+	if (prot != VM_PROT_RW)
+		vmchprot(va, prot);
+	vmap_free(stage, PAGE_SIZE);
+
+	_swap_slotfree(sp->slot);
+	sp->st = SWST_NONE;
+	return;
+
+      fail:
+	printf("MRG PID %d: can't swap in %08lx\n", getpid(), va);
+	sys_die(-3);
+}
+
+static void _swap_wait(vaddr_t va)
+{
+	struct swpage *sp = swap.pages + (va >> PAGE_SHIFT);
+
+	while (sp->st == SWST_IN || sp->st == SWST_OUT)
+		lwt_yield();
+}
+
+static void _swap_reclaim(vaddr_t va)
+{
+	if (blk_swapout(SWAP_RECLAIM, 0) == 0) {
+		printf("MRG PID %d: out of memory at %08lx\n", getpid(), va);
+		sys_die(-3);
+	}
+}
+
+/*
+ * Called from the page fault handler. Returns 1 if the fault has
+ * been handled.
+ */
+int __swap_fault(vaddr_t va, u_long err, struct intframe *f)
+{
+	struct swpage *sp;
+
+	if (swap.dk == NULL || (va >> PAGE_SHIFT) >= SWAP_NPAGES)
+		return 0;
+	sp = swap.pages + (va >> PAGE_SHIFT);
+
+	switch (sp->st) {
+	case SWST_SWAPPED:
+		if ((err & PG_ERR_REASON_MASK) != PG_ERR_REASON_NOTP)
+			return 0;
+		framecall(f, _swap_pagein, va);
+		return 1;
+	case SWST_OUT:
+	case SWST_IN:
+		framecall(f, _swap_wait, va);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Called from the page fault handler when the kernel is out of
+ * memory. Returns 1 if the faulting thread will try to free some.
+ */
+int __swap_reclaim(vaddr_t va, struct intframe *f)
+{
+	if (swap.dk == NULL)
+		return 0;
+	framecall(f, _swap_reclaim, va);
+	return 1;
+}
+
+/* Forget swapped out pages of a freed vmap area. */
+void __swap_discard(vaddr_t va, size_t sz)
+{
+	unsigned i;
+
+	if (swap.dk == NULL)
+		return;
+	for (i = va >> PAGE_SHIFT;
+	     i < (va + sz) >> PAGE_SHIFT && i < SWAP_NPAGES; i++)
+		if (swap.pages[i].st == SWST_SWAPPED) {
+			_swap_slotfree(swap.pages[i].slot);
+			swap.pages[i].st = SWST_NONE;
+		}
+}
+
+int blk_swapon(struct blkdisk *dk, uint64_t blkid, uint64_t nblks)
+{
+	size_t blkperpg;
+
+	if (swap.dk != NULL)
+		return -EBUSY;
+	if (dk->invalid || dk->info.blksz == 0
+	    || PAGE_SIZE % dk->info.blksz != 0)
+		return -EINVAL;
+	if (blkid >= dk->info.blkno || nblks > dk->info.blkno - blkid)
+		return -EINVAL;
+
+	blkperpg = PAGE_SIZE / dk->info.blksz;
+	swap.nslots = nblks / blkperpg;
+	if (swap.nslots == 0)
+		return -EINVAL;
+
+	swap.slotmap = calloc((swap.nslots + 31) / 32, sizeof(uint32_t));
+	swap.pages = calloc(SWAP_NPAGES, sizeof(struct swpage));
+	swap.ages = malloc(SWAP_NPAGES);
+	if (swap.slotmap == NULL || swap.pages == NULL || swap.ages == NULL) {
+		free(swap.slotmap);
+		free(swap.pages);
+		free(swap.ages);
+		return -ENOMEM;
+	}
+	/* Slots past the end are never free. */
+	if (swap.nslots % 32)
+		swap.slotmap[swap.nslots / 32] = ~((1U << (swap.nslots % 32)) - 1);
+
+	swap.blkid = blkid;
+	swap.blkperpg = blkperpg;
+	swap.nfree = swap.nslots;
+	dk->ref++;
+	swap.dk = dk;
+	return 0;
+}
+
+/*
+ * Age swappable pages and swap out up to 'npages' of those not
+ * accessed in the last 'minage' calls, oldest first. Returns the
+ * number of pages swapped out.
+ */
+unsigned blk_swapout(unsigned npages, unsigned minage)
+{
+	int age;
+	unsigned i, n = 0;
+	vm_prot_t prot;
+	vaddr_t va;
+
+	if (swap.dk == NULL)
+		return 0;
+
+	va = (vaddr_t)SWAP_MINPAGE << PAGE_SHIFT;
+	if (vmage(va, (SWAP_NPAGES - SWAP_MINPAGE) << PAGE_SHIFT,
+		  swap.ages + SWAP_MINPAGE))
+		return 0;
+
+	for (age = VMAGE_NONE - 1; age >= (int)minage && n < npages; age--) {
+		for (i = SWAP_MINPAGE; i < SWAP_NPAGES && n < npages; i++) {
+			if (swap.ages[i] != age
+			    || swap.pages[i].st != SWST_NONE)
+				continue;
+			va = (vaddr_t)i << PAGE_SHIFT;
+			prot = _swap_prot(va);
+			if (prot == VM_PROT_NIL)
+				continue;
+			if (_swap_pageout(va, prot) == 0)
+				n++;
+			if (swap.nfree == 0)
+				return n;
+		}
+	}
+	return n;
+}
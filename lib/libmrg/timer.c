@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2016, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <microkernel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <mrg.h>
+
+/*
+ * Time and timed sleeps.
+ *
+ * The SYS device exports the system timer: a free running counter,
+ * its period and the wall time at which it started. The small page
+ * holding the counter is mapped read only, so that reading the time
+ * is a couple of loads. Kernels that don't allow it are read through
+ * the I/O port.
+ *
+ * Sleeping LWTs are kept in a list sorted by deadline. The thread's
+ * real time alarm is armed at the first deadline, and its interrupt
+ * wakes the timer LWT, which wakes the expired sleepers and re-arms
+ * the alarm. The alarm is per thread, so a process must not fork
+ * after its first timed sleep.
+ */
+
+#define TIMER_STACKSIZE (16 * 1024)
+
+/* Femtoseconds per nanosecond. */
+#define FS_PER_NS 1000000ULL
+
+struct sleeper {
+	lwt_t *lwt;
+	uint64_t deadline;
+	int onlist;
+
+	TAILQ_ENTRY(sleeper) list;
+};
+
+static struct {
+	int init;		/* 1 working, -1 no timer. */
+	DEVICE *d;
+	uint64_t period;	/* Counter period, in fs. */
+	uint64_t boottime;
+	volatile uint32_t *cnt;
+
+	int evt;
+	lwt_t *lwt;
+	uint64_t armed;		/* Counter value of the alarm, 0 if none. */
+	TAILQ_HEAD(, sleeper) sleepers;
+} tmr;
+
+static uint64_t _timer_counter(void)
+{
+	uint32_t hi1, hi2, lo;
+	uint64_t val;
+
+	if (tmr.cnt == NULL) {
+		din(tmr.d, IOPORT_QWORD(SYSDEVIO_RTTCNT), &val);
+		return val;
+	}
+	do {
+		hi1 = tmr.cnt[1];
+		lo = tmr.cnt[0];
+		hi2 = tmr.cnt[1];
+	} while (hi1 != hi2);
+	return (uint64_t)hi1 << 32 | lo;
+}
+
+/* Split to not overflow: the period is in the order of 10^7 fs. */
+static uint64_t _timer_tons(uint64_t ticks)
+{
+	return (ticks / FS_PER_NS) * tmr.period
+		+ (ticks % FS_PER_NS) * tmr.period / FS_PER_NS;
+}
+
+static uint64_t _timer_toticks(uint64_t ns)
+{
+	return (ns / tmr.period) * FS_PER_NS
+		+ (ns % tmr.period) * FS_PER_NS / tmr.period;
+}
+
+/* Arm the alarm for the first sleeper, unless it's armed earlier. */
+static void _timer_arm(uint64_t now)
+{
+	uint64_t diff;
+	struct sleeper *s;
+
+	s = TAILQ_FIRST(&tmr.sleepers);
+	if (s == NULL)
+		return;
+	if (tmr.armed != 0 && tmr.armed <= s->deadline)
+		return;
+
+	diff = s->deadline > now ? s->deadline - now : 1;
+	/* The alarm is 32 bit. Re-armed when it fires. */
+	if (diff > UINT32_MAX)
+		diff = UINT32_MAX;
+	tmr.armed = now + diff;
+	dout(tmr.d, IOPORT_DWORD(SYSDEVIO_RTTALM), diff);
+}
+
+static void _timer_lwt(void *arg)
+{
+	uint64_t now;
+	struct sleeper *s;
+
+	for (;;) {
+		evtwait(tmr.evt);
+		evtclear(tmr.evt);
+		tmr.armed = 0;
+
+		now = _timer_counter();
+		while ((s = TAILQ_FIRST(&tmr.sleepers)) != NULL
+		       && s->deadline <= now) {
+			TAILQ_REMOVE(&tmr.sleepers, s, list);
+			s->onlist = 0;
+			lwt_wake(s->lwt);
+		}
+		_timer_arm(now);
+	}
+}
+
+static int _timer_init(void)
+{
+	uint64_t val;
+
+	if (tmr.init)
+		return tmr.init < 0 ? -ENODEV : 0;
+
+	tmr.init = -1;
+	tmr.d = dopen("SYSTEM");
+	if (tmr.d == NULL)
+		return -ENODEV;
+	if (din(tmr.d, IOPORT_QWORD(SYSDEVIO_TMRPRD), &tmr.period)
+	    || tmr.period == 0 || tmr.period == (uint64_t)-1) {
+		printf("TIMER: no system timer\n");
+		goto fail;
+	}
+	if (din(tmr.d, IOPORT_QWORD(SYSDEVIO_BOOTTM), &val) == 0
+	    && val != (uint64_t)-1)
+		tmr.boottime = val;
+	if (din(tmr.d, IOPORT_QWORD(SYSDEVIO_TMRADDR), &val) == 0
+	    && val != 0 && val != (uint64_t)-1)
+		tmr.cnt = diomap(tmr.d, val, 2 * sizeof(uint32_t));
+	if (tmr.cnt == NULL)
+		printf("TIMER: counter not mappable, using system calls\n");
+
+	TAILQ_INIT(&tmr.sleepers);
+	tmr.evt = evtalloc();
+	if (dmapirq(tmr.d, SYSDEVIO_RTTINT, tmr.evt)) {
+		printf("TIMER: can't map alarm interrupt\n");
+		evtfree(tmr.evt);
+		goto fail;
+	}
+	tmr.lwt = lwt_create(_timer_lwt, NULL, TIMER_STACKSIZE);
+	if (tmr.lwt == NULL) {
+		evtfree(tmr.evt);
+		goto fail;
+	}
+	lwt_wake(tmr.lwt);
+	tmr.init = 1;
+	return 0;
+
+      fail:
+	dclose(tmr.d);
+	tmr.d = NULL;
+	return -ENODEV;
+}
+
+/* Monotonic time since boot, in nanoseconds. 0 if no timer. */
+uint64_t timer_nsecs(void)
+{
+	if (_timer_init())
+		return 0;
+	return _timer_tons(_timer_counter());
+}
+
+/* Wall time of boot, in seconds since the Epoch. 0 if unknown. */
+uint64_t timer_boottime(void)
+{
+	if (_timer_init())
+		return 0;
+	return tmr.boottime;
+}
+
+/*
+ * Sleep until woken by lwt_wake() or until timer_nsecs() reaches
+ * 'nsecs'. Returns 0 if woken, -ETIMEDOUT if the time has come.
+ */
+int lwt_sleepuntil(uint64_t nsecs)
+{
+	int ret;
+	uint64_t now;
+	struct sleeper s, *p;
+
+	ret = _timer_init();
+	if (ret) {
+		lwt_yield();
+		return ret;
+	}
+
+	s.deadline = _timer_toticks(nsecs);
+	now = _timer_counter();
+	if (s.deadline <= now)
+		return -ETIMEDOUT;
+
+	s.lwt = lwt_getcurrent();
+	TAILQ_FOREACH(p, &tmr.sleepers, list)
+		if (p->deadline > s.deadline)
+			break;
+	if (p == NULL)
+		TAILQ_INSERT_TAIL(&tmr.sleepers, &s, list);
+	else
+		TAILQ_INSERT_BEFORE(p, &s, list);
+	s.onlist = 1;
+	_timer_arm(now);
+
+	lwt_sleep();
+
+	/* Still on the list: someone else woke us up. */
+	if (s.onlist) {
+		TAILQ_REMOVE(&tmr.sleepers, &s, list);
+		return 0;
+	}
+	return -ETIMEDOUT;
+}
+
+void lwt_nsleep(uint64_t nsecs)
+{
+	uint64_t end = timer_nsecs() + nsecs;
+
+	while (lwt_sleepuntil(end) == 0);
+}
@@ -40,6 +40,10 @@
 extern lwt_t *lwt_current;
 extern void framedump(struct intframe *f);
 void framelongjmp(struct intframe *f, jmp_buf * jb);
+extern vm_prot_t __blkmap_prot(vaddr_t va);
+extern int __blkmap_fault(vaddr_t va, u_long err, struct intframe *f);
+extern int __swap_fault(vaddr_t va, u_long err, struct intframe *f);
+extern int __swap_reclaim(vaddr_t va, struct intframe *f);
 
 extern void _scode __asm("__executable_start");
 extern void _ecode __asm("__etext");
@@ -51,6 +55,7 @@ extern void _end __asm("_end");
 
 static const void *maxbrk = (void *) (1LL * 1024 * 1024 * 1024);
 static void *brkaddr = (void *) -1;
+static unsigned faultaround = 0;
 
 static inline void *__getbrk(void)
 {
@@ -98,16 +103,58 @@ static vm_prot_t _resolve_va(vaddr_t va)
 		return VM_PROT_RX;
 	case VFNT_WREXEC:
 		return VM_PROT_WX;
+	case VFNT_BLKMAP:
+		return __blkmap_prot(va);
 	default:
 		break;
 	}
 	return VM_PROT_NIL;
 }
 
+/* End of the fault-around window for a fault at va, if any. */
+static vaddr_t _faultaround_end(vaddr_t va)
+{
+	vaddr_t vastart, end;
+	size_t vasize;
+	uint8_t vatype;
+
+	if (faultaround == 0)
+		return 0;
+
+	/* Only vmap areas: their bounds are known. */
+	if (va < (vaddr_t) __getbrk())
+		return 0;
+	if (va >= (USRSTACK - MAXSSIZ) && va <= USRSTACK)
+		return 0;
+
+	vmap_info(va, &vastart, &vasize, &vatype);
+	end = trunc_page(va) + ((vaddr_t)(faultaround + 1) << PAGE_SHIFT);
+	if (end > vastart + vasize || end < va)
+		end = vastart + vasize;
+	return end;
+}
+
+void vmfaultaround(unsigned npages)
+{
+	faultaround = npages;
+}
+
+/* The data segment from the first full page to the break is anonymous. */
+static void _brk_anon(void *obrk, void *nbrk)
+{
+	vaddr_t start = round_page((vaddr_t) & _sdata);
+
+	if (round_page((vaddr_t) obrk) == round_page((vaddr_t) nbrk))
+		return;
+	if (round_page((vaddr_t) nbrk) > start)
+		(void)vmanon(start, round_page((vaddr_t) nbrk) - start, VM_PROT_RW);
+}
+
 int brk(void *nbrk)
 {
 	if (nbrk < &_end || nbrk >= maxbrk)
 		return -1;
+	_brk_anon(__getbrk(), nbrk);
 	brkaddr = nbrk;
 	return 0;
 }
@@ -128,6 +175,16 @@ int __sys_pgfaulthandler(vaddr_t va, u_long err, struct intframe *f)
 {
 	vm_prot_t prot = _resolve_va(va);
 	unsigned reason = err & PG_ERR_REASON_MASK;
+	vaddr_t end;
+	int ret;
+
+	ret = __blkmap_fault(va, err, f);
+	if (ret > 0)
+		return 0;
+	if (ret < 0)
+		prot = VM_PROT_NIL;
+	if (__swap_fault(va, err, f))
+		return 0;
 
 	if (prot == VM_PROT_PASSTHROUGH
 	    && lwt_current != NULL
@@ -144,9 +201,23 @@ int __sys_pgfaulthandler(vaddr_t va, u_long err, struct intframe *f)
 
 	switch (reason) {
 	case PG_ERR_REASON_NOTP:
-		/* XXX: Find if we need to swap in from somewhere */
-		/* XXX: For now, just populate new page */
-		vmmap(va, prot);
+		/* Disk-backed pages are handled above. Populate
+		 * new page. */
+		end = _faultaround_end(va);
+		if (end > trunc_page(va))
+			ret = vmfill_range(trunc_page(va), end - trunc_page(va), prot);
+		else
+			ret = vmmap(va, prot);
+		if (ret == -ENOMEM)
+			goto oom;
+		if (ret < 0) {
+			/* E.g. an unmapped small page: retrying would
+			 * fault forever. */
+			printf("MRG PID %d: Can't map page at %08lx (%d)\n",
+			       getpid(), va, ret);
+			framedump(f);
+			sys_die(-3);
+		}
 		return 0;
 	case PG_ERR_REASON_PROT:
 		if ((err & (PG_ERR_INFO_COW | PG_ERR_INFO_WRITE))
@@ -154,7 +225,8 @@ int __sys_pgfaulthandler(vaddr_t va, u_long err, struct intframe *f)
 			vaddr_t pg = va & ~PAGE_MASK;
 
 			/* cow fault */
-			vmmap(VACOW, VM_PROT_RW);
+			if (vmmap(VACOW, VM_PROT_RW) == -ENOMEM)
+				goto oom;
 			memcpy((void *) VACOW, (void *) pg, PAGE_SIZE);
 			sys_move(va, VACOW);
 			return 0;
@@ -169,9 +241,18 @@ int __sys_pgfaulthandler(vaddr_t va, u_long err, struct intframe *f)
 		break;
 	}
 	sys_die(-3);
+
+      oom:
+	/* Retry after swapping out some pages. */
+	if (__swap_reclaim(va, f))
+		return 0;
+	printf("MRG PID %d: Out of memory at %08lx\n", getpid(), va);
+	sys_die(-3);
 }
 
 static void __attribute__ ((constructor))
 	_vm_init(void)
 {
+	(void)vmanon(USRSTACK - MAXSSIZ, MAXSSIZ, VM_PROT_RW);
+	_brk_anon(NULL, __getbrk());
 }
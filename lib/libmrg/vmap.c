@@ -41,6 +41,8 @@
 #include "mrg.h"
 
 
+extern void __swap_discard(vaddr_t va, size_t sz);
+
 /*
  * VM map db.
  */
@@ -195,8 +197,26 @@ vaddr_t vmap_alloc(size_t size, uint8_t type)
 	}
 	pgsz = round_page(size);
 	va = vmapzone_alloc(&vmap_zone, pgsz);
-	if (va != 0)
-		vmap_insert(va, pgsz, type);
+	if (va == 0)
+		return 0;
+	vmap_insert(va, pgsz, type);
+
+	/* Demand-paged areas: let the kernel handle faults. If the
+	 * kernel is out of anonymous regions, our pager does. */
+	switch (type) {
+	case VFNT_RODATA:
+		(void)vmanon(va, pgsz, VM_PROT_RO);
+		break;
+	case VFNT_RWDATA:
+		(void)vmanon(va, pgsz, VM_PROT_RW);
+		break;
+	case VFNT_EXEC:
+		(void)vmanon(va, pgsz, VM_PROT_RX);
+		break;
+	case VFNT_WREXEC:
+		(void)vmanon(va, pgsz, VM_PROT_WX);
+		break;
+	}
 	return va;
 }
 
@@ -214,6 +234,10 @@ void vmap_free(vaddr_t va, size_t size)
 	assert(vme->addr == va);
 	assert(vme->size == size);
 	assert(vme->type != VFNT_FREE);
+	if (vme->type >= VFNT_RODATA && vme->type <= VFNT_WREXEC)
+		(void)vmanon(va, size, VM_PROT_NIL);
+	if (vme->type == VFNT_RODATA || vme->type == VFNT_RWDATA)
+		__swap_discard(va, size);
 	vmap_remove(vme);
 	vmapzone_free(&vmap_zone, va, size);
 }
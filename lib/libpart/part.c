@@ -4,6 +4,8 @@
 #include <mrg/blk/part.h>
 #include <squoze.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 struct part {
 	struct blkdisk *blk;
@@ -15,7 +17,7 @@ int part_blkrd(void *opq, void *data, size_t sz, uint64_t blkid, size_t nblks, i
 {
 	struct part *p = (struct part *)opq;
 
-	if ((blkid >= p->length) || (blkid + nblks >= p->length))
+	if ((blkid >= p->length) || (blkid + nblks > p->length))
 		return -EINVAL;
 
 	return blk_read(p->blk, data, sz, p->start + blkid, nblks, evt, res);
@@ -25,15 +27,52 @@ int part_blkwr(void *opq, uint64_t blkid, size_t nblks, void *data, size_t sz, i
 {
 	struct part *p = (struct part *)opq;
 
-	if ((blkid >= p->length) || (blkid + nblks >= p->length))
+	if ((blkid >= p->length) || (blkid + nblks > p->length))
 		return -EINVAL;
 
 	return blk_write(p->blk, p->start + blkid, nblks, data, sz, evt, res);
 }
 
+int part_blkreg(void *opq, void *va, size_t sz)
+{
+	struct part *p = (struct part *)opq;
+
+	return blk_register(p->blk, va, sz);
+}
+
+int part_blkunreg(void *opq, void *va)
+{
+	struct part *p = (struct part *)opq;
+
+	return blk_unregister(p->blk, va);
+}
+
+int part_blkflush(void *opq, int evt, int *res)
+{
+	struct part *p = (struct part *)opq;
+
+	*res = blk_flush(p->blk);
+	evtset(evt);
+	return 0;
+}
+
+int part_blkiov(void *opq, int wr, uint64_t blkid, size_t nblks, const struct blkiov *iov, unsigned iovcnt, void (*done)(void *, int), void *arg)
+{
+	struct part *p = (struct part *)opq;
+
+	if ((blkid >= p->length) || (blkid + nblks > p->length))
+		return -EINVAL;
+
+	return blk_iov(p->blk, wr, p->start + blkid, nblks, iov, iovcnt, done, arg);
+}
+
 static struct blkops part_blkops = {
 	.blkrd = part_blkrd,
 	.blkwr = part_blkwr,
+	.blkreg = part_blkreg,
+	.blkunreg = part_blkunreg,
+	.blkflush = part_blkflush,
+	.blkiov = part_blkiov,
 };
 
 
@@ -69,10 +108,208 @@ void partadd(unsigned pno, uint64_t blkdev, uint64_t start, uint64_t len)
 	blk_add(name, blkdev, &info, &part_blkops, (void *)p);
 }
 
+/*
+ * GPT.
+ *
+ * The primary header and the entry array that normally follows it
+ * are read with a single I/O. If the primary header or its entries
+ * are not valid, the backup header at the end of the disk is used.
+ */
+
+#define GPT_SIGNATURE 0x5452415020494645ULL /* "EFI PART" */
+#define GPT_ENTRIES_SIZE (128 * 128)	/* Minimum array size. */
+
+struct gpt_hdr {
+	uint64_t signature;
+	uint32_t revision;
+	uint32_t hdrsz;
+	uint32_t hdrcrc;
+	uint32_t reserved;
+	uint64_t mylba;
+	uint64_t altlba;
+	uint64_t firstlba;
+	uint64_t lastlba;
+	uint8_t diskguid[16];
+	uint64_t entlba;
+	uint32_t nents;
+	uint32_t entsz;
+	uint32_t entcrc;
+} __attribute__((packed));
+
+struct gpt_ent {
+	uint8_t type[16];
+	uint8_t guid[16];
+	uint64_t firstlba;
+	uint64_t lastlba;
+	uint64_t attrs;
+	uint16_t name[36];
+} __attribute__((packed));
+
+static uint32_t crc32_table[256];
+
+static uint32_t crc32(const void *buf, size_t sz)
+{
+	size_t i;
+	unsigned j;
+	uint32_t c;
+	const uint8_t *p = buf;
+
+	if (crc32_table[1] == 0)
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			crc32_table[i] = c;
+		}
+
+	c = 0xffffffff;
+	for (i = 0; i < sz; i++)
+		c = crc32_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffff;
+}
+
+static int gpt_read(struct blkdisk *blk, void *buf, size_t blksz,
+		    uint64_t lba, size_t nblks, int evt)
+{
+	int ret, res;
+
+	ret = blk_read(blk, buf, nblks * blksz, lba, nblks, evt, &res);
+	if (ret)
+		return ret;
+	evtwait(evt);
+	evtclear(evt);
+	return res;
+}
+
+/* Check a header read from 'lba'. */
+static int gpt_hdrok(struct gpt_hdr *hdr, uint64_t lba, size_t blksz,
+		     struct blkinfo *info)
+{
+	uint32_t crc;
+
+	if (hdr->signature != GPT_SIGNATURE)
+		return 0;
+	if (hdr->hdrsz < sizeof(*hdr) || hdr->hdrsz > blksz)
+		return 0;
+	crc = hdr->hdrcrc;
+	hdr->hdrcrc = 0;
+	if (crc32(hdr, hdr->hdrsz) != crc)
+		return 0;
+	hdr->hdrcrc = crc;
+	if (hdr->mylba != lba)
+		return 0;
+	if (hdr->entsz < sizeof(struct gpt_ent) || hdr->entsz % 8
+	    || hdr->nents == 0 || hdr->nents > 4096)
+		return 0;
+	if (hdr->entlba >= info->blkno || hdr->lastlba >= info->blkno)
+		return 0;
+	return 1;
+}
+
+static size_t gpt_entblks(struct gpt_hdr *hdr, size_t blksz)
+{
+	return ((size_t)hdr->nents * hdr->entsz + blksz - 1) / blksz;
+}
+
+/* Register the partitions in the entry array. */
+static int gpt_parts(uint64_t blkid, struct gpt_hdr *hdr, uint8_t *ents)
+{
+	unsigned i, n = 0;
+	struct gpt_ent *ent;
+	static const uint8_t unused[16];
+
+	for (i = 0; i < hdr->nents; i++) {
+		ent = (struct gpt_ent *)(ents + i * hdr->entsz);
+		if (!memcmp(ent->type, unused, sizeof(unused)))
+			continue;
+		if (ent->firstlba < hdr->firstlba || ent->lastlba > hdr->lastlba
+		    || ent->lastlba < ent->firstlba)
+			continue;
+		partadd(i, blkid, ent->firstlba,
+			ent->lastlba - ent->firstlba + 1);
+		n++;
+	}
+	return n;
+}
+
 int gpt_scan(uint64_t blkid)
 {
-	/* TODO */
-	return 0;
+	int evt, ret = 0;
+	uint8_t *buf = NULL, *ents;
+	size_t blksz, nblks, entblks;
+	uint64_t altlba;
+	struct blkdisk *blk;
+	struct blkinfo info;
+	struct gpt_hdr hdr;
+
+	blk = blk_open(blkid);
+	if (blk == NULL) {
+		printf("libpart: %s not found", unsquoze_inline(blkid).str);
+		return 0;
+	}
+	blk_info(blk, &info);
+	blksz = info.blksz;
+	if (blksz < 512 || info.blkno < 3) {
+		blk_close(blk);
+		return 0;
+	}
+	evt = evtalloc();
+
+	/* Primary header at LBA 1, and the entries usually after it. */
+	nblks = 1 + (GPT_ENTRIES_SIZE + blksz - 1) / blksz;
+	if (nblks > info.blkno - 1)
+		nblks = info.blkno - 1;
+	buf = malloc(nblks * blksz);
+	if (buf == NULL || gpt_read(blk, buf, blksz, 1, nblks, evt))
+		goto backup;
+	if (!gpt_hdrok((struct gpt_hdr *)buf, 1, blksz, &info))
+		goto backup;
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	entblks = gpt_entblks(&hdr, blksz);
+	if (hdr.entlba == 2 && entblks <= nblks - 1) {
+		ents = buf + blksz;
+	} else {
+		free(buf);
+		buf = malloc(entblks * blksz);
+		if (buf == NULL
+		    || gpt_read(blk, buf, blksz, hdr.entlba, entblks, evt))
+			goto backup;
+		ents = buf;
+	}
+	if (crc32(ents, (size_t)hdr.nents * hdr.entsz) == hdr.entcrc)
+		goto found;
+
+      backup:
+	/* Backup header, normally in the last block. */
+	free(buf);
+	buf = malloc(blksz);
+	if (buf == NULL)
+		goto out;
+	altlba = info.blkno - 1;
+	if (gpt_read(blk, buf, blksz, altlba, 1, evt)
+	    || !gpt_hdrok((struct gpt_hdr *)buf, altlba, blksz, &info))
+		goto out;
+	memcpy(&hdr, buf, sizeof(hdr));
+	printf("libpart: %s: using backup GPT\n", unsquoze_inline(blkid).str);
+
+	entblks = gpt_entblks(&hdr, blksz);
+	free(buf);
+	buf = malloc(entblks * blksz);
+	if (buf == NULL || gpt_read(blk, buf, blksz, hdr.entlba, entblks, evt))
+		goto out;
+	ents = buf;
+	if (crc32(ents, (size_t)hdr.nents * hdr.entsz) != hdr.entcrc)
+		goto out;
+
+      found:
+	gpt_parts(blkid, &hdr, ents);
+	ret = 1;
+      out:
+	free(buf);
+	evtfree(evt);
+	blk_close(blk);
+	return ret;
 }
 
 #define is_mbr(_s) (((_s)[510] == 0x55) && ((_s)[511] == 0xaa))
@@ -48,6 +48,10 @@ int sys_getpid(void);
 int sys_raise(int);
 int sys_tls(void *);
 int sys_map(vaddr_t vaddr, sys_map_flags_t perm);
+int sys_maprange(vaddr_t vaddr, size_t npages, sys_map_flags_t perm);
+int sys_mapanon(vaddr_t vaddr, size_t npages, sys_map_flags_t perm);
+int sys_pgage(vaddr_t vaddr, size_t npages, uint8_t *ages);
+int sys_pgswap(vaddr_t vaddr);
 int sys_move(vaddr_t dst, vaddr_t src);
 
 
@@ -75,9 +79,36 @@ int vmmap32(vaddr_t addr, vm_prot_t prot);
 int vmunmap(vaddr_t addr);
 int vmchprot(vaddr_t addr, vm_prot_t prot);
 
+/* Range versions: operate on all pages in [addr, addr + sz). */
+int vmmap_range(vaddr_t addr, size_t sz, vm_prot_t prot);
+int vmmap32_range(vaddr_t addr, size_t sz, vm_prot_t prot);
+int vmfill_range(vaddr_t addr, size_t sz, vm_prot_t prot);
+int vmunmap_range(vaddr_t addr, size_t sz);
+int vmchprot_range(vaddr_t addr, size_t sz, vm_prot_t prot);
+
+/* Small (4k) page versions. The 2M pages containing the range must
+   be unmapped or hold small pages only. */
+int vmmap_small(vaddr_t addr, size_t sz, vm_prot_t prot);
+int vmunmap_small(vaddr_t addr, size_t sz);
+int vmchprot_small(vaddr_t addr, size_t sz, vm_prot_t prot);
+
+/* Let the kernel zero-fill and COW-copy pages in [addr, addr + sz).
+   VM_PROT_NIL forgets the region starting at addr. */
+int vmanon(vaddr_t addr, size_t sz, vm_prot_t prot);
+
+/* Page aging: one byte per page in [addr, addr + sz), counting the
+   scans since the page was last accessed. VMAGE_NONE marks pages
+   that can't be swapped out. vmswap() frees a page whose contents
+   have been saved: faults on it always reach the pager. */
+#define VMAGE_NONE 0xff
+int vmage(vaddr_t addr, size_t sz, uint8_t *ages);
+int vmswap(vaddr_t addr);
+
 int sys_open(u_int64_t id);
 int sys_open32(u_long hi, u_long lo);
 int sys_iomap(unsigned ddno, u_long va, uint64_t mmioaddr);
+int sys_iomaprange(unsigned ddno, u_long va, uint64_t mmioaddr, size_t npages);
+int sys_iomapsmall(unsigned ddno, u_long va, uint64_t mmioaddr, size_t npages);
 int sys_iounmap(unsigned ddno, u_long va);
 int sys_info(unsigned ddno, struct sys_info_cfg *cfg);
 int sys_export(unsigned ddno, u_long va, size_t sz, iova_t *iova);
@@ -89,6 +120,7 @@ int sys_wrcfg(unsigned ddno, uint32_t off, uint8_t sz, uint64_t *val);
 int sys_close(unsigned ddno);
 
 int sys_creat(struct sys_creat_cfg *cfg, unsigned sig, devmode_t mode);
+int sys_remove(unsigned did);
 int sys_poll(unsigned did, struct sys_poll_ior *ior);
 int sys_wriospc(unsigned did, unsigned id, uint32_t port, u_long val);
 int sys_irq(unsigned did, unsigned id, unsigned irq);
@@ -132,6 +132,41 @@ int sys_map(vaddr_t vaddr, sys_map_flags_t perm)
 	return ret;
 }
 
+int sys_maprange(vaddr_t vaddr, size_t npages, sys_map_flags_t perm)
+{
+	int ret;
+
+	__syscall3(SYS_MAPRANGE, (unsigned long) vaddr,
+		   (unsigned long) npages, (unsigned long) perm, ret);
+	return ret;
+}
+
+int sys_mapanon(vaddr_t vaddr, size_t npages, sys_map_flags_t perm)
+{
+	int ret;
+
+	__syscall3(SYS_MAPANON, (unsigned long) vaddr,
+		   (unsigned long) npages, (unsigned long) perm, ret);
+	return ret;
+}
+
+int sys_pgage(vaddr_t vaddr, size_t npages, uint8_t *ages)
+{
+	int ret;
+
+	__syscall3(SYS_PGAGE, (unsigned long) vaddr,
+		   (unsigned long) npages, (unsigned long) ages, ret);
+	return ret;
+}
+
+int sys_pgswap(vaddr_t vaddr)
+{
+	int ret;
+
+	__syscall1(SYS_PGSWAP, (unsigned long) vaddr, ret);
+	return ret;
+}
+
 int sys_move(vaddr_t dst, vaddr_t src)
 {
 	int ret;
@@ -172,6 +207,24 @@ int sys_iomap(unsigned ddno, u_long va, uint64_t mmioaddr)
 	return ret;
 }
 
+int sys_iomaprange(unsigned ddno, u_long va, uint64_t mmioaddr, size_t npages)
+{
+	int ret;
+
+	__syscall4(SYS_IOMAPRANGE, (unsigned long) ddno, (unsigned long) va,
+		   (unsigned long) mmioaddr, (unsigned long) npages, ret);
+	return ret;
+}
+
+int sys_iomapsmall(unsigned ddno, u_long va, uint64_t mmioaddr, size_t npages)
+{
+	int ret;
+
+	__syscall4(SYS_IOMAPSMALL, (unsigned long) ddno, (unsigned long) va,
+		   (unsigned long) mmioaddr, (unsigned long) npages, ret);
+	return ret;
+}
+
 int sys_iounmap(unsigned ddno, u_long va)
 {
 	int ret;
@@ -284,6 +337,14 @@ int sys_creat(struct sys_creat_cfg *cfg, unsigned sig, devmode_t mode)
 	return ret;
 }
 
+int sys_remove(unsigned did)
+{
+	int ret;
+
+	__syscall1(SYS_REMOVE, (unsigned long) did, ret);
+	return ret;
+}
+
 int sys_poll(unsigned did, struct sys_poll_ior *ior)
 {
 	int ret;
@@ -30,7 +30,7 @@
 #include <machine/vmparam.h>
 #include <microkernel.h>
 
-#define PROTFLAGS (MAP_NEW|MAP_NEW32)
+#define PROTFLAGS (MAP_NEW|MAP_NEW32|MAP_FILL)
 
 int vmmap(vaddr_t addr, vm_prot_t prot)
 {
@@ -51,3 +51,65 @@ int vmchprot(vaddr_t addr, vm_prot_t prot)
 {
 	return sys_map(addr, prot & ~PROTFLAGS);
 }
+
+#define NPAGES(_a, _sz) ((round_page((_a) + (_sz)) - trunc_page(_a)) >> PAGE_SHIFT)
+
+int vmmap_range(vaddr_t addr, size_t sz, vm_prot_t prot)
+{
+	return sys_maprange(addr, NPAGES(addr, sz), prot | MAP_NEW);
+}
+
+int vmmap32_range(vaddr_t addr, size_t sz, vm_prot_t prot)
+{
+	return sys_maprange(addr, NPAGES(addr, sz), prot | MAP_NEW32);
+}
+
+/* Map new pages only where none is present. */
+int vmfill_range(vaddr_t addr, size_t sz, vm_prot_t prot)
+{
+	return sys_maprange(addr, NPAGES(addr, sz), prot | MAP_NEW | MAP_FILL);
+}
+
+int vmunmap_range(vaddr_t addr, size_t sz)
+{
+	return sys_maprange(addr, NPAGES(addr, sz), 0);
+}
+
+int vmchprot_range(vaddr_t addr, size_t sz, vm_prot_t prot)
+{
+	return sys_maprange(addr, NPAGES(addr, sz), prot & ~PROTFLAGS);
+}
+
+#define NSPAGES(_a, _sz) ((round_spage((_a) + (_sz)) - trunc_spage(_a)) >> SPAGE_SHIFT)
+
+int vmmap_small(vaddr_t addr, size_t sz, vm_prot_t prot)
+{
+	return sys_maprange(trunc_spage(addr), NSPAGES(addr, sz),
+			    prot | MAP_NEW | MAP_SMALL);
+}
+
+int vmunmap_small(vaddr_t addr, size_t sz)
+{
+	return sys_maprange(trunc_spage(addr), NSPAGES(addr, sz), MAP_SMALL);
+}
+
+int vmchprot_small(vaddr_t addr, size_t sz, vm_prot_t prot)
+{
+	return sys_maprange(trunc_spage(addr), NSPAGES(addr, sz),
+			    (prot & ~PROTFLAGS) | MAP_SMALL);
+}
+
+int vmanon(vaddr_t addr, size_t sz, vm_prot_t prot)
+{
+	return sys_mapanon(addr, NPAGES(addr, sz), prot & ~PROTFLAGS);
+}
+
+int vmage(vaddr_t addr, size_t sz, uint8_t *ages)
+{
+	return sys_pgage(addr, NPAGES(addr, sz), ages);
+}
+
+int vmswap(vaddr_t addr)
+{
+	return sys_pgswap(addr);
+}
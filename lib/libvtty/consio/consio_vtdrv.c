@@ -1,6 +1,9 @@
 #include <sys/cdefs.h>
+#include <stdlib.h>
+#include <string.h>
 #include <mrg.h>
 #include <mrg/consio.h>
+#include <sys/param.h> /* MIN,MAX */
 #include "vtdrv.h"
 #include "window.h"
 
@@ -12,6 +15,91 @@ int keybevt = -1;
 int keybon = 1;
 int clistevt = -1;
 
+/*
+ * Cell buffer mode. The screen contents live in 'cells', exported to
+ * the console. Output only updates the buffer and the damaged
+ * rectangle, which is sent to the console on vtdrv_flush().
+ */
+static uint32_t *cells = NULL;
+static short ncols, nlines;
+static short cellx, celly;
+static short posx = -1, posy = -1;
+static short dmgx0, dmgy0, dmgx1 = -1, dmgy1 = -1;
+
+static void cell_damage(short x0, short y0, short x1, short y1)
+{
+	if (dmgx1 < 0) {
+		dmgx0 = x0;
+		dmgy0 = y0;
+		dmgx1 = x1;
+		dmgy1 = y1;
+		return;
+	}
+	dmgx0 = MIN(dmgx0, x0);
+	dmgy0 = MIN(dmgy0, y0);
+	dmgx1 = MAX(dmgx1, x1);
+	dmgy1 = MAX(dmgy1, y1);
+}
+
+static void cellbuf_init(void)
+{
+	int ret;
+	size_t sz;
+	iova_t iova;
+
+	ncols = vtdrv_columns();
+	nlines = vtdrv_lines();
+	if (ncols <= 0 || nlines <= 0)
+		return;
+
+	sz = ncols * nlines * sizeof(uint32_t);
+	cells = malloc(sz);
+	if (cells == NULL)
+		return;
+	memset(cells, 0, sz);
+
+	ret = dexport(cons, cells, sz, &iova);
+	if (ret != 0)
+		goto fail;
+
+	ret = dout(cons, IOPORT_QWORD(CONSIO_CELLBUF), iova);
+	if (ret != 0) {
+		dunexport(cons, cells);
+		goto fail;
+	}
+
+	cellx = celly = 0;
+	posx = posy = -1;
+	dmgx1 = dmgy1 = -1;
+	return;
+
+ fail:
+	/* Fall back to character mode. */
+	free(cells);
+	cells = NULL;
+}
+
+static void cell_scroll(int up)
+{
+	int i;
+	uint32_t *dst, *src, *clr;
+	size_t len = (nlines - 1) * ncols * sizeof(uint32_t);
+
+	if (up) {
+		dst = cells;
+		src = cells + ncols;
+		clr = cells + (nlines - 1) * ncols;
+	} else {
+		dst = cells + ncols;
+		src = cells;
+		clr = cells;
+	}
+	memmove(dst, src, len);
+	for (i = 0; i < ncols; i++)
+		clr[i] = CONSIO_CELL(' ', cur_attr, cur_colattr);
+	cell_damage(0, 0, ncols - 1, nlines - 1);
+}
+
 static void __redraw(void *arg __unused)
 {
 	vtdrv_goto(0,0);
@@ -72,6 +160,51 @@ void printchar(int c)
 #endif
 
 void _clist_add(int c);
+
+/*
+ * Keyboard ring mode. All keys delivered by the console are consumed
+ * at every wakeup.
+ */
+static struct consio_kbring *kbring = NULL;
+
+static void kbring_init(void)
+{
+	int ret;
+	iova_t iova;
+
+	kbring = malloc(sizeof(*kbring));
+	if (kbring == NULL)
+		return;
+	memset(kbring, 0, sizeof(*kbring));
+
+	ret = dexport(cons, kbring, sizeof(*kbring), &iova);
+	if (ret != 0)
+		goto fail;
+
+	ret = dout(cons, IOPORT_QWORD(CONSIO_KBRING), iova);
+	if (ret != 0) {
+		dunexport(cons, kbring);
+		goto fail;
+	}
+	return;
+
+ fail:
+	/* Fall back to KBDATA mode. */
+	free(kbring);
+	kbring = NULL;
+}
+
+static void kbring_drain(void)
+{
+	uint32_t prod = kbring->prod;
+
+	while (kbring->cons != prod) {
+		_clist_add(kbring->keys[kbring->cons % CONSIO_KBRING_SIZE]);
+		kbring->cons++;
+	}
+	evtset(clistevt);
+}
+
 static void __lwt_vttykbd(void *a)
 {
 	uint64_t val;
@@ -81,9 +214,13 @@ static void __lwt_vttykbd(void *a)
 		dout(cons, IOPORT_BYTE(CONSIO_DEVSTS),
 		     CONSIO_DEVSTS_KBDVAL);
 		evtwait(keybevt);
-		din(cons, IOPORT_WORD(CONSIO_KBDATA), &val);
-		evtset(clistevt);
-		_clist_add((int)val & 0xffff);
+		if (kbring != NULL) {
+			kbring_drain();
+		} else {
+			din(cons, IOPORT_WORD(CONSIO_KBDATA), &val);
+			evtset(clistevt);
+			_clist_add((int)val & 0xffff);
+		}
 		evtclear(keybevt);
 	}
 }
@@ -109,6 +246,9 @@ int vtdrv_init(void)
 	evtast(drawevt, __redraw, NULL);
 	dmapirq(cons, CONSIO_IRQ_REDRAW, drawevt);
 
+	cellbuf_init();
+	kbring_init();
+
 	clistevt = evtalloc();
 	kblwt = lwt_create(__lwt_vttykbd, NULL, 65536);
 	preempt_disable();
@@ -141,8 +281,20 @@ short vtdrv_columns(void)
 
 void  vtdrv_exit(void)
 {
+	if (cells != NULL)
+		dunexport(cons, cells);
+	if (kbring != NULL)
+		dunexport(cons, kbring);
 	dclose(cons);
 	cons = NULL;
+	if (cells != NULL) {
+		free(cells);
+		cells = NULL;
+	}
+	if (kbring != NULL) {
+		free(kbring);
+		kbring = NULL;
+	}
 }
 
 void  vtdrv_set_attr(char attr)
@@ -169,17 +321,31 @@ void  vtdrv_goto(short x, short y)
 {
 	uint64_t val = ((uint32_t)y  << 16) + x;
 
+	if (cells != NULL) {
+		/* Cursor is updated on flush. */
+		cellx = x;
+		celly = y;
+		return;
+	}
 	dout(cons, IOPORT_DWORD(CONSIO_OUTPOS), val);
 }
 
 void  vtdrv_scroll(void)
 {
+	if (cells != NULL) {
+		cell_scroll(1);
+		return;
+	}
 
 	CONS_OP(SCROLL);
 }
 
 void  vtdrv_upscroll(void)
 {
+	if (cells != NULL) {
+		cell_scroll(0);
+		return;
+	}
 
 	CONS_OP(UPSCRL);
 }
@@ -188,10 +354,46 @@ void  vtdrv_putc(char c)
 {
 	uint64_t val = 0;
 
+	if (cells != NULL) {
+		if (cellx < ncols && celly < nlines) {
+			cells[celly * ncols + cellx] =
+				CONSIO_CELL(c, cur_attr, cur_colattr);
+			cell_damage(cellx, celly, cellx, celly);
+		}
+		/* Same wrapping as the console. */
+		if (++cellx >= ncols) {
+			cellx = 0;
+			if (celly < nlines - 1)
+				celly++;
+		}
+		return;
+	}
+
 	val = ((uint32_t)cur_colattr << 16) + (cur_attr << 8) + c;
 	dout(cons, IOPORT_DWORD(CONSIO_OUTDATA), val);
 }
 
+void  vtdrv_flush(void)
+{
+	uint64_t val;
+
+	if (cells == NULL)
+		return;
+
+	if (dmgx1 >= 0) {
+		val = CONSIO_FLUSH_RECT(dmgx0, dmgy0, dmgx1, dmgy1);
+		dout(cons, IOPORT_QWORD(CONSIO_FLUSH), val);
+		dmgx1 = dmgy1 = -1;
+	}
+
+	if (cellx != posx || celly != posy) {
+		val = ((uint32_t)celly  << 16) + cellx;
+		dout(cons, IOPORT_DWORD(CONSIO_OUTPOS), val);
+		posx = cellx;
+		posy = celly;
+	}
+}
+
 void  vtdrv_bell(void)
 {
 
@@ -17,5 +17,6 @@ void vtdrv_scroll(void);
 void vtdrv_upscroll(void);
 void vtdrv_putc(char c);
 void vtdrv_bell(void);
+void vtdrv_flush(void);
 
 #endif /* !__VTDRV_H__ */
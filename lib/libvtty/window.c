@@ -40,8 +40,6 @@
 #include "config.h"
 #endif
 
-#define BUFFERSIZE 2048
-
 #define swap(x, y) { int d = (x); (x) = (y); (y) = d; }
 
 /* Special characters */
@@ -59,17 +57,32 @@ static char S_LL;
 static char S_VER;
 static char S_LR;
 
-static char _bufstart[BUFFERSIZE];
-static char *_bufpos = _bufstart;
-static char *_buffend;
 static ELM *gmap;
 
+/*
+ * Screen shadows. 'vmap' is what should be on the screen, 'smap' is
+ * what the driver has actually been sent. Writes only update 'vmap'
+ * and the damaged span of the line; vtty_wflush() sends the
+ * difference between the two.
+ */
+static ELM *vmap;
+static ELM *smap;
+static short *dmgx1;
+static short *dmgx2;
+#define A_INVALID ((char)-1)	/* Unknown screen contents. */
+#define ELMEQ(_a, _b) ((_a)->value == (_b)->value			\
+		       && (_a)->attr == (_b)->attr			\
+		       && (_a)->color == (_b)->color)
+
 static char curattr = -1;
 static char curcolor = -1;
-static int curx = -1;
+static int curx = -1;		/* Cursor position requested */
 static int cury = -1;
+static int hwx = -1;		/* Cursor position on screen */
+static int hwy = -1;
 static int _intern = 0;
 static int _curstype = CNORMAL;
+static int _hwcurstype = -1;
 static int _has_am = 0;
 static ELM oldc;
 static int sflag = 0;
@@ -122,25 +135,6 @@ int debug(char *s, ...)
 
 /* ===== Low level routines ===== */
 
-/*
- * Flush the screen buffer
- */
-void vtty_wflush(void)
-{
-  int todo, done;
-
-  todo = _bufpos - _bufstart;
-  _bufpos = _bufstart;
-
-  while (todo > 0) {
-    vtdrv_putc(*_bufpos);
-    done++;
-    todo -= done;
-    _bufpos += done;
-  }
-  _bufpos = _bufstart;
-}
-
 /*
  * Turn off all attributes
  */
@@ -192,14 +186,14 @@ static void _setattr(char attr, char color)
 }
 
 /*
- * Goto (x, y) in stdwin
+ * Move the screen cursor to (x, y)
  */
-static void _gotoxy(int x, int y)
+static void _hwgotoxy(int x, int y)
 {
   int oldattr = -1;
 
   /* Sanity check. */
-  if (x >= COLS || y >= LINES || (x == curx && y == cury)) {
+  if (x < 0 || y < 0 || x >= COLS || y >= LINES || (x == hwx && y == hwy)) {
 #  if 0
     if (x >= COLS || y >= LINES)
       fprintf(stderr, "OOPS: (x, y) == (%d, %d)\n",
@@ -214,17 +208,94 @@ static void _gotoxy(int x, int y)
   }
 
   vtdrv_goto(x, y);
-  curx = x;
-  cury = y;
+  hwx = x;
+  hwy = y;
   if (oldattr != -1)
     _setattr(oldattr, curcolor);
 }
 
+/*
+ * Goto (x, y) in stdwin. The cursor is moved on flush.
+ */
+static void _gotoxy(int x, int y)
+{
+  /* Sanity check. */
+  if (x >= COLS || y >= LINES)
+    return;
+
+  curx = x;
+  cury = y;
+}
+
+/*
+ * Mark (x, y) as changed in the screen shadow.
+ */
+static void _damage(int x, int y)
+{
+  if (x < dmgx1[y])
+    dmgx1[y] = x;
+  if (x > dmgx2[y])
+    dmgx2[y] = x;
+}
+
+/*
+ * Follow a full screen scroll in the screen shadows. The line that
+ * scrolls in is blank in 'vmap', and unknown on the screen.
+ */
+static void _scrollshadow(int dir, char attr, char color)
+{
+  int x, src, dst, new;
+  size_t len = (LINES - 1) * COLS * sizeof(ELM);
+
+  if (dir == S_UP) {
+    src = 1;
+    dst = 0;
+    new = LINES - 1;
+  } else {
+    src = 0;
+    dst = 1;
+    new = 0;
+  }
+  memmove(vmap + dst * COLS, vmap + src * COLS, len);
+  memmove(smap + dst * COLS, smap + src * COLS, len);
+  memmove(dmgx1 + dst, dmgx1 + src, (LINES - 1) * sizeof(*dmgx1));
+  memmove(dmgx2 + dst, dmgx2 + src, (LINES - 1) * sizeof(*dmgx2));
+
+  for (x = 0; x < COLS; x++) {
+    vmap[new * COLS + x].value = ' ';
+    vmap[new * COLS + x].attr = attr;
+    vmap[new * COLS + x].color = color;
+    smap[new * COLS + x].attr = A_INVALID;
+  }
+  dmgx1[new] = 0;
+  dmgx2[new] = COLS - 1;
+}
+
+/*
+ * Forget what is on the screen: next flush redraws everything.
+ */
+static void _invalidate(void)
+{
+  int i;
+
+  for (i = 0; i < LINES * COLS; i++)
+    smap[i].attr = A_INVALID;
+  for (i = 0; i < LINES; i++) {
+    dmgx1[i] = 0;
+    dmgx2[i] = COLS - 1;
+  }
+  hwx = hwy = -1;
+  _hwcurstype = -1;
+  curattr = -1;
+  curcolor = -1;
+}
+
 /*
  * Write a character in stdwin at x, y with attr & color
  * 'doit' can be  -1: only write to screen, not to memory
  *                 0: only write to memory, not to screen
  *                 1: write to both screen and memory
+ * Screen writes are deferred until the next vtty_wflush().
  */
 static void _write(char c, int doit, int x, int y, char attr, char color)
 {
@@ -233,15 +304,13 @@ static void _write(char c, int doit, int x, int y, char attr, char color)
   if (x < COLS && y < LINES)
   {
     if (doit != 0) {
-      static int x0 = -1, y0 = -1, c0 = 0;
-      static char attr0, color0;
-      if (x!=x0+1 || y!=y0 || attr!=attr0 || color!=color0 || !(c0&128)) {
-        _gotoxy(x, y);
-        _setattr(attr, color);
+      e = &vmap[x + y * COLS];
+      if (e->value != c || e->attr != attr || e->color != color) {
+        e->value = c;
+        e->attr = attr;
+        e->color = color;
+        _damage(x, y);
       }
-      x0 = x; y0 = y; attr0 = attr; color0 = color; c0 = c;
-      vtdrv_putc(c);
-      curx++;
     }
     if (doit >= 0) {
       e = &gmap[x + y * COLS];
@@ -253,16 +322,58 @@ static void _write(char c, int doit, int x, int y, char attr, char color)
 }
 
 /*
- * Set cursor type.
+ * Set cursor type. The cursor is updated on flush.
  */
 static void _cursor(int type)
 {
   _curstype = type;
+}
+
+/*
+ * Flush the screen buffer
+ *
+ * Only the damaged part of each line is compared with the screen
+ * shadow, and only the cells that differ are sent. Runs of adjacent
+ * cells need a single goto, and attributes are only set when they
+ * change along the run.
+ */
+void vtty_wflush(void)
+{
+  int x, y;
+  ELM *v, *e;
 
-  if (type == CNORMAL)
-    vtdrv_cursor(1);
-  if (type == CNONE)
-    vtdrv_cursor(0);
+  if (vmap == NULL)
+    return;
+
+  for (y = 0; y < LINES; y++) {
+    if (dmgx1[y] > dmgx2[y])
+      continue;
+
+    v = vmap + y * COLS;
+    e = smap + y * COLS;
+    for (x = dmgx1[y]; x <= dmgx2[y]; x++) {
+      if (ELMEQ(v + x, e + x))
+        continue;
+      if (x != hwx || y != hwy)
+        _hwgotoxy(x, y);
+      _setattr(v[x].attr, v[x].color);
+      vtdrv_putc(v[x].value);
+      e[x] = v[x];
+      hwx++;
+    }
+    dmgx1[y] = COLS;
+    dmgx2[y] = -1;
+  }
+
+  _hwgotoxy(curx, cury);
+  if (_curstype != _hwcurstype) {
+    if (_curstype == CNORMAL)
+      vtdrv_cursor(1);
+    if (_curstype == CNONE)
+      vtdrv_cursor(0);
+    _hwcurstype = _curstype;
+  }
+  vtdrv_flush();
 }
 
 
@@ -509,10 +620,10 @@ void vtty_wleave(void)
   ocursor = _curstype;
 
   _gotoxy(0, LINES - 1);
-  _setattr(XA_NORMAL, COLATTR(WHITE, BLACK));
   _cursor(CNORMAL);
-  vtdrv_exit();
   vtty_wflush();
+  _setattr(XA_NORMAL, COLATTR(WHITE, BLACK));
+  vtdrv_exit();
 }
 
 int vtty_wreturn(void)
@@ -527,8 +638,7 @@ int vtty_wreturn(void)
   curwin = NULL;
 #endif
 
-  curattr = -1;
-  curcolor = -1;
+  _invalidate();
 
   _gotoxy(0, 0);
   _cursor(ocursor);
@@ -554,8 +664,8 @@ void vtty_wrestore(void)
   oldy = cury;
   ocursor = _curstype;
   
-  curattr = -1;
-  curcolor = -1;
+  /* Screen was redrawn by somebody else. */
+  _invalidate();
   _gotoxy(0, 0);
 
   _cursor(CNONE);
@@ -637,7 +747,7 @@ static int _wclreol(WIN *w)
  */
 void vtty_wscroll(WIN *win, int dir)
 {
-  ELM *e, *f;
+  ELM *e;
   char *src, *dst;
   int x, y;
   int doit = 1;
@@ -651,6 +761,8 @@ void vtty_wscroll(WIN *win, int dir)
   /*
    * If the window *is* the physical screen, we can scroll very simple.
    * This improves performance on slow screens (eg ATARI ST) dramatically.
+   * The screen shadows are moved along, so that pending damage is
+   * still sent to the right place on the next flush.
    */
   if (win->direct && LINES == (win->sy2 - win->sy1 + 1)) {
     doit = 0;
@@ -663,6 +775,7 @@ void vtty_wscroll(WIN *win, int dir)
       _gotoxy(0, 0);
       vtdrv_upscroll();
     }
+    _scrollshadow(dir, win->attr, win->color);
   }
 
   /* If a terminal has automatic margins, we can't write
@@ -1124,9 +1237,6 @@ void vtty_winclr(WIN *w)
 {
   int y;
   int olddir = w->direct;
-  ELM *e, *f;
-  int i;
-  int m;
 
   _setattr(w->attr, w->color);
   w->curx = 0;
@@ -1557,7 +1667,24 @@ int vtty_init(int fg, int bg, int attr)
     fprintf(stderr, "Not enough memory\n");
     return -1;
   };
-  _buffend = _bufstart + BUFFERSIZE;
+
+  /* Memory for the screen shadows */
+  vmap = malloc(sizeof(ELM) * LINES * COLS);
+  smap = malloc(sizeof(ELM) * LINES * COLS);
+  dmgx1 = malloc(sizeof(short) * LINES);
+  dmgx2 = malloc(sizeof(short) * LINES);
+  if (vmap == NULL || smap == NULL || dmgx1 == NULL || dmgx2 == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    free(vmap);
+    free(smap);
+    free(dmgx1);
+    free(dmgx2);
+    free(gmap);
+    vmap = smap = gmap = NULL;
+    return -1;
+  }
+  memset(vmap, A_INVALID, sizeof(ELM) * LINES * COLS);
+  _invalidate();
 
   /* Initialize stdwin */
   stdwin = &_stdwin;
@@ -1593,7 +1720,12 @@ void vtty_end(void)
   vtty_wflush();
   vtdrv_exit();
   free(gmap);
+  free(vmap);
+  free(smap);
+  free(dmgx1);
+  free(dmgx2);
   gmap = NULL;
+  vmap = smap = NULL;
   stdwin = NULL;
   w_init = 0;
 }
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2016, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <machine/vmparam.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <mrg.h>
+
+/*
+ * Hypervisor memory allocator.
+ *
+ * Small allocations come from slabs of RM_SLABSIZE bytes, carved in
+ * blocks of a single size class. Blocks are carved lazily. A block
+ * of size S at offset i * S in an aligned slab is aligned to the
+ * largest power of two dividing S: a request is served by the
+ * smallest class that is large enough and aligned enough.
+ *
+ * Memory is faulted in a whole page, 2MB, at a time. So that every
+ * class doesn't pin a page of its own, slabs are cut out of
+ * page-sized chunks shared by all classes.
+ *
+ * Larger allocations come from malloc(), with the pointer it returned
+ * stored right before the aligned block. Memory is not zeroed: the
+ * rump kernel zeroes what it needs (kmem_zalloc and friends).
+ */
+
+#define RM_CHUNKSIZE PAGE_SIZE
+#define RM_SLABSIZE (64 * 1024)
+#define RM_SLABSPERCHUNK (RM_CHUNKSIZE / RM_SLABSIZE)
+#define RM_MAXSMALL (16 * 1024)
+#define RM_NHASH 256
+
+struct rmchunk {
+	vaddr_t base;
+	unsigned nused;
+	unsigned ncarved;
+	void *freelist;		/* Free slabs. */
+	LIST_ENTRY(rmchunk) list;
+};
+
+struct rmslab {
+	vaddr_t base;
+	struct rmchunk *chunk;
+	int cls;
+	unsigned nfree;
+	unsigned ncarved;
+	void *freelist;
+	LIST_ENTRY(rmslab) hash;
+	LIST_ENTRY(rmslab) list;
+};
+
+struct rmclass {
+	size_t size;
+	unsigned nblks;		/* Blocks per slab. */
+	unsigned nempty;	/* Empty slabs kept. */
+	LIST_HEAD(, rmslab) partial;
+};
+
+/* Powers of two and the midpoints between them. */
+static struct rmclass rm_classes[] = {
+	{ 16 }, { 32 }, { 48 }, { 64 }, { 96 }, { 128 }, { 192 },
+	{ 256 }, { 384 }, { 512 }, { 768 }, { 1024 }, { 1536 }, { 2048 },
+	{ 3072 }, { 4096 }, { 6144 }, { 8192 }, { 12288 }, { 16384 },
+};
+
+#define RM_NCLASSES (sizeof(rm_classes) / sizeof(rm_classes[0]))
+
+static LIST_HEAD(, rmslab) rm_hash[RM_NHASH];
+
+/* Chunks with free slabs. */
+static LIST_HEAD(, rmchunk) rm_chunks;
+static unsigned rm_nemptychunks;
+
+#define rm_slabhash(_va) (rm_hash + (((_va) / RM_SLABSIZE) % RM_NHASH))
+
+static struct rmslab *
+rm_lookup(vaddr_t va)
+{
+	struct rmslab *s;
+
+	va &= ~(vaddr_t)(RM_SLABSIZE - 1);
+	LIST_FOREACH(s, rm_slabhash(va), hash)
+		if (s->base == va)
+			return s;
+	return NULL;
+}
+
+static int
+rm_class(size_t sz, size_t align)
+{
+	unsigned i;
+	size_t csz;
+
+	for (i = 0; i < RM_NCLASSES; i++) {
+		csz = rm_classes[i].size;
+		if (csz >= sz && (csz & -csz) >= align)
+			return i;
+	}
+	return -1;
+}
+
+static vaddr_t
+rm_chunkalloc(struct rmchunk **chp)
+{
+	vaddr_t va;
+	struct rmchunk *ch;
+
+	ch = LIST_FIRST(&rm_chunks);
+	if (ch == NULL) {
+		ch = malloc(sizeof(*ch));
+		if (ch == NULL)
+			return 0;
+		ch->base = vmap_alloc(RM_CHUNKSIZE, VFNT_RWDATA);
+		if (ch->base == 0) {
+			free(ch);
+			return 0;
+		}
+		ch->nused = 0;
+		ch->ncarved = 0;
+		ch->freelist = NULL;
+		LIST_INSERT_HEAD(&rm_chunks, ch, list);
+	} else if (ch->nused == 0) {
+		rm_nemptychunks--;
+	}
+
+	if (ch->freelist != NULL) {
+		va = (vaddr_t)ch->freelist;
+		ch->freelist = *(void **)ch->freelist;
+	} else {
+		va = ch->base + ch->ncarved++ * RM_SLABSIZE;
+	}
+	if (++ch->nused == RM_SLABSPERCHUNK)
+		LIST_REMOVE(ch, list);
+	*chp = ch;
+	return va;
+}
+
+static void
+rm_chunkfree(struct rmchunk *ch, vaddr_t va)
+{
+
+	*(void **)va = ch->freelist;
+	ch->freelist = (void *)va;
+	if (ch->nused-- == RM_SLABSPERCHUNK)
+		LIST_INSERT_HEAD(&rm_chunks, ch, list);
+	if (ch->nused != 0)
+		return;
+
+	/* Keep one empty chunk, as for slabs. */
+	if (rm_nemptychunks == 0) {
+		rm_nemptychunks++;
+		return;
+	}
+	LIST_REMOVE(ch, list);
+	vmap_free(ch->base, RM_CHUNKSIZE);
+	free(ch);
+}
+
+static struct rmslab *
+rm_newslab(int cls)
+{
+	struct rmslab *s;
+
+	s = malloc(sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->base = rm_chunkalloc(&s->chunk);
+	if (s->base == 0) {
+		free(s);
+		return NULL;
+	}
+	s->cls = cls;
+	s->freelist = NULL;
+	s->ncarved = 0;
+	s->nfree = rm_classes[cls].nblks;
+	LIST_INSERT_HEAD(rm_slabhash(s->base), s, hash);
+	return s;
+}
+
+static void
+rm_freeslab(struct rmslab *s)
+{
+
+	LIST_REMOVE(s, hash);
+	rm_chunkfree(s->chunk, s->base);
+	free(s);
+}
+
+static int
+rm_large(size_t sz, size_t align, void **memp)
+{
+	uintptr_t raw, p;
+
+	if (sz > SIZE_MAX - sizeof(void *) - align)
+		return -ENOMEM;
+	raw = (uintptr_t)malloc(sz + sizeof(void *) + align - 1);
+	if (raw == 0)
+		return -ENOMEM;
+	p = (raw + sizeof(void *) + align - 1) & ~(uintptr_t)(align - 1);
+	((void **)p)[-1] = (void *)raw;
+	*memp = (void *)p;
+	return 0;
+}
+
+int
+rumpmrg_malloc(size_t sz, size_t align, void **memp)
+{
+	int cls;
+	void *blk;
+	struct rmslab *s;
+	struct rmclass *c;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (align & (align - 1) || align > PAGE_SIZE)
+		return -EINVAL;
+	if (sz == 0)
+		sz = 1;
+
+	cls = sz <= RM_MAXSMALL ? rm_class(sz, align) : -1;
+	if (cls < 0)
+		return rm_large(sz, align, memp);
+
+	c = rm_classes + cls;
+	if (c->nblks == 0)
+		c->nblks = RM_SLABSIZE / c->size;
+	s = LIST_FIRST(&c->partial);
+	if (s == NULL) {
+		s = rm_newslab(cls);
+		if (s == NULL)
+			return -ENOMEM;
+		LIST_INSERT_HEAD(&c->partial, s, list);
+	} else if (s->nfree == c->nblks) {
+		c->nempty--;
+	}
+
+	if (s->freelist != NULL) {
+		blk = s->freelist;
+		s->freelist = *(void **)blk;
+	} else {
+		blk = (void *)(s->base + s->ncarved++ * c->size);
+	}
+	if (--s->nfree == 0)
+		LIST_REMOVE(s, list);
+
+	*memp = blk;
+	return 0;
+}
+
+void
+rumpmrg_free(void *ptr)
+{
+	struct rmslab *s;
+	struct rmclass *c;
+
+	if (ptr == NULL)
+		return;
+	s = rm_lookup((vaddr_t)ptr);
+	if (s == NULL) {
+		free(((void **)ptr)[-1]);
+		return;
+	}
+
+	c = rm_classes + s->cls;
+	*(void **)ptr = s->freelist;
+	s->freelist = ptr;
+	if (s->nfree++ == 0)
+		LIST_INSERT_HEAD(&c->partial, s, list);
+	if (s->nfree < c->nblks)
+		return;
+
+	/* Keep one empty slab, to avoid thrashing at the boundary. */
+	if (c->nempty == 0) {
+		c->nempty++;
+		return;
+	}
+	LIST_REMOVE(s, list);
+	rm_freeslab(s);
+}
@@ -125,6 +125,10 @@ struct rumpuser_hyperup rumpuser__hyp;
 int rumpuser__random_init(void);
 int  rumpuser__errtrans(int);
 
+int rumpmrg_malloc(size_t sz, size_t align, void **memp);
+void rumpmrg_free(void *ptr);
+void rumpmrg_lockstats(unsigned max);
+
 static void init_sched(void);
 static void join_thread(struct thread *);
 static void switch_threads(struct thread *prev, struct thread *next);
@@ -338,12 +342,26 @@ rumpuser_init(int version, const struct rumpuser_hyperup *hyp)
 	return 0;
 }
 
+#define NSEC_PER_SEC 1000000000ULL
+
 int
 rumpuser_clock_gettime(int enum_rumpclock, int64_t *sec, long *nsec)
 {
-	*sec = 42;
-	*nsec = 42;
+	enum rumpclock rclk = enum_rumpclock;
+	uint64_t ns;
+
 	RUMP_TRACE_DETAIL();
+	ns = timer_nsecs();
+	switch (rclk) {
+	case RUMPUSER_CLOCK_RELWALL:
+		*sec = timer_boottime() + ns / NSEC_PER_SEC;
+		break;
+	case RUMPUSER_CLOCK_ABSMONO:
+	default:
+		*sec = ns / NSEC_PER_SEC;
+		break;
+	}
+	*nsec = ns % NSEC_PER_SEC;
 	ET(0);
 }
 
@@ -351,18 +369,18 @@ int
 rumpuser_clock_sleep(int enum_rumpclock, int64_t sec, long nsec)
 {
 	enum rumpclock rclk = enum_rumpclock;
-	uint64_t msec;
+	uint64_t ns;
 	int nlocks;
+
 	RUMP_TRACE_DETAIL();
+	ns = sec * NSEC_PER_SEC + nsec;
 	rumpkern_unsched(&nlocks, NULL);
 	switch (rclk) {
 	case RUMPUSER_CLOCK_RELWALL:
-		msec = sec * 1000 + nsec / (1000*1000UL);
-		lwt_yield();
+		lwt_nsleep(ns);
 		break;
 	case RUMPUSER_CLOCK_ABSMONO:
-		msec = sec * 1000 + nsec / (1000*1000UL);
-		lwt_yield();
+		while (lwt_sleepuntil(ns) == 0);
 		break;
 	}
 	rumpkern_sched(nlocks, NULL);
@@ -370,15 +388,46 @@ rumpuser_clock_sleep(int enum_rumpclock, int64_t sec, long nsec)
 	return 0;
 }
 
+/*
+ * Virtual CPUs.
+ *
+ * All rump CPUs are multiplexed on the LWTs of the process, and only
+ * the thread holding a CPU runs in the rump kernel. Threads running
+ * on different CPUs interleave wherever they block in a hypercall,
+ * so locks must not assume their owner is not running.
+ *
+ * RUMP_NCPU > 1 therefore gives no parallelism: LWTs are cooperative
+ * and the process runs on one physical CPU at a time. It only makes
+ * the rump kernel take its multiprocessor paths, which the locks
+ * below must handle correctly.
+ */
+#define RUMPMRG_MAXCPUS 32
+
+static int
+getncpu(void)
+{
+	char *env, *end;
+	long n;
+
+	env = getenv("RUMP_NCPU");
+	if (env == NULL)
+		return 1;
+	n = strtol(env, &end, 10);
+	if (*env == '\0' || *end != '\0' || n < 1) {
+		printk("invalid RUMP_NCPU \"%s\", using 1\n", env);
+		return 1;
+	}
+	return n > RUMPMRG_MAXCPUS ? RUMPMRG_MAXCPUS : n;
+}
+
 int
 rumpuser_getparam(const char *name, void *buf, size_t blen)
 {
 	int rv;
-	const char *ncpu = "1";
 
 	RUMP_TRACE_DETAIL();
 	if (strcmp(name, RUMPUSER_PARAM_NCPU) == 0) {
-		strncpy(buf, ncpu, blen);
+		snprintf(buf, blen, "%d", getncpu());
 		rv = 0;
 	} else if (strcmp(name, RUMPUSER_PARAM_HOSTNAME) == 0) {
 		char tmp[MAXHOSTNAMELEN];
@@ -408,6 +457,8 @@ __dead void
 rumpuser_exit(int rv)
 {
 	RUMP_TRACE_DETAIL();
+	if (getenv("RUMP_LOCKSTATS") != NULL)
+		rumpmrg_lockstats(32);
 	sys_wait(); /* XXX: */
 	if (rv == RUMPUSER_PANIC)
 		abort();
@@ -453,14 +504,22 @@ struct waiter {
 	int onlist;
 };
 
+/* Wait to be woken up, or until the monotonic time 'deadline' if not 0. */
 static int
-wait(struct waithead *wh, uint64_t msec)
+wait(struct waithead *wh, uint64_t deadline)
 {
 	struct waiter w;
 	w.who = get_current();
 	TAILQ_INSERT_TAIL(wh, &w, entries);
 	w.onlist = 1;
-	lwt_sleep();
+	if (deadline == 0)
+		lwt_sleep();
+	else
+		lwt_sleepuntil(deadline);
+	if (w.onlist) {
+		TAILQ_REMOVE(wh, &w, entries);
+		return ETIMEDOUT;
+	}
 	return 0;
 }
 
@@ -531,7 +590,114 @@ rumpuser_thread_join(void *p)
 	return 0;
 }
 
+/*
+ * Locks.
+ *
+ * A thread finding a lock held first yields a few times if the owner
+ * is runnable: it is likely to release the lock soon, and yielding
+ * is cheaper than giving up the rump CPU. Otherwise it sleeps.
+ * Locks are handed off: the thread releasing a lock makes the first
+ * waiter its owner before waking it, so it never has to retry.
+ *
+ * Every lock counts its contention. rumpmrg_lockstats() prints the
+ * most contended ones, and so does rumpuser_exit() if RUMP_LOCKSTATS
+ * is set in the environment.
+ */
+
+#define LOCK_SPINS 8
+
+struct lockstats {
+	uint64_t acquires;
+	uint64_t contended;
+	uint64_t spins;
+	uint64_t sleeps;
+	uint64_t handoffs;
+};
+
+struct lockhdr {
+	const char *type;
+	struct lockstats st;
+	TAILQ_ENTRY(lockhdr) list;
+};
+
+static TAILQ_HEAD(, lockhdr) locks = TAILQ_HEAD_INITIALIZER(locks);
+
+static void
+lock_init(struct lockhdr *lk, const char *type)
+{
+
+	lk->type = type;
+	memset(&lk->st, 0, sizeof(lk->st));
+	TAILQ_INSERT_TAIL(&locks, lk, list);
+}
+
+static void
+lock_destroy(struct lockhdr *lk)
+{
+
+	TAILQ_REMOVE(&locks, lk, list);
+}
+
+/* The owner is waiting to run, not blocked. */
+static inline int
+lock_ownerrunnable(struct thread *o)
+{
+
+	return o != NULL && (o->lwt->flags & LWTF_ACTIVE);
+}
+
+/* Make the first waiter runnable, owning the lock. */
+static struct thread *
+handoff_one(struct lockhdr *lk, struct waithead *wh)
+{
+	struct waiter *w;
+
+	if ((w = TAILQ_FIRST(wh)) == NULL)
+		return NULL;
+	TAILQ_REMOVE(wh, w, entries);
+	w->onlist = 0;
+	lk->st.acquires++;
+	lk->st.handoffs++;
+	lwt_wake(w->who->lwt);
+	return w->who;
+}
+
+void
+rumpmrg_lockstats(unsigned max)
+{
+	unsigned i, n = 0;
+	struct lockhdr *lk, *top[32];
+
+	if (max > 32)
+		max = 32;
+	TAILQ_FOREACH(lk, &locks, list) {
+		if (lk->st.contended == 0)
+			continue;
+		for (i = n; i > 0; i--) {
+			if (top[i - 1]->st.contended >= lk->st.contended)
+				break;
+			if (i < max)
+				top[i] = top[i - 1];
+		}
+		if (i < max) {
+			top[i] = lk;
+			if (n < max)
+				n++;
+		}
+	}
+
+	printk("%u contended locks:\n", n);
+	printk("  %-6s %-10s %12s %12s %12s %12s %12s\n", "type", "lock",
+	       "acquires", "contended", "spins", "sleeps", "handoffs");
+	for (i = 0; i < n; i++)
+		printk("  %-6s %-10p %12llu %12llu %12llu %12llu %12llu\n",
+		       top[i]->type, top[i], top[i]->st.acquires,
+		       top[i]->st.contended, top[i]->st.spins,
+		       top[i]->st.sleeps, top[i]->st.handoffs);
+}
+
 struct rumpuser_mtx {
+	struct lockhdr lk;
 	struct waithead waiters;
 	int v;
 	int flags;
@@ -548,34 +714,62 @@ rumpuser_mutex_init(struct rumpuser_mtx **mtxp, int flags)
 	memset(mtx, 0, sizeof(*mtx));
 	mtx->flags = flags;
 	TAILQ_INIT(&mtx->waiters);
+	lock_init(&mtx->lk, "mutex");
 	*mtxp = mtx;
 }
 
+/* Yield while the owner is runnable. */
+static int
+mutex_spin(struct rumpuser_mtx *mtx)
+{
+	int i;
+
+	for (i = 0; i < LOCK_SPINS && lock_ownerrunnable(mtx->o); i++) {
+		mtx->lk.st.spins++;
+		lwt_yield();
+		if (rumpuser_mutex_tryenter(mtx) == 0)
+			return 0;
+	}
+	return EBUSY;
+}
+
 void
 rumpuser_mutex_enter(struct rumpuser_mtx *mtx)
 {
 	int nlocks;
 
 	RUMP_TRACE_DETAIL();
-	if (rumpuser_mutex_tryenter(mtx) != 0) {
-		while (rumpuser_mutex_tryenter(mtx) != 0) {
-			rumpkern_unsched(&nlocks, NULL);
-			wait(&mtx->waiters, 0);
-			rumpkern_sched(nlocks, NULL);
-		}
+	if (rumpuser_mutex_tryenter(mtx) == 0)
+		return;
+	mtx->lk.st.contended++;
+	if (mutex_spin(mtx) == 0)
+		return;
+
+	rumpkern_unsched(&nlocks, NULL);
+	while (rumpuser_mutex_tryenter(mtx) != 0) {
+		mtx->lk.st.sleeps++;
+		if (wait(&mtx->waiters, 0) == 0)
+			break;	/* Handed off. */
 	}
+	rumpkern_sched(nlocks, NULL);
 }
 
 void
 rumpuser_mutex_enter_nowrap(struct rumpuser_mtx *mtx)
 {
-	int rv;
+
 	RUMP_TRACE_DETAIL();
-	rv = rumpuser_mutex_tryenter(mtx);
-	/* one VCPU supported, no preemption => must succeed */
-	if (rv != 0) {
-		printk("no voi ei\n");
-	}
+	if (rumpuser_mutex_tryenter(mtx) == 0)
+		return;
+	mtx->lk.st.contended++;
+	/*
+	 * The owner runs on another CPU and is blocked in a
+	 * hypercall. We can't give up our CPU: let it run.
+	 */
+	do {
+		mtx->lk.st.spins++;
+		lwt_yield();
+	} while (rumpuser_mutex_tryenter(mtx) != 0);
 }
 
 int
@@ -589,6 +783,7 @@ rumpuser_mutex_tryenter(struct rumpuser_mtx *mtx)
 
 	mtx->v++;
 	mtx->o = t;
+	mtx->lk.st.acquires++;
 
 	return 0;
 }
@@ -600,8 +795,9 @@ rumpuser_mutex_exit(struct rumpuser_mtx *mtx)
 	RUMP_TRACE_DETAIL();
 	assert(mtx->v > 0);
 	if (--mtx->v == 0) {
-		mtx->o = NULL;
-		wakeup_one(&mtx->waiters);
+		mtx->o = handoff_one(&mtx->lk, &mtx->waiters);
+		if (mtx->o != NULL)
+			mtx->v = 1;
 	}
 }
 
@@ -611,6 +807,7 @@ rumpuser_mutex_destroy(struct rumpuser_mtx *mtx)
 
 	RUMP_TRACE_DETAIL();
 	assert(TAILQ_EMPTY(&mtx->waiters) && mtx->o == NULL);
+	lock_destroy(&mtx->lk);
 	free(mtx);
 }
 
@@ -623,10 +820,11 @@ rumpuser_mutex_owner(struct rumpuser_mtx *mtx, struct lwp **lp)
 }
 
 struct rumpuser_rw {
+	struct lockhdr lk;
 	struct waithead rwait;
 	struct waithead wwait;
 	int v;
-	struct lwp *o;
+	struct thread *o;
 };
 
 void
@@ -639,16 +837,36 @@ rumpuser_rw_init(struct rumpuser_rw **rwp)
 	memset(rw, 0, sizeof(*rw));
 	TAILQ_INIT(&rw->rwait);
 	TAILQ_INIT(&rw->wwait);
+	lock_init(&rw->lk, "rw");
 
 	*rwp = rw;
 }
 
+/*
+ * Hand off a free lock: to the first writer, or to all the readers
+ * if no writer waits, so readers don't starve out writers.
+ */
+static void
+rw_handoff(struct rumpuser_rw *rw)
+{
+
+	if (rw->o != NULL)
+		return;
+	if (!TAILQ_EMPTY(&rw->wwait)) {
+		if (rw->v == 0)
+			rw->o = handoff_one(&rw->lk, &rw->wwait);
+		return;
+	}
+	while (handoff_one(&rw->lk, &rw->rwait) != NULL)
+		rw->v++;
+}
+
 void
 rumpuser_rw_enter(int enum_rumprwlock, struct rumpuser_rw *rw)
 {
 	enum rumprwlock lk = enum_rumprwlock;
 	struct waithead *w = NULL;
-	int nlocks;
+	int i, nlocks;
 
 	RUMP_TRACE_DETAIL();
 	switch (lk) {
@@ -660,12 +878,23 @@ rumpuser_rw_enter(int enum_rumprwlock, struct rumpuser_rw *rw)
 		break;
 	}
 
-	if (rumpuser_rw_tryenter(enum_rumprwlock, rw) != 0) {
-		rumpkern_unsched(&nlocks, NULL);
-		while (rumpuser_rw_tryenter(enum_rumprwlock, rw) != 0)
-			wait(w, 0);
-		rumpkern_sched(nlocks, NULL);
+	if (rumpuser_rw_tryenter(enum_rumprwlock, rw) == 0)
+		return;
+	rw->lk.st.contended++;
+	for (i = 0; i < LOCK_SPINS && lock_ownerrunnable(rw->o); i++) {
+		rw->lk.st.spins++;
+		lwt_yield();
+		if (rumpuser_rw_tryenter(enum_rumprwlock, rw) == 0)
+			return;
+	}
+
+	rumpkern_unsched(&nlocks, NULL);
+	while (rumpuser_rw_tryenter(enum_rumprwlock, rw) != 0) {
+		rw->lk.st.sleeps++;
+		if (wait(w, 0) == 0)
+			break;	/* Handed off. */
 	}
+	rumpkern_sched(nlocks, NULL);
 }
 
 int
@@ -677,8 +906,9 @@ rumpuser_rw_tryenter(int enum_rumprwlock, struct rumpuser_rw *rw)
 	RUMP_TRACE_DETAIL();
 	switch (lk) {
 	case RUMPUSER_RW_WRITER:
-		if (rw->o == NULL) {
-			rw->o = rumpuser_curlwp();
+		/* Readers may be blocked on other CPUs. */
+		if (rw->o == NULL && rw->v == 0) {
+			rw->o = get_current();
 			rv = 0;
 		} else {
 			rv = EBUSY;
@@ -696,6 +926,8 @@ rumpuser_rw_tryenter(int enum_rumprwlock, struct rumpuser_rw *rw)
 		rv = EINVAL;
 	}
 
+	if (rv == 0)
+		rw->lk.st.acquires++;
 	return rv;
 }
 
@@ -703,20 +935,13 @@ void
 rumpuser_rw_exit(struct rumpuser_rw *rw)
 {
 
+	RUMP_TRACE_DETAIL();
 	if (rw->o) {
 		rw->o = NULL;
 	} else {
 		rw->v--;
 	}
-
-	RUMP_TRACE_DETAIL();
-	/* standard procedure, don't let readers starve out writers */
-	if (!TAILQ_EMPTY(&rw->wwait)) {
-		if (rw->o == NULL)
-			wakeup_one(&rw->wwait);
-	} else if (!TAILQ_EMPTY(&rw->rwait) && rw->o == NULL) {
-		wakeup_all(&rw->rwait);
-	}
+	rw_handoff(rw);
 }
 
 void
@@ -724,6 +949,7 @@ rumpuser_rw_destroy(struct rumpuser_rw *rw)
 {
 
 	RUMP_TRACE_DETAIL();
+	lock_destroy(&rw->lk);
 	free(rw);
 }
 
@@ -735,7 +961,7 @@ rumpuser_rw_held(int enum_rumprwlock, struct rumpuser_rw *rw, int *rvp)
 	RUMP_TRACE_DETAIL();
 	switch (lk) {
 	case RUMPUSER_RW_WRITER:
-		*rvp = rw->o == rumpuser_curlwp();
+		*rvp = rw->o != NULL && rw->o == get_current();
 		break;
 	case RUMPUSER_RW_READER:
 		*rvp = rw->v > 0;
@@ -748,8 +974,11 @@ rumpuser_rw_downgrade(struct rumpuser_rw *rw)
 {
 
 	RUMP_TRACE_DETAIL();
-	assert(rw->o == rumpuser_curlwp());
-	rw->v = -1;
+	assert(rw->o == get_current());
+	rw->o = NULL;
+	rw->v = 1;
+	/* Readers on other CPUs can join, unless a writer waits. */
+	rw_handoff(rw);
 }
 
 int
@@ -757,9 +986,9 @@ rumpuser_rw_tryupgrade(struct rumpuser_rw *rw)
 {
 
 	RUMP_TRACE_DETAIL();
-	if (rw->v == -1) {
-		rw->v = 1;
-		rw->o = rumpuser_curlwp();
+	if (rw->o == NULL && rw->v == 1) {
+		rw->v = 0;
+		rw->o = get_current();
 		return 0;
 	}
 
@@ -846,11 +1075,16 @@ rumpuser_cv_timedwait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx,
 {
 	int nlocks;
 	int rv;
+	uint64_t deadline;
 
 	RUMP_TRACE_DETAIL();
+	/* Not 0, that is no timeout. */
+	deadline = timer_nsecs() + sec * NSEC_PER_SEC + nsec;
+	if (deadline == 0)
+		deadline = 1;
 	cv->nwaiters++;
 	cv_unsched(mtx, &nlocks);
-	rv = wait(&cv->waiters, sec * 1000 + nsec / (1000*1000));
+	rv = wait(&cv->waiters, deadline);
 	cv_resched(mtx, nlocks);
 	cv->nwaiters--;
 
@@ -930,24 +1164,9 @@ rumpuser_daemonize_done(int error)
 int
 rumpuser_malloc(size_t howmuch, int alignment, void **memp)
 {
-	uint8_t *mem = NULL;
-	int rv = 0;
 
 	RUMP_TRACE();
-	if (alignment == 0)
-		alignment = sizeof(void *);
-
-
-	mem = (uint8_t *)malloc(howmuch + alignment - 1);
-	memset(mem, 0, howmuch + alignment - 1);
-	if (mem != NULL) {
-		mem = (void *)(((uintptr_t)mem + alignment - 1) & ~(alignment - 1));
-	} else {
-		ET(-ENOMEM);
-	}
-	//	printf("allocating %d (%d -> %d) -> %p\n", (int)howmuch, (int)alignment, (int)howmuch + (int)alignment - 1, mem);
-	*memp = (void *)mem;
-	ET(rv);
+	ET(-rumpmrg_malloc(howmuch, alignment, memp));
 }
 
 /*ARGSUSED1*/
@@ -956,7 +1175,7 @@ rumpuser_free(void *ptr, size_t size)
 {
 
 	RUMP_TRACE();
-  //	free(ptr);
+	rumpmrg_free(ptr);
 }
 
 int
@@ -1054,6 +1273,9 @@ rumpuser_open(const char *path, int ruflags, int *fdp)
 		return -1;
 	}
 
+	/* Have small file system requests merged. */
+	blk_queue(blk, BLKQ_DEADLINE);
+
 	fildes[next++] = blk;
 
 	if (fdp)
@@ -1070,12 +1292,115 @@ rumpuser_close(int fd)
 	return 0;
 }
 
+/*
+ * Block I/O.
+ *
+ * Requests are passed to the blk layer as vectors of the caller's
+ * buffers, without copies. rumpuser_iovread() and rumpuser_iovwrite()
+ * wait for completion with the rump CPU released. rumpuser_bio()
+ * completions are collected by a single biodone thread, which calls
+ * biodone for all those ready under one rump schedule.
+ */
+
+static struct blkdisk *
+rumpmrg_getblk(int fd)
+{
+
+	if (fd < 0 || fd >= 256)
+		return NULL;
+	return fildes[fd];
+}
+
+struct rumpmrg_sio {
+	int evt;
+	int ret;
+};
+
+static void
+_rumpmrg_sio_done(void *arg, int ret)
+{
+	struct rumpmrg_sio *sio = (struct rumpmrg_sio *)arg;
+
+	sio->ret = ret;
+	evtset(sio->evt);
+}
+
+/* Synchronous vectored I/O. Returns bytes transferred or -errno. */
+static ssize_t
+rumpmrg_iov(int fd, int wr, const struct rumpuser_iovec *ruiov,
+	    size_t iovlen, int64_t roff)
+{
+	int ret, nlocks;
+	unsigned n;
+	size_t i, blksz, len, done = 0;
+	uint64_t blkid, maxsz;
+	struct blkdisk *blk;
+	struct blkiov iov[BLK_IOVMAX];
+	struct rumpmrg_sio sio;
+
+	blk = rumpmrg_getblk(fd);
+	if (blk == NULL)
+		return -EBADF;
+	blksz = blk->info.blksz;
+	if (roff < 0 || roff % blksz)
+		return -EINVAL;
+
+	sio.evt = evtalloc();
+	i = 0;
+	while (i < iovlen) {
+		/* Short transfer at the end of the disk. */
+		blkid = (roff + done) / blksz;
+		if (blkid >= blk->info.blkno)
+			break;
+		maxsz = (blk->info.blkno - blkid) * blksz;
+
+		len = 0;
+		for (n = 0; n < BLK_IOVMAX && i < iovlen && len < maxsz; i++) {
+			if (ruiov[i].iov_len == 0)
+				continue;
+			if (ruiov[i].iov_len % blksz) {
+				ret = -EINVAL;
+				goto out;
+			}
+			iov[n].addr = ruiov[i].iov_base;
+			iov[n].len = MIN(ruiov[i].iov_len, maxsz - len);
+			len += iov[n++].len;
+		}
+		if (n == 0)
+			break;
+
+		ret = blk_iov(blk, wr, blkid, len / blksz, iov, n,
+			      _rumpmrg_sio_done, &sio);
+		if (ret == 0) {
+			rumpkern_unsched(&nlocks, NULL);
+			evtwait(sio.evt);
+			evtclear(sio.evt);
+			rumpkern_sched(nlocks, NULL);
+			ret = sio.ret;
+		}
+		if (ret)
+			goto out;
+		done += len;
+	}
+	ret = 0;
+
+out:
+	evtfree(sio.evt);
+	return ret ? ret : (ssize_t)done;
+}
+
 int
 rumpuser_iovread(int fd, struct rumpuser_iovec *ruiov, size_t iovlen,
 	int64_t roff, size_t *retp)
 {
+	ssize_t ret;
+
 	RUMP_TRACE();
-	ET(-ENOSYS);
+	ret = rumpmrg_iov(fd, 0, ruiov, iovlen, roff);
+	if (ret < 0)
+		ET(-ret);
+	*retp = ret;
+	return 0;
 }
 
 
@@ -1083,70 +1408,146 @@ int
 rumpuser_iovwrite(int fd, const struct rumpuser_iovec *ruiov, size_t iovlen,
 	int64_t roff, size_t *retp)
 {
+	ssize_t ret;
+
 	RUMP_TRACE();
-	ET(-ENOSYS);
+	ret = rumpmrg_iov(fd, 1, ruiov, iovlen, roff);
+	if (ret < 0)
+		ET(-ret);
+	*retp = ret;
+	return 0;
 }
 
 int
 rumpuser_syncfd(int fd, int flags, uint64_t start, uint64_t len)
 {
+	int ret, nlocks;
+	struct blkdisk *blk;
+
 	RUMP_TRACE();
-	ET(-ENOSYS);
+	blk = rumpmrg_getblk(fd);
+	if (blk == NULL)
+		ET(EBADF);
+
+	/* Writes are complete when acknowledged: only flush caches. */
+	if (!(flags & (RUMPUSER_SYNCFD_WRITE | RUMPUSER_SYNCFD_SYNC)))
+		return 0;
+
+	rumpkern_unsched(&nlocks, NULL);
+	ret = blk_flush(blk);
+	rumpkern_sched(nlocks, NULL);
+	ET(-ret);
 }
 
 struct rumpmrg_bio {
-	int evt;
+	struct blkdisk *blk;
+	struct blkiov iov;
+	int sync;
 	int ret;
 	rump_biodone_fn biodone;
 	void *bioarg;
+	TAILQ_ENTRY(rumpmrg_bio) list;
 };
 
-unsigned char *datap;
+static TAILQ_HEAD(, rumpmrg_bio) rumpmrg_biodoneq =
+	TAILQ_HEAD_INITIALIZER(rumpmrg_biodoneq);
+static lwt_t *rumpmrg_biolwt;
+static int rumpmrg_bioidle;
 
-void _rumpmrg_bio_ast(void *arg)
+static void
+_rumpmrg_biothread(void *arg)
 {
-	int dummy;
-	struct rumpmrg_bio *biop = (struct rumpmrg_bio *)arg;
+	struct rumpmrg_bio *biop;
+	TAILQ_HEAD(, rumpmrg_bio) doneq;
 
-	set_thread("bio_ast");
+	set_thread("biodone");
+	for (;;) {
+		while (TAILQ_EMPTY(&rumpmrg_biodoneq)) {
+			rumpmrg_bioidle = 1;
+			lwt_sleep();
+		}
+		TAILQ_INIT(&doneq);
+		while ((biop = TAILQ_FIRST(&rumpmrg_biodoneq)) != NULL) {
+			TAILQ_REMOVE(&rumpmrg_biodoneq, biop, list);
+			TAILQ_INSERT_TAIL(&doneq, biop, list);
+		}
 
-	rumpuser__hyp.hyp_schedule();
-	biop->biodone(biop->bioarg, biop->ret, biop->ret);
-	rumpuser__hyp.hyp_unschedule();
-	evtfree(biop->evt);
-	free(biop);
+		/* Synchronous writes are done when on stable storage. */
+		TAILQ_FOREACH(biop, &doneq, list)
+			if (biop->sync && biop->ret == 0)
+				biop->ret = blk_flush(biop->blk);
+
+		rumpuser__hyp.hyp_schedule();
+		while ((biop = TAILQ_FIRST(&doneq)) != NULL) {
+			TAILQ_REMOVE(&doneq, biop, list);
+			biop->biodone(biop->bioarg,
+				      biop->ret ? 0 : biop->iov.len,
+				      rumpuser__errtrans(-biop->ret));
+			free(biop);
+		}
+		rumpuser__hyp.hyp_unschedule();
+	}
+}
+
+/* Called by the driver's completion LWT. */
+static void
+_rumpmrg_bio_done(void *arg, int ret)
+{
+	struct rumpmrg_bio *biop = (struct rumpmrg_bio *)arg;
+
+	biop->ret = ret;
+	TAILQ_INSERT_TAIL(&rumpmrg_biodoneq, biop, list);
+	if (rumpmrg_bioidle) {
+		rumpmrg_bioidle = 0;
+		lwt_wake(rumpmrg_biolwt);
+	}
 }
 
 void
 rumpuser_bio(int fd, int op, void *data, size_t dlen, int64_t doff,
 	rump_biodone_fn biodone, void *bioarg)
 {
-	struct rumpmrg_bio bio;
-	uint64_t blkid;
-	size_t blkno;
+	int ret;
+	size_t blksz;
+	struct blkdisk *blk;
 	struct rumpmrg_bio *biop;
 
-	memset(data, 0x55, dlen);
-
 	RUMP_TRACE();
-	blkid = doff / 512;
-	assert (doff % 512 == 0);
-	blkno = (dlen + 511) / 512;
+	if (rumpmrg_biolwt == NULL) {
+		rumpmrg_biolwt = lwt_create(_rumpmrg_biothread, NULL, STACKSIZE);
+		assert(rumpmrg_biolwt != NULL);
+		lwt_wake(rumpmrg_biolwt);
+	}
+
+	blk = rumpmrg_getblk(fd);
+	if (blk == NULL) {
+		biodone(bioarg, 0, rumpuser__errtrans(EBADF));
+		return;
+	}
+	blksz = blk->info.blksz;
+	if (doff < 0 || doff % blksz || dlen == 0 || dlen % blksz) {
+		biodone(bioarg, 0, rumpuser__errtrans(EINVAL));
+		return;
+	}
 
 	biop = malloc(sizeof(*biop));
-	biop->evt = evtalloc();
+	if (biop == NULL) {
+		biodone(bioarg, 0, rumpuser__errtrans(ENOMEM));
+		return;
+	}
+	biop->blk = blk;
+	biop->iov.addr = data;
+	biop->iov.len = dlen;
+	biop->sync = (op & RUMPUSER_BIO_WRITE) && (op & RUMPUSER_BIO_SYNC);
 	biop->biodone = biodone;
 	biop->bioarg = bioarg;
 
-	evtast(biop->evt, _rumpmrg_bio_ast, biop);
-	if (op & RUMPUSER_BIO_READ) {
-		blk_read(fildes[fd], data, dlen, blkid, blkno, biop->evt, &biop->ret);
-		datap = data;
-	} else {
-		printf("<Write disabled>\n");
-		//blk_write(fildes[fd], blkid, blkno, data, dlen, biop->evt, &biop->ret);
+	ret = blk_iov(blk, !!(op & RUMPUSER_BIO_WRITE), doff / blksz,
+		      dlen / blksz, &biop->iov, 1, _rumpmrg_bio_done, biop);
+	if (ret) {
+		free(biop);
+		biodone(bioarg, 0, rumpuser__errtrans(-ret));
 	}
-
 }
 
 /*
@@ -0,0 +1,632 @@
+/*
+ * Copyright (c) 2016, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <machine/vmparam.h>
+#include <microkernel.h>
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rump/rumpuser.h>
+
+#include <mrg.h>
+
+#include "rumpuser_component.h"
+
+/*
+ * Virtual network interface.
+ *
+ * A virtif interface is a link between two processes through a user
+ * device named "vif<devstr>". The first process creating the
+ * interface creates the device (the server), the second opens it
+ * (the client).
+ *
+ * The client exports a shared area holding two rings of frames: tx
+ * from client to server and rx from server to client. The client
+ * accesses the rings directly, the server copies from and to them
+ * with devread() and devwrite().
+ *
+ * Frames sent by the rump kernel are queued, and a per interface tx
+ * LWT pushes all those queued when it runs, ringing the doorbell
+ * once per batch: an OUT to the device from the client, an IRQ from
+ * the server. A consumer asks for the doorbell by setting 'notify'
+ * in the ring before going idle. Frames that don't fit in the ring
+ * are dropped.
+ *
+ * Received frames are delivered by a per interface rx LWT, a batch
+ * per rump schedule.
+ *
+ * When the interface is destroyed both LWTs exit, and the device is
+ * removed (server) or unexported and closed (client), so that the
+ * name can be used again.
+ */
+
+/* Hypercall interface of the rump virtif driver. */
+struct virtif_sc;
+struct virtif_user;
+int rumpcomp_virtif_create(const char *, struct virtif_sc *, uint8_t *,
+			   struct virtif_user **);
+void rumpcomp_virtif_dying(struct virtif_user *);
+void rumpcomp_virtif_destroy(struct virtif_user *);
+void rumpcomp_virtif_send(struct virtif_user *, struct iovec *, size_t);
+void rump_virtif_pktdeliver(struct virtif_sc *, struct iovec *, size_t);
+
+void set_thread(const char *name);
+
+#define VIF_STACKSIZE (64 * 1024)
+
+#define VIF_SLOTSZ   2048
+#define VIF_NSLOTS   256
+#define VIF_FRAMEMAX (VIF_SLOTSZ - sizeof(uint32_t))
+#define VIF_BATCH    32
+
+/* Client OUT ports. */
+#define VIFIO_RING 0		/* IOVA of the shared area. */
+#define VIFIO_KICK 1		/* Frames in the tx ring. */
+
+/* Server IRQs. */
+#define VIFIRQ_RX  0		/* Frames in the rx ring. */
+
+struct vifhdr {
+	volatile uint32_t prod;
+	volatile uint32_t cons;
+	volatile uint32_t notify;
+	uint32_t pad[13];
+};
+
+struct vifslot {
+	uint32_t len;
+	uint8_t data[VIF_FRAMEMAX];
+};
+
+struct vifring {
+	struct vifhdr hdr;
+	struct vifslot slot[VIF_NSLOTS];
+};
+
+struct vifshm {
+	struct vifring tx;
+	struct vifring rx;
+};
+
+#define VIF_SHMSZ round_page(sizeof(struct vifshm))
+
+/* Offsets in the shared area, for the server. */
+#define TXOFF(_f) (offsetof(struct vifshm, tx) + offsetof(struct vifring, _f))
+#define RXOFF(_f) (offsetof(struct vifshm, rx) + offsetof(struct vifring, _f))
+
+struct virtif_user {
+	struct virtif_sc *sc;
+	char name[16];
+	int server;
+	int dying;
+	int evt;
+
+	/* Client. */
+	DEVICE *d;
+	struct vifshm *shm;
+
+	/* Server. */
+	unsigned did;
+	int peer;
+	u_long iova;
+	struct vifslot *stage;	/* Frames to send. */
+	unsigned sprod, scons;
+	struct vifslot *rxbuf;
+
+	lwt_t *rxlwt;
+	lwt_t *txlwt;
+	int txidle;
+	unsigned nlwts;		/* LWTs not exited yet. */
+
+	uint64_t txframes, rxframes;
+	uint64_t drops, kicks;
+};
+
+static void
+vif_deliver(struct virtif_user *viu, struct vifslot *slot, unsigned n)
+{
+	unsigned i;
+	struct iovec iov;
+
+	rumpuser_component_schedule(NULL);
+	for (i = 0; i < n; i++) {
+		if (slot[i].len > VIF_FRAMEMAX)
+			continue;
+		iov.iov_base = slot[i].data;
+		iov.iov_len = slot[i].len;
+		rump_virtif_pktdeliver(viu->sc, &iov, 1);
+	}
+	rumpuser_component_unschedule();
+	viu->rxframes += n;
+}
+
+static unsigned
+vif_gather(struct vifslot *slot, struct iovec *iov, size_t iovlen)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < iovlen; i++)
+		len += iov[i].iov_len;
+	if (len > VIF_FRAMEMAX)
+		return 0;
+
+	slot->len = len;
+	len = 0;
+	for (i = 0; i < iovlen; i++) {
+		memcpy(slot->data + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	return 1;
+}
+
+/*
+ * Client.
+ */
+
+static void
+vif_client_rx(void *arg)
+{
+	unsigned n, cons;
+	struct virtif_user *viu = (struct virtif_user *)arg;
+	struct vifring *rx = &viu->shm->rx;
+
+	set_thread(viu->name);
+	rumpuser_component_kthread();
+	while (!viu->dying) {
+		if (rx->hdr.prod == rx->hdr.cons) {
+			rx->hdr.notify = 1;
+			__sync_synchronize();
+			if (rx->hdr.prod == rx->hdr.cons) {
+				evtwait(viu->evt);
+				evtclear(viu->evt);
+			}
+			rx->hdr.notify = 0;
+			continue;
+		}
+
+		/* Deliver up to the end of the ring. */
+		cons = rx->hdr.cons % VIF_NSLOTS;
+		n = rx->hdr.prod - rx->hdr.cons;
+		if (n > VIF_NSLOTS - cons)
+			n = VIF_NSLOTS - cons;
+		if (n > VIF_BATCH)
+			n = VIF_BATCH;
+		vif_deliver(viu, rx->slot + cons, n);
+		rx->hdr.cons += n;
+	}
+	rumpuser_component_kthread_release();
+	viu->nlwts--;
+}
+
+static void
+vif_client_tx(void *arg)
+{
+	struct virtif_user *viu = (struct virtif_user *)arg;
+	struct vifring *tx = &viu->shm->tx;
+
+	for (;;) {
+		viu->txidle = 1;
+		lwt_sleep();
+		if (viu->dying)
+			break;
+		__sync_synchronize();
+		if (tx->hdr.notify) {
+			tx->hdr.notify = 0;
+			dout(viu->d, IOPORT_DWORD(VIFIO_KICK), 0);
+			viu->kicks++;
+		}
+	}
+	viu->nlwts--;
+}
+
+static void
+vif_client_send(struct virtif_user *viu, struct iovec *iov, size_t iovlen)
+{
+	struct vifring *tx = &viu->shm->tx;
+
+	if (tx->hdr.prod - tx->hdr.cons >= VIF_NSLOTS
+	    || !vif_gather(tx->slot + tx->hdr.prod % VIF_NSLOTS, iov, iovlen)) {
+		viu->drops++;
+		return;
+	}
+	/* The frame before the index. */
+	__sync_synchronize();
+	tx->hdr.prod++;
+	viu->txframes++;
+}
+
+static int
+vif_client_init(struct virtif_user *viu)
+{
+	int ret;
+	iova_t iova;
+	vaddr_t va;
+
+	viu->d = dopen(viu->name);
+	if (viu->d == NULL)
+		return -ENODEV;
+
+	va = vmap_alloc(VIF_SHMSZ, VFNT_RWDATA);
+	if (va == 0) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	ret = vmmap_range(va, VIF_SHMSZ, VM_PROT_RW);
+	if (ret)
+		goto fail_free;
+	viu->shm = (struct vifshm *)va;
+	memset(viu->shm, 0, sizeof(*viu->shm));
+
+	ret = dexport(viu->d, viu->shm, VIF_SHMSZ, &iova);
+	if (ret)
+		goto fail_free;
+	ret = dmapirq(viu->d, VIFIRQ_RX, viu->evt);
+	if (ret)
+		goto fail_unexport;
+	dout(viu->d, IOPORT_QWORD(VIFIO_RING), iova);
+	return 0;
+
+      fail_unexport:
+	dunexport(viu->d, viu->shm);
+      fail_free:
+	vmap_free(va, VIF_SHMSZ);
+      fail:
+	dclose(viu->d);
+	return ret;
+}
+
+/*
+ * Server.
+ */
+
+static void
+vif_server_poll(struct virtif_user *viu)
+{
+	int id;
+	struct sys_poll_ior ior;
+
+	while ((id = devpoll(viu->did, &ior)) >= 0) {
+		switch (ior.op) {
+		case SYS_POLL_OP_OPEN:
+			if (viu->peer < 0)
+				viu->peer = id;
+			break;
+		case SYS_POLL_OP_OUT:
+			if (id != viu->peer)
+				break;
+			if (ior.port == VIFIO_RING)
+				viu->iova = ior.val;
+			break;
+		case SYS_POLL_OP_CLOSE:
+			if (id != viu->peer)
+				break;
+			viu->peer = -1;
+			viu->iova = 0;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Read the tx ring. Returns the number of frames delivered. */
+static unsigned
+vif_server_drain(struct virtif_user *viu)
+{
+	unsigned n, cons;
+	struct vifhdr hdr;
+
+	if (viu->iova == 0)
+		return 0;
+	if (devread(viu->did, viu->peer, viu->iova + TXOFF(hdr),
+		    sizeof(hdr), &hdr) < 0)
+		return 0;
+	if (hdr.prod == hdr.cons)
+		return 0;
+
+	cons = hdr.cons % VIF_NSLOTS;
+	n = hdr.prod - hdr.cons;
+	if (n > VIF_NSLOTS - cons)
+		n = VIF_NSLOTS - cons;
+	if (n > VIF_BATCH)
+		n = VIF_BATCH;
+	if (devread(viu->did, viu->peer, viu->iova + TXOFF(slot[cons]),
+		    n * sizeof(struct vifslot), viu->rxbuf) < 0)
+		return 0;
+	vif_deliver(viu, viu->rxbuf, n);
+
+	hdr.cons += n;
+	devwrite(viu->did, viu->peer, (void *)&hdr.cons, sizeof(hdr.cons),
+		 viu->iova + TXOFF(hdr.cons));
+	return n;
+}
+
+static void
+vif_server_rx(void *arg)
+{
+	uint32_t one = 1, zero = 0;
+	struct virtif_user *viu = (struct virtif_user *)arg;
+
+	set_thread(viu->name);
+	rumpuser_component_kthread();
+	while (!viu->dying) {
+		vif_server_poll(viu);
+		if (vif_server_drain(viu))
+			continue;
+
+		/* Idle: ask for a kick, then look again. */
+		if (viu->iova != 0) {
+			devwrite(viu->did, viu->peer, &one, sizeof(one),
+				 viu->iova + TXOFF(hdr.notify));
+			if (vif_server_drain(viu)) {
+				devwrite(viu->did, viu->peer, &zero,
+					 sizeof(zero),
+					 viu->iova + TXOFF(hdr.notify));
+				continue;
+			}
+		}
+		evtwait(viu->evt);
+		evtclear(viu->evt);
+	}
+	rumpuser_component_kthread_release();
+	viu->nlwts--;
+}
+
+/* Copy the queued frames to the rx ring. */
+static void
+vif_server_flush(struct virtif_user *viu)
+{
+	unsigned n, i, prod;
+	uint32_t zero = 0;
+	struct vifhdr hdr;
+	struct vifslot *s;
+
+	n = viu->sprod - viu->scons;
+	if (n == 0)
+		return;
+	if (viu->iova == 0
+	    || devread(viu->did, viu->peer, viu->iova + RXOFF(hdr),
+		       sizeof(hdr), &hdr) < 0) {
+		viu->drops += n;
+		viu->scons = viu->sprod;
+		return;
+	}
+
+	if (n > VIF_NSLOTS - (hdr.prod - hdr.cons)) {
+		viu->drops += n - (VIF_NSLOTS - (hdr.prod - hdr.cons));
+		n = VIF_NSLOTS - (hdr.prod - hdr.cons);
+	}
+	for (i = 0; i < n; i++) {
+		s = viu->stage + (viu->scons + i) % VIF_NSLOTS;
+		prod = (hdr.prod + i) % VIF_NSLOTS;
+		devwrite(viu->did, viu->peer, s,
+			 offsetof(struct vifslot, data) + s->len,
+			 viu->iova + RXOFF(slot[prod]));
+	}
+	viu->scons = viu->sprod;
+	viu->txframes += n;
+
+	/* Publish, then check if the client waits. */
+	hdr.prod += n;
+	devwrite(viu->did, viu->peer, (void *)&hdr.prod, sizeof(hdr.prod),
+		 viu->iova + RXOFF(hdr.prod));
+	if (devread(viu->did, viu->peer, viu->iova + RXOFF(hdr.notify),
+		    sizeof(hdr.notify), (void *)&hdr.notify) < 0)
+		return;
+	if (hdr.notify) {
+		devwrite(viu->did, viu->peer, &zero, sizeof(zero),
+			 viu->iova + RXOFF(hdr.notify));
+		devraiseirq(viu->did, viu->peer, VIFIRQ_RX);
+		viu->kicks++;
+	}
+}
+
+static void
+vif_server_tx(void *arg)
+{
+	struct virtif_user *viu = (struct virtif_user *)arg;
+
+	for (;;) {
+		viu->txidle = 1;
+		lwt_sleep();
+		if (viu->dying)
+			break;
+		vif_server_flush(viu);
+	}
+	viu->nlwts--;
+}
+
+static void
+vif_server_send(struct virtif_user *viu, struct iovec *iov, size_t iovlen)
+{
+
+	if (viu->sprod - viu->scons >= VIF_NSLOTS
+	    || !vif_gather(viu->stage + viu->sprod % VIF_NSLOTS, iov, iovlen)) {
+		viu->drops++;
+		return;
+	}
+	viu->sprod++;
+}
+
+static int
+vif_server_init(struct virtif_user *viu)
+{
+	int ret;
+	struct sys_creat_cfg cfg;
+
+	viu->stage = malloc(VIF_NSLOTS * sizeof(struct vifslot));
+	viu->rxbuf = malloc(VIF_BATCH * sizeof(struct vifslot));
+	if (viu->stage == NULL || viu->rxbuf == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nameid = squoze(viu->name);
+	cfg.vendorid = squoze("MRGRUMP");
+	cfg.nirqs = 1;
+	ret = devcreat(&cfg, 0111, viu->evt);
+	if (ret < 0)
+		goto fail;
+	viu->did = ret;
+	viu->peer = -1;
+	return 0;
+
+      fail:
+	free(viu->stage);
+	free(viu->rxbuf);
+	return ret;
+}
+
+/*
+ * Hypercalls.
+ */
+
+int
+rumpcomp_virtif_create(const char *devstr, struct virtif_sc *sc,
+		       uint8_t *enaddr, struct virtif_user **viup)
+{
+	int ret, dd;
+	pid_t pid = sys_getpid();
+	struct virtif_user *viu;
+
+	viu = calloc(1, sizeof(*viu));
+	if (viu == NULL)
+		return rumpuser_component_errtrans(ENOMEM);
+	viu->sc = sc;
+	snprintf(viu->name, sizeof(viu->name), "vif%s", devstr);
+	viu->evt = evtalloc();
+
+	/* Open the device if the peer created it, or create it. */
+	dd = sys_open(squoze(viu->name));
+	if (dd >= 0) {
+		sys_close(dd);
+		ret = vif_client_init(viu);
+	} else {
+		viu->server = 1;
+		ret = vif_server_init(viu);
+		if (ret < 0) {
+			/* Lost a race with the peer. */
+			viu->server = 0;
+			ret = vif_client_init(viu);
+		}
+	}
+	if (ret < 0) {
+		evtfree(viu->evt);
+		free(viu);
+		return rumpuser_component_errtrans(-ret);
+	}
+
+	viu->rxlwt = lwt_create(viu->server ? vif_server_rx : vif_client_rx,
+				viu, VIF_STACKSIZE);
+	viu->txlwt = lwt_create(viu->server ? vif_server_tx : vif_client_tx,
+				viu, VIF_STACKSIZE);
+	assert(viu->rxlwt != NULL && viu->txlwt != NULL);
+	viu->nlwts = 2;
+	lwt_wake(viu->rxlwt);
+	lwt_wake(viu->txlwt);
+
+	/* Locally administered, different for the two ends. */
+	enaddr[0] = 0xb2;
+	enaddr[1] = 0xa0;
+	enaddr[2] = viu->server;
+	enaddr[3] = pid >> 16;
+	enaddr[4] = pid >> 8;
+	enaddr[5] = pid;
+
+	*viup = viu;
+	return 0;
+}
+
+void
+rumpcomp_virtif_send(struct virtif_user *viu, struct iovec *iov,
+		     size_t iovlen)
+{
+
+	if (viu->dying)
+		return;
+	if (viu->server)
+		vif_server_send(viu, iov, iovlen);
+	else
+		vif_client_send(viu, iov, iovlen);
+
+	/* Push when the rump kernel lets the tx LWT run. */
+	if (viu->txidle) {
+		viu->txidle = 0;
+		lwt_wake(viu->txlwt);
+	}
+}
+
+void
+rumpcomp_virtif_dying(struct virtif_user *viu)
+{
+
+	viu->dying = 1;
+	evtset(viu->evt);
+	if (viu->txidle) {
+		viu->txidle = 0;
+		lwt_wake(viu->txlwt);
+	}
+}
+
+void
+rumpcomp_virtif_destroy(struct virtif_user *viu)
+{
+	void *cookie;
+
+	/* The rx LWT needs the rump CPU to exit. */
+	cookie = rumpuser_component_unschedule();
+	while (viu->nlwts)
+		lwt_yield();
+	rumpuser_component_schedule(cookie);
+
+	printf("%s: tx %llu rx %llu drops %llu kicks %llu\n", viu->name,
+	       viu->txframes, viu->rxframes, viu->drops, viu->kicks);
+
+	if (viu->server) {
+		devremove(viu->did);
+		free(viu->stage);
+		free(viu->rxbuf);
+	} else {
+		dunexport(viu->d, viu->shm);
+		dclose(viu->d);
+		vmap_free((vaddr_t)viu->shm, VIF_SHMSZ);
+	}
+	evtfree(viu->evt);
+	free(viu->rxlwt);
+	free(viu->txlwt);
+	free(viu);
+}
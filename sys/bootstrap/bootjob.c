@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2016, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Boot jobs.
+ *
+ * Bootstrap work is split in jobs with dependencies. A job is
+ * started in its own LWT as soon as all the jobs it depends on have
+ * completed successfully. Jobs that fail, or depend on a failed
+ * job, never run their dependents.
+ *
+ * Exclusive jobs run alone: they start when no other job is running,
+ * and no job starts while they run. Other ready jobs keep starting
+ * while an exclusive job waits, so it only delays its dependents.
+ * Jobs that fork must be exclusive, or the child would inherit the
+ * other jobs' LWTs.
+ *
+ * Every job records when it became ready, started and ended. When
+ * all jobs are done the timeline is printed, with the critical path
+ * (the chain of last-completing dependencies) marked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <microkernel.h>
+#include <mrg.h>
+#include "internal.h"
+
+#define BOOTJOB_STACKSIZE (64 * 1024)
+
+#define JOB_WAITING 0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+#define JOB_FAILED  3
+#define JOB_SKIPPED 4
+
+struct bootjob {
+	char name[24];
+	int (*fn)(void *);
+	void *arg;
+	int flags;
+	int state;
+	int ret;
+	int critical;
+
+	unsigned ndeps;
+	struct bootjob **deps;
+
+	uint64_t tready;
+	uint64_t tstart;
+	uint64_t tend;
+
+	TAILQ_ENTRY(bootjob) list;
+};
+
+static TAILQ_HEAD(, bootjob) bootjobs = TAILQ_HEAD_INITIALIZER(bootjobs);
+static lwt_t *bootjob_main = NULL;
+static unsigned bootjob_nrunning = 0;
+static uint64_t bootjob_t0;
+
+static inline uint64_t
+bootjob_clock(void)
+{
+	uint32_t lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+struct bootjob *
+bootjob_add(const char *name, int (*fn)(void *), void *arg, int flags)
+{
+	struct bootjob *job;
+
+	job = calloc(1, sizeof(*job));
+	assert(job != NULL);
+	strncpy(job->name, name, sizeof(job->name) - 1);
+	job->fn = fn;
+	job->arg = arg;
+	job->flags = flags;
+	job->state = JOB_WAITING;
+	TAILQ_INSERT_TAIL(&bootjobs, job, list);
+	return job;
+}
+
+void
+bootjob_after(struct bootjob *job, struct bootjob *dep)
+{
+
+	assert(job->state == JOB_WAITING);
+	job->deps = realloc(job->deps, (job->ndeps + 1) * sizeof(*job->deps));
+	assert(job->deps != NULL);
+	job->deps[job->ndeps++] = dep;
+}
+
+/* Return JOB_DONE if job can run, JOB_SKIPPED if it never will. */
+static int
+bootjob_depstate(struct bootjob *job)
+{
+	unsigned i;
+	int st = JOB_DONE;
+
+	for (i = 0; i < job->ndeps; i++)
+		switch (job->deps[i]->state) {
+		case JOB_FAILED:
+		case JOB_SKIPPED:
+			return JOB_SKIPPED;
+		case JOB_WAITING:
+		case JOB_RUNNING:
+			st = JOB_WAITING;
+			break;
+		}
+	return st;
+}
+
+static void
+bootjob_start(void *arg)
+{
+	struct bootjob *job = (struct bootjob *)arg;
+
+	job->tstart = bootjob_clock();
+	job->ret = job->fn(job->arg);
+	job->tend = bootjob_clock();
+	job->state = job->ret < 0 ? JOB_FAILED : JOB_DONE;
+	if (job->ret < 0)
+		printf("boot: %s failed: %d\n", job->name, job->ret);
+	bootjob_nrunning--;
+	if (lwt_getcurrent() != bootjob_main)
+		lwt_wake(bootjob_main);
+}
+
+/*
+ * Update the state of waiting jobs. Returns the number of jobs not
+ * completed, and in *excl the first ready exclusive job.
+ */
+static unsigned
+bootjob_update(struct bootjob **excl)
+{
+	int st;
+	unsigned pending = 0;
+	struct bootjob *job;
+
+	*excl = NULL;
+	TAILQ_FOREACH(job, &bootjobs, list) {
+		if (job->state == JOB_RUNNING)
+			pending++;
+		if (job->state != JOB_WAITING)
+			continue;
+
+		st = bootjob_depstate(job);
+		if (st == JOB_SKIPPED) {
+			job->state = JOB_SKIPPED;
+			continue;
+		}
+		pending++;
+		if (st != JOB_DONE)
+			continue;
+		if (job->tready == 0)
+			job->tready = bootjob_clock();
+		if ((job->flags & BOOTJOB_EXCL) && *excl == NULL)
+			*excl = job;
+	}
+	return pending;
+}
+
+/* Start ready jobs. Returns the number of jobs not completed. */
+static unsigned
+bootjob_schedule(void)
+{
+	unsigned pending;
+	struct bootjob *job, *excl;
+	lwt_t *lwt;
+
+	pending = bootjob_update(&excl);
+	if (excl != NULL && bootjob_nrunning == 0) {
+		/* Nothing else is running: run it alone. */
+		excl->state = JOB_RUNNING;
+		bootjob_nrunning++;
+		bootjob_start(excl);
+		return pending;
+	}
+
+	/* Exclusive jobs wait for the running ones to end. */
+	TAILQ_FOREACH(job, &bootjobs, list) {
+		if (job->state != JOB_WAITING || job->tready == 0)
+			continue;
+		if (job->flags & BOOTJOB_EXCL)
+			continue;
+
+		job->state = JOB_RUNNING;
+		bootjob_nrunning++;
+		lwt = lwt_create(bootjob_start, job, BOOTJOB_STACKSIZE);
+		if (lwt == NULL) {
+			/* Run it here, synchronously. */
+			bootjob_start(job);
+			continue;
+		}
+		lwt_wake(lwt);
+	}
+	return pending;
+}
+
+/* Mark the chain of dependencies that completed last. */
+static void
+bootjob_critical(void)
+{
+	unsigned i;
+	struct bootjob *job, *last = NULL;
+
+	TAILQ_FOREACH(job, &bootjobs, list)
+		if (job->state == JOB_DONE || job->state == JOB_FAILED)
+			if (last == NULL || job->tend > last->tend)
+				last = job;
+
+	while (last != NULL) {
+		last->critical = 1;
+		job = last;
+		last = NULL;
+		for (i = 0; i < job->ndeps; i++)
+			if (last == NULL || job->deps[i]->tend > last->tend)
+				last = job->deps[i];
+	}
+}
+
+static void
+bootjob_timeline(void)
+{
+	struct bootjob *job;
+	static const char *stname[] = {
+		"waiting", "running", "done", "failed", "skipped"
+	};
+
+	bootjob_critical();
+	printf("Boot timeline (kcycles from start):\n");
+	printf("  %-24s %10s %10s %10s\n", "job", "ready", "start", "end");
+	TAILQ_FOREACH(job, &bootjobs, list) {
+		if (job->state != JOB_DONE && job->state != JOB_FAILED) {
+			printf("  %-24s %s\n", job->name, stname[job->state]);
+			continue;
+		}
+		printf("%c %-24s %10llu %10llu %10llu%s\n",
+		       job->critical ? '*' : ' ', job->name,
+		       (job->tready - bootjob_t0) / 1000,
+		       (job->tstart - bootjob_t0) / 1000,
+		       (job->tend - bootjob_t0) / 1000,
+		       job->state == JOB_FAILED ? " (failed)" : "");
+	}
+}
+
+/*
+ * Run all jobs, including those added by jobs while running. Returns
+ * when all have completed, failed or been skipped.
+ */
+void
+bootjob_run(void)
+{
+
+	bootjob_main = lwt_getcurrent();
+	bootjob_t0 = bootjob_clock();
+	while (bootjob_schedule() != 0) {
+		/* Woken up when a job ends. */
+		if (bootjob_nrunning)
+			lwt_sleep();
+	}
+	bootjob_timeline();
+}
+
+int
+bootjob_failed(struct bootjob *job)
+{
+
+	return job->state == JOB_FAILED || job->state == JOB_SKIPPED;
+}
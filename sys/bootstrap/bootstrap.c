@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <microkernel.h>
 #include <squoze.h>
 #include <assert.h>
@@ -28,9 +29,15 @@ static int _sys_write(void *cookie, const char *c, int n)
 static int _console_write(void *cookie, const char *c, int n)
 {
 	WIN *w = (WIN *)cookie;
+	int odirflush = dirflush;
+
+	/* Flush the screen once per write, not per character. */
+	dirflush = 0;
 	for (int i = 0; i < n; i++) {
 		vtty_wputc(w, *c++);
 	}
+	dirflush = odirflush;
+	vtty_wflush();
 }
 
 void devadd(struct sys_hwcreat_cfg *cfg)
@@ -74,75 +81,118 @@ int do_child()
 #include <mrg/blk.h>
 #include <mrg/blk/part.h>
 
-int main()
+/*
+ * Boot jobs.
+ */
+
+static struct bootjob *platform_job;
+static struct bootjob *console_job;
+static WIN *ws;
+
+static int
+platform_start(void *arg)
 {
 	int ret;
-	int consevt = -1;
-	DEVICE *console;
 
-	syscons = fwopen(NULL, _sys_write);
-	stdout = syscons;
-	stderr = syscons;
-	setvbuf(syscons, NULL, _IONBF, 80);
-
-	printf("MRG bootstrap initiated.\n");
 	ret = platform_init();
-	if (ret < 0) {
+	if (ret < 0)
 		printf("ACPI platform initialization failed: %d\n", ret);
-		return -1;
-	}
+	return ret;
+}
 
-	/* Become INTRCHILD handler */
-	inthandler(INTR_CHILD, do_child, NULL);
+static int
+disks_start(void *arg)
+{
+	uint64_t cur;
 
-	/* Search for storage devices. */
-	do {
-		uint64_t cur;
-		struct device *d;
+	for (cur = blk_iter(0); cur; cur = blk_iter(cur))
+		printf("Found disk %s\n", unsquoze_inline(cur).str);
+	return 0;
+}
 
-		/* Step 1: Probe for devices. */
-		SLIST_FOREACH(d, &devices, list) {
-			blkdrv_ahci_probe(d->nameid, squoze("DISK"));
-		}
+static int
+part_start(void *arg)
+{
 
-		/* Step 2: Probe for partitions. */
-		for (cur = blk_iter(0); cur; cur = blk_iter(cur))
-			part_scan(cur);
-	} while (0);
+	part_scan((uint64_t)(uintptr_t)arg);
+	return 0;
+}
 
-	/* Search for a MRG root partition. */
-	do {
-		uint64_t cur;
+/* Scan the disks found by the probes, all in parallel. */
+static int
+partitions_start(void *arg)
+{
+	char name[24];
+	uint64_t cur;
+	struct bootjob *disks, *job;
 
-		for (cur = blk_iter(0); cur; cur = blk_iter(cur))
-			printf("Found disk %s\n", unsquoze_inline(cur).str);
-	} while (0);
+	disks = bootjob_add("disks", disks_start, NULL, 0);
+	for (cur = blk_iter(0); cur; cur = blk_iter(cur)) {
+		snprintf(name, sizeof(name), "part:%s",
+			 unsquoze_inline(cur).str);
+		job = bootjob_add(name, part_start, (void *)(uintptr_t)cur, 0);
+		bootjob_after(disks, job);
+	}
+	return 0;
+}
 
-	/* Mount the filesystem. */
-	
-	/* Run system configuration and inittab */
+static int
+probe_start(void *arg)
+{
+	int ret;
+	uint64_t nameid = *(uint64_t *)arg;
 
-	/* Being the INTRCHILD handler, we'll handle death of processes. */
+	ret = blkdrv_ahci_probe(nameid, squoze("DISK"));
+	if (ret < 0 && ret != -ENOSYS)
+		printf("AHCI probe of %s failed: %d\n",
+		       unsquoze_inline(nameid).str, ret);
+	/* A device not probing must not stop the others. */
+	return 0;
+}
 
-	/*
-	 * REST HIGHLY TEMPORARY
-	 */
+/* Probe all devices in parallel, then scan their disks. */
+static int
+devices_start(void *arg)
+{
+	char name[24];
+	struct device *d;
+	struct bootjob *parts, *job;
+
+	parts = bootjob_add("partitions", partitions_start, NULL, 0);
+	SLIST_FOREACH(d, &devices, list) {
+		snprintf(name, sizeof(name), "probe:%s",
+			 unsquoze_inline(d->nameid).str);
+		job = bootjob_add(name, probe_start, &d->nameid, 0);
+		bootjob_after(parts, job);
+	}
+	return 0;
+}
+
+static int
+console_start(void *arg)
+{
+	int ret;
 
 	/* create console device. */
 	ret = pltconsole_process();
 	if (ret <= 0) {
 		printf("console process couldn't start: %d\n", ret);
-		return ret;
+		return ret < 0 ? ret : -1;
 	}
 	printf("PLTCONSOLE started as pid %d\n", ret);
+	return 0;
+}
+
+static int
+wsys_start(void *arg)
+{
 
 	/* Initialize Window System */
 	vtty_init(BLACK, WHITE, XA_NORMAL);
-	WIN *ws;
 	ws = vtty_wopen(0, 0, vtty_cols() - 1, vtty_lines() - 1,
 			BNONE, XA_NORMAL, BLACK, WHITE, 0, 1);
 	vtty_wredraw(ws, 1);
-	
+
 #ifndef CONSOLE_DEBUG_BOOT
 	FILE *consf = fwopen((void *)ws, _console_write);
 	setvbuf(consf, NULL, _IONBF, 0);
@@ -150,11 +200,67 @@ int main()
 	stderr = consf;
 #endif
 	printf("Welcome to the MURGIA system.\n");
+	return 0;
+}
+
+static int
+klogger_start(void *arg)
+{
+	int ret;
 
 	printf("starting kernel log...");
 	/* fork and create kloggerd. */
 	ret = klogger_process();
 	printf("PID %d\n", ret);
+	return ret < 0 ? ret : 0;
+}
+
+int main()
+{
+	struct bootjob *devs, *wsys, *klog;
+
+	syscons = fwopen(NULL, _sys_write);
+	stdout = syscons;
+	stderr = syscons;
+	setvbuf(syscons, NULL, _IONBF, 80);
+
+	printf("MRG bootstrap initiated.\n");
+
+	/* Become INTRCHILD handler */
+	inthandler(INTR_CHILD, do_child, NULL);
+
+	/*
+	 * Storage probing and the console start in parallel once the
+	 * platform devices are known. Forks are exclusive jobs.
+	 */
+	platform_job = bootjob_add("platform", platform_start, NULL, 0);
+
+	devs = bootjob_add("devices", devices_start, NULL, 0);
+	bootjob_after(devs, platform_job);
+
+	console_job = bootjob_add("console", console_start, NULL, BOOTJOB_EXCL);
+	bootjob_after(console_job, platform_job);
+
+	wsys = bootjob_add("window system", wsys_start, NULL, 0);
+	bootjob_after(wsys, console_job);
+
+	klog = bootjob_add("klogger", klogger_start, NULL, BOOTJOB_EXCL);
+	bootjob_after(klog, wsys);
+
+	bootjob_run();
+
+	if (bootjob_failed(platform_job))
+		return -1;
+	if (bootjob_failed(console_job))
+		return -1;
+
+	/* Search for a MRG root partition. */
+
+	/* Mount the filesystem. */
+	
+	/* Run system configuration and inittab */
+
+	/* Being the INTRCHILD handler, we'll handle death of processes. */
 
 	while(1) {
 		printf("<%lx>", vtty_kgetcw());
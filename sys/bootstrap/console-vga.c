@@ -1,4 +1,5 @@
 #include <mrg.h>
+#include <sys/param.h> /* MIN,MAX */
 #include <stdlib.h>
 #include <string.h>
 #include "vgahw.h"
@@ -246,7 +247,7 @@ static int coltrans(int col)
 	}
 }
 
-void console_vga_putc(int c, int colattr, int xattr)
+static uint16_t vga_cell(int c, int colattr, int xattr)
 {
 	uint8_t attr;
 	int bg, fg;
@@ -321,8 +322,16 @@ void console_vga_putc(int c, int colattr, int xattr)
 		}
 	}
 
-	__vga_mem[(xpos + ypos * 80) * 2] = c & 0xff;
-	__vga_mem[(xpos + ypos * 80) * 2 + 1] = attr;
+	return (attr << 8) | (c & 0xff);
+}
+
+void console_vga_putc(int c, int colattr, int xattr)
+{
+	uint16_t cell;
+
+	cell = vga_cell(c, colattr, xattr);
+	__vga_mem[(xpos + ypos * 80) * 2] = cell & 0xff;
+	__vga_mem[(xpos + ypos * 80) * 2 + 1] = cell >> 8;
 	xpos++;
 	if (xpos >= 80) {
 		xpos = 0;
@@ -331,6 +340,30 @@ void console_vga_putc(int c, int colattr, int xattr)
 	update_cursor();
 }
 
+/*
+ * Draw 'n' cells encoded as CONSIO_OUTDATA at (x, y), without moving
+ * the cursor.
+ */
+void console_vga_blit(unsigned x, unsigned y, uint32_t *cells, unsigned n)
+{
+	volatile uint8_t *ptr;
+	uint16_t cell;
+	unsigned i;
+
+	if (y >= 25 || x >= 80)
+		return;
+	n = MIN(n, 80 - x);
+
+	ptr = __vga_mem + (x + y * 80) * 2;
+	for (i = 0; i < n; i++) {
+		cell = vga_cell(cells[i] & 0xff,
+				(cells[i] >> 16) & 0xff,
+				(cells[i] >> 8) & 0xff);
+		*ptr++ = cell & 0xff;
+		*ptr++ = cell >> 8;
+	}
+}
+
 unsigned console_vga_cols(void)
 {
 	return 80;
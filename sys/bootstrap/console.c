@@ -1,5 +1,6 @@
 #include <microkernel.h>
 #include <sys/param.h> /* MIN,MAX */
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -24,12 +25,15 @@ struct screen {
 	int req;
 	int fpos;
 	int wpos;
-#define KBDBUF_SIZE 16
+#define KBDBUF_SIZE CONSIO_KBRING_SIZE
 	uint16_t kbdbuf[KBDBUF_SIZE];
 	void *kbd_opq;
+	u_long kbring;
+	uint32_t kbprod;
 
 	/* Display I/O State. */
 	void *dsp_opq;
+	u_long cellbuf;
 };
 
 unsigned cur_screen = 0;
@@ -37,7 +41,11 @@ struct screen screens[CONSOLE_MAXSCREENS];
 #define cscr() (screens + cur_screen)
 #define scr(_id) (screens + (_id))
 
+/* Bounce buffer for cell buffer flushes. */
+static uint32_t *flushbuf = NULL;
+
 static void devsts_kbdata_update(int id);
+static void kbring_update(int id);
 
 void
 kbdbuf_add(uint16_t c)
@@ -53,8 +61,12 @@ kbdbuf_add(uint16_t c)
 	s->wpos %= KBDBUF_SIZE;
 
 	if (s->req) {
-		s->req = 0;
-		devsts_kbdata_update(cur_screen);
+		if (s->kbring != 0) {
+			kbring_update(cur_screen);
+		} else {
+			s->req = 0;
+			devsts_kbdata_update(cur_screen);
+		}
 	}
 }
 
@@ -155,6 +167,7 @@ outops_do(int id, uint64_t val)
 }
 
 void console_vga_putc(int c, int colattr, int xattr);
+void console_vga_blit(unsigned x, unsigned y, uint32_t *cells, unsigned n);
 
 static void
 outdata_update(int id, uint64_t val)
@@ -172,6 +185,51 @@ outdata_update(int id, uint64_t val)
 #endif
 }
 
+static void
+cellbuf_update(int id, uint64_t val)
+{
+	struct screen *s = scr(id);
+
+	s->cellbuf = (u_long)val;
+}
+
+static void
+flush_do(int id, uint64_t val)
+{
+#ifndef CONSOLE_DEBUG_BOOT
+	struct screen *s = scr(id);
+	unsigned x0, y0, x1, y1, y, cols, lines;
+	size_t off, len;
+	int ret;
+
+	if (id != cur_screen || s->cellbuf == 0 || flushbuf == NULL)
+		return;
+
+	cols = console_vga_cols();
+	lines = console_vga_lines();
+	x0 = CONSIO_FLUSH_X0(val);
+	y0 = CONSIO_FLUSH_Y0(val);
+	x1 = MIN(CONSIO_FLUSH_X1(val), cols - 1);
+	y1 = MIN(CONSIO_FLUSH_Y1(val), lines - 1);
+	if (x0 > x1 || y0 > y1)
+		return;
+
+	/* Read all damaged lines in one go. */
+	off = y0 * cols + x0;
+	len = y1 * cols + x1 + 1 - off;
+	ret = devread(devid, id, s->cellbuf + off * sizeof(uint32_t),
+		      len * sizeof(uint32_t), flushbuf);
+	if (ret != 0) {
+		printf("error on devread(%d)", id);
+		return;
+	}
+
+	for (y = y0; y <= y1; y++)
+		console_vga_blit(x0, y, flushbuf + (y - y0) * cols,
+				 x1 - x0 + 1);
+#endif
+}
+
 static void
 devsts_kbdata_update(int id)
 {
@@ -199,6 +257,73 @@ devsts_kbdata_update(int id)
 		printf("error raising irq(%d)", id);
 }
 
+static void
+kbring_setup(int id, uint64_t val)
+{
+	struct screen *s = scr(id);
+
+	s->req = 0;
+	s->kbring = (u_long)val;
+	s->kbprod = 0;
+}
+
+/*
+ * Move all pending keys that fit into the client's ring, and notify
+ * the client once.
+ */
+static void
+kbring_update(int id)
+{
+	struct screen *s = scr(id);
+	struct consio_kbring hdr;
+	uint16_t keys[CONSIO_KBRING_SIZE];
+	unsigned n, first, len, space;
+	int ret;
+
+	ret = devread(devid, id, s->kbring,
+		      offsetof(struct consio_kbring, keys), &hdr);
+	if (ret != 0) {
+		printf("error on devread(%d)", id);
+		return;
+	}
+
+	space = CONSIO_KBRING_SIZE - (s->kbprod - hdr.cons);
+	if (space > CONSIO_KBRING_SIZE)
+		space = 0;
+	for (n = 0; n < space && s->fpos != s->wpos; n++)
+		keys[n] = kbdfetch(id);
+	if (n == 0)
+		return;
+
+	first = s->kbprod % CONSIO_KBRING_SIZE;
+	len = MIN(n, CONSIO_KBRING_SIZE - first);
+	ret = devwrite(devid, id, keys, len * sizeof(uint16_t),
+		       s->kbring + offsetof(struct consio_kbring, keys)
+		       + first * sizeof(uint16_t));
+	if (ret == 0 && len < n)
+		ret = devwrite(devid, id, keys + len,
+			       (n - len) * sizeof(uint16_t),
+			       s->kbring
+			       + offsetof(struct consio_kbring, keys));
+	if (ret != 0) {
+		printf("error on devwrite(%d)", id);
+		return;
+	}
+
+	s->kbprod += n;
+	ret = devwrite(devid, id, &s->kbprod, sizeof(s->kbprod),
+		       s->kbring + offsetof(struct consio_kbring, prod));
+	if (ret != 0) {
+		printf("error on devwrite(%d)", id);
+		return;
+	}
+
+	s->req = 0;
+	ret = devraiseirq(devid, id, CONSIO_IRQ_KBDATA);
+	if (ret != 0)
+		printf("error raising irq(%d)", id);
+}
+
 static void
 console_io_out(int id, uint32_t port, uint64_t val, uint8_t size)
 {
@@ -207,7 +332,12 @@ console_io_out(int id, uint32_t port, uint64_t val, uint8_t size)
 	switch (port) {
 	case CONSIO_DEVSTS:
 		if (val & CONSIO_DEVSTS_KBDVAL) {
-			devsts_kbdata_update(id);
+			if (s->kbring != 0) {
+				s->req = 1;
+				kbring_update(id);
+			} else {
+				devsts_kbdata_update(id);
+			}
 		}
 		break;
 	case CONSIO_OUTDATA:
@@ -219,6 +349,15 @@ console_io_out(int id, uint32_t port, uint64_t val, uint8_t size)
 	case CONSIO_OUTPOS:
 		outpos_do(id, val);
 		break;
+	case CONSIO_CELLBUF:
+		cellbuf_update(id, val);
+		break;
+	case CONSIO_FLUSH:
+		flush_do(id, val);
+		break;
+	case CONSIO_KBRING:
+		kbring_setup(id, val);
+		break;
 	}
 }
 
@@ -237,6 +376,9 @@ console_io_close(int id)
 
 	s->kbd_opq = NULL;
 	s->dsp_opq = NULL;
+	s->cellbuf = 0;
+	s->kbring = 0;
+	s->kbprod = 0;
 }
 
 static void
@@ -250,6 +392,9 @@ console_io_open(int id)
 
 	s->kbd_opq = NULL;
 	s->dsp_opq = NULL;
+	s->cellbuf = 0;
+	s->kbring = 0;
+	s->kbprod = 0;
 	s->active = 1;
 }
 
@@ -266,6 +411,10 @@ console_io_clone(int id, int clid)
 	/* FIXME */
 	cls->kbd_opq = NULL;
 	cls->dsp_opq = NULL;
+	/* Exports are not inherited by clones. */
+	cls->cellbuf = 0;
+	cls->kbring = 0;
+	cls->kbprod = 0;
 	cls->active = 1;
 }
 
@@ -326,6 +475,9 @@ static void pltconsole()
 	cfg.vendorid = CONSOLE_VENDORID;
 	cfg.usercfg[0] = console_vga_cols() + (console_vga_lines() << 8);
 
+	flushbuf = malloc(console_vga_cols() * console_vga_lines()
+			  * sizeof(uint32_t));
+
 	reqevt = evtalloc();
 	evtast(reqevt, __console_io_ast, NULL);
 
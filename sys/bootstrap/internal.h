@@ -29,6 +29,19 @@ int platform_getpciaddr(void *dev, int *devno, int *funcno);
 int platform_getpciintrs(void *pciroot, int dev, int ints[4]);
 
 int pltpci_init(void);
+int pltpci_rdcfg(unsigned bus, unsigned dev, unsigned func,
+		 uint16_t reg, int width, uint32_t *value);
+int pltpci_wrcfg(unsigned bus, unsigned dev, unsigned func,
+		 uint16_t reg, int width, uint32_t value);
+
+/* boot jobs */
+struct bootjob;
+#define BOOTJOB_EXCL 1		/* Run alone, e.g. when forking. */
+struct bootjob *bootjob_add(const char *name, int (*fn)(void *), void *arg,
+			    int flags);
+void bootjob_after(struct bootjob *job, struct bootjob *dep);
+int bootjob_failed(struct bootjob *job);
+void bootjob_run(void);
 
 /* device management */
 void devadd(struct sys_hwcreat_cfg *cfg);
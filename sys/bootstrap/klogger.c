@@ -31,15 +31,19 @@ __klog_avl_ast(void *arg __unused)
 {
 	uint64_t ioval = 0;
 	uint8_t ch;
+	int odirflush = dirflush;
 
 	dout(klogger, IOPORT_BYTE(KLOGDEVIO_ISR), 1);
 	din(klogger, IOPORT_DWORD(KLOGDEVIO_SZ), &ioval);
+	dirflush = 0;
 	while (ioval != 0) {
 		din(klogger, IOPORT_BYTE(KLOGDEVIO_GETC), &ioval);
 		ch = ioval & 0xff;
 		vtty_wputc(view, ch);
 		din(klogger, IOPORT_DWORD(KLOGDEVIO_SZ), &ioval);
 	}
+	dirflush = odirflush;
+	vtty_wflush();
 }
 
 void screen_init(void)
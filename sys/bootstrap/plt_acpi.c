@@ -66,6 +66,7 @@ static unsigned _vga_found = 0;
 #define PCI_BRIDGE_PMEMBASE(reg) ((reg) & 0xFFFF)
 #define PCI_BRIDGE_PMEMLIMIT(reg) (((reg) >> 16) & 0xFFFF)
 #define PCI_BRIDGE_SECONDBUS(reg) (((reg) >> 8) & 0xFF)
+#define PCI_BRIDGE_SUBBUS(reg)    (((reg) >> 16) & 0xFF)
 #define PCI_INTR_PIN(reg)         (((reg) >> 8) & 0xFF)
 #define PCI_CAP_PTR(reg)          ((reg) & 0xFF)
 #define PCI_CAP_TYPE(reg)         ((reg) & 0xFF)
@@ -398,6 +399,26 @@ acpi_per_device(ACPI_HANDLE devhandle, UINT32 level, void *ctx, void **retval)
  * identifiers by the platform BIOS.
  */
 
+static ACPI_STATUS
+pci_rdcfg(ACPI_PCI_ID *id, UINT32 reg, UINT64 *val, UINT32 width)
+{
+	uint32_t v;
+
+	if (pltpci_rdcfg(id->Bus, id->Device, id->Function, reg, width, &v))
+		return AE_ERROR;
+	*val = v;
+	return AE_OK;
+}
+
+static ACPI_STATUS
+pci_wrcfg(ACPI_PCI_ID *id, UINT32 reg, UINT64 val, UINT32 width)
+{
+
+	if (pltpci_wrcfg(id->Bus, id->Device, id->Function, reg, width, val))
+		return AE_ERROR;
+	return AE_OK;
+}
+
 static int
 getnfuncs(int bus, int dev)
 {
@@ -411,7 +432,7 @@ getnfuncs(int bus, int dev)
 	acpi_pciid.Device = dev;
 	acpi_pciid.Function = 0;
 
-	as = AcpiOsReadPciConfiguration(&acpi_pciid, PCI_HDRTYPE_REG, &reg, 32);
+	as = pci_rdcfg(&acpi_pciid, PCI_HDRTYPE_REG, &reg, 32);
 	if (ACPI_FAILURE(as))
 		return 0;
 
@@ -472,7 +493,7 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 
 	printf(",%s", name);
 
-	AcpiOsReadPciConfiguration(&acpi_pciid, PCI_VENDOR_REG, &reg, 32);
+	pci_rdcfg(&acpi_pciid, PCI_VENDOR_REG, &reg, 32);
 	snprintf(name, 13, "PCI%04x.%04x",
 		 (uint16_t)PCI_VENDOR(reg), (uint16_t)PCI_DEVICE(reg));
 	hwcreat.deviceids[j++] = squoze(name);
@@ -484,7 +505,7 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 	   associated with it. Work around this by creating
 	   an extra 'VGA' device when we found a compatible one. */
 	if (!_vga_found) {
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_CLASS_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_CLASS_REG, &reg, 32);
 		reg = PCI_CLASS(reg);
 		switch (reg) {
 		case 0x000100: /* class 0, subclass 1, prog-if 0 */
@@ -518,7 +539,7 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 	}
   skip_acpi_dev_info:
 	if (i < (SYS_HWCREAT_MAX_DEVIDS - j)) {
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_CLASS_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_CLASS_REG, &reg, 32);
 		reg = PCI_CLASS(reg);
 		snprintf(name, 13, "PCI%02x.%02x.%02x",
 			 (unsigned)(reg >> 16) & 0xff,
@@ -529,7 +550,7 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 	}
 
 	/* Populate IRQs */
-	AcpiOsReadPciConfiguration(&acpi_pciid, PCI_INTR_REG, &reg, 32);
+	pci_rdcfg(&acpi_pciid, PCI_INTR_REG, &reg, 32);
 	if (PCI_INTR_PIN(reg) != 0 && PCI_INTR_PIN(reg) < 5) {
 		uint8_t pin = PCI_INTR_PIN(reg);
 		uint8_t nxtcap;
@@ -550,28 +571,28 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 
 #if 0
 		/* Enable Interrupt */
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_CMD_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_CMD_REG, &reg, 32);
 
 		printf("cmd = %lx", reg);
 		if (reg & PCI_CMD_ID) {
 			reg &= ~PCI_CMD_ID;
-			AcpiOsWritePciConfiguration(&acpi_pciid, PCI_CMD_REG, reg, 32);
+			pci_wrcfg(&acpi_pciid, PCI_CMD_REG, reg, 32);
 		}
 
 		/* Disable MSIs */
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_CAP_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_CAP_REG, &reg, 32);
 		nxtcap = PCI_CAP_PTR(reg);
 
 		while(nxtcap) {
 			uint16_t msictl;
 
 			printf("nxtcap = %x,", nxtcap);
-			AcpiOsReadPciConfiguration(&acpi_pciid, nxtcap, &reg, 32);
+			pci_rdcfg(&acpi_pciid, nxtcap, &reg, 32);
 			if (PCI_CAP_TYPE(reg) == PCI_CAP_TYPE_MSI) {
 				msictl = PCI_CAP_MSICTL(reg);
 				printf("MSI:%d", msictl & 1);
 				reg &= ~PCI_MSICTL_MSIEN;
-				AcpiOsWritePciConfiguration(&acpi_pciid, nxtcap, reg, 32);
+				pci_wrcfg(&acpi_pciid, nxtcap, reg, 32);
 			}
 
 			nxtcap = PCI_CAP_NEXT(reg);
@@ -580,7 +601,7 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 
 	}
 
-	AcpiOsReadPciConfiguration(&acpi_pciid, PCI_HDRTYPE_REG, &reg, 32);
+	pci_rdcfg(&acpi_pciid, PCI_HDRTYPE_REG, &reg, 32);
 	hdrtype = PCI_HDRTYPE(reg) & 0x7f;
 
 	switch (hdrtype) {
@@ -606,7 +627,7 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 		uint32_t iobase, iolen;
 
 		reg = 0;
-		if (AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BAR_REG(i), &reg, 32))
+		if (pci_rdcfg(&acpi_pciid, PCI_BAR_REG(i), &reg, 32))
 			continue;
 
 		if (reg == 0)
@@ -619,11 +640,11 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 
 		orig = reg;
 
-		if (AcpiOsWritePciConfiguration(&acpi_pciid, PCI_BAR_REG(i), (uint64_t)-1, 32))
+		if (pci_wrcfg(&acpi_pciid, PCI_BAR_REG(i), (uint64_t)-1, 32))
 			continue;
-		if (AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BAR_REG(i), &size, 32))
+		if (pci_rdcfg(&acpi_pciid, PCI_BAR_REG(i), &size, 32))
 			continue;
-		if (AcpiOsWritePciConfiguration(&acpi_pciid, PCI_BAR_REG(i), orig, 32))
+		if (pci_wrcfg(&acpi_pciid, PCI_BAR_REG(i), orig, 32))
 			continue;
 		size &= ~(uint64_t)0x3LL;
 		if (size == 0)
@@ -659,11 +680,11 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 		int base32, limit32;
 		uint32_t iobase, iolimit;
 
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BRIDGE_IO_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_BRIDGE_IO_REG, &reg, 32);
 		iobase = (PCI_BRIDGE_IOBASE(reg) & 0xf0) << 8;
 		iolimit = 0xfff | ((PCI_BRIDGE_IOLIMIT(reg)& 0xf0) << 8);
 
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BRIDGE_IOUPPER_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_BRIDGE_IOUPPER_REG, &reg, 32);
 		if ((PCI_BRIDGE_IOBASE(reg) & 0xf) == 1) {
 			iobase |= (PCI_BRIDGE_IOBASE_UPPER(reg) << 16);
 		}
@@ -685,7 +706,7 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 		uint64_t membase, memlen;
 
 		reg = 0;
-		if (AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BAR_REG(i), &reg, 32))
+		if (pci_rdcfg(&acpi_pciid, PCI_BAR_REG(i), &reg, 32))
 			continue;
 
 		if (reg == 0)
@@ -697,11 +718,11 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 		}
 
 		orig = reg;
-		if (AcpiOsWritePciConfiguration(&acpi_pciid, PCI_BAR_REG(i), (uint64_t)-1, 32))
+		if (pci_wrcfg(&acpi_pciid, PCI_BAR_REG(i), (uint64_t)-1, 32))
 			continue;
-		if (AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BAR_REG(i), &size, 32))
+		if (pci_rdcfg(&acpi_pciid, PCI_BAR_REG(i), &size, 32))
 			continue;
-		if (AcpiOsWritePciConfiguration(&acpi_pciid, PCI_BAR_REG(i), orig, 32))
+		if (pci_wrcfg(&acpi_pciid, PCI_BAR_REG(i), orig, 32))
 			continue;
 		size &= ~(uint64_t)0xfLL;
 		if (size == 0)
@@ -734,7 +755,7 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 	if (hdrtype == 1) {
 		uint64_t membase, memlimit;
 
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BRIDGE_MEM_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_BRIDGE_MEM_REG, &reg, 32);
 		membase = (PCI_BRIDGE_MEMBASE(reg) & 0xfff0) << 20;
 		memlimit = ((PCI_BRIDGE_MEMLIMIT(reg) & 0xfff0) << 20) + 0xfffff;
 		if (membase < memlimit) {
@@ -745,13 +766,13 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 		}
 
 
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BRIDGE_PMEM_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_BRIDGE_PMEM_REG, &reg, 32);
 		membase = (PCI_BRIDGE_PMEMBASE(reg) & 0xfff0) << 20;
 		memlimit = ((PCI_BRIDGE_PMEMLIMIT(reg) & 0xfff0) << 20) + 0xfffff;
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BRIDGE_PMEM_BASEUPPER_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_BRIDGE_PMEM_BASEUPPER_REG, &reg, 32);
 		if (reg != (uint32_t)-1)
 			membase |= (reg << 32);
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BRIDGE_PMEM_LIMITUPPER_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_BRIDGE_PMEM_LIMITUPPER_REG, &reg, 32);
 		if (reg != (uint32_t)-1)
 			memlimit |= (uint64_t)reg << 32;
 
@@ -776,10 +797,13 @@ acpi_pci_scandevice(void *root, int bus, int dev, int func, struct bridgeirqs *b
 		for (i = 0; i < 4; i++)
 			brirqs.ints[i] = ints[i];
 
-		AcpiOsReadPciConfiguration(&acpi_pciid, PCI_BRIDGE_BUSNO_REG, &reg, 32);
+		pci_rdcfg(&acpi_pciid, PCI_BRIDGE_BUSNO_REG, &reg, 32);
 		subbus = PCI_BRIDGE_SECONDBUS(reg);
 
-		acpi_pci_scanbus(subdev, subbus, &brirqs);
+		/* Only follow configured bridges: buses behind them
+		 * are numbered after ours. */
+		if (subbus > bus && subbus <= PCI_BRIDGE_SUBBUS(reg))
+			acpi_pci_scanbus(subdev, subbus, &brirqs);
 	}
 	
 }
@@ -798,7 +822,7 @@ acpi_pci_scanbus(void *root, int bus, struct bridgeirqs *brirqs)
 		nfuncs = getnfuncs(bus, dev);
 		for (func = 0; func < nfuncs; func++) {
 			acpi_pciid.Function = func;
-			AcpiOsReadPciConfiguration(&acpi_pciid, PCI_VENDOR_REG, &reg, 32);
+			pci_rdcfg(&acpi_pciid, PCI_VENDOR_REG, &reg, 32);
 			if (PCI_VENDOR(reg) == 0xffff ||
 			    PCI_VENDOR(reg) == 0) {
 				continue;
@@ -838,6 +862,7 @@ acpi_pci_scan(void)
 
 	printf("PCI root device found at %s\n", unsquoze_inline(d->nameid).str);
 
+	pltpci_init();
 	pciroot = platform_getdev(d->nameid);
 	return acpi_pci_scanbus(pciroot, 0, NULL);
 }
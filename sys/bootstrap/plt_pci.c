@@ -1,107 +1,138 @@
 #include "internal.h"
 #include <sys/types.h>
 #include <microkernel.h>
-#include <squoze.h>
+#include <acpi/acpi.h>
 #include <stdio.h>
 #include <errno.h>
 #include <mrg.h>
 
-#define perror(...) printf(__VA_ARGS__)
-#warning add perror
-
 
 /*
- * PCI bus.
+ * PCI configuration space access.
+ *
+ * If the ACPI MCFG table describes an ECAM area for segment 0,
+ * configuration space is memory mapped, one bus at a time on first
+ * access, and reads and writes are plain loads and stores.
+ * Otherwise we use the 0xCF8/0xCFC ports through the ACPI OS layer.
  */
 
-
-#define PCI_VENDOR(reg)		((reg) & 0xFFFF)
-#define PCI_DEVICE(reg)		(((reg) >> 16) & 0xFFFF)
-#define PCI_VENDOR_INVALID	0xFFFF
-#define PCI_VENDOR_ID		0x00
-
-#define PCI_HDRTYPE		0x0E
-
-static DEVICE *rootdev = NULL;
+#define ECAM_BUSSHIFT 20
+#define ECAM_OFF(dev, func, reg)				\
+	(((dev) << 15) | ((func) << 12) | ((reg) & 0xfff))
 
 enum pci_cfg_method {
 	UNKNOWN,
 	IO,
+	ECAM,
 } pci_cfg_method = UNKNOWN;
 
+static uint64_t ecam_base;
+static unsigned ecam_startbus;
+static unsigned ecam_endbus;
+static volatile uint8_t *ecam_bus[256];
 
-int
-pltpci_rdcfg_io(unsigned bus, unsigned dev, unsigned func,
-		uint16_t reg, int width, uint32_t *value)
+static volatile void *
+ecam_ptr(unsigned bus, unsigned dev, unsigned func, uint16_t reg)
 {
-	int ret;
-	uint32_t inaddr = 0xcfc + (reg & 3);
-	uint32_t outval = (bus << 16)
-		| (dev << 11)
-		| (func << 8)
-		| (reg & ~0x3)
-		| 0x80000000; /* enable bit */
-	uint32_t port;
-	uint64_t cfgval;
-
-	ret = dout(rootdev, IOPORT_DWORD(0xcf8), outval);
-	if (ret)
-		return ret;
+	void *ptr;
+
+	if (bus < ecam_startbus || bus > ecam_endbus)
+		return NULL;
+	if (ecam_bus[bus] == NULL) {
+		ptr = AcpiOsMapMemory(ecam_base + ((uint64_t)bus << ECAM_BUSSHIFT),
+				      1 << ECAM_BUSSHIFT);
+		if (ptr == NULL)
+			return NULL;
+		ecam_bus[bus] = ptr;
+	}
+	return ecam_bus[bus] + ECAM_OFF(dev, func, reg);
+}
+
+static int
+pltpci_rdcfg_ecam(unsigned bus, unsigned dev, unsigned func,
+		  uint16_t reg, int width, uint32_t *value)
+{
+	volatile void *ptr;
+
+	ptr = ecam_ptr(bus, dev, func, reg);
+	if (ptr == NULL)
+		return -EINVAL;
+
 	switch (width) {
-	case 32: 
-		port = IOPORT_DWORD(inaddr);
+	case 32:
+		*value = *(volatile uint32_t *)ptr;
 		break;
 	case 16:
-		port = IOPORT_WORD(inaddr);
+		*value = *(volatile uint16_t *)ptr;
 		break;
 	case 8:
-		port = IOPORT_BYTE(inaddr);
+		*value = *(volatile uint8_t *)ptr;
 		break;
 	default:
 		return -EINVAL;
 	}
-	ret = din(rootdev, port, &cfgval);
-	if (ret) 
-		return ret;
-
-	*value = (uint32_t)cfgval;
 	return 0;
 }
 
-int
-pltpci_wrcfg_io(unsigned bus, unsigned dev, unsigned func,
-		uint16_t reg, int width, uint32_t value)
+static int
+pltpci_wrcfg_ecam(unsigned bus, unsigned dev, unsigned func,
+		  uint16_t reg, int width, uint32_t value)
 {
-	int ret;
-	uint32_t inaddr = 0xcfc + (reg & 3);
-	uint32_t outval = (bus << 16)
-		| (dev << 11)
-		| (func << 8)
-		| (reg & ~0x3)
-		| 0x80000000; /* enable bit */
-	uint32_t port;
-
-	ret = dout(rootdev, IOPORT_DWORD(0xcf8), outval);
-	if (ret)
-		return ret;
+	volatile void *ptr;
+
+	ptr = ecam_ptr(bus, dev, func, reg);
+	if (ptr == NULL)
+		return -EINVAL;
 
 	switch (width) {
-	case 32: 
-		port = IOPORT_DWORD(inaddr);
+	case 32:
+		*(volatile uint32_t *)ptr = value;
 		break;
 	case 16:
-		port = IOPORT_WORD(inaddr);
+		*(volatile uint16_t *)ptr = value;
 		break;
 	case 8:
-		port = IOPORT_BYTE(inaddr);
+		*(volatile uint8_t *)ptr = value;
 		break;
 	default:
 		return -EINVAL;
 	}
-	ret = dout(rootdev, port, (uint64_t)value);
-	if (ret)
-		return ret;
+	return 0;
+}
 
+static int
+pltpci_rdcfg_io(unsigned bus, unsigned dev, unsigned func,
+		uint16_t reg, int width, uint32_t *value)
+{
+	ACPI_STATUS as;
+	ACPI_PCI_ID pciid;
+	uint64_t val;
+
+	pciid.Segment = 0;
+	pciid.Bus = bus;
+	pciid.Device = dev;
+	pciid.Function = func;
+	as = AcpiOsReadPciConfiguration(&pciid, reg, &val, width);
+	if (ACPI_FAILURE(as))
+		return -EIO;
+	*value = (uint32_t)val;
+	return 0;
+}
+
+static int
+pltpci_wrcfg_io(unsigned bus, unsigned dev, unsigned func,
+		uint16_t reg, int width, uint32_t value)
+{
+	ACPI_STATUS as;
+	ACPI_PCI_ID pciid;
+
+	pciid.Segment = 0;
+	pciid.Bus = bus;
+	pciid.Device = dev;
+	pciid.Function = func;
+	as = AcpiOsWritePciConfiguration(&pciid, reg, value, width);
+	if (ACPI_FAILURE(as))
+		return -EIO;
 	return 0;
 }
 
@@ -111,6 +142,8 @@ pltpci_rdcfg(unsigned bus, unsigned dev, unsigned func,
 {
 
 	switch(pci_cfg_method) {
+	case ECAM:
+		return pltpci_rdcfg_ecam(bus, dev, func, reg, width, value);
 	case IO:
 		return pltpci_rdcfg_io(bus, dev, func, reg, width, value);
 	default:
@@ -125,6 +158,8 @@ pltpci_wrcfg(unsigned bus, unsigned dev, unsigned func,
 {
 
 	switch(pci_cfg_method) {
+	case ECAM:
+		return pltpci_wrcfg_ecam(bus, dev, func, reg, width, value);
 	case IO:
 		return pltpci_wrcfg_io(bus, dev, func, reg, width, value);
 	default:
@@ -133,103 +168,57 @@ pltpci_wrcfg(unsigned bus, unsigned dev, unsigned func,
 	}
 }
 
+/* Look for the ECAM area of segment 0 in the MCFG table. */
 static int
-getnfuncs(int bus, int dev)
+pltpci_mcfg(void)
 {
-	int ret;
-	uint32_t hdr;
+	ACPI_STATUS as;
+	ACPI_TABLE_HEADER *hdr;
+	ACPI_MCFG_ALLOCATION *alloc;
+	uint8_t *end;
 
-	ret = pltpci_rdcfg(bus, dev, 0, PCI_HDRTYPE, 8, &hdr);
-	if (ret)
-		return ret;
-	return hdr & 0x80 ? 8 : 1;
-}
+	as = AcpiGetTable(ACPI_SIG_MCFG, 1, &hdr);
+	if (ACPI_FAILURE(as))
+		return -ENOENT;
 
+	alloc = (ACPI_MCFG_ALLOCATION *)((uint8_t *)hdr
+					 + sizeof(ACPI_TABLE_MCFG));
+	end = (uint8_t *)hdr + hdr->Length;
+	for (; (uint8_t *)(alloc + 1) <= end; alloc++) {
+		if (alloc->PciSegment != 0)
+			continue;
+		if (alloc->EndBusNumber < alloc->StartBusNumber)
+			continue;
+		ecam_base = alloc->Address;
+		ecam_startbus = alloc->StartBusNumber;
+		ecam_endbus = alloc->EndBusNumber;
+		return 0;
+	}
+	return -ENOENT;
+}
 
 int
 pltpci_init(void)
 {
 	uint32_t reg;
-	int i, nfuncs, ret, bus, dev, ndevs, func;
-	char name[13];
-	struct dinfo info;
-	struct device *tmp, *d = NULL;
-	uint64_t pnpid = squoze("PNP0A03");
-
-
-	/*
-	 * Search for PCI root.
-	 */
-
-	/* Search for PNP0A03 in devices */
-	SLIST_FOREACH(tmp, &devices, list) {
-		for (i = 0; i < DEVICEIDS; i++) {
-			if (tmp->deviceids[i] == pnpid)  {
-				d = tmp;
-				break;
-			}
-		}
-	}
-	if (d == NULL) {
-		printf("PCI root device not found\n");
-		return -ESRCH;
-	}
-
-	unsquozelen(d->nameid, 13, name);
-	printf("PCI root device found at %s\n", name);
 
-
-	/*
-	 * Open PCI device
-	 */
-
-	rootdev = dopen(name);
-	if (rootdev == NULL) {
-		perror("open(%s)", name);
-		return -ENOENT;
-	}
-
-	ret = dgetinfo(rootdev, &info);
-	if (ret < 0) {
-		perror("dinfo(%s)", name);
-		return -EINVAL;
-	}
-
-	/*
-	 * Determine PCI access method.
-	 */
-
-	/* Having I/O  ports is a  pretty good indication of  us being
-	 * able to use I/O ports.  */
-	if ((info.npios != 0) && (dgetpio(rootdev, 0) == 0xcf8)) {
-		pci_cfg_method = IO;
-		goto scan;
-	}
-
-	if (pci_cfg_method == UNKNOWN)
-		return -ENOTSUP;
-
-	/*
-	 * Scan PCI bus
-	 */
-scan:
-	ndevs = 0;
-	for (bus = 0; bus < 256; bus++) {
-		for (dev = 0; dev < 32; dev++) {
-			nfuncs = getnfuncs(bus, dev);
-			for (func = 0; func < nfuncs; func++) {
-				if (pltpci_rdcfg(bus, dev, func,
-						 PCI_VENDOR_ID, 32, &reg))
-					continue;
-				if (PCI_VENDOR(reg) == PCI_VENDOR_INVALID ||
-				    PCI_VENDOR(reg) == 0)
-					continue;
-				printf("%02x:%02x.%d\n", bus, dev, func);
-				ndevs++;
-			}
+	if (pci_cfg_method != UNKNOWN)
+		return 0;
+
+	if (pltpci_mcfg() == 0) {
+		pci_cfg_method = ECAM;
+		/* Check that the area really decodes bus 0. */
+		if (ecam_startbus == 0
+		    && pltpci_rdcfg(0, 0, 0, 0, 32, &reg) == 0
+		    && reg != 0xffffffff) {
+			printf("PCI: ECAM at %llx, buses %02x-%02x\n",
+			       ecam_base, ecam_startbus, ecam_endbus);
+			return 0;
 		}
+		printf("PCI: unusable ECAM at %llx\n", ecam_base);
 	}
-	printf("Found %d PCI devices/funcs\n", ndevs);
-	
+
+	pci_cfg_method = IO;
+	printf("PCI: using configuration ports\n");
 	return 0;
 }
@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2016, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Microbenchmarks of kernel and runtime primitives.
+ *
+ * Every benchmark is timed with the TSC and reports one line:
+ *
+ *   BENCH name=<name> [key=value...] n=<samples> min=<> p50=<> p90=<>
+ *         p99=<> max=<> unit=cycles
+ *
+ * Bandwidth lines add 'size' and, if the TSC could be calibrated
+ * against the system timer, 'mbps' at the median.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <microkernel.h>
+#include <machine/vmparam.h>
+#include <mrg.h>
+
+#define BENCH_N      1000
+#define BENCH_FORKN  100
+#define BENCH_PAGES  16
+#define BENCH_BWN    100
+#define BENCH_BUFSZ  (1024 * 1024)
+#define BENCH_STACK  (16 * 1024)
+
+#define BENCH_DEV    "bench0"
+
+/* usrdev ports. */
+#define BENCHIO_PING 0
+#define BENCHIO_BUF  1
+
+static uint64_t samples[BENCH_N];
+static uint64_t tsc_mhz;
+static int childevt;
+
+static inline uint64_t
+rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static int
+cmp64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *name, const char *extra, uint64_t *s, unsigned n)
+{
+
+	qsort(s, n, sizeof(*s), cmp64);
+	printf("BENCH name=%s%s n=%u min=%llu p50=%llu p90=%llu p99=%llu"
+	       " max=%llu unit=cycles\n", name, extra, n, s[0],
+	       s[(n - 1) * 50 / 100], s[(n - 1) * 90 / 100],
+	       s[(n - 1) * 99 / 100], s[n - 1]);
+}
+
+static void
+report_bw(const char *name, size_t size, uint64_t *s, unsigned n)
+{
+	char extra[64];
+	uint64_t p50;
+
+	qsort(s, n, sizeof(*s), cmp64);
+	p50 = s[(n - 1) / 2];
+	if (tsc_mhz && p50)
+		snprintf(extra, sizeof(extra), " size=%zu mbps=%llu", size,
+			 size * tsc_mhz / p50);
+	else
+		snprintf(extra, sizeof(extra), " size=%zu", size);
+	report(name, extra, s, n);
+}
+
+static void
+calibrate(void)
+{
+	uint64_t ns, t0;
+
+	ns = timer_nsecs();
+	t0 = rdtsc();
+	lwt_nsleep(100 * 1000 * 1000);
+	ns = timer_nsecs() - ns;
+	if (ns != 0)
+		tsc_mhz = (rdtsc() - t0) * 1000 / ns;
+	printf("BENCH name=tsc mhz=%llu\n", tsc_mhz);
+}
+
+static void
+child_hdlr(int intr, void *arg)
+{
+
+	__evtset(childevt);
+}
+
+static void
+reap(void)
+{
+	struct sys_childstat cs;
+
+	while (sys_childstat(&cs) < 0) {
+		evtwait(childevt);
+		evtclear(childevt);
+	}
+}
+
+static void
+bench_null(void)
+{
+	unsigned i;
+	uint64_t t0;
+
+	for (i = 0; i < BENCH_N; i++) {
+		t0 = rdtsc();
+		sys_getpid();
+		samples[i] = rdtsc() - t0;
+	}
+	report("null_syscall", "", samples, BENCH_N);
+}
+
+static void
+bench_fork(void)
+{
+	int pid;
+	unsigned i;
+	uint64_t t0;
+
+	for (i = 0; i < BENCH_FORKN; i++) {
+		t0 = rdtsc();
+		pid = sys_fork();
+		if (pid == 0)
+			sys_die(0);
+		if (pid < 0) {
+			printf("bench: fork failed (%d)\n", pid);
+			break;
+		}
+		reap();
+		samples[i] = rdtsc() - t0;
+	}
+	if (i != 0)
+		report("fork_die_childstat", "", samples, i);
+}
+
+/* Demand faults, then copy on write faults in a child. */
+static void
+bench_fault(void)
+{
+	int pid;
+	unsigned i;
+	uint64_t t0;
+	vaddr_t va;
+	size_t sz = (size_t)BENCH_PAGES << PAGE_SHIFT;
+
+	va = vmap_alloc(sz, VFNT_RWDATA);
+	assert(va != 0);
+	for (i = 0; i < BENCH_PAGES; i++) {
+		t0 = rdtsc();
+		*(volatile char *)(va + ((vaddr_t)i << PAGE_SHIFT)) = 1;
+		samples[i] = rdtsc() - t0;
+	}
+	report("pgfault", "", samples, BENCH_PAGES);
+
+	pid = sys_fork();
+	if (pid == 0) {
+		for (i = 0; i < BENCH_PAGES; i++) {
+			t0 = rdtsc();
+			*(volatile char *)(va + ((vaddr_t)i << PAGE_SHIFT)) = 2;
+			samples[i] = rdtsc() - t0;
+		}
+		report("cow_fault", "", samples, BENCH_PAGES);
+		sys_die(0);
+	}
+	if (pid < 0)
+		printf("bench: fork failed (%d)\n", pid);
+	else
+		reap();
+	vmap_free(va, sz);
+}
+
+static volatile uint64_t sig_t1;
+
+static void
+sig_hdlr(int intr, void *arg)
+{
+
+	sig_t1 = rdtsc();
+}
+
+static void
+bench_signal(void)
+{
+	unsigned i, intr;
+	uint64_t t0;
+
+	intr = intalloc();
+	inthandler(intr, sig_hdlr, NULL);
+	for (i = 0; i < BENCH_N; i++) {
+		t0 = rdtsc();
+		sys_raise(intr);
+		samples[i] = sig_t1 - t0;
+	}
+	intfree(intr);
+	report("signal", "", samples, BENCH_N);
+}
+
+static volatile int lwt_stop;
+
+static void
+yielder(void *arg)
+{
+
+	while (!lwt_stop)
+		lwt_yield();
+	lwt_sleep();
+}
+
+static void
+bench_lwt_yield(void)
+{
+	unsigned i;
+	uint64_t t0;
+	lwt_t *lwt;
+
+	lwt_stop = 0;
+	lwt = lwt_create(yielder, NULL, BENCH_STACK);
+	assert(lwt != NULL);
+	lwt_wake(lwt);
+	lwt_yield();
+
+	/* A round trip through the other LWT. */
+	for (i = 0; i < BENCH_N; i++) {
+		t0 = rdtsc();
+		lwt_yield();
+		samples[i] = rdtsc() - t0;
+	}
+	lwt_stop = 1;
+	lwt_yield();
+	report("lwt_yield", "", samples, BENCH_N);
+}
+
+static int evt_evt;
+static uint64_t evt_t0;
+
+static void
+evtwaiter(void *arg)
+{
+	unsigned i;
+
+	for (i = 0; i < BENCH_N; i++) {
+		evtwait(evt_evt);
+		samples[i] = rdtsc() - evt_t0;
+		evtclear(evt_evt);
+	}
+	lwt_sleep();
+}
+
+static void
+bench_evt(void)
+{
+	unsigned i;
+	lwt_t *lwt;
+
+	evt_evt = evtalloc();
+	lwt = lwt_create(evtwaiter, NULL, BENCH_STACK);
+	assert(lwt != NULL);
+	lwt_wake(lwt);
+	lwt_yield();
+
+	for (i = 0; i < BENCH_N; i++) {
+		evt_t0 = rdtsc();
+		evtset(evt_evt);
+		lwt_yield();
+	}
+	evtfree(evt_evt);
+	report("evtset_evtwait", "", samples, BENCH_N);
+}
+
+/* Process switch: ping-pong sys_yield() with a child. */
+static void
+bench_ctxsw(void)
+{
+	int pid;
+	unsigned i;
+	uint64_t t0;
+
+	pid = sys_fork();
+	if (pid == 0) {
+		for (i = 0; i < 2 * BENCH_N; i++)
+			sys_yield();
+		sys_die(0);
+	}
+	if (pid < 0) {
+		printf("bench: fork failed (%d)\n", pid);
+		return;
+	}
+	for (i = 0; i < BENCH_N; i++) {
+		t0 = rdtsc();
+		sys_yield();
+		samples[i] = (rdtsc() - t0) / 2;
+	}
+	reap();
+	report("ctxsw", "", samples, BENCH_N);
+}
+
+/*
+ * usrdev: the parent serves the device, the child measures the
+ * round trips, then the parent measures copies from and to a buffer
+ * exported by the child.
+ */
+
+static int reqevt;
+static unsigned devid;
+
+static void
+bench_devbw(unsigned id, u_long iova)
+{
+	static const size_t sizes[] = {
+		64, 512, 4096, 32768, 262144, BENCH_BUFSZ,
+	};
+	unsigned i, j;
+	uint64_t t0;
+	void *buf;
+
+	buf = malloc(BENCH_BUFSZ);
+	assert(buf != NULL);
+	memset(buf, 0, BENCH_BUFSZ);
+	for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+		for (i = 0; i < BENCH_BWN; i++) {
+			t0 = rdtsc();
+			devread(devid, id, iova, sizes[j], buf);
+			samples[i] = rdtsc() - t0;
+		}
+		report_bw("devread", sizes[j], samples, BENCH_BWN);
+		for (i = 0; i < BENCH_BWN; i++) {
+			t0 = rdtsc();
+			devwrite(devid, id, buf, sizes[j], iova);
+			samples[i] = rdtsc() - t0;
+		}
+		report_bw("devwrite", sizes[j], samples, BENCH_BWN);
+	}
+	free(buf);
+}
+
+static void
+devserver(void *arg)
+{
+	int id;
+	struct sys_poll_ior ior;
+
+	for (;;) {
+		evtwait(reqevt);
+		evtclear(reqevt);
+		while ((id = devpoll(devid, &ior)) >= 0) {
+			if (ior.op != SYS_POLL_OP_OUT)
+				continue;
+			if (ior.port == BENCHIO_BUF)
+				bench_devbw(id, ior.val);
+			devraiseirq(devid, id, 0);
+		}
+	}
+}
+
+static void
+devclient(void)
+{
+	int dd, irqevt;
+	unsigned i;
+	uint64_t t0, nameid = squoze(BENCH_DEV);
+	iova_t iova;
+	void *buf;
+	DEVICE *d;
+
+	for (i = 0; i < BENCH_N; i++) {
+		t0 = rdtsc();
+		dd = sys_open(nameid);
+		sys_close(dd);
+		samples[i] = rdtsc() - t0;
+	}
+	report("usrdev_open_close", "", samples, BENCH_N);
+
+	d = dopen(BENCH_DEV);
+	assert(d != NULL);
+	irqevt = evtalloc();
+	dmapirq(d, 0, irqevt);
+	for (i = 0; i < BENCH_N; i++) {
+		t0 = rdtsc();
+		dout(d, IOPORT_QWORD(BENCHIO_PING), i);
+		evtwait(irqevt);
+		evtclear(irqevt);
+		samples[i] = rdtsc() - t0;
+	}
+	report("usrdev_out_poll_irq", "", samples, BENCH_N);
+
+	buf = malloc(BENCH_BUFSZ);
+	assert(buf != NULL);
+	memset(buf, 0, BENCH_BUFSZ);
+	if (dexport(d, buf, BENCH_BUFSZ, &iova) == 0) {
+		dout(d, IOPORT_QWORD(BENCHIO_BUF), iova);
+		evtwait(irqevt);
+		evtclear(irqevt);
+	}
+	sys_die(0);
+}
+
+static void
+bench_usrdev(void)
+{
+	int ret, pid;
+	lwt_t *lwt;
+	struct sys_creat_cfg cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nameid = squoze(BENCH_DEV);
+	cfg.nirqs = 1;
+	reqevt = evtalloc();
+	ret = devcreat(&cfg, 0111, reqevt);
+	assert(ret >= 0);
+	devid = ret;
+
+	pid = sys_fork();
+	if (pid == 0)
+		devclient();
+	if (pid < 0) {
+		printf("bench: fork failed (%d)\n", pid);
+		devremove(devid);
+		evtfree(reqevt);
+		return;
+	}
+
+	lwt = lwt_create(devserver, NULL, BENCH_STACK);
+	assert(lwt != NULL);
+	lwt_wake(lwt);
+	reap();
+}
+
+void
+bench(void)
+{
+
+	childevt = evtalloc();
+	inthandler(INTR_CHILD, child_hdlr, NULL);
+
+	calibrate();
+	bench_null();
+	bench_signal();
+	bench_lwt_yield();
+	bench_evt();
+	bench_fault();
+	bench_fork();
+	bench_ctxsw();
+	bench_usrdev();
+	printf("BENCH name=done\n");
+}
@@ -151,6 +151,12 @@ test_usrexport(void)
 	lwt_sleep();
 }
 
+#if defined(TEST_BENCH)
+void bench(void);
+#elif defined(TEST_VIFPPS)
+void vifpps(void);
+#endif
+
 int
 main()
 {
@@ -160,6 +166,14 @@ main()
 	stderr = syscons;
 	setvbuf(syscons, NULL, _IONBF, 80);
 
+#if defined(TEST_BENCH)
+	bench();
+	lwt_sleep();
+#elif defined(TEST_VIFPPS)
+	vifpps();
+	lwt_sleep();
+#else
 //	test_idle_int();
 	test_usrexport();
+#endif
 }
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2016, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Packets per second between two rump kernels over virtif.
+ *
+ * The process forks and each side boots a rump kernel with a virt0
+ * interface, linked to the other's through the "vif0" user device.
+ * The child sends VIFPPS_N UDP datagrams to the parent as fast as it
+ * can, then a few short end markers. Both sides report one line, in
+ * the format of the other benchmarks:
+ *
+ *   BENCH name=virtif_tx size=<> n=<> pps=<>
+ *   BENCH name=virtif_rx size=<> n=<> lost=<> pps=<>
+ *
+ * Frames dropped on a full ring count as lost. pps is omitted if
+ * there is no system timer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <microkernel.h>
+#include <mrg.h>
+
+#include <rump/rump.h>
+#include <rump/netconfig.h>
+#include <rump/rump_syscalls.h>
+
+#define VIFPPS_N     100000
+#define VIFPPS_SIZE  64
+#define VIFPPS_NEND  16
+#define VIFPPS_PORT  5000
+#define VIFPPS_IF    "virt0"
+
+/* The rump kernel's (NetBSD) socket ABI, whatever the host's. */
+#define VIFPPS_AF_INET    2
+#define VIFPPS_SOCK_DGRAM 2
+
+struct vifpps_sin {
+	uint8_t len;
+	uint8_t family;
+	uint16_t port;		/* Big endian. */
+	uint32_t addr;		/* Big endian. */
+	uint8_t zero[8];
+};
+
+static const char *vifpps_addr[2] = { "10.93.0.1", "10.93.0.2" };
+
+static void
+vifpps_sin(struct vifpps_sin *sin, uint32_t addr)
+{
+
+	memset(sin, 0, sizeof(*sin));
+	sin->len = sizeof(*sin);
+	sin->family = VIFPPS_AF_INET;
+	sin->port = __builtin_bswap16(VIFPPS_PORT);
+	sin->addr = __builtin_bswap32(addr);
+}
+
+static void
+vifpps_report(const char *name, const char *extra, unsigned n,
+	      uint64_t ns)
+{
+
+	if (ns != 0)
+		printf("BENCH name=%s size=%u n=%u%s pps=%llu\n", name,
+		       VIFPPS_SIZE, n, extra, (uint64_t)n * 1000000000 / ns);
+	else
+		printf("BENCH name=%s size=%u n=%u%s\n", name, VIFPPS_SIZE,
+		       n, extra);
+}
+
+/* Boot a rump kernel as side 'n' and return a UDP socket. */
+static int
+vifpps_setup(int n)
+{
+	int ret;
+
+	ret = rump_init();
+	if (ret == 0)
+		ret = rump_pub_netconfig_ifcreate(VIFPPS_IF);
+	if (ret == 0)
+		ret = rump_pub_netconfig_ipv4_ifaddr(VIFPPS_IF,
+						     vifpps_addr[n],
+						     "255.255.255.0");
+	if (ret != 0) {
+		printf("BENCH name=virtif error=%d\n", ret);
+		return -1;
+	}
+	return rump_sys_socket(VIFPPS_AF_INET, VIFPPS_SOCK_DGRAM, 0);
+}
+
+static void
+vifpps_send(void)
+{
+	int s;
+	unsigned i, n = 0;
+	uint64_t t0, t1;
+	uint8_t buf[VIFPPS_SIZE];
+	struct vifpps_sin dst;
+
+	s = vifpps_setup(1);
+	if (s < 0)
+		return;
+	/* Let the receiver boot and bind. */
+	lwt_nsleep(1000ULL * 1000 * 1000);
+
+	vifpps_sin(&dst, 0x0a5d0001);
+	memset(buf, 0xa5, sizeof(buf));
+	t0 = timer_nsecs();
+	for (i = 0; i < VIFPPS_N; i++)
+		if (rump_sys_sendto(s, buf, sizeof(buf), 0,
+				    (void *)&dst, sizeof(dst)) == sizeof(buf))
+			n++;
+	t1 = timer_nsecs();
+
+	/* Let the ring drain before the end markers. */
+	for (i = 0; i < VIFPPS_NEND; i++) {
+		lwt_nsleep(10 * 1000 * 1000);
+		rump_sys_sendto(s, buf, 1, 0, (void *)&dst, sizeof(dst));
+	}
+	vifpps_report("virtif_tx", "", n, t1 - t0);
+}
+
+static void
+vifpps_recv(void)
+{
+	int s;
+	ssize_t len;
+	unsigned n = 0;
+	uint64_t t0 = 0, t1 = 0;
+	char extra[32];
+	uint8_t buf[VIFPPS_SIZE];
+	struct vifpps_sin sin;
+
+	s = vifpps_setup(0);
+	if (s < 0)
+		return;
+	vifpps_sin(&sin, 0);
+	if (rump_sys_bind(s, (void *)&sin, sizeof(sin)) < 0) {
+		printf("BENCH name=virtif_rx error=bind\n");
+		return;
+	}
+
+	for (;;) {
+		len = rump_sys_recvfrom(s, buf, sizeof(buf), 0, NULL, NULL);
+		if (len < VIFPPS_SIZE)
+			break;
+		if (n++ == 0)
+			t0 = timer_nsecs();
+		t1 = timer_nsecs();
+	}
+	snprintf(extra, sizeof(extra), " lost=%u", VIFPPS_N - n);
+	vifpps_report("virtif_rx", extra, n, t1 - t0);
+}
+
+void
+vifpps(void)
+{
+
+	if (sys_fork() == 0) {
+		vifpps_send();
+		sys_die(0);
+	}
+	vifpps_recv();
+}
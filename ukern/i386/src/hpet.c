@@ -59,6 +59,8 @@
 #define REG_TMRCMP(_n) ((0x20 * (_n)) + 0x108)
 
 static volatile void *hpet_base;
+static paddr_t hpet_paddr;
+static uint64_t boottime;
 static uint32_t period_femto;
 static uint64_t gencfg;
 static uint64_t tmrcfg;
@@ -137,7 +139,8 @@ void hpet_init(void)
 		return;
 	}
 
-	hpet_base = kvmap(tbl->Address.Address, HPET_SIZE);
+	hpet_paddr = tbl->Address.Address;
+	hpet_base = kvmap(hpet_paddr, HPET_SIZE);
 	gencap = hpet_read(REG_GENCAP);
 	gencfg = 0;
 	period_femto = gencap >> 32;
@@ -191,6 +194,7 @@ void hpet_init(void)
 
 	/* Start Time of Boot. */
 	hpet_write(REG_COUNTER, 0);
+	boottime = rtc_readtime();
 
 	/* Setup Counter 0 */
 	hpet_write(REG_TMRCAP(TMR), tmrcfg);
@@ -211,6 +215,20 @@ uint64_t timer_readperiod(void)
 	return period_femto;
 }
 
+/* Wall time, in seconds since the Epoch, when the counter was zero. */
+uint64_t timer_readboottime(void)
+{
+	return boottime;
+}
+
+/* Physical address of the counter register, 0 if none. */
+paddr_t timer_counteraddr(void)
+{
+	if (hpet_base == NULL)
+		return 0;
+	return hpet_paddr + REG_COUNTER;
+}
+
 void timer_setcounter(uint64_t cnt)
 {
 	hpet_pause();
@@ -70,6 +70,8 @@ struct tss {
 #define PCI_CFG_ADDR 0xcf8
 #define PCI_CFG_DATA 0xcfc
 
+uint64_t rtc_readtime(void);
+
 static inline int inb(int port)
 {
 	int ret;
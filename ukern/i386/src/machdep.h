@@ -52,6 +52,8 @@ void usrframe_settls(struct usrframe *f, uaddr_t tls);
 
 uint64_t timer_readcounter(void);
 uint64_t timer_readperiod(void);
+uint64_t timer_readboottime(void);
+paddr_t timer_counteraddr(void);
 void timer_setcounter(uint64_t);
 void timer_setalarm(uint64_t);
 void timer_handler_cb(void);
@@ -44,9 +44,10 @@
 #define L1OFF(_a)  (((uintptr_t)(_a) & L1MASK) >> L1SHIFT)
 #define L1VA(_a)   (((_a) & 0x1ff) << L1SHIFT)
 
-/* L0: Actual PAE PTE, used only for linear maps here. Sorry. */
+/* L0: Actual PAE PTE, used for linear maps and split user pages. */
 #define L0SHIFT    12
 #define L0MASK     (0x1ff << L0SHIFT)
+#define L0OFF(_a)  (((uintptr_t)(_a) & L0MASK) >> L0SHIFT)
 #define L0VA(_a)   (((_a) & 0x1ff) << L0SHIFT)
 
 
@@ -71,6 +72,10 @@
 #define PG_AVAIL_COW     (1L << 9)
 #define PG_AVAIL_WIRED   (2L << 9)
 #define PG_AVAIL_IOMAP   (4L << 9)
+/* Not present: contents swapped out by the process. */
+#define PG_AVAIL_SWAP    (7L << 9)
+/* L1 entry pointing to a table of small pages. */
+#define PG_AVAIL_SPLIT   (3L << 9)
 
 #define __paeoffva(_l2,_l1,_l0) (L2VA(_l2) + L1VA(_l1) + L0VA(_l0))
 #define __val1tbl(_va) ((l1e_t *)__paeoffva(2, LINOFF+ 2, LINOFF + L2OFF(_va)))
@@ -85,6 +90,11 @@
 /* We use 2Mb pages, PAE has only 2 levels for to us */
 typedef uint64_t l2e_t;
 typedef uint64_t l1e_t;
+/* ...except in split L1 entries, pointing to 4k PTEs. */
+typedef uint64_t l0e_t;
+
+#define mkl0e(_a, _f) (trunc_4k((paddr_t)(_a)) | (_f))
+#define l0eaddr(_l0e) ((paddr_t)(_l0e) & 0x000ffffffffff000ULL)
 
 #define l1epfn(_l1e) ((_l1e)>>PAGE_SHIFT)
 #define l1eflags(_l1e) ((_l1e) & 0x8000000000000fffULL)
@@ -105,6 +115,10 @@ typedef uint64_t l1e_t;
 	(((_l1e) & (PG_AVAIL|PG_P)) == (PG_AVAIL_COW|PG_P))
 #define l1e_iomap(_l1e)						\
 	(((_l1e) & (PG_AVAIL|PG_P)) == (PG_AVAIL_IOMAP|PG_P))
-#define l1e_external(_l1e) (l1e_wired(_l1e) || l1e_iomap(_l1e))
+#define l1e_split(_l1e)						\
+	(((_l1e) & (PG_AVAIL|PG_P)) == (PG_AVAIL_SPLIT|PG_P))
+#define l1e_external(_l1e)					\
+	(l1e_wired(_l1e) || l1e_iomap(_l1e) || l1e_split(_l1e))
+#define l1e_swapped(_l1e) (((_l1e) & (PG_AVAIL|PG_P)) == PG_AVAIL_SWAP)
 
 #endif
@@ -40,6 +40,7 @@
 #include <uk/fixmems.h>
 #include <uk/structs.h>
 #include <uk/pfndb.h>
+#include <uk/vmap.h>
 #include <uk/kern.h>
 
 struct slab pmap_cache;
@@ -87,6 +88,8 @@ struct pmap *pmap_alloc(void)
 
 	pmap->lock = 0;
 	pmap->refcnt = 0;
+	pmap->nanon = 0;
+	pmap->nspages = 0;
 
 	return pmap;
 }
@@ -112,12 +115,484 @@ static l1e_t _pmap_set(struct pmap *pmap, l1e_t * l1p, l1e_t nl1e)
 	l1e_t ol1e;
 
 	ol1e = *l1p;
-	pmap->tlbflush = __tlbflushp(ol1e, nl1e);
+	pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
 	__setl1e(l1p, nl1e);
 
 	return ol1e;
 }
 
+/*
+ * Anonymous faults.
+ *
+ * Pages of anonymous regions are zero-filled on first access, and
+ * COW pages are copied (or reused, if this is the last reference)
+ * on write, without reflecting the fault to the process.
+ */
+
+#define ANON_NONE  0
+#define ANON_ZERO  1
+#define ANON_REUSE 2
+#define ANON_COPY  3
+
+/*
+ * Per-CPU kernel windows used to fill new anonymous pages: the new
+ * page, followed by the page copied from. The kernel is not
+ * preemptible, so a CPU uses its windows without locking.
+ */
+static vaddr_t pmap_fill_va[UKERN_MAX_CPUS];
+
+static struct pmap_anon *_pmap_anon_find(struct pmap *pmap, vaddr_t va)
+{
+	unsigned i;
+
+	for (i = 0; i < pmap->nanon; i++)
+		if (va >= pmap->anon[i].start && va < pmap->anon[i].end)
+			return pmap->anon + i;
+	return NULL;
+}
+
+/* Call with pmap lock held. */
+static int _pmap_anon_action(struct pmap *pmap, vaddr_t va,
+			     unsigned long err, l1e_t l1e)
+{
+	struct pmap_anon *anon;
+
+	anon = _pmap_anon_find(pmap, va);
+	if (anon == NULL || l1e_external(l1e) || l1e_swapped(l1e))
+		return ANON_NONE;
+
+	if (!l1e_present(l1e))
+		return ANON_ZERO;
+
+	if (l1e_cow(l1e) && (err & FAULT_W)
+	    && is_prot_writeable(anon->prot))
+		return pfn_getref(l1epfn(l1e)) == 1 ? ANON_REUSE : ANON_COPY;
+
+	return ANON_NONE;
+}
+
+/* Zero pfn, or copy spfn in it. */
+static void _pmap_fill(pfn_t pfn, pfn_t spfn)
+{
+	vaddr_t va = pmap_fill_va[cpu_number()];
+	vaddr_t sva = va + PAGE_SIZE;
+	l1e_t *l1p = __val1tbl(va) + L1OFF(va);
+	l1e_t *sl1p = __val1tbl(sva) + L1OFF(sva);
+
+	/* Only this CPU ever accesses its windows. */
+	__setl1e(l1p, mkl1e(ptoa(pfn), PROT_KERNWR));
+	if (spfn != PFN_INVALID)
+		__setl1e(sl1p, mkl1e(ptoa(spfn), PROT_KERN));
+	__flush_local_tlbs();
+
+	if (spfn != PFN_INVALID)
+		memcpy((void *) va, (void *) sva, PAGE_SIZE);
+	else
+		memset((void *) va, 0, PAGE_SIZE);
+
+	__setl1e(l1p, mkl1e(ptoa(PFN_INVALID), 0));
+	if (spfn != PFN_INVALID)
+		__setl1e(sl1p, mkl1e(ptoa(PFN_INVALID), 0));
+	__flush_local_tlbs();
+}
+
+static int _pmap_anon_fault(struct pmap *pmap, vaddr_t va, unsigned long err)
+{
+	int action;
+	pfn_t pfn, opfn = PFN_INVALID, npfn = PFN_INVALID;
+	pfn_t spfn = PFN_INVALID;
+	struct pmap_anon *anon;
+	l1e_t l1e, nl1e, *l1p = __val1tbl(va) + L1OFF(va);
+
+	spinlock(&pmap->lock);
+	l1e = *l1p;
+	action = _pmap_anon_action(pmap, va, err, l1e);
+	if (action == ANON_COPY) {
+		/* Hold the source while it is copied unlocked. */
+		spfn = l1epfn(l1e);
+		pfn_incref(spfn);
+	}
+	spinunlock(&pmap->lock);
+
+	if (action == ANON_NONE)
+		return 0;
+
+	if (action != ANON_REUSE) {
+		npfn = __allocuser();
+		if (npfn == PFN_INVALID) {
+			if (spfn != PFN_INVALID && !pfn_decref(spfn))
+				__freepage(spfn);
+			return 0;
+		}
+		_pmap_fill(npfn, spfn);
+	}
+
+	spinlock(&pmap->lock);
+	/* Our hold counts as a reference: drop it before checking. */
+	if (spfn != PFN_INVALID && !pfn_decref(spfn))
+		opfn = spfn;
+	if (*l1p != l1e || _pmap_anon_action(pmap, va, err, l1e) != action) {
+		/* Changed under our feet. Retry the access. */
+		spinunlock(&pmap->lock);
+		if (npfn != PFN_INVALID)
+			__freepage(npfn);
+		if (opfn != PFN_INVALID)
+			__freepage(opfn);
+		return 1;
+	}
+	anon = _pmap_anon_find(pmap, va);
+
+	switch (action) {
+	case ANON_ZERO:
+		pfn = npfn;
+		break;
+	case ANON_COPY:
+		pfn = npfn;
+		opfn = l1epfn(l1e);
+		break;
+	case ANON_REUSE:
+	default:
+		pfn = l1epfn(l1e);
+		break;
+	}
+
+	nl1e = l1e_mknormal(mkl1e(ptoa(pfn), anon->prot));
+	if (pfn == npfn)
+		pfn_incref(npfn);
+	pmap->tlbflush |= __tlbflushp(l1e, nl1e);
+	__setl1e(l1p, nl1e);
+	spinunlock(&pmap->lock);
+	pmap_commit(pmap);
+
+	if (opfn != PFN_INVALID && !pfn_decref(opfn))
+		__freepage(opfn);
+	return 1;
+}
+
+int pmap_uanon(struct pmap *pmap, vaddr_t start, vaddr_t end,
+	       pmap_prot_t prot)
+{
+	int ret = 0;
+	struct pmap_anon *anon;
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	spinlock(&pmap->lock);
+	anon = NULL;
+	for (anon = pmap->anon; anon < pmap->anon + pmap->nanon; anon++)
+		if (anon->start == start)
+			break;
+
+	if (!is_prot_present(prot)) {
+		/* Remove region starting at start. */
+		if (anon < pmap->anon + pmap->nanon)
+			*anon = pmap->anon[--pmap->nanon];
+		else
+			ret = -ENOENT;
+	} else if (anon < pmap->anon + pmap->nanon) {
+		anon->end = end;
+		anon->prot = prot;
+	} else if (pmap->nanon < PMAP_MAXANON) {
+		anon->start = start;
+		anon->end = end;
+		anon->prot = prot;
+		pmap->nanon++;
+	} else
+		ret = -ENOSPC;
+	spinunlock(&pmap->lock);
+
+	return ret;
+}
+
+/*
+ * Small pages.
+ *
+ * A split L1 entry points to a table of 4k PTEs. Tables and small
+ * pages are allocated from the 4k fixmem, which keeps track of the
+ * 4k blocks of each page it uses. Small pages are never shared:
+ * pmap_copy() copies them.
+ */
+
+#define l1el0tbl(_l1e) ((l0e_t *)(UKERNBASE + (uintptr_t)l0eaddr(_l1e)))
+#define l0epage(_l0e) ((void *)(UKERNBASE + (uintptr_t)l0eaddr(_l0e)))
+
+/*
+ * Small pages and the tables of split slots are carved out of user
+ * pages, allocated with GFP_CANFAIL from the direct mapped zones. The
+ * first small page of each chunk holds its header. Chunks with free
+ * small pages are kept in a list, and returned when empty.
+ *
+ * Each pmap is charged for its small pages, up to PMAP_MAXSPAGES.
+ */
+#define SPAGES_PER_PAGE (PAGE_SIZE >> SPAGE_SHIFT)
+
+struct spchunk {
+	LIST_ENTRY(spchunk) list;
+	unsigned nfree;
+	uint32_t bmap[SPAGES_PER_PAGE / 32];
+};
+
+static LIST_HEAD(, spchunk) spchunks = LIST_HEAD_INITIALIZER(spchunks);
+static lock_t spage_lock = 0;
+
+/* Zeroed small page, charged to pmap. NULL if none. */
+void *pmap_spage_alloc(struct pmap *pmap)
+{
+	pfn_t pfn;
+	unsigned i, j;
+	void *page;
+	struct spchunk *c;
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	spinlock(&spage_lock);
+	if (pmap->nspages >= PMAP_MAXSPAGES) {
+		spinunlock(&spage_lock);
+		return NULL;
+	}
+	c = LIST_FIRST(&spchunks);
+	if (c == NULL) {
+		pfn = pgalloc(1, PFNT_USER, GFP_KERN | GFP_CANFAIL);
+		if (pfn == PFN_INVALID) {
+			spinunlock(&spage_lock);
+			return NULL;
+		}
+		c = (struct spchunk *) ptova(pfn);
+		memset(c, 0, sizeof(*c));
+		c->bmap[0] = 1;
+		c->nfree = SPAGES_PER_PAGE - 1;
+		LIST_INSERT_HEAD(&spchunks, c, list);
+	}
+	for (i = 0; c->bmap[i] == (uint32_t)-1; i++);
+	j = ffs(~c->bmap[i]) - 1;
+	c->bmap[i] |= 1U << j;
+	if (--c->nfree == 0)
+		LIST_REMOVE(c, list);
+	pmap->nspages++;
+	spinunlock(&spage_lock);
+
+	page = (uint8_t *) c + ((i * 32 + j) << SPAGE_SHIFT);
+	memset(page, 0, SPAGE_SIZE);
+	return page;
+}
+
+void pmap_spage_free(struct pmap *pmap, void *page)
+{
+	unsigned n;
+	struct spchunk *c;
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	c = (struct spchunk *) trunc_page((vaddr_t) page);
+	n = ((vaddr_t) page - (vaddr_t) c) >> SPAGE_SHIFT;
+	assert(n != 0 && (c->bmap[n / 32] & (1U << (n % 32))));
+
+	spinlock(&spage_lock);
+	assert(pmap->nspages != 0);
+	pmap->nspages--;
+	c->bmap[n / 32] &= ~(1U << (n % 32));
+	if (c->nfree++ == 0)
+		LIST_INSERT_HEAD(&spchunks, c, list);
+	if (c->nfree == SPAGES_PER_PAGE - 1) {
+		LIST_REMOVE(c, list);
+		spinunlock(&spage_lock);
+		pgfree(vatop((vaddr_t) c), 1);
+		return;
+	}
+	spinunlock(&spage_lock);
+}
+
+/* Call with pmap lock held. */
+static l0e_t *_pmap_split(struct pmap *pmap, l1e_t * l1p)
+{
+	l0e_t *l0s;
+	l1e_t l1e = *l1p;
+
+	if (l1e_split(l1e))
+		return l1el0tbl(l1e);
+	if (l1e_present(l1e) || l1e_swapped(l1e))
+		return NULL;
+
+	l0s = pmap_spage_alloc(pmap);
+	if (l0s == NULL)
+		return NULL;
+	/* Permissions are in the small PTEs. Not present before:
+	 * no flush needed. */
+	__setl1e(l1p, mkl0e(DEUKERNBASE(l0s),
+			    PG_AVAIL_SPLIT | PG_A | PROT_USER_WRX));
+	return l0s;
+}
+
+/* Why _pmap_split() failed on l1e. */
+static int _pmap_nosplit(l1e_t l1e)
+{
+	return l1e_present(l1e) || l1e_swapped(l1e) ? -EBUSY : -ENOMEM;
+}
+
+/* Free a table no longer in use, and its small pages. */
+static void _pmap_l0free(struct pmap *pmap, l0e_t *l0s)
+{
+	int i;
+
+	for (i = 0; i < NPTES; i++)
+		if (l1e_normal(l0s[i]))
+			pmap_spage_free(pmap, l0epage(l0s[i]));
+	pmap_spage_free(pmap, l0s);
+}
+
+/* Copy the table of split l1e and its small pages into pmap. I/O
+ * pages are not inherited. Returns 0 if out of memory. */
+static l1e_t _pmap_l0copy(struct pmap *pmap, l1e_t l1e)
+{
+	int i;
+	void *page;
+	l0e_t *ol0s, *nl0s;
+
+	ol0s = l1el0tbl(l1e);
+	nl0s = pmap_spage_alloc(pmap);
+	if (nl0s == NULL)
+		return 0;
+	for (i = 0; i < NPTES; i++) {
+		if (!l1e_normal(ol0s[i]))
+			continue;
+		page = pmap_spage_alloc(pmap);
+		if (page == NULL) {
+			_pmap_l0free(pmap, nl0s);
+			return 0;
+		}
+		memcpy(page, l0epage(ol0s[i]), SPAGE_SIZE);
+		nl0s[i] = mkl0e(DEUKERNBASE(page),
+				ol0s[i] & ~l0eaddr(ol0s[i]));
+	}
+	return mkl0e(DEUKERNBASE(nl0s), l1e & ~l0eaddr(l1e));
+}
+
+/*
+ * Enter the small page at kernel address 'page' at va, or clear it
+ * if page is NULL. The replaced page, if any, is returned in *opage
+ * and must be freed after pmap_commit().
+ */
+int pmap_usenter(struct pmap *pmap, vaddr_t va, void *page,
+		 pmap_prot_t prot, void **opage)
+{
+	int ret;
+	l1e_t *l1p;
+	l0e_t ol0e, nl0e, *l0s;
+
+	assert(__isuaddr(va));
+	if (page != NULL)
+		assert(is_prot_present(prot) && is_prot_user(prot));
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	if (pmap == pmap_current())
+		l1p = __val1tbl(va) + L1OFF(va);
+	else
+		panic("small pages on different pmap not supported.");
+
+	*opage = NULL;
+	nl0e = page != NULL ? mkl0e(DEUKERNBASE(page), prot) : 0;
+	spinlock(&pmap->lock);
+	if (page != NULL)
+		l0s = _pmap_split(pmap, l1p);
+	else
+		l0s = l1e_split(*l1p) ? l1el0tbl(*l1p) : NULL;
+	if (l0s == NULL) {
+		ret = page == NULL ? 0 : _pmap_nosplit(*l1p);
+		spinunlock(&pmap->lock);
+		return ret;
+	}
+	ol0e = l0s[L0OFF(va)];
+	if (l1e_iomap(ol0e)) {
+		spinunlock(&pmap->lock);
+		return -EBUSY;
+	}
+	if (l1e_present(ol0e))
+		pmap->tlbflush |= TLBF_NORMAL;
+	__setl1e(l0s + L0OFF(va), nl0e);
+	spinunlock(&pmap->lock);
+
+	if (l1e_normal(ol0e))
+		*opage = l0epage(ol0e);
+	return 0;
+}
+
+int pmap_uschprot(struct pmap *pmap, vaddr_t va, pmap_prot_t prot)
+{
+	l1e_t l1e, *l1p;
+	l0e_t ol0e, *l0p;
+
+	assert(__isuaddr(va));
+	assert(is_prot_present(prot) && is_prot_user(prot));
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	if (pmap == pmap_current())
+		l1p = __val1tbl(va) + L1OFF(va);
+	else
+		panic("small pages on different pmap not supported.");
+
+	spinlock(&pmap->lock);
+	l1e = *l1p;
+	if (!l1e_split(l1e)) {
+		spinunlock(&pmap->lock);
+		return -EPERM;
+	}
+	l0p = l1el0tbl(l1e) + L0OFF(va);
+	ol0e = *l0p;
+	if (!l1e_normal(ol0e)) {
+		/* Not present or I/O. */
+		spinunlock(&pmap->lock);
+		return -EPERM;
+	}
+	__setl1e(l0p, mkl0e(l0eaddr(ol0e), prot));
+	pmap->tlbflush |= TLBF_NORMAL;
+	spinunlock(&pmap->lock);
+
+	return 0;
+}
+
+int pmap_usiomap(struct pmap *pmap, vaddr_t va, paddr_t pa,
+		 pmap_prot_t prot)
+{
+	int ret;
+	l1e_t *l1p;
+	l0e_t *l0s;
+
+	assert(__isuaddr(va));
+	assert(is_prot_present(prot) && is_prot_user(prot));
+	assert(pfn_is_mmio(atop(pa)));
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	if (pmap == pmap_current())
+		l1p = __val1tbl(va) + L1OFF(va);
+	else
+		panic("iomap on foreign pmaps arbitrarily not supported.");
+
+	spinlock(&pmap->lock);
+	l0s = _pmap_split(pmap, l1p);
+	if (l0s == NULL) {
+		ret = _pmap_nosplit(*l1p);
+		spinunlock(&pmap->lock);
+		return ret;
+	}
+	if (l1e_present(l0s[L0OFF(va)])) {
+		spinunlock(&pmap->lock);
+		return -EBUSY;
+	}
+	__setl1e(l0s + L0OFF(va), l1e_mkiomap(mkl0e(pa, prot)));
+	spinunlock(&pmap->lock);
+
+	return 0;
+}
+
 int _pmap_fault(vaddr_t va, unsigned long err, struct usrframe *f)
 {
 	int is_cow = 0;
@@ -125,6 +600,9 @@ int _pmap_fault(vaddr_t va, unsigned long err, struct usrframe *f)
 	struct pmap *pmap = pmap_current();
 	l1e_t l1e, *l1p = __val1tbl(va) + L1OFF(va);
 
+	if ((err & FAULT_U) && __isuaddr(va) && _pmap_anon_fault(pmap, va, err))
+		return 1;
+
 	spinlock(&pmap->lock);
 	l1e = *l1p;
 	if (l1e_cow(l1e)) {
@@ -220,7 +698,7 @@ int pmap_uiomap(struct pmap *pmap, vaddr_t va, pfn_t pfn,
 			*opfn = PFN_INVALID;
 		return -EBUSY;
 	}
-	pmap->tlbflush = __tlbflushp(ol1e, nl1e);
+	pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
 	__setl1e(l1p, nl1e);
 	spinunlock(&pmap->lock);
 
@@ -246,13 +724,18 @@ int pmap_uiounmap(struct pmap *pmap, vaddr_t va)
 
 	spinlock(&pmap->lock);
 	ol1e = *l1p;
+	if (l1e_split(ol1e)) {
+		/* Small I/O page. */
+		l1p = l1el0tbl(ol1e) + L0OFF(va);
+		ol1e = *l1p;
+	}
 	if (!l1e_iomap(ol1e)) {
 		/* Not iomap! */
 		spinunlock(&pmap->lock);
 		return -1;
 	}
 	nl1e = mkl1e(PFN_INVALID, 0);
-	pmap->tlbflush = __tlbflushp(ol1e, nl1e);
+	pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
 	__setl1e(l1p, nl1e);
 	spinunlock(&pmap->lock);
 
@@ -274,7 +757,7 @@ int pmap_phys(struct pmap *pmap, vaddr_t va, pfn_t *pfn)
 	ret = -EFAULT;
 	spinlock(&pmap->lock);
 	l1e = *l1p;
-	if (l1e_external(l1e) && l1e_present(l1e)) {
+	if (l1e_external(l1e) && !l1e_split(l1e) && l1e_present(l1e)) {
 		*pfn = l1epfn(l1e);
 		ret = 0;
 	}
@@ -306,6 +789,17 @@ int pmap_uenter(struct pmap *pmap, vaddr_t va, pfn_t pfn,
 	nl1e = l1e_mknormal(mkl1e(ptoa(pfn), prot));
 	spinlock(&pmap->lock);
 	ol1e = *l1p;
+	if (l1e_split(ol1e) && !is_prot_present(prot)) {
+		/* Clearing the whole slot: free its small pages. */
+		__setl1e(l1p, nl1e);
+		pmap->tlbflush |= TLBF_NORMAL;
+		spinunlock(&pmap->lock);
+		pmap_commit(pmap);
+		_pmap_l0free(pmap, l1el0tbl(ol1e));
+		if (opfn)
+			*opfn = PFN_INVALID;
+		return 0;
+	}
 	if (l1e_external(ol1e)) {
 		/* Externally controlled */
 		spinunlock(&pmap->lock);
@@ -315,7 +809,51 @@ int pmap_uenter(struct pmap *pmap, vaddr_t va, pfn_t pfn,
 	}
 	if (nl1e & PG_P)
 		pfn_incref(l1epfn(nl1e));
-	pmap->tlbflush = __tlbflushp(ol1e, nl1e);
+	pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
+	__setl1e(l1p, nl1e);
+	spinunlock(&pmap->lock);
+
+	if (l1e_normal(ol1e) && !pfn_decref(l1epfn(ol1e)))
+		*opfn = l1epfn(ol1e);
+	else
+		*opfn = PFN_INVALID;
+	return 0;
+}
+
+/* Like pmap_uenter(), but only if no page is present at va. */
+int pmap_ufill(struct pmap *pmap, vaddr_t va, pfn_t pfn,
+	       pmap_prot_t prot, pfn_t * opfn)
+{
+	l1e_t ol1e, nl1e, *l1p;
+
+	assert(__isuaddr(va));
+	assert(is_prot_present(prot) && is_prot_user(prot));
+	assert(pfn_is_userpage(pfn));
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	if (pmap == pmap_current())
+		l1p = __val1tbl(va) + L1OFF(va);
+	else
+		l1p = pmap->l1s + NPTES * L2OFF(va) + L1OFF(va);
+
+	nl1e = l1e_mknormal(mkl1e(ptoa(pfn), prot));
+	spinlock(&pmap->lock);
+	ol1e = *l1p;
+	if (l1e_external(ol1e)) {
+		/* Split, I/O or wired: can't be filled. */
+		spinunlock(&pmap->lock);
+		*opfn = PFN_INVALID;
+		return -EBUSY;
+	}
+	if (l1e_present(ol1e) || l1e_swapped(ol1e)) {
+		spinunlock(&pmap->lock);
+		*opfn = PFN_INVALID;
+		return -EEXIST;
+	}
+	pfn_incref(pfn);
+	pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
 	__setl1e(l1p, nl1e);
 	spinunlock(&pmap->lock);
 
@@ -409,10 +947,89 @@ int pmap_uchprot(struct pmap *pmap, vaddr_t va, pmap_prot_t prot)
 	assert(l1e_normal(ol1e));
 	nl1e = l1e_mknormal(mkl1e(ptoa(l1epfn(ol1e)), prot));
 
-	pmap->tlbflush = __tlbflushp(ol1e, nl1e);
+	pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
+	__setl1e(l1p, nl1e);
+	spinunlock(&pmap->lock);
+
+	return 0;
+}
+
+/*
+ * Clear the accessed bit of the user page at va, and return the
+ * number of calls since it was last found set, up to 255. Returns
+ * -ENOENT if the page is not a private, normal user page.
+ */
+int pmap_uage(struct pmap *pmap, vaddr_t va)
+{
+	unsigned age;
+	l1e_t l1e, *l1p;
+
+	assert(__isuaddr(va));
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	if (pmap == pmap_current())
+		l1p = __val1tbl(va) + L1OFF(va);
+	else
+		panic("aging a different pmap not supported.");
+
+	spinlock(&pmap->lock);
+	l1e = *l1p;
+	if (!l1e_normal(l1e) || !(l1e & PG_U)
+	    || !pfn_is_userpage(l1epfn(l1e))
+	    || pfn_getref(l1epfn(l1e)) != 1) {
+		spinunlock(&pmap->lock);
+		return -ENOENT;
+	}
+	if (l1e & PG_A) {
+		__setl1e(l1p, l1e & ~PG_A);
+		/* Let the CPU set it again on next access. */
+		pmap->tlbflush |= TLBF_NORMAL;
+	}
+	age = pfn_age(l1epfn(l1e), l1e & PG_A);
+	spinunlock(&pmap->lock);
+
+	return age;
+}
+
+/*
+ * Remove the user page at va, leaving a swapped entry: faults on it
+ * are reflected to the process, never resolved in the kernel.
+ */
+int pmap_uswap(struct pmap *pmap, vaddr_t va, pfn_t * opfn)
+{
+	l1e_t ol1e, nl1e, *l1p;
+
+	assert(__isuaddr(va));
+
+	if (pmap == NULL)
+		pmap = pmap_current();
+
+	if (pmap == pmap_current())
+		l1p = __val1tbl(va) + L1OFF(va);
+	else
+		panic("swapping a different pmap not supported.");
+
+	nl1e = PG_AVAIL_SWAP;
+	spinlock(&pmap->lock);
+	ol1e = *l1p;
+	if (!l1e_normal(ol1e) || !(ol1e & PG_U)
+	    || !pfn_is_userpage(l1epfn(ol1e))
+	    || pfn_getref(l1epfn(ol1e)) != 1) {
+		/* Shared, external or not present. */
+		spinunlock(&pmap->lock);
+		*opfn = PFN_INVALID;
+		return -EBUSY;
+	}
+	pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
 	__setl1e(l1p, nl1e);
 	spinunlock(&pmap->lock);
 
+	if (!pfn_decref(l1epfn(ol1e)))
+		*opfn = l1epfn(ol1e);
+	else
+		*opfn = PFN_INVALID;
 	return 0;
 }
 
@@ -471,14 +1088,14 @@ int pmap_uwire(struct pmap *pmap, vaddr_t va)
 
 	spinlock(&pmap->lock);
 	ol1e = *l1p;
-	if (l1e_iomap(ol1e)) {
+	if (l1e_iomap(ol1e) || l1e_split(ol1e)) {
 		/* Externally controlled already. */
 		spinunlock(&pmap->lock);
 		return -EBUSY;
 	}
 	pfn_incwir(l1epfn(ol1e));
 	nl1e = l1e_mkwired(ol1e);
-	pmap->tlbflush = __tlbflushp(ol1e, nl1e);
+	pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
 	__setl1e(l1p, nl1e);
 	spinunlock(&pmap->lock);
 
@@ -507,7 +1124,7 @@ int pmap_uunwire(struct pmap *pmap, vaddr_t va)
 	}
 	if (!pfn_decwir(l1epfn(ol1e))) {
 		nl1e = l1e_mknormal(ol1e);
-		pmap->tlbflush = __tlbflushp(ol1e, nl1e);
+		pmap->tlbflush |= __tlbflushp(ol1e, nl1e);
 		__setl1e(l1p, nl1e);
 	}
 	spinunlock(&pmap->lock);
@@ -515,7 +1132,12 @@ int pmap_uunwire(struct pmap *pmap, vaddr_t va)
 	return 0;
 }
 
-struct pmap *pmap_copy(void)
+/*
+ * Copy the current pmap for fork. Swap slots belong to the process
+ * that swapped the pages out, so a pmap with swapped entries can't
+ * be copied.
+ */
+int pmap_copy(struct pmap **newp)
 {
 	struct pmap *pmap, *new;
 	l1e_t *orig, *copy, l1e;
@@ -523,9 +1145,31 @@ struct pmap *pmap_copy(void)
 
 	pmap = pmap_current();
 	new = pmap_alloc();
+	if (new == NULL)
+		return -ENOMEM;
 
 	spinlock(&pmap->lock);
 
+	for (va = COWBASE; va < COWEND; va += PAGE_SIZE) {
+		if (l1e_swapped(*(__val1tbl(va) + L1OFF(va)))) {
+			spinunlock(&pmap->lock);
+			pmap_free(new);
+			return -EBUSY;
+		}
+	}
+
+	/* Small pages are private. Copy them first: this can fail. */
+	for (va = COWBASE; va < COWEND; va += PAGE_SIZE) {
+		l1e = *(__val1tbl(va) + L1OFF(va));
+		if (!l1e_split(l1e))
+			continue;
+		copy = new->l1s + NPTES * L2OFF(va) + L1OFF(va);
+		l1e = _pmap_l0copy(new, l1e);
+		if (l1e == 0)
+			goto nomem;
+		__setl1e(copy, l1e);
+	}
+
 	for (va = ZCOWBASE; va < ZCOWEND; va += PAGE_SIZE) {
 		/* No COW area. Leave blank */
 		copy = new->l1s + NPTES * L2OFF(va) + L1OFF(va);
@@ -539,6 +1183,8 @@ struct pmap *pmap_copy(void)
 		if (!(l1e & PG_P)) {
 			/* Not present, copy */
 			__setl1e(copy, l1e);
+		} else if (l1e_split(l1e)) {
+			/* Copied above. */
 		} else if (l1e_external(l1e)) {
 			/* Do not inherit I/O mappings. This means
 			 * that wired memory (exported by hwdev) will
@@ -556,9 +1202,22 @@ struct pmap *pmap_copy(void)
 		}
 	}
 	/* TLB of copy not affected. We just created it */
+	new->nanon = pmap->nanon;
+	memcpy(new->anon, pmap->anon, sizeof(pmap->anon));
 	spinunlock(&pmap->lock);
 
-	return new;
+	*newp = new;
+	return 0;
+
+      nomem:
+	for (va = COWBASE; va < COWEND; va += PAGE_SIZE) {
+		copy = new->l1s + NPTES * L2OFF(va) + L1OFF(va);
+		if (l1e_split(*copy))
+			_pmap_l0free(new, l1el0tbl(*copy));
+	}
+	spinunlock(&pmap->lock);
+	pmap_free(new);
+	return -ENOMEM;
 }
 
 void pmap_commit(struct pmap *pmap)
@@ -626,3 +1285,14 @@ void pmap_init(void)
 
 	/* Safe now to alloc a pmap */
 }
+
+/* Called by each CPU once it has entered. */
+void pmap_init_cpu(void)
+{
+	vaddr_t va;
+
+	va = vmap_alloc(2 * PAGE_SIZE, VFNT_MAP);
+	if (va == 0)
+		panic("PMAP: Fill window alloc failed");
+	pmap_fill_va[cpu_number()] = va;
+}
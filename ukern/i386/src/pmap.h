@@ -34,6 +34,14 @@
 #include <uk/param.h>
 #include <machine/uk/pae.h>
 
+/* Anonymous memory region, whose faults are resolved in kernel. */
+#define PMAP_MAXANON 16
+struct pmap_anon {
+	vaddr_t start;
+	vaddr_t end;
+	pmap_prot_t prot;
+};
+
 struct pmap {
 	/* Needs to be first and cache aligned (32-byte needed by HW) */
 	l2e_t pdptr[NPDPTE];
@@ -43,8 +51,16 @@ struct pmap {
 	cpumask_t cpumap;
 	unsigned refcnt;
 	lock_t lock;
+
+	unsigned nanon;
+	struct pmap_anon anon[PMAP_MAXANON];
+
+	unsigned nspages;	/* Small pages and tables charged. */
 };
 
+/* Small pages, including tables of split slots, a pmap can use. */
+#define PMAP_MAXSPAGES 8192
+
 struct pv_entry {
 	LIST_ENTRY(pv_entry) list_entry;
 	struct pmap *pmap;
@@ -55,9 +71,10 @@ struct usrframe;
 int _pmap_fault(unsigned long va, unsigned long err, struct usrframe *f);
 
 void pmap_init(void);
+void pmap_init_cpu(void);
 struct pmap *pmap_boot(void);
 struct pmap *pmap_alloc(void);
-struct pmap *pmap_copy(void);
+int pmap_copy(struct pmap **newp);
 void pmap_switch(struct pmap *pmap);
 void pmap_free(struct pmap *);
 
@@ -87,9 +104,20 @@ int pmap_kenter(struct pmap *pmap, vaddr_t va, pfn_t pa,
 		pmap_prot_t prot, pfn_t * pfn);
 int pmap_uenter(struct pmap *pmap, vaddr_t va, pfn_t pa,
 		pmap_prot_t prot, pfn_t * pfn);
+int pmap_ufill(struct pmap *pmap, vaddr_t va, pfn_t pfn,
+	       pmap_prot_t prot, pfn_t * opfn);
 int pmap_uchaddr(struct pmap *pmap, vaddr_t oldva, vaddr_t newva,
 		 pfn_t * pfn);
 int pmap_uchprot(struct pmap *pmap, vaddr_t va, pmap_prot_t prot);
+void *pmap_spage_alloc(struct pmap *pmap);
+void pmap_spage_free(struct pmap *pmap, void *page);
+int pmap_usenter(struct pmap *pmap, vaddr_t va, void *page,
+		 pmap_prot_t prot, void **opage);
+int pmap_uschprot(struct pmap *pmap, vaddr_t va, pmap_prot_t prot);
+int pmap_usiomap(struct pmap *pmap, vaddr_t va, paddr_t pa,
+		 pmap_prot_t prot);
+int pmap_uage(struct pmap *pmap, vaddr_t va);
+int pmap_uswap(struct pmap *pmap, vaddr_t va, pfn_t * opfn);
 int pmap_uiomap(struct pmap *pmap, vaddr_t va, pfn_t pfn,
 		pmap_prot_t prot, pfn_t * opfn);
 int pmap_uiounmap(struct pmap *pmap, vaddr_t va);
@@ -102,7 +130,10 @@ int pmap_hunmap(struct pmap *pmap);
 int pmap_uwire(struct pmap *pmap, vaddr_t va);
 int pmap_uunwire(struct pmap *pmap, vaddr_t va);
 
-struct pmap *pmap_copy(void);
+int pmap_uanon(struct pmap *pmap, vaddr_t start, vaddr_t end,
+	       pmap_prot_t prot);
+
+int pmap_copy(struct pmap **newp);
 
 #define pmap_kclear(_pmap, _va, _pfn) pmap_kenter((_pmap), (_va), 0, 0, _pfn)
 #define pmap_uclear(_pmap, _va, _pfn) pmap_uenter((_pmap), (_va), 0, 0, _pfn)
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2017, Gianluca Guida
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * CMOS Real Time Clock.
+ *
+ * Only read once at boot, to know the wall time at which the system
+ * timer started counting. The RTC is assumed to keep UTC.
+ */
+
+#include <uk/types.h>
+#include <uk/logio.h>
+#include <machine/uk/machdep.h>
+
+#include "i386.h"
+
+#define RTC_ADDR 0x70
+#define RTC_DATA 0x71
+
+#define RTC_SEC   0x00
+#define RTC_MIN   0x02
+#define RTC_HOUR  0x04
+#define RTC_DAY   0x07
+#define RTC_MON   0x08
+#define RTC_YEAR  0x09
+#define RTC_STA   0x0a
+#define STA_UIP   (1 << 7)
+#define RTC_STB   0x0b
+#define STB_24H   (1 << 1)
+#define STB_BIN   (1 << 2)
+
+struct rtc_time {
+	unsigned sec, min, hour, day, mon, year;
+};
+
+static unsigned rtc_read(unsigned reg)
+{
+	outb(RTC_ADDR, reg);
+	return inb(RTC_DATA);
+}
+
+static void rtc_readall(struct rtc_time *t)
+{
+	while (rtc_read(RTC_STA) & STA_UIP);
+	t->sec = rtc_read(RTC_SEC);
+	t->min = rtc_read(RTC_MIN);
+	t->hour = rtc_read(RTC_HOUR);
+	t->day = rtc_read(RTC_DAY);
+	t->mon = rtc_read(RTC_MON);
+	t->year = rtc_read(RTC_YEAR);
+}
+
+static unsigned bcd(unsigned v)
+{
+	return (v & 0xf) + (v >> 4) * 10;
+}
+
+/* Days from 1970-01-01 to the civil date y-m-d. */
+static uint64_t days_from_civil(unsigned y, unsigned m, unsigned d)
+{
+	unsigned era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = y / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return (uint64_t)era * 146097 + doe - 719468;
+}
+
+/* Seconds since the Epoch. */
+uint64_t rtc_readtime(void)
+{
+	unsigned stb, pm;
+	struct rtc_time t, t2;
+
+	/* Read until two consecutive reads agree. */
+	rtc_readall(&t2);
+	do {
+		t = t2;
+		rtc_readall(&t2);
+	} while (t.sec != t2.sec || t.min != t2.min || t.hour != t2.hour
+		 || t.day != t2.day || t.mon != t2.mon || t.year != t2.year);
+
+	stb = rtc_read(RTC_STB);
+	pm = t.hour & 0x80;
+	t.hour &= 0x7f;
+	if (!(stb & STB_BIN)) {
+		t.sec = bcd(t.sec);
+		t.min = bcd(t.min);
+		t.hour = bcd(t.hour);
+		t.day = bcd(t.day);
+		t.mon = bcd(t.mon);
+		t.year = bcd(t.year);
+	}
+	if (!(stb & STB_24H)) {
+		t.hour %= 12;
+		if (pm)
+			t.hour += 12;
+	}
+	if (t.mon < 1 || t.mon > 12 || t.day < 1 || t.day > 31) {
+		printf("RTC: invalid date, ignoring.\n");
+		return 0;
+	}
+	/* No century register we trust. */
+	t.year += 2000;
+
+	return days_from_civil(t.year, t.mon, t.day) * 86400
+		+ t.hour * 3600 + t.min * 60 + t.sec;
+}
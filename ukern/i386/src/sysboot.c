@@ -178,6 +178,7 @@ void sysboot(void)
 
 	/* Now that basic platform is initialised, we can setup the CPU infrastructure. */
 	cpu_enter();
+	pmap_init_cpu();
 
 	kern_boot();
 }
@@ -191,6 +192,7 @@ void sysboot_ap(void)
 	/* Now that we are using the full kernel pmap, we can access
 	   platform drivers safely */
 	cpu_enter();
+	pmap_init_cpu();
 
 	kern_bootap();
 }
@@ -31,6 +31,7 @@
 #define __ukparam_h
 
 #define PAGE_SHIFT   21
+#define SPAGE_SHIFT  12 /* Small pages, see MAP_SMALL. */
 
 #define LPDPTE 2 /* Linear map L2 PTE. */
 #define KPDPTE 3 /* Kernel L2 PTE. */
@@ -38,6 +38,11 @@
 #define trunc_page(x) (((x) >> PAGE_SHIFT) << PAGE_SHIFT)	/* type-safe */
 #define round_page(x) trunc_page((x) + PAGE_MASK)
 
+#define SPAGE_SIZE  (1 << SPAGE_SHIFT)
+#define SPAGE_MASK  (SPAGE_SIZE - 1)
+#define trunc_spage(x) (((x) >> SPAGE_SHIFT) << SPAGE_SHIFT)
+#define round_spage(x) trunc_spage((x) + SPAGE_MASK)
+
 #ifndef _ASSEMBLER
 
 #define atop(x)  ((paddr_t)(x) >> PAGE_SHIFT)
@@ -290,6 +290,26 @@ static void bus_put_dev(struct bus *b, struct dev *d)
 		return ret;						\
 	} while(0)
 
+/* As OP_CALL, but return the result of the operation, or '_nop' if
+ * the device doesn't implement it. */
+#define OP_CALLRET(_op, _nop, ...) do					\
+	{								\
+		int ret;						\
+		struct dev *d;						\
+									\
+		ret = bus_get_dev(b, desc, &d);				\
+		if (ret != 0)						\
+			return ret;					\
+									\
+		if (d->ops->_op == NULL)				\
+			ret = (_nop);					\
+		else							\
+			ret = d->ops->_op(d->devopq, b->devs[desc].devid, \
+					  __VA_ARGS__);			\
+		bus_put_dev(b,d);					\
+		return ret;						\
+	} while(0)
+
 int bus_in(struct bus *b, unsigned desc, uint32_t port, uint64_t * valptr)
 {
 	OP_CALL(in, port, valptr);
@@ -323,7 +343,13 @@ int bus_unexport(struct bus *b, unsigned desc, unsigned long iova)
 int bus_iomap(struct bus *b, unsigned desc, vaddr_t va,
 	      paddr_t mmioaddr, pmap_prot_t prot)
 {
-	OP_CALL(iomap, va, mmioaddr, prot);
+	OP_CALLRET(iomap, -ENOSYS, va, mmioaddr, prot);
+}
+
+int bus_iomapsmall(struct bus *b, unsigned desc, vaddr_t va,
+		   paddr_t mmioaddr, pmap_prot_t prot)
+{
+	OP_CALLRET(iomapsmall, -ENOSYS, va, mmioaddr, prot);
 }
 
 int bus_iounmap(struct bus *b, unsigned desc, vaddr_t va)
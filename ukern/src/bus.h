@@ -60,6 +60,8 @@ struct devops {
 		    uint64_t val);
 	int (*iomap) (void *devopq, unsigned id, vaddr_t va,
 		      paddr_t mmioaddr, pmap_prot_t prot);
+	int (*iomapsmall) (void *devopq, unsigned id, vaddr_t va,
+			   paddr_t mmioaddr, pmap_prot_t prot);
 	int (*iounmap) (void *devopq, unsigned id, vaddr_t va);
 	int (*export) (void *devopq, unsigned id, vaddr_t va,
 		       size_t sz, uint64_t *iova);
@@ -103,6 +105,8 @@ int bus_export(struct bus *b, unsigned desc, vaddr_t va, size_t sz,
 int bus_unexport(struct bus *b, unsigned desc, vaddr_t va);
 int bus_iomap(struct bus *b, unsigned desc, vaddr_t va,
 	      paddr_t mmioaddr, pmap_prot_t prot);
+int bus_iomapsmall(struct bus *b, unsigned desc, vaddr_t va,
+		   paddr_t mmioaddr, pmap_prot_t prot);
 int bus_irqmap(struct bus *b, unsigned desc, unsigned intr, unsigned sig);
 int bus_unplug(struct bus *b, unsigned desc);
 int bus_info(struct bus *b, unsigned desc, struct sys_info_cfg *cfg);
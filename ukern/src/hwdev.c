@@ -271,8 +271,8 @@ static int _hwdev_unexport(void *devopq, unsigned id, vaddr_t va)
 	return ret;
 }
 
-static int _hwdev_iomap(void *devopq, unsigned id, vaddr_t va,
-			paddr_t mmioaddr, pmap_prot_t prot)
+static int _hwdev_domap(void *devopq, unsigned id, vaddr_t va,
+			paddr_t mmioaddr, pmap_prot_t prot, int small)
 {
 	struct hwdev *hd = (struct hwdev *) devopq;
 	pfn_t mmiopfn = (pfn_t) atop(mmioaddr);
@@ -283,8 +283,10 @@ static int _hwdev_iomap(void *devopq, unsigned id, vaddr_t va,
 
 	found = 0;
 	for (i = 0; i < cfg->nmemsegs; i++, ptr++) {
-		paddr_t start = trunc_page(ptr->base);
-		paddr_t end = round_page(ptr->base + ptr->len);
+		paddr_t start = small ? trunc_spage(ptr->base)
+			: trunc_page(ptr->base);
+		paddr_t end = small ? round_spage(ptr->base + ptr->len)
+			: round_page(ptr->base + ptr->len);
 
 		if (start <= mmioaddr && mmioaddr <= end) {
 			found = 1;
@@ -294,7 +296,9 @@ static int _hwdev_iomap(void *devopq, unsigned id, vaddr_t va,
 	if (!found)
 		return -EPERM;
 
-	if ((va & PAGE_MASK) != (mmioaddr & PAGE_MASK)) {
+	if (small && (va & SPAGE_MASK) != (mmioaddr & SPAGE_MASK))
+		return -EINVAL;
+	if (!small && (va & PAGE_MASK) != (mmioaddr & PAGE_MASK)) {
 		/* Do not confuse  the caller by thinking  one can get
 		 * away with  mapping at  different page  offsets.  Do
 		 * not  make  implicitly  a vfn-to-pfn  mapping  (thus
@@ -307,7 +311,10 @@ static int _hwdev_iomap(void *devopq, unsigned id, vaddr_t va,
 	if (!pfn_is_valid(mmiopfn))
 		return -EINVAL;
 
-	ret = iomap(va, mmiopfn, prot);
+	if (small)
+		ret = iomap_small(va, mmioaddr, prot);
+	else
+		ret = iomap(va, mmiopfn, prot);
 	if (ret < 0)
 		return ret;
 
@@ -319,6 +326,18 @@ static int _hwdev_iomap(void *devopq, unsigned id, vaddr_t va,
 	return 0;
 }
 
+static int _hwdev_iomap(void *devopq, unsigned id, vaddr_t va,
+			paddr_t mmioaddr, pmap_prot_t prot)
+{
+	return _hwdev_domap(devopq, id, va, mmioaddr, prot, 0);
+}
+
+static int _hwdev_iomapsmall(void *devopq, unsigned id, vaddr_t va,
+			     paddr_t mmioaddr, pmap_prot_t prot)
+{
+	return _hwdev_domap(devopq, id, va, mmioaddr, prot, 1);
+}
+
 static int _hwdev_iounmap(void *devopq, unsigned id, vaddr_t va)
 {
 	struct hwdev *hd = (struct hwdev *) devopq;
@@ -474,6 +493,7 @@ static struct devops hwdev_ops = {
 	.export = _hwdev_export,
 	.unexport = _hwdev_unexport,
 	.iomap = _hwdev_iomap,
+	.iomapsmall = _hwdev_iomapsmall,
 	.iounmap = _hwdev_iounmap,
 	.info = _hwdev_info,
 	.irqmap = _hwdev_irqmap,
@@ -193,14 +193,21 @@ static void __childstart(void)
 	/* Not reached */
 }
 
-struct thread *thfork(void)
+/* Fork the current thread. Returns the child's pid. */
+int thfork(void)
 {
-	int i;
+	int i, ret;
 	vaddr_t va;
 	struct thread *nth, *cth = current_thread();
 
 	nth = structs_alloc(&threads);
-	nth->pmap = pmap_copy();
+	if (nth == NULL)
+		return -ENOMEM;
+	ret = pmap_copy(&nth->pmap);
+	if (ret) {
+		structs_free(nth);
+		return ret;
+	}
 	nth->stack_4k = alloc4k();
 	nth->frame = (uint8_t *) nth->stack_4k;
 	memcpy(nth->frame, cth->frame, sizeof(struct usrframe));
@@ -285,7 +292,7 @@ struct thread *thfork(void)
 	TAILQ_INSERT_TAIL(&running_threads, nth, sched_list);
 	spinunlock(&sched_lock);
 
-	return nth;
+	return nth->pid;
 }
 
 void thintr(unsigned vect, vaddr_t va, unsigned long err)
@@ -619,6 +626,18 @@ int iomap(vaddr_t vaddr, pfn_t mmiopfn, pmap_prot_t prot)
 	return ret;
 }
 
+int iomap_small(vaddr_t vaddr, paddr_t mmioaddr, pmap_prot_t prot)
+{
+	int ret;
+
+	if (!pfn_is_mmio(atop(mmioaddr)))
+		return -EINVAL;
+
+	ret = pmap_usiomap(NULL, vaddr, mmioaddr, prot);
+	pmap_commit(NULL);
+	return ret;
+}
+
 int iounmap(vaddr_t vaddr)
 {
 	int ret = 0;
@@ -635,6 +654,8 @@ unsigned vmpopulate(vaddr_t addr, size_t sz, pmap_prot_t prot)
 
 	for (i = 0; i < round_page(sz) >> PAGE_SHIFT; i++) {
 		pfn = __allocuser();
+		if (pfn == PFN_INVALID)
+			panic("OOM");
 		pmap_uenter(NULL, trunc_page(addr) + i * PAGE_SIZE, pfn,
 			    prot, &pfn);
 		if (pfn != PFN_INVALID) {
@@ -667,56 +688,125 @@ unsigned vmclear(vaddr_t addr, size_t sz)
 	return ret;
 }
 
-int vmmap(vaddr_t addr, pmap_prot_t prot)
+/*
+ * Map 'n' new pages starting at addr, with a single TLB flush.
+ *
+ * With VMMAP_FILL pages already present are left untouched,
+ * otherwise they are replaced. Slots holding small pages or I/O
+ * can't be filled: -EBUSY if it's the first, skipped otherwise.
+ * Pages are zeroed unless VMMAP_DMA32 is set. Returns the number
+ * of pages replaced, or a negative error. On error, pages before
+ * the failing one stay mapped.
+ */
+int vmmap_range(vaddr_t addr, unsigned n, pmap_prot_t prot, int flags)
 {
-	int ret = 0;
-	pfn_t pfn, opfn;
+	int ret = 0, rc;
+	unsigned i, nfree = 0;
+	pfn_t pfn, opfn, freel[16];
+	vaddr_t va = trunc_page(addr);
 
-	pfn = __allocuser();
-	ret = pmap_uenter(NULL, addr, pfn, prot, &opfn);
-	pmap_commit(NULL);
+	for (i = 0; i < n; i++, va += PAGE_SIZE) {
+		pfn = flags & VMMAP_DMA32 ? __allocuser32() : __allocuser();
+		if (pfn == PFN_INVALID) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (flags & VMMAP_FILL) {
+			rc = pmap_ufill(NULL, va, pfn, prot, &opfn);
+			if (rc == -EBUSY && i > 0)
+				rc = -EEXIST;
+		} else {
+			rc = pmap_uenter(NULL, va, pfn, prot, &opfn);
+		}
 
-	if (ret < 0) {
-		__freepage(pfn);
-		return ret;
-	}
+		if (rc == -EEXIST) {
+			__freepage(pfn);
+			continue;
+		}
+		if (rc < 0) {
+			__freepage(pfn);
+			ret = rc;
+			break;
+		}
 
-	if (opfn != PFN_INVALID) {
-		__freepage(opfn);
-		ret = 1;
+		/* Warning: accessing user space without checking, as
+		   in vmpopulate(). No stale TLB entry when filling: the
+		   page was not present. */
+		if ((flags & VMMAP_FILL) && !(flags & VMMAP_DMA32))
+			memset((void *)va, 0, PAGE_SIZE);
+
+		if (opfn == PFN_INVALID)
+			continue;
+
+		/* Replaced pages can be freed only after the flush. */
+		ret++;
+		freel[nfree++] = opfn;
+		if (nfree == 16) {
+			pmap_commit(NULL);
+			while (nfree)
+				__freepage(freel[--nfree]);
+		}
 	}
+	pmap_commit(NULL);
+	while (nfree)
+		__freepage(freel[--nfree]);
 
-	memset((void *)trunc_page(addr), 0, PAGE_SIZE);
+	if (!(flags & (VMMAP_FILL | VMMAP_DMA32)))
+		memset((void *)trunc_page(addr), 0, i << PAGE_SHIFT);
 	return ret;
 }
 
+int vmmap(vaddr_t addr, pmap_prot_t prot)
+{
+	return vmmap_range(addr, 1, prot, 0);
+}
+
 int vmmap32(vaddr_t addr, pmap_prot_t prot)
 {
-	int ret = 0;
-	pfn_t pfn, opfn;
+	return vmmap_range(addr, 1, prot, VMMAP_DMA32);
+}
 
-	pfn = __allocuser32();
-	ret = pmap_uenter(NULL, addr, pfn, prot, &opfn);
-	pmap_commit(NULL);
+int vmunmap_range(vaddr_t addr, unsigned n)
+{
+	int ret = 0, rc;
+	unsigned i, nfree = 0;
+	pfn_t pfn, freel[16];
+	vaddr_t va = trunc_page(addr);
 
-	if (ret < 0) {
-		__freepage(pfn);
-		return ret;
-	}
+	for (i = 0; i < n; i++, va += PAGE_SIZE) {
+		rc = pmap_uenter(NULL, va, PFN_INVALID, 0, &pfn);
+		if (rc < 0) {
+			ret = rc;
+			break;
+		}
+		if (pfn == PFN_INVALID)
+			continue;
 
-	if (opfn != PFN_INVALID) {
-		__freepage(opfn);
-		ret = 1;
+		ret++;
+		freel[nfree++] = pfn;
+		if (nfree == 16) {
+			pmap_commit(NULL);
+			while (nfree)
+				__freepage(freel[--nfree]);
+		}
 	}
+	pmap_commit(NULL);
+	while (nfree)
+		__freepage(freel[--nfree]);
 	return ret;
 }
 
 int vmunmap(vaddr_t addr)
 {
-	int ret = 0;
+	return vmunmap_range(addr, 1);
+}
+
+int vmmove(vaddr_t dst, vaddr_t src)
+{
+	int ret;
 	pfn_t pfn;
 
-	ret = pmap_uenter(NULL, addr, PFN_INVALID, 0, &pfn);
+	ret = pmap_uchaddr(NULL, src, dst, &pfn);
 	pmap_commit(NULL);
 
 	if (ret < 0)
@@ -729,33 +819,160 @@ int vmunmap(vaddr_t addr)
 	return ret;
 }
 
-int vmmove(vaddr_t dst, vaddr_t src)
+int vmchprot_range(vaddr_t addr, unsigned n, pmap_prot_t prot)
 {
-	int ret;
-	pfn_t pfn;
+	int ret = 0;
+	unsigned i;
+	vaddr_t va = trunc_page(addr);
 
-	ret = pmap_uchaddr(NULL, src, dst, &pfn);
+	for (i = 0; i < n; i++, va += PAGE_SIZE) {
+		ret = pmap_uchprot(NULL, va, prot);
+		if (ret)
+			break;
+	}
 	pmap_commit(NULL);
+	return ret;
+}
 
-	if (ret < 0)
-		return ret;
+/*
+ * Map 'n' new zeroed small pages starting at addr. Small pages live
+ * in split 2M slots: the slot must be empty or already split.
+ * Returns the number of small pages replaced, or a negative error.
+ */
+int vmsmap_range(vaddr_t addr, unsigned n, pmap_prot_t prot)
+{
+	int ret = 0, rc;
+	unsigned i, nfree = 0;
+	void *page, *opage, *freel[16];
+	vaddr_t va = trunc_spage(addr);
 
-	if (pfn != PFN_INVALID) {
-		__freepage(pfn);
-		ret = 1;
+	for (i = 0; i < n; i++, va += SPAGE_SIZE) {
+		page = pmap_spage_alloc(NULL);
+		if (page == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		rc = pmap_usenter(NULL, va, page, prot, &opage);
+		if (rc < 0) {
+			pmap_spage_free(NULL, page);
+			ret = rc;
+			break;
+		}
+		if (opage == NULL)
+			continue;
+
+		/* Replaced pages can be freed only after the flush. */
+		ret++;
+		freel[nfree++] = opage;
+		if (nfree == 16) {
+			pmap_commit(NULL);
+			while (nfree)
+				pmap_spage_free(NULL, freel[--nfree]);
+		}
+	}
+	pmap_commit(NULL);
+	while (nfree)
+		pmap_spage_free(NULL, freel[--nfree]);
+	return ret;
+}
+
+int vmsunmap_range(vaddr_t addr, unsigned n)
+{
+	int ret = 0, rc;
+	unsigned i, nfree = 0;
+	void *opage, *freel[16];
+	vaddr_t va = trunc_spage(addr);
+
+	for (i = 0; i < n; i++, va += SPAGE_SIZE) {
+		rc = pmap_usenter(NULL, va, NULL, 0, &opage);
+		if (rc < 0) {
+			ret = rc;
+			break;
+		}
+		if (opage == NULL)
+			continue;
+
+		ret++;
+		freel[nfree++] = opage;
+		if (nfree == 16) {
+			pmap_commit(NULL);
+			while (nfree)
+				pmap_spage_free(NULL, freel[--nfree]);
+		}
 	}
+	pmap_commit(NULL);
+	while (nfree)
+		pmap_spage_free(NULL, freel[--nfree]);
 	return ret;
 }
 
-int vmchprot(vaddr_t addr, pmap_prot_t prot)
+int vmschprot_range(vaddr_t addr, unsigned n, pmap_prot_t prot)
 {
-	int ret;
+	int ret = 0;
+	unsigned i;
+	vaddr_t va = trunc_spage(addr);
 
-	ret = pmap_uchprot(NULL, addr, prot);
+	for (i = 0; i < n; i++, va += SPAGE_SIZE) {
+		ret = pmap_uschprot(NULL, va, prot);
+		if (ret)
+			break;
+	}
 	pmap_commit(NULL);
 	return ret;
 }
 
+/*
+ * Mark 'n' pages at addr as anonymous memory with protection prot,
+ * or forget the region starting at addr if prot is not present.
+ * Faults in anonymous regions are resolved without the pager.
+ */
+int vmanon(vaddr_t addr, unsigned n, pmap_prot_t prot)
+{
+	return pmap_uanon(NULL, addr, addr + ((vaddr_t)n << PAGE_SHIFT), prot);
+}
+
+/*
+ * Age the 'n' pages at addr, clearing their accessed bits. ages[i]
+ * is set to the number of scans page i has not been accessed for,
+ * or to VMAGE_NONE if it can't be swapped out.
+ */
+void vmage(vaddr_t addr, unsigned n, uint8_t *ages)
+{
+	int ret;
+	unsigned i;
+	vaddr_t va = trunc_page(addr);
+
+	for (i = 0; i < n; i++, va += PAGE_SIZE) {
+		ret = pmap_uage(NULL, va);
+		if (ret < 0)
+			ages[i] = VMAGE_NONE;
+		else
+			ages[i] = ret < VMAGE_NONE ? ret : VMAGE_NONE - 1;
+	}
+	pmap_commit(NULL);
+}
+
+/* Free the page at addr, whose contents the process saved. */
+int vmswap(vaddr_t addr)
+{
+	int ret;
+	pfn_t pfn;
+
+	ret = pmap_uswap(NULL, trunc_page(addr), &pfn);
+	pmap_commit(NULL);
+	if (ret < 0)
+		return ret;
+
+	if (pfn != PFN_INVALID)
+		__freepage(pfn);
+	return 0;
+}
+
+int vmchprot(vaddr_t addr, pmap_prot_t prot)
+{
+	return vmchprot_range(addr, 1, prot);
+}
+
 int hwcreat(struct sys_hwcreat_cfg *cfg, mode_t mode)
 {
 	struct thread *th = current_thread();
@@ -945,6 +1162,13 @@ int deviomap(unsigned dd, vaddr_t va, paddr_t mmioaddr, pmap_prot_t prot)
 	return bus_iomap(&th->bus, dd, va, mmioaddr, prot);
 }
 
+int deviomapsmall(unsigned dd, vaddr_t va, paddr_t mmioaddr, pmap_prot_t prot)
+{
+	struct thread *th = current_thread();
+
+	return bus_iomapsmall(&th->bus, dd, va, mmioaddr, prot);
+}
+
 int deviounmap(unsigned dd, vaddr_t va)
 {
 	struct thread *th = current_thread();
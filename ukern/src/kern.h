@@ -137,10 +137,11 @@ void cpu_softirq_raise(int);
 void cpu_kick(void);
 void do_softirq(void);
 
-struct thread *thfork(void);
+int thfork(void);
 void thraise(struct thread *th, unsigned vect);
 
 int iomap(vaddr_t vaddr, pfn_t mmiopfn, pmap_prot_t prot);
+int iomap_small(vaddr_t vaddr, paddr_t mmioaddr, pmap_prot_t prot);
 int iounmap(vaddr_t vaddr);
 
 unsigned vmpopulate(vaddr_t addr, size_t sz, pmap_prot_t prot);
@@ -151,6 +152,19 @@ int vmmove(vaddr_t dst, vaddr_t src);
 int vmchprot(vaddr_t, pmap_prot_t prot);
 int vmunmap(vaddr_t);
 
+#define VMMAP_DMA32 1		/* Allocate pages below 4G. */
+#define VMMAP_FILL  2		/* Skip pages already present. */
+int vmmap_range(vaddr_t addr, unsigned n, pmap_prot_t prot, int flags);
+int vmunmap_range(vaddr_t addr, unsigned n);
+int vmchprot_range(vaddr_t addr, unsigned n, pmap_prot_t prot);
+int vmsmap_range(vaddr_t addr, unsigned n, pmap_prot_t prot);
+int vmsunmap_range(vaddr_t addr, unsigned n);
+int vmschprot_range(vaddr_t addr, unsigned n, pmap_prot_t prot);
+int vmanon(vaddr_t addr, unsigned n, pmap_prot_t prot);
+#define VMAGE_NONE 0xff	/* Page can't be swapped out. */
+void vmage(vaddr_t addr, unsigned n, uint8_t *ages);
+int vmswap(vaddr_t addr);
+
 int hwcreat(struct sys_hwcreat_cfg *cfg, mode_t mode);
 
 int childstat(struct sys_childstat *cs);
@@ -171,6 +185,7 @@ int devin(unsigned dd, uint32_t port, uint64_t * valptr);
 int devout(unsigned dd, uint32_t port, uint64_t val);
 int devinfo(unsigned dd, struct sys_info_cfg *cfg);
 int deviomap(unsigned dd, vaddr_t va, paddr_t mmioaddr, pmap_prot_t prot);
+int deviomapsmall(unsigned dd, vaddr_t va, paddr_t mmioaddr, pmap_prot_t prot);
 int deviounmap(unsigned dd, vaddr_t va);
 void devclose(unsigned dd);
 
@@ -195,6 +210,8 @@ void irqunregister(struct irqsig *irqsig);
 
 uint64_t timer_readcounter(void);
 uint64_t timer_readperiod(void);
+uint64_t timer_readboottime(void);
+paddr_t timer_counteraddr(void);
 void timer_setcounter(uint64_t cnt);
 void timer_event(void);
 
@@ -235,6 +235,19 @@ uint64_t pfndb_clrwir(unsigned pfn)
 	return __sync_and_and_fetch(&p->usr.wir, 0);
 }
 
+unsigned pfndb_age(unsigned pfn, int accessed)
+{
+	ipfn_t *p = &pfndb[pfn];
+
+	assert(pfn <= pfndb_max);
+	assert(p->type == PFNT_USER);
+	if (accessed)
+		p->usr.age = 0;
+	else if (p->usr.age != 0xff)
+		p->usr.age++;
+	return p->usr.age;
+}
+
 void pfndb_printstats(void)
 {
 	uint8_t i;
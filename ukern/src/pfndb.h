@@ -42,6 +42,7 @@ typedef struct {
 		struct {
 			uint64_t ref;
 			uint64_t wir;
+			uint8_t age;
 		} usr;
 	};
 } __packed ipfn_t;
@@ -88,6 +89,7 @@ uint64_t pfndb_incwir(unsigned pfn);
 uint64_t pfndb_decwir(unsigned pfn);
 uint64_t pfndb_getwir(unsigned pfn);
 uint64_t pfndb_clrwir(unsigned pfn);
+unsigned pfndb_age(unsigned pfn, int accessed);
 
 #define pfn_is_valid(_pfn) (pfndb_valid((_pfn)))
 #define pfn_is_mmio(_pfn) (pfndb_type((_pfn)) == PFNT_MMIO)
@@ -105,14 +107,19 @@ uint64_t pfndb_clrwir(unsigned pfn);
 #define pfn_decwir(_pfn) pfndb_decwir((_pfn))
 #define pfn_clrwir(_pfn) pfndb_clrwir((_pfn))
 #define pfn_getwir(_pfn) pfndb_getwir((_pfn))
+/* Scans since user page was last accessed. */
+#define pfn_age(_pfn, _acc) pfndb_age((_pfn), (_acc))
 
 static inline pfn_t __allocuser(void)
 {
 	pfn_t pfn;
 
-	pfn = pgalloc(1, PFNT_USER, GFP_HIGH);
+	pfn = pgalloc(1, PFNT_USER, GFP_HIGH | GFP_CANFAIL);
+	if (pfn == PFN_INVALID)
+		return pfn;
 	pfn_clrref(pfn);
 	pfn_clrwir(pfn);
+	pfn_age(pfn, 1);
 	return pfn;
 }
 
@@ -120,9 +127,12 @@ static inline pfn_t __allocuser32(void)
 {
 	pfn_t pfn;
 
-	pfn = pgalloc(1, PFNT_USER, GFP_MEM32);
+	pfn = pgalloc(1, PFNT_USER, GFP_MEM32 | GFP_CANFAIL);
+	if (pfn == PFN_INVALID)
+		return pfn;
 	pfn_clrref(pfn);
 	pfn_clrwir(pfn);
+	pfn_age(pfn, 1);
 	return pfn;
 }
 
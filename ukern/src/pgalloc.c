@@ -211,8 +211,11 @@ pfn_t pgalloc(size_t size, uint8_t type, unsigned long flags)
 		      addr = pgzone_alloc(pgzones + 0, size);
 		      }
 	);
-	if (!addr)
+	if (!addr) {
+		if (flags & GFP_CANFAIL)
+			return PFN_INVALID;
 		panic("OOM");
+	}
 
 	for (i = 0; i < size; i++)
 		pfndb_settype(addr + i, type);
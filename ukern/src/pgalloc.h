@@ -43,6 +43,7 @@ struct pgzentry {
 #define GFP_KERN_ONLY   2
 #define GFP_HIGH32_ONLY 4
 #define GFP_HIGH_ONLY   8
+#define GFP_CANFAIL     16	/* Return PFN_INVALID instead of panicking. */
 
 #define GFP_MEM32  (GFP_KERN32_ONLY | GFP_HIGH32_ONLY)
 #define GFP_KERN   (GFP_KERN32_ONLY | GFP_KERN_ONLY)
@@ -138,14 +138,16 @@ static int _pltdev_export(void *devopq, unsigned id, vaddr_t va,
 	return ret;
 }
 
-static int _pltdev_iomap(void *devopq, unsigned id, vaddr_t va,
-			 paddr_t mmioaddr, pmap_prot_t prot)
+static int _pltdev_domap(void *devopq, unsigned id, vaddr_t va,
+			 paddr_t mmioaddr, pmap_prot_t prot, int small)
 {
 	pfn_t mmiopfn = (pfn_t)atop(mmioaddr);
 	struct pltmap *pltmap;
 	int ret;
 
-	if ((va & PAGE_MASK) != (mmioaddr & PAGE_MASK)) {
+	if (small && (va & SPAGE_MASK) != (mmioaddr & SPAGE_MASK))
+		return -EINVAL;
+	if (!small && (va & PAGE_MASK) != (mmioaddr & PAGE_MASK)) {
 		/* Do not confuse  the caller by thinking  one can get
 		 * away with  mapping at  different page  offsets.  Do
 		 * not  make  implicitly  a vfn-to-pfn  mapping  (thus
@@ -158,7 +160,10 @@ static int _pltdev_iomap(void *devopq, unsigned id, vaddr_t va,
 	if (!pfn_is_valid(mmiopfn))
 		return -EINVAL;
 
-	ret = iomap(va, mmiopfn, prot);
+	if (small)
+		ret = iomap_small(va, mmioaddr, prot);
+	else
+		ret = iomap(va, mmiopfn, prot);
 	if (ret < 0)
 		return ret;
 
@@ -170,6 +175,18 @@ static int _pltdev_iomap(void *devopq, unsigned id, vaddr_t va,
 	return 0;
 }
 
+static int _pltdev_iomap(void *devopq, unsigned id, vaddr_t va,
+			 paddr_t mmioaddr, pmap_prot_t prot)
+{
+	return _pltdev_domap(devopq, id, va, mmioaddr, prot, 0);
+}
+
+static int _pltdev_iomapsmall(void *devopq, unsigned id, vaddr_t va,
+			      paddr_t mmioaddr, pmap_prot_t prot)
+{
+	return _pltdev_domap(devopq, id, va, mmioaddr, prot, 1);
+}
+
 static int _pltdev_iounmap(void *devopq, unsigned id, vaddr_t va)
 {
 	struct pltmap *pm, *tpm;
@@ -250,6 +267,7 @@ static struct devops pltdev_ops = {
 	.out = _pltdev_out,
 	.export = _pltdev_export,
 	.iomap = _pltdev_iomap,
+	.iomapsmall = _pltdev_iomapsmall,
 	.iounmap = _pltdev_iounmap,
 	.info = _pltdev_info,
 	.irqmap = _pltdev_irqmap,
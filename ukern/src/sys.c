@@ -97,10 +97,7 @@ static int sys_raise(unsigned sint)
 
 static int sys_fork(void)
 {
-	struct thread *th;
-
-	th = thfork();
-	return th == NULL ? 0 : th->pid;
+	return thfork();
 }
 
 static int sys_getpid(void)
@@ -140,6 +137,15 @@ static int sys_creat(uaddr_t ucfg, unsigned sig, devmode_t mode)
 	return devcreat(&cfg, sig, mode);
 }
 
+static int sys_remove(unsigned did)
+{
+
+	if (did >= MAXDEVS)
+		return -EINVAL;
+	devremove(did);
+	return 0;
+}
+
 static int sys_poll(unsigned did, uaddr_t uior)
 {
 	int id, ret;
@@ -340,55 +346,153 @@ static int sys_close(unsigned ddno)
 	return 0;
 }
 
-static int sys_map(vaddr_t vaddr, sys_map_flags_t perm)
+static int sys_map_prot(sys_map_flags_t perm, pmap_prot_t *prot)
 {
-	struct thread *th = current_thread();
-	int np, np32, ret;
-	pmap_prot_t prot;
-
-	/* _probably_ should not kill it and just return an error,
-	 * like a nice, respectful OS */
-	procassert(__chkuaddr(trunc_page(vaddr), PAGE_SIZE));
-	np = perm & MAP_NEW;
-	np32 = perm & MAP_NEW32;
-	perm &= ~(MAP_NEW | MAP_NEW32);
 
 	switch (perm) {
 	case MAP_RDONLY:
-		prot = PROT_USER;
+		*prot = PROT_USER;
 		break;
 	case MAP_RDEXEC:
-		prot = PROT_USER_X;
+		*prot = PROT_USER_X;
 		break;
 	case MAP_WRITE:
-		prot = PROT_USER_WR;
+		*prot = PROT_USER_WR;
 		break;
 	case MAP_WREXEC:
-		prot = PROT_USER_WRX;
+		*prot = PROT_USER_WRX;
 		break;
 	case MAP_NONE:
-		prot = 0;
-		np = 0;
-		np32 = 0;
+		*prot = 0;
 		break;
 	default:
 		return -EINVAL;
 	}
+	return 0;
+}
+
+/*
+ * Small pages. They are zeroed private memory: MAP_NEW32 and
+ * MAP_FILL are not supported, and they can't be exported.
+ */
+static int sys_maprange_small(vaddr_t vaddr, size_t npages,
+			      sys_map_flags_t perm)
+{
+	int np;
+	pmap_prot_t prot;
+
+	if (npages == 0 || npages > (USEREND >> SPAGE_SHIFT))
+		return -EINVAL;
+	if (vaddr & SPAGE_MASK)
+		return -EINVAL;
+	if (!__chkuaddr(vaddr, npages << SPAGE_SHIFT))
+		return -EINVAL;
+	if (perm & (MAP_NEW32 | MAP_FILL))
+		return -EINVAL;
+	np = perm & MAP_NEW;
+	perm &= ~MAP_NEW;
+
+	if (sys_map_prot(perm, &prot))
+		return -EINVAL;
+
+	if (!prot)
+		return vmsunmap_range(vaddr, npages);
+	if (np)
+		return vmsmap_range(vaddr, npages, prot);
+	return vmschprot_range(vaddr, npages, prot);
+}
+
+static int sys_maprange(vaddr_t vaddr, size_t npages, sys_map_flags_t perm)
+{
+	struct thread *th = current_thread();
+	int np, np32, fill, ret;
+	pmap_prot_t prot;
+
+	if (perm & MAP_SMALL)
+		return sys_maprange_small(vaddr, npages, perm & ~MAP_SMALL);
+	if (npages == 0 || npages > (USEREND >> PAGE_SHIFT))
+		return -EINVAL;
+
+	/* _probably_ should not kill it and just return an error,
+	 * like a nice, respectful OS */
+	procassert(__chkuaddr(trunc_page(vaddr), npages << PAGE_SHIFT));
+	np = perm & MAP_NEW;
+	np32 = perm & MAP_NEW32;
+	fill = perm & MAP_FILL;
+	perm &= ~(MAP_NEW | MAP_NEW32 | MAP_FILL);
+
+	if (sys_map_prot(perm, &prot))
+		return -EINVAL;
+	if (!prot) {
+		np = 0;
+		np32 = 0;
+	}
 
 	if (np)
-		ret = vmmap(vaddr, prot);
+		ret = vmmap_range(vaddr, npages, prot, fill ? VMMAP_FILL : 0);
 	else if (np32) {
 		if (th->euid)
 			ret = -EPERM;
 		else
-			ret = vmmap32(vaddr, prot);
+			ret = vmmap_range(vaddr, npages, prot,
+					  VMMAP_DMA32 | (fill ? VMMAP_FILL : 0));
 	} else if (!prot)
-		ret = vmunmap(vaddr);
+		ret = vmunmap_range(vaddr, npages);
 	else
-		ret = vmchprot(vaddr, prot);
+		ret = vmchprot_range(vaddr, npages, prot);
 	return ret;
 }
 
+static int sys_map(vaddr_t vaddr, sys_map_flags_t perm)
+{
+
+	if (perm & MAP_FILL)
+		return -EINVAL;
+	return sys_maprange(vaddr, 1, perm);
+}
+
+/* Register (or with MAP_NONE, remove) an anonymous region. */
+static int sys_mapanon(vaddr_t vaddr, size_t npages, sys_map_flags_t perm)
+{
+	pmap_prot_t prot;
+
+	if (npages == 0 || npages > (USEREND >> PAGE_SHIFT))
+		return -EINVAL;
+	if (!__chkuaddr(trunc_page(vaddr), npages << PAGE_SHIFT))
+		return -EINVAL;
+	if (sys_map_prot(perm, &prot))
+		return -EINVAL;
+
+	return vmanon(trunc_page(vaddr), npages, prot);
+}
+
+/* Age npages at vaddr, storing one byte per page at uages. */
+static int sys_pgage(vaddr_t vaddr, size_t npages, uaddr_t uages)
+{
+	size_t i, n;
+	uint8_t ages[64];
+
+	if (npages == 0 || npages > (USEREND >> PAGE_SHIFT))
+		return -EINVAL;
+	if (!__chkuaddr(trunc_page(vaddr), npages << PAGE_SHIFT))
+		return -EINVAL;
+
+	for (i = 0; i < npages; i += n) {
+		n = npages - i < sizeof(ages) ? npages - i : sizeof(ages);
+		vmage(trunc_page(vaddr) + (i << PAGE_SHIFT), n, ages);
+		if (copy_to_user(uages + i, ages, n))
+			return -EFAULT;
+	}
+	return 0;
+}
+
+static int sys_pgswap(vaddr_t vaddr)
+{
+	if (!__chkuaddr(trunc_page(vaddr), PAGE_SIZE))
+		return -EINVAL;
+	return vmswap(vaddr);
+}
+
 static int sys_move(vaddr_t dst, vaddr_t src)
 {
 	/* _probably_ should not kill it and just return an error,
@@ -411,6 +515,56 @@ static int sys_iomap(unsigned ddno, vaddr_t va, uint64_t mmioaddr)
 	return deviomap(ddno, va, mmioaddr, prot);
 }
 
+/* Map npages of consecutive MMIO pages. All or nothing. */
+static int sys_iomaprange(unsigned ddno, vaddr_t va, uint64_t mmioaddr,
+			  size_t npages)
+{
+	int ret;
+	size_t i;
+	pmap_prot_t prot = PROT_USER_WR;
+
+	if (npages == 0 || npages > (USEREND >> PAGE_SHIFT))
+		return -EINVAL;
+	if (!__chkuaddr(trunc_page(va), npages << PAGE_SHIFT))
+		return -EINVAL;
+
+	for (i = 0; i < npages; i++) {
+		ret = deviomap(ddno, va + (i << PAGE_SHIFT),
+			       mmioaddr + (i << PAGE_SHIFT), prot);
+		if (ret < 0) {
+			while (i--)
+				deviounmap(ddno, va + (i << PAGE_SHIFT));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* Map npages of consecutive 4k MMIO pages. All or nothing. */
+static int sys_iomapsmall(unsigned ddno, vaddr_t va, uint64_t mmioaddr,
+			  size_t npages)
+{
+	int ret;
+	size_t i;
+	pmap_prot_t prot = PROT_USER_WR;
+
+	if (npages == 0 || npages > (USEREND >> SPAGE_SHIFT))
+		return -EINVAL;
+	if (!__chkuaddr(trunc_spage(va), npages << SPAGE_SHIFT))
+		return -EINVAL;
+
+	for (i = 0; i < npages; i++) {
+		ret = deviomapsmall(ddno, va + (i << SPAGE_SHIFT),
+				    mmioaddr + (i << SPAGE_SHIFT), prot);
+		if (ret < 0) {
+			while (i--)
+				deviounmap(ddno, va + (i << SPAGE_SHIFT));
+			return ret;
+		}
+	}
+	return 0;
+}
+
 static int sys_iounmap(unsigned ddno, vaddr_t va)
 {
 	int ret;
@@ -558,6 +712,14 @@ int sys_call(int sc,
 		return sys_map(a1, a2);
 	case SYS_MOVE:
 		return sys_move(a1, a2);
+	case SYS_MAPRANGE:
+		return sys_maprange(a1, a2, a3);
+	case SYS_MAPANON:
+		return sys_mapanon(a1, a2, a3);
+	case SYS_PGAGE:
+		return sys_pgage(a1, a2, a3);
+	case SYS_PGSWAP:
+		return sys_pgswap(a1);
 	case SYS_GETPID:
 		return sys_getpid();
 	case SYS_RAISE:
@@ -571,6 +733,8 @@ int sys_call(int sc,
 		return sys_tls(a1, a2);
 	case SYS_CREAT:
 		return sys_creat(a1, a2, a3);
+	case SYS_REMOVE:
+		return sys_remove(a1);
 	case SYS_POLL:
 		return sys_poll(a1, a2);
 	case SYS_WRIOSPC:
@@ -607,6 +771,10 @@ int sys_call(int sc,
 		return sys_iomap(a1, a2, a3);
 	case SYS_IOUNMAP:
 		return sys_iounmap(a1, a2);
+	case SYS_IOMAPRANGE:
+		return sys_iomaprange(a1, a2, a3, a4);
+	case SYS_IOMAPSMALL:
+		return sys_iomapsmall(a1, a2, a3, a4);
 	case SYS_CLOSE:
 		return sys_close(a1);
 	case SYS_HWCREAT:
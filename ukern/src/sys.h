@@ -59,6 +59,8 @@ struct sys_childstat {
 typedef enum {
 	MAP_NEW = 0x100,
 	MAP_NEW32 = 0x200,
+	MAP_FILL = 0x400,	/* SYS_MAPRANGE: keep present pages. */
+	MAP_SMALL = 0x800,	/* SYS_MAPRANGE: npages are 4k pages. */
 	MAP_NONE = 0,
 	MAP_RDONLY = 1,
 	MAP_RDEXEC = 2,
@@ -68,6 +70,10 @@ typedef enum {
 #endif
 #define SYS_MAP  0x10
 #define SYS_MOVE 0x11
+#define SYS_MAPRANGE 0x12
+#define SYS_MAPANON  0x13
+#define SYS_PGAGE    0x14
+#define SYS_PGSWAP   0x15
 
 #ifndef _ASSEMBLER
 struct sys_info_cfg {
@@ -120,6 +126,7 @@ struct sys_info_cfg {
 #define SYS_RDCFG   0x2B
 #define SYS_WRCFG   0x2C
 #define SYS_EOI     0x2D
+#define SYS_IOMAPRANGE 0x2E
 #define SYS_CLOSE  0x2F
 
 #define SYS_CREAT_CFG_MAXUSERCFG SYS_DEVCONFIG_MAXUSERCFG
@@ -163,6 +170,8 @@ struct sys_poll_ior {
 #define SYS_IRQ    0x33
 #define SYS_READ   0x34
 #define SYS_WRITE  0x35
+#define SYS_IOMAPSMALL 0x36
+#define SYS_REMOVE 0x37
 
 #ifndef _ASSEMBLER
 #define SYS_HWCREAT_MAX_DEVIDS SYS_DEVCFG_MAXDEVIDS
@@ -229,6 +238,8 @@ struct sys_hwcreat_cfg {
 #define SYSDEVIO_RTTALM 1 /* Write */
 #define SYSDEVIO_VTTCNT 2 /* Read */
 #define SYSDEVIO_VTTALM 2 /* Write */
+#define SYSDEVIO_BOOTTM 3 /* Read: Epoch seconds at counter zero. */
+#define SYSDEVIO_TMRADDR 4 /* Read: counter address, for iomap. */
 
 #define SYSDEVIO_CONSON 0x100 /* Write */
 
@@ -70,6 +70,12 @@ static int _sysdev_in(void *devopq, unsigned id, uint32_t port,
 	case SYSDEVIO_VTTCNT:
 		ioval = thvtt(th);
 		break;
+	case SYSDEVIO_BOOTTM:
+		ioval = timer_readboottime();
+		break;
+	case SYSDEVIO_TMRADDR:
+		ioval = timer_counteraddr();
+		break;
 	default:
 		ioval = -1;
 		break;
@@ -151,6 +157,25 @@ static int _sysdev_iomap(void *devopq, unsigned id, vaddr_t va,
 	return -ENOSYS;
 }
 
+/*
+ * The only memory of the system device is the small page holding the
+ * timer counter, mapped read-only so that reading the time doesn't
+ * need a system call.
+ */
+static int _sysdev_iomapsmall(void *devopq, unsigned id, vaddr_t va,
+			      paddr_t mmioaddr, pmap_prot_t prot)
+{
+	paddr_t cntaddr = timer_counteraddr();
+
+	if (cntaddr == 0)
+		return -ENOSYS;
+	if (trunc_spage(mmioaddr) != trunc_spage(cntaddr)
+	    || (va & SPAGE_MASK) != (mmioaddr & SPAGE_MASK))
+		return -EINVAL;
+
+	return iomap_small(va, trunc_spage(cntaddr), PROT_USER);
+}
+
 static int _sysdev_iounmap(void *devopq, unsigned id, vaddr_t va)
 {
 	return -ENOSYS;
@@ -163,6 +188,7 @@ static struct devops sysdev_ops = {
 	.out = _sysdev_out,
 	.export = _sysdev_export,
 	.iomap = _sysdev_iomap,
+	.iomapsmall = _sysdev_iomapsmall,
 	.iounmap = _sysdev_iounmap,
 	.info = _sysdev_info,
 	.irqmap = _sysdev_irqmap,